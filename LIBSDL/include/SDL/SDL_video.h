@@ -950,6 +950,36 @@ extern DECLSPEC SDL_GrabMode SDLCALL SDL_WM_GrabInput(SDL_GrabMode mode);
 /** @internal Not in public API at the moment - do not use! */
 extern DECLSPEC int SDLCALL SDL_SoftStretch(SDL_Surface *src, SDL_Rect *srcrect,
                                     SDL_Surface *dst, SDL_Rect *dstrect);
+
+#ifdef __N3DS__
+/** N3DS: the input the event pump turns into events */
+typedef struct SDL_N3DSInput {
+	Uint32 held;	/**< KEY_* bits held */
+	Uint32 down;	/**< KEY_* bits pressed since the last pump */
+	Uint32 up;	/**< KEY_* bits released since the last pump */
+	Uint16 touch_x, touch_y;	/**< last touch position */
+	Sint16 cpad_x, cpad_y;
+	Sint16 cstick_x, cstick_y;
+} SDL_N3DSInput;
+
+/**
+ * N3DS: have the event pump take its input from source instead of scanning
+ * the HID itself, e.g. when another thread samples it. NULL scans again.
+ */
+extern DECLSPEC void SDLCALL SDL_N3DS_SetInputSource(void (*source)(SDL_N3DSInput *input));
+
+/** N3DS: what a buffer in linear memory is used for */
+#define SDL_N3DS_LINEAR_VIDEO	0	/**< screen buffer */
+#define SDL_N3DS_LINEAR_AUDIO	1	/**< wave buffers */
+
+/**
+ * N3DS: have the screen and wave buffers allocated by alloc and freed by
+ * free instead of linearAlloc/linearFree, e.g. to pool them. The buffers
+ * must be aligned like those of linearAlloc. NULL restores the defaults.
+ * Call it before SDL_Init.
+ */
+extern DECLSPEC void SDLCALL SDL_N3DS_SetLinearAllocator(void *(*alloc)(size_t size, int use), void (*free)(void *p));
+#endif
                     
 /* Ends C function definitions when using C++ */
 #ifdef __cplusplus
@@ -28,6 +28,7 @@
 #include "SDL_rwops.h"
 #include "SDL_timer.h"
 #include "SDL_audio.h"
+#include "SDL_video.h"
 #include "../SDL_audiomem.h"
 #include "../SDL_audio_c.h"
 #include "../SDL_audiodev_c.h"
@@ -42,6 +43,10 @@
 static dspHookCookie g_dspHook;
 static SDL_AudioDevice *g_audDev;
 
+/* set with SDL_N3DS_SetLinearAllocator, in SDL_n3dsvideo.c */
+extern void *(*N3DS_LinearAlloc)(size_t size, int use);
+extern void (*N3DS_LinearFree)(void *p);
+
 /* Audio driver functions */
 static int N3DSAUD_OpenAudio(_THIS, SDL_AudioSpec *spec);
 static void N3DSAUD_WaitAudio(_THIS);
@@ -82,7 +87,7 @@ static void N3DSAUD_DeleteDevice(SDL_AudioDevice *device)
 		device->hidden->mixbuf = NULL;
 	}
 	if 	( device->hidden->waveBuf[0].data_vaddr!= NULL ) {
-		linearFree((void*)device->hidden->waveBuf[0].data_vaddr);
+		N3DS_LinearFree((void*)device->hidden->waveBuf[0].data_vaddr);
 		device->hidden->waveBuf[0].data_vaddr = NULL;
 	}
 
@@ -231,7 +236,7 @@ static void N3DSAUD_CloseAudio(_THIS)
 		this->hidden->mixbuf = NULL;
 	}
 	if ( this->hidden->waveBuf[0].data_vaddr!= NULL ) {
-		linearFree((void*)this->hidden->waveBuf[0].data_vaddr);
+		N3DS_LinearFree((void*)this->hidden->waveBuf[0].data_vaddr);
 		this->hidden->waveBuf[0].data_vaddr = NULL;
 	}
 
@@ -296,7 +301,7 @@ static int N3DSAUD_OpenAudio(_THIS, SDL_AudioSpec *spec)
 	}
 	SDL_memset(this->hidden->mixbuf, spec->silence, spec->size);
 
-	Uint8 * temp = (Uint8 *) linearAlloc(this->hidden->mixlen*NUM_BUFFERS);
+	Uint8 * temp = (Uint8 *) N3DS_LinearAlloc(this->hidden->mixlen*NUM_BUFFERS, SDL_N3DS_LINEAR_AUDIO);
 	if (temp == NULL ) {
 		SDL_free(this->hidden->mixbuf);
 		return(-1);
@@ -46,11 +46,9 @@ void SDL_SYS_JoystickUpdate (SDL_Joystick *joystick) {
 		return;
 	}
 
-	circlePosition circlePad;
-	hidCircleRead(&circlePad);
 	int x,y;
-	x = circlePad.dx;
-	y = circlePad.dy;
+	x = N3DS_input.cpad_x;
+	y = N3DS_input.cpad_y;
 	if (x > 156) x= 156;
 	if (x < -156) x= -156;
 	if (y > 156) y= 156;
@@ -64,10 +62,8 @@ void SDL_SYS_JoystickUpdate (SDL_Joystick *joystick) {
 		SDL_PrivateJoystickAxis (joystick, 1, - y * 210);
 	}
 
-	circlePosition circleStick = {0};
-	irrstCstickRead(&circleStick);
-	x = circleStick.dx;
-	y = circleStick.dy;
+	x = N3DS_input.cstick_x;
+	y = N3DS_input.cstick_y;
 	if (x > 156) x= 156;
 	if (x < -156) x= -156;
 	if (y > 156) y= 156;
@@ -81,7 +77,7 @@ void SDL_SYS_JoystickUpdate (SDL_Joystick *joystick) {
 		SDL_PrivateJoystickAxis (joystick, 3, - y * 210);
 	}
 
-	key_press = hidKeysDown ();
+	key_press = N3DS_input.down;
 	int dpad_state = old_dpad_state;
 	if ((key_press & KEY_A)) {
 		SDL_PrivateJoystickButton (joystick, 1, SDL_PRESSED);
@@ -126,7 +122,7 @@ void SDL_SYS_JoystickUpdate (SDL_Joystick *joystick) {
 		SDL_PrivateJoystickButton (joystick, 9, SDL_PRESSED);
 	}
 
-	key_release = hidKeysUp ();
+	key_release = N3DS_input.up;
 	if ((key_release & KEY_A)) {
 		SDL_PrivateJoystickButton (joystick, 1, SDL_RELEASED);
 	}
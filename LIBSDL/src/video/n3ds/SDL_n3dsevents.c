@@ -33,10 +33,43 @@
 #include "SDL_n3dsvideo.h"
 #include "SDL_n3dsevents_c.h"
 
+SDL_N3DSInput N3DS_input;
+static void (*N3DS_inputSource)(SDL_N3DSInput *input) = NULL;
+
+void SDL_N3DS_SetInputSource(void (*source)(SDL_N3DSInput *input))
+{
+	N3DS_inputSource = source;
+}
+
+static void N3DS_ScanInput(SDL_N3DSInput *input)
+{
+	touchPosition touch;
+	circlePosition pos;
+
+	hidScanInput();
+	input->held = hidKeysHeld();
+	input->down = hidKeysDown();
+	input->up = hidKeysUp();
+	if (input->held & KEY_TOUCH) {
+		hidTouchRead(&touch);
+		input->touch_x = touch.px;
+		input->touch_y = touch.py;
+	}
+	hidCircleRead(&pos);
+	input->cpad_x = pos.dx;
+	input->cpad_y = pos.dy;
+	irrstCstickRead(&pos);
+	input->cstick_x = pos.dx;
+	input->cstick_y = pos.dy;
+}
+
 void N3DS_PumpEvents(_THIS)
 {
 	svcSleepThread(100000); // 0.1 ms
 
+	// edges are only reported once
+	N3DS_input.down = N3DS_input.up = 0;
+
 	if (!aptMainLoop())
 	{
 		static bool pushedQuit = false;
@@ -49,12 +82,14 @@ void N3DS_PumpEvents(_THIS)
 		return;
 	}
 
-	hidScanInput();
-
-	if (hidKeysHeld() & KEY_TOUCH) {
-		touchPosition touch;
+	if (N3DS_inputSource)
+		N3DS_inputSource(&N3DS_input);
+	else
+		N3DS_ScanInput(&N3DS_input);
 
-		hidTouchRead (&touch);
+	// a tap between two pumps still counts
+	if ((N3DS_input.held | N3DS_input.down) & KEY_TOUCH) {
+		touchPosition touch = { N3DS_input.touch_x, N3DS_input.touch_y };
 
 // TO DO: handle fit screen on x and y.Y and Y to be considered separately
 
@@ -112,6 +112,11 @@ static void videoThread(void* data);
 static void (*addDrawCallback)(void *)=NULL;
 static void *addDrawParam=NULL;
 
+// linear memory for the screen buffer and the wave buffers of the audio driver
+static void *N3DS_DefaultLinearAlloc(size_t size, int use) { return linearAlloc(size); }
+void *(*N3DS_LinearAlloc)(size_t size, int use) = N3DS_DefaultLinearAlloc;
+void (*N3DS_LinearFree)(void *p) = linearFree;
+
 /* Initialization/Query functions */
 static int N3DS_VideoInit(_THIS, SDL_PixelFormat *vformat);
 static SDL_Rect **N3DS_ListModes(_THIS, SDL_PixelFormat *format, Uint32 flags);
@@ -357,7 +362,7 @@ SDL_Surface *N3DS_SetVideoMode(_THIS, SDL_Surface *current,
 	}
 
 	if ( this->hidden->buffer ) {
-		linearFree( this->hidden->buffer );
+		N3DS_LinearFree( this->hidden->buffer );
 		this->hidden->buffer = NULL;
 	}
 	if ( this->hidden->palettedbuffer ) {
@@ -365,7 +370,7 @@ SDL_Surface *N3DS_SetVideoMode(_THIS, SDL_Surface *current,
 		this->hidden->palettedbuffer = NULL;
 	}
 
-	this->hidden->buffer = (u8*) linearAlloc(hw * hh * this->hidden->byteperpixel);
+	this->hidden->buffer = (u8*) N3DS_LinearAlloc(hw * hh * this->hidden->byteperpixel, SDL_N3DS_LINEAR_VIDEO);
 	if ( ! this->hidden->buffer ) {
 		SDL_SetError("Couldn't allocate buffer for requested mode");
 		return(NULL);
@@ -377,7 +382,7 @@ SDL_Surface *N3DS_SetVideoMode(_THIS, SDL_Surface *current,
 		this->hidden->palettedbuffer = malloc(width * height);
 		if ( ! this->hidden->palettedbuffer ) {
 			SDL_SetError("Couldn't allocate buffer for requested mode");
-			linearFree(this->hidden->buffer);
+			N3DS_LinearFree(this->hidden->buffer);
 			return(NULL);
 		}
 		SDL_memset(this->hidden->palettedbuffer, 0, width * height);
@@ -385,7 +390,7 @@ SDL_Surface *N3DS_SetVideoMode(_THIS, SDL_Surface *current,
 
 	/* Allocate the new pixel format for the screen */
 	if ( ! SDL_ReallocFormat(current, bpp, Rmask, Gmask, Bmask, Amask) ) {
-		linearFree(this->hidden->buffer);
+		N3DS_LinearFree(this->hidden->buffer);
 		this->hidden->buffer = NULL;
 		SDL_SetError("Couldn't allocate new pixel format for requested mode");
 		return(NULL);
@@ -495,6 +500,11 @@ static void N3DS_UnlockHWSurface(_THIS, SDL_Surface *surface)
 
 static unsigned int RenderClearColor;
 
+void SDL_N3DS_SetLinearAllocator(void *(*alloc)(size_t size, int use), void (*free)(void *p)) {
+	N3DS_LinearAlloc = alloc && free ? alloc : N3DS_DefaultLinearAlloc;
+	N3DS_LinearFree = alloc && free ? free : linearFree;
+}
+
 void SDL_RequestCall(void(*callback)(void*), void *param) {
 	addDrawCallback=callback;
 	addDrawParam=param;
@@ -677,7 +687,7 @@ void N3DS_VideoQuit(_THIS)
 	}
 	if (this->hidden->buffer)
 	{
-		linearFree(this->hidden->buffer);
+		N3DS_LinearFree(this->hidden->buffer);
 		this->hidden->buffer = NULL;
 	}
 	if (this->hidden->palettedbuffer)
@@ -60,4 +60,7 @@ struct SDL_PrivateVideoData {
 	bool blockVideo;  // block video output and events handlings on SDL_QUIT
 };
 
+/* input of the last N3DS_PumpEvents(), for the joystick driver */
+extern SDL_N3DSInput N3DS_input;
+
 #endif /* _SDL_n3dsvideo_h */
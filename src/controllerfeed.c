@@ -0,0 +1,101 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * controllerfeed.c - feeds the controller servers with the input samples
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <3ds.h>
+#include "controllerfeed.h"
+#include "inputsampler.h"
+#include "vjoy-udp-feeder-client.h"
+#include "dsu-server.h"
+
+#define CONTROLLER_STACK_SIZE	(16 * 1024)
+// longest wait for a sample, so that Cemuhook requests are answered even
+// if the sampler stalls
+#define CONTROLLER_WAIT_NS		(50 * 1000000LL)
+
+// The thread wakes up with every sample the input thread takes and passes
+// it on at once, so that the servers get the input at the sampling rate
+// however long the main loop takes to decode. It does not log, as logging
+// draws on the screen; failures are left for controller_health().
+static Thread					controller_tid = NULL;
+static volatile int				controller_quit = 0;
+static volatile int				controller_failed = 0;
+static struct vjoy_udp_client	*feed_udp;
+static int						feed_udp_motion;
+static struct dsu_server		*feed_dsu;
+static input_reader				reader;
+
+static void controller_fail(int feed)
+{
+	__atomic_or_fetch(&controller_failed, feed, __ATOMIC_RELAXED);
+}
+
+static void controller_thread(void *arg)
+{
+	input_sample in;
+
+	while (!controller_quit) {
+		input_wait(&reader, CONTROLLER_WAIT_NS);
+		// answer requests of Cemuhook clients
+		if (feed_dsu && dsu_server_run(feed_dsu)) {
+			controller_fail(CONTROLLER_DSU);
+			feed_dsu = NULL;
+		}
+		while (input_read(&reader, &in)) {
+			if (feed_udp)
+				vjoy_udp_client_update(feed_udp, in.time, in.held, &in.cpad, &in.cstick, &in.touch,
+					feed_udp_motion ? &in.accel : NULL, feed_udp_motion ? &in.gyro : NULL, in.slider);
+			if (feed_dsu &&
+				dsu_server_update(feed_dsu, in.time, in.held, &in.cpad, &in.cstick, &in.touch, &in.accel, &in.gyro))
+			{
+				controller_fail(CONTROLLER_DSU);
+				feed_dsu = NULL;
+			}
+		}
+	}
+}
+
+int controller_start(struct vjoy_udp_client *udp, int udp_motion, struct dsu_server *dsu)
+{
+	s32 prio;
+
+	if (controller_tid) return 0;
+	input_reader_init(&reader);
+	if (!udp && !dsu) return 0;
+	controller_quit = 0;
+	controller_failed = 0;
+	feed_udp = udp;
+	feed_udp_motion = udp_motion;
+	feed_dsu = dsu;
+
+	// between the input thread and the main thread, sending takes little
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	controller_tid = threadCreate(controller_thread, NULL, CONTROLLER_STACK_SIZE, prio - 1, -2, false);
+	return controller_tid ? 0 : -1;
+}
+
+void controller_stop()
+{
+	if (!controller_tid) return;
+	controller_quit = 1;
+	threadJoin(controller_tid, U64_MAX);
+	threadFree(controller_tid);
+	controller_tid = NULL;
+}
+
+int controller_health()
+{
+	return __atomic_exchange_n(&controller_failed, 0, __ATOMIC_RELAXED);
+}
+
+u32 controller_overruns()
+{
+	return reader.overruns;
+}
@@ -0,0 +1,33 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * controllerfeed.h - feeds the controller servers with the input samples
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+#ifndef _CONTROLLERFEED_H
+#define _CONTROLLERFEED_H
+
+#include <3ds.h>
+
+// the feeds, for controller_health()
+#define CONTROLLER_UDP	1		// vJoy-UDP-feeder client
+#define CONTROLLER_DSU	2		// Cemuhook server
+
+struct vjoy_udp_client;
+struct dsu_server;
+
+// hands every input sample, as it is taken, to the vJoy-UDP-feeder client
+// (with motion data if udp_motion is set) and the Cemuhook server, on a
+// thread of its own. Either may be NULL; both belong to the thread until
+// controller_stop(). Returns 0 if the thread is running.
+extern int controller_start(struct vjoy_udp_client *udp, int udp_motion, struct dsu_server *dsu);
+// stops the thread, before the input sampler is stopped
+extern void controller_stop();
+// returns the CONTROLLER_* bits of the feeds that failed since the last
+// call; they are not fed any more and may be shut down
+extern int controller_health();
+// samples the thread lost because it fell behind; call after controller_stop()
+extern u32 controller_overruns();
+
+#endif // _CONTROLLERFEED_H
@@ -4,7 +4,9 @@
 typedef struct {
 	int (*init)();
 	int (*feed)(void *data, int size);
-	int (*decode)(void **outdata, int *size);
+	// decodes up to size bytes into outdata; returns the number of bytes
+	// decoded, 0 if more data is needed or a negative number on error
+	int (*decode)(void *outdata, int size);
 	int (*info)(char **type, int *rate, int *channels, int *bitrate);
 	int (*close)();
 	const char *(*errstr)();
@@ -21,8 +21,20 @@ https://v1993.github.io/cemuhook-protocol/
 #define MAX_VERSION 1001
 #define DSU_DEFAULT_PORT 26760
 #define CLIENT_TIMEOUT 5
+#define MAX_SLOTS 4			// slots of the protocol, we are a controller in slot 0
+#define PAD_DATA_LEN 100	// controller data packet
+#define PAD_DATA_COUNTER 32	// offset of the per-client packet number in it
 
 static u32 serverID=0;
+static u8 serverMAC[6] = {0x00, 0x00, 0x00, 0x00, 0x3d, 0x50}; // for MAC based registration of slot 0
+
+// CRC-32 tables for slicing-by-8: crc_table[0] is the classic byte table,
+// crc_table[k] advances a byte k more positions
+static u32 crc_table[8][256];
+// CRC of a zeroed controller data packet with one byte of the packet number
+// set, so that the number can be patched into a CRC computed once for all
+// clients
+static u32 crc_counter[4][256];
 
 int dsu_server_init(struct dsu_server *server, int port)
 {
@@ -94,31 +106,65 @@ int dsu_server_shutdown(struct dsu_server *server)
 	return 0;
 }
 
+static void crc32_init()
+{
+	u32 crc, b;
+	int i, j, k;
+
+	for (b = 0; b < 256; b++) {
+		crc = b;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		crc_table[0][b] = crc;
+	}
+	for (b = 0; b < 256; b++)
+		for (k = 1; k < 8; k++)
+			crc_table[k][b] = (crc_table[k-1][b] >> 8) ^ crc_table[0][crc_table[k-1][b] & 0xFF];
+
+	// CRC without pre- and post-conditioning, which is linear: the CRC of
+	// a packet numbered n is that of the packet numbered 0 xor these
+	for (i = 0; i < 4; i++) {
+		for (b = 0; b < 256; b++) {
+			crc = crc_table[0][b];
+			for (j = PAD_DATA_COUNTER + i + 1; j < PAD_DATA_LEN; j++)
+				crc = (crc >> 8) ^ crc_table[0][crc & 0xFF];
+			crc_counter[i][b] = crc;
+		}
+	}
+}
+
 unsigned int crc32calc(unsigned char *message, int msglen) {
-   int i, j;
-   unsigned int byte, crc, mask;
-   static unsigned int table[256];
-
-   /* Set up the table, if necessary. */
-   if (table[1] == 0) {
-      for (byte = 0; byte <= 255; byte++) {
-         crc = byte;
-         for (j = 7; j >= 0; j--) {    // Do eight times.
-            mask = -(crc & 1);
-            crc = (crc >> 1) ^ (0xEDB88320 & mask);
-         }
-         table[byte] = crc;
-      }
-   }
-
-   /* Through with table setup, now calculate the CRC. */
-   i = 0;
-   crc = 0xFFFFFFFF;
-   while (i < msglen) {
-      crc = (crc >> 8) ^ table[(crc ^ message[i]) & 0xFF];
-      i = i + 1;
-   }
-   return ~crc;
+	u32 crc = 0xFFFFFFFF, one, two;
+
+	if (crc_table[0][1] == 0) crc32_init();
+
+	// byte by byte up to a word boundary, then 8 bytes at a time
+	while (msglen && ((uintptr_t)message & 3)) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *message++) & 0xFF];
+		msglen--;
+	}
+	while (msglen >= 8) {
+		one = *(u32*)message ^ crc;
+		two = *(u32*)(message + 4);
+		crc =	crc_table[7][one & 0xFF] ^ crc_table[6][(one >> 8) & 0xFF] ^
+				crc_table[5][(one >> 16) & 0xFF] ^ crc_table[4][one >> 24] ^
+				crc_table[3][two & 0xFF] ^ crc_table[2][(two >> 8) & 0xFF] ^
+				crc_table[1][(two >> 16) & 0xFF] ^ crc_table[0][two >> 24];
+		message += 8;
+		msglen -= 8;
+	}
+	while (msglen--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *message++) & 0xFF];
+	return ~crc;
+}
+
+// the CRC of a controller data packet after setting its packet number to n,
+// from the CRC of the same packet numbered 0
+static u32 crc32patch(u32 crc, u32 n)
+{
+	return crc ^
+		crc_counter[0][n & 0xFF] ^ crc_counter[1][(n >> 8) & 0xFF] ^
+		crc_counter[2][(n >> 16) & 0xFF] ^ crc_counter[3][n >> 24];
 }
 
 static void dsu_fill_controller_info(u8 nr, u8 *buf)
@@ -127,6 +173,7 @@ static void dsu_fill_controller_info(u8 nr, u8 *buf)
 	if (nr==0) {
 		buf[1] = 2; // Slot state (2: connected)
 		buf[2] = 2; // Device model (2: full gyro)
+		memcpy(buf + 4, serverMAC, 6);
 		
 		// only check batt every 5 seconds
 		static u8 batt, charge;
@@ -145,7 +192,7 @@ static void dsu_fill_controller_info(u8 nr, u8 *buf)
 	}
 }
 
-static int dsu_send_packet(struct dsu_server *server, struct sockaddr *cli_addr, u8 *buf, int len)
+static void dsu_fill_header(u8 *buf, int len)
 {
 	buf[0]='D';
 	buf[1]='S';
@@ -156,9 +203,14 @@ static int dsu_send_packet(struct dsu_server *server, struct sockaddr *cli_addr,
 	*((u16*)(buf+6)) = len - 16;
 	*((u32*)(buf+12)) = serverID;
 	*((u32*)(buf+8)) = 0;
-	*((u32*)(buf+8)) = crc32calc(buf, len);
+}
+
+// sends a packet with header and CRC already filled in; never blocks, a
+// packet that does not fit into the socket buffer is dropped
+static int dsu_sendto(struct dsu_server *server, struct sockaddr *cli_addr, u8 *buf, int len)
+{
 	socklen_t clilen = sizeof(struct sockaddr_in);
-	int n=sendto(server->socket, buf, len, 0, cli_addr, clilen);
+	int n=sendto(server->socket, buf, len, MSG_DONTWAIT, cli_addr, clilen);
 //hex_dump((char*)buf,len,"packet sent");
 	if (n != len) {
 		if (n < 0) {
@@ -174,6 +226,13 @@ static int dsu_send_packet(struct dsu_server *server, struct sockaddr *cli_addr,
 	return 0;
 }
 
+static int dsu_send_packet(struct dsu_server *server, struct sockaddr *cli_addr, u8 *buf, int len)
+{
+	dsu_fill_header(buf, len);
+	*((u32*)(buf+8)) = crc32calc(buf, len);
+	return dsu_sendto(server, cli_addr, buf, len);
+}
+
 static int dsu_process_message(struct dsu_server *server, u8 *buf, int len, struct sockaddr *cli_addr)
 {
 	int idx=0;
@@ -275,13 +334,17 @@ static int dsu_process_message(struct dsu_server *server, u8 *buf, int len, stru
 	} else if (mType == 0x100002) {
 		// get bitmask of actions you should take
 		u8 regFlags = buf[idx++];
-		if (regFlags == 2) { // we only support slot based registration
-			//log_citra("  dropping - MAC-based registration requested");
-			return 0;
-		}
 		u8 idToReg = buf[idx++];
-		if (regFlags == 0 && idToReg != 0) { // only slot 0 supported
-			//log_citra("  dropping - slot %d requested", idToReg);
+		u8 *macToReg = buf + idx;
+		u8 slots = 0;
+		if (regFlags == 0) {
+			slots = (1 << MAX_SLOTS) - 1; // all controllers
+		} else {
+			if ((regFlags & 1) && idToReg < MAX_SLOTS) slots |= 1 << idToReg;
+			if ((regFlags & 2) && !memcmp(macToReg, serverMAC, 6)) slots |= 1; // our controller
+		}
+		if (!slots) {
+			//log_citra("  dropping - nothing to register (flags %d, slot %d)", regFlags, idToReg);
 			return 0;
 		}
 		
@@ -304,7 +367,9 @@ static int dsu_process_message(struct dsu_server *server, u8 *buf, int len, stru
 			}	
 			server->cli_last = c;
 		}
-		// update timestamp and address
+		// update timestamp, address and slots; a client subscribed to other
+		// slots only gets no data, as they are never connected
+		c->slots |= slots;
 		c->timestamp = time(NULL);
 		c->addr = *((struct sockaddr_in *)cli_addr);
 //log_citra("received controler data feed request");
@@ -357,7 +422,48 @@ static u32 dsu_server_transform(int a, int dead, int max, u32 thresh)
 }
 
 // all parameters can be NULL except server
-int dsu_server_update(struct dsu_server *server, u32 but, circlePosition *posCp, circlePosition *posStk, touchPosition *touch, accelVector *accel, angularRate *gyro)
+// sends the controller data packet in sbuf to all clients subscribed to
+// slot 0, built and checksummed once and patched per client
+static void dsu_send_pad_data(struct dsu_server *server, u8 *sbuf)
+{
+	struct dsu_client *c,*c1;
+	u64 tim = time(NULL);
+	u32 crc;
+
+	dsu_fill_header(sbuf, PAD_DATA_LEN);
+	*((u32*)(sbuf+PAD_DATA_COUNTER)) = 0;
+	crc = crc32calc(sbuf, PAD_DATA_LEN);
+
+	for(c = server->cli_first; c != NULL; ) {
+
+		// check if we have a client timeout
+		if (tim - c->timestamp > CLIENT_TIMEOUT) {
+			// remove client and move to next
+			if (server->cli_first == c) server->cli_first = c->next;
+			if (server->cli_last == c) server->cli_last = c->prev;
+			if (c->prev) c->prev->next = c->next;
+			if (c->next) c->next->prev = c->prev;
+			c1 = c->next;
+			free(c);
+			c=c1;
+			continue;
+		}
+
+		// check if this packet was already sent
+		if ((c->slots & 1) && memcmp(sbuf+20, c->oldpacket, 80)) {
+			memcpy(c->oldpacket, sbuf+20, 80);
+			// update packet number and CRC, and send packet
+			*((u32*)(sbuf+PAD_DATA_COUNTER)) = ++(c->packet_count); // packet number for this client
+			*((u32*)(sbuf+8)) = crc32patch(crc, c->packet_count);
+			dsu_sendto(server, (struct sockaddr*)&c->addr, sbuf, PAD_DATA_LEN);
+//hex_dump(sbuf,100,"controler update");
+			*((u32*)(sbuf+PAD_DATA_COUNTER)) = 0;
+		}
+		c = c->next;
+	}
+}
+
+int dsu_server_update(struct dsu_server *server, u64 timestamp, u32 but, circlePosition *posCp, circlePosition *posStk, touchPosition *touch, accelVector *accel, angularRate *gyro)
 {
 	static u64 lastupdate = 0;
 	static int count = 0;
@@ -420,9 +526,9 @@ int dsu_server_update(struct dsu_server *server, u32 but, circlePosition *posCp,
 	}
 	++count;
 
-	u64 now = getmicrotime();
+	u64 now = timestamp ? timestamp : getmicrotime();
 	if (!lastupdate) lastupdate = now;
-	if (now - lastupdate > server->interval) { // done collecting data - now send!
+	if (now - lastupdate >= server->interval * 1000) { // done collecting data - now send!
 		lastupdate = now;
 
 		static u8 oldacc[12]={0};
@@ -543,34 +649,7 @@ int dsu_server_update(struct dsu_server *server, u32 but, circlePosition *posCp,
 		bzero(&data, sizeof(data));
 
 		// send to all clients
-		struct dsu_client *c,*c1;
-		u64 tim = time(NULL);
-		for(c = server->cli_first; c != NULL; ) {
-			
-			// check if we have a client timeout
-			if (tim - c->timestamp > CLIENT_TIMEOUT) {
-				// remove client and move to next
-				if (server->cli_first == c) server->cli_first = c->next;
-				if (server->cli_last == c) server->cli_last = c->prev;
-				if (c->prev) c->prev->next = c->next;
-				if (c->next) c->next->prev = c->prev;
-				c1 = c->next;
-				free(c);
-				c=c1;
-				continue;
-			}
-
-			// check if this packet was already sent
-			*((u32*)(sbuf+32)) = 0;
-			if (memcmp(sbuf+20, c->oldpacket, 80)) {
-				memcpy(c->oldpacket, sbuf+20, 80);
-				// update packet number and send packet
-				*((u32*)(sbuf+32)) = ++(c->packet_count); // packet number for this client
-				dsu_send_packet(server, (struct sockaddr*)&c->addr, sbuf, 100);
-	//hex_dump(sbuf,100,"controler update");
-			}
-			c = c->next;
-		}
+		dsu_send_pad_data(server, sbuf);
 	}
 	return 0;
 }
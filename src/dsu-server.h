@@ -29,6 +29,7 @@ struct dsu_client {
 	struct dsu_client *prev;
 	u32 packet_count;
 	u8 oldpacket[80];
+	u8 slots; // bit mask of the slots the client subscribed to
 };
 
 struct dsu_server {
@@ -45,7 +46,7 @@ struct dsu_server {
 	u32 button_minus; // KEY_DDOWN per default (+meta)
 	u32 button_LSTCK_PUSH; // KEY_DLEFT per default (+meta)
 	u32 button_RSTCK_PUSH; // KEY_DRIGHT per default (+meta)
-	int interval; // in which minimum intervals (ms) should we send new data to the clients? (default 75)
+	int interval; // in which minimum intervals (ms) should we send new data to the clients? (default 75, 0: every update)
 };
 
 extern int dsu_server_init(struct dsu_server *server, int port);
@@ -53,6 +54,7 @@ extern int dsu_server_shutdown(struct dsu_server *server);
 extern int dsu_server_run(struct dsu_server *server);
 extern int dsu_server_update(	// all parameters can be NULL except server
 	struct dsu_server *server,
+	u64 timestamp,	// of the sample in microseconds, 0 for now
 	u32 buttons,
 	circlePosition *posCp,
 	circlePosition *posStk,
@@ -0,0 +1,186 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * inputsampler.c - samples HID, touch and motion on a thread of its own
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <string.h>
+#include <SDL/SDL.h>
+#include <3ds.h>
+#include "inputsampler.h"
+
+#define INPUT_STACK_SIZE	(16 * 1024)
+#define INPUT_PERIOD_US		(1000000 / INPUT_RATE_HZ)
+
+// The thread is the only one scanning the HID while it runs. It writes
+// the ring and then publishes the sample by advancing ring_head; readers
+// copy a sample and check that the thread had not started to overwrite
+// it meanwhile, so neither side ever waits for the other.
+static input_sample		ring[INPUT_RING];
+static u32				ring_head = 0;	// samples published
+static LightEvent		ring_event;		// signalled with every sample, see input_wait()
+
+static Thread			input_tid = NULL;
+static volatile int		input_quit = 0;
+static int				input_motion = 0;
+static input_stats		stats;
+
+// what the SDL event pump has been told so far
+static input_reader		sdl_reader;
+static u32				sdl_held;
+static u32				sdl_last;		// held in the last sample read
+static touchPosition	sdl_touch;
+
+// monotonic microseconds, without overflowing the tick multiplication
+static u64 input_time()
+{
+	u64 t = svcGetSystemTick();
+	return t / SYSCLOCK_ARM11 * 1000000 + t % SYSCLOCK_ARM11 * 1000000 / SYSCLOCK_ARM11;
+}
+
+static void input_sample_hid(input_sample *s)
+{
+	hidScanInput();
+	s->held = hidKeysHeld();
+	hidCircleRead(&s->cpad);
+	irrstCstickRead(&s->cstick);
+	hidTouchRead(&s->touch);
+	if (input_motion) {
+		hidAccelRead(&s->accel);
+		hidGyroRead(&s->gyro);
+	}
+	s->slider = osGet3DSliderState();
+	s->time = input_time();
+}
+
+static void input_thread(void *arg)
+{
+	u64 next = input_time(), now, d;
+	u32 head = ring_head;
+
+	while (!input_quit) {
+		input_sample *s = &ring[head % INPUT_RING];
+
+		input_sample_hid(s);
+		now = s->time;
+		__atomic_store_n(&ring_head, ++head, __ATOMIC_RELEASE);
+		LightEvent_Signal(&ring_event);
+
+		d = now > next ? now - next : next - now;
+		if (d > stats.jitter_max) stats.jitter_max = d;
+		if (now > next + INPUT_PERIOD_US) {
+			// fell behind, start over rather than catching up in a burst
+			stats.late++;
+			next = now;
+		}
+		stats.samples++;
+
+		next += INPUT_PERIOD_US;
+		now = input_time();
+		if (next > now) svcSleepThread((next - now) * 1000);
+	}
+}
+
+void input_reader_init(input_reader *r)
+{
+	r->cursor = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	r->overruns = 0;
+}
+
+int input_read(input_reader *r, input_sample *s)
+{
+	u32 head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+
+	while (head != r->cursor) {
+		if (head - r->cursor > INPUT_RING - 1) {
+			// lost the oldest samples, go on with those still there
+			r->overruns += head - r->cursor - (INPUT_RING - 1);
+			r->cursor = head - (INPUT_RING - 1);
+		}
+		*s = ring[r->cursor % INPUT_RING];
+		// keep it unless the thread has come round to its slot meanwhile
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		if (head - r->cursor < INPUT_RING) {
+			r->cursor++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int input_wait(input_reader *r, s64 timeout_ns)
+{
+	if (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) != r->cursor) return 1;
+	LightEvent_WaitTimeout(&ring_event, timeout_ns);
+	return __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) != r->cursor;
+}
+
+// hands the samples since the last pump to SDL. A key pressed and released
+// in between is reported as both; a key released and pressed again is
+// released now and pressed with the next pump, as SDL handles presses
+// before releases.
+static void input_sdl_source(SDL_N3DSInput *in)
+{
+	input_sample s;
+	u32 down = 0, up = 0, changed;
+
+	while (input_read(&sdl_reader, &s)) {
+		down |= s.held & ~sdl_last;
+		up |= sdl_last & ~s.held;
+		sdl_last = s.held;
+		if (s.held & KEY_TOUCH) sdl_touch = s.touch;
+		in->cpad_x = s.cpad.dx;
+		in->cpad_y = s.cpad.dy;
+		in->cstick_x = s.cstick.dx;
+		in->cstick_y = s.cstick.dy;
+	}
+
+	changed = down | up | (sdl_held ^ sdl_last);
+	in->up = changed & sdl_held;
+	in->down = changed & ~sdl_held;
+	in->up |= in->down & ~sdl_last;
+	in->held = sdl_last;
+	in->touch_x = sdl_touch.px;
+	in->touch_y = sdl_touch.py;
+	sdl_held = (sdl_held | in->down) & ~in->up;
+}
+
+int input_start(int motion)
+{
+	s32 prio;
+
+	if (input_tid) return 0;
+	input_quit = 0;
+	input_motion = motion;
+	memset(&stats, 0, sizeof(stats));
+	LightEvent_Init(&ring_event, RESET_ONESHOT);
+
+	// above the main and audio threads, sampling takes next to no time
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	input_tid = threadCreate(input_thread, NULL, INPUT_STACK_SIZE, prio - 2, -2, false);
+	if (!input_tid) return -1;
+
+	input_reader_init(&sdl_reader);
+	sdl_held = sdl_last = hidKeysHeld();
+	SDL_N3DS_SetInputSource(input_sdl_source);
+	return 0;
+}
+
+void input_stop()
+{
+	if (!input_tid) return;
+	SDL_N3DS_SetInputSource(NULL);
+	input_quit = 1;
+	threadJoin(input_tid, U64_MAX);
+	threadFree(input_tid);
+	input_tid = NULL;
+}
+
+void input_get_stats(input_stats *s)
+{
+	*s = stats;
+	s->overruns = sdl_reader.overruns;
+}
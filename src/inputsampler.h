@@ -0,0 +1,56 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * inputsampler.h - samples HID, touch and motion on a thread of its own
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+#ifndef _INPUTSAMPLER_H
+#define _INPUTSAMPLER_H
+
+#include <3ds.h>
+
+#define INPUT_RATE_HZ	250		// samples per second
+#define INPUT_RING		64		// samples kept for readers, a power of 2
+
+typedef struct {
+	u64 time;				// us, monotonic
+	u32 held;				// KEY_*, including KEY_TOUCH
+	circlePosition cpad;
+	circlePosition cstick;
+	touchPosition touch;
+	accelVector accel;		// only if motion is enabled
+	angularRate gyro;
+	float slider;			// 3D slider
+} input_sample;
+
+typedef struct {
+	u32 samples;		// taken since the start
+	u32 late;			// samples taken late by more than a period
+	u32 overruns;		// samples the SDL event pump lost, see input_reader
+	u64 jitter_max;		// us, largest deviation from the sampling period
+} input_stats;
+
+// where a reader is in the samples; every reader has one of its own
+typedef struct {
+	u32 cursor;			// samples read or skipped
+	u32 overruns;		// samples lost because the reader fell behind
+} input_reader;
+
+// starts sampling, with accelerometer and gyroscope if motion is set, and
+// hands the input to the SDL event pump; returns 0 if the thread is running
+extern int input_start(int motion);
+// stops sampling, the SDL event pump scans the HID itself again
+extern void input_stop();
+// copies the next sample for reader r into s; returns 0 if there is no
+// newer sample. Only the thread owning r may call it.
+extern int input_read(input_reader *r, input_sample *s);
+// waits until there is a sample r has not read yet, for timeout_ns at most;
+// returns 0 if there is none. Only one thread may wait at a time.
+extern int input_wait(input_reader *r, s64 timeout_ns);
+// sets up r to start with the samples to come
+extern void input_reader_init(input_reader *r);
+// call after input_stop(), the counters of the thread are its own until then
+extern void input_get_stats(input_stats *s);
+
+#endif // _INPUTSAMPLER_H
@@ -0,0 +1,178 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * linearpool.c - pooled allocation of linear (GPU and DSP visible) memory
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdlib.h>
+#include <3ds.h>
+#include "linearpool.h"
+
+// Buffers are sized to the next 4 KB and sorted into size classes, two per
+// power of two from 4 KB to 16 MB. A freed buffer stays in the pool of its
+// class and serves the next request of the class it is large enough for,
+// so resizing back and forth or reconnecting reuses the same blocks
+// instead of cutting up the linear heap. A buffer of LARGE_MIN or more
+// that the pool cannot serve is placed as if there were no pool: the pool
+// is handed back first, so that kept blocks do not split the heap where
+// the framebuffers go. It is handed back as well whenever an allocation
+// fails.
+#define CLASS_MIN_SHIFT		12
+#define CLASS_MAX_SHIFT		24
+#define CLASSES				(2 * (CLASS_MAX_SHIFT - CLASS_MIN_SHIFT) + 1)
+#define POOL_MAX			(8 * 1024 * 1024)	// bytes kept at most
+#define LARGE_MIN			(1024 * 1024)
+
+// kept apart from the buffers, a header in front of them would keep
+// power-of-two buffers from packing tightly
+typedef struct block {
+	struct block *next;		// in the pool or in the list of live buffers
+	void *mem;
+	u32 size;				// allocated
+	s8 cls;					// -1: larger than the classes
+	u8 use;
+	u32 requested;
+} block;
+
+static block *pool[CLASSES];
+static block *live;
+static linear_stats stats;
+static LightLock lock;
+static int lock_init = 0;
+
+static void linear_lock()
+{
+	// the first allocation comes from the main thread before any other
+	// thread is started
+	if (!lock_init) {
+		LightLock_Init(&lock);
+		lock_init = 1;
+	}
+	LightLock_Lock(&lock);
+}
+
+// the class of a buffer of size bytes, -1 if it is larger than the classes
+static int size_class(u32 size)
+{
+	int shift;
+	u32 s;
+
+	for (shift = CLASS_MIN_SHIFT; shift <= CLASS_MAX_SHIFT; shift++) {
+		s = 1 << shift;
+		if (size <= s) return 2 * (shift - CLASS_MIN_SHIFT);
+		if (shift < CLASS_MAX_SHIFT && size <= s + s / 2)
+			return 2 * (shift - CLASS_MIN_SHIFT) + 1;
+	}
+	return -1;
+}
+
+static void pool_release()
+{
+	block *b;
+
+	for (int i = 0; i < CLASSES; i++) {
+		while ((b = pool[i])) {
+			pool[i] = b->next;
+			linearFree(b->mem);
+			free(b);
+		}
+	}
+	stats.pooled = 0;
+}
+
+void *linear_alloc(size_t size, linear_use use)
+{
+	block *b = NULL, **l = NULL;
+	u32 alloc_size = (size + (1 << CLASS_MIN_SHIFT) - 1) & ~((1 << CLASS_MIN_SHIFT) - 1);
+	int cls = size_class(alloc_size);
+
+	linear_lock();
+	// the first block of the class that is large enough
+	if (cls >= 0)
+		for (l = &pool[cls]; *l && (*l)->size < alloc_size; l = &(*l)->next);
+	if (l && (b = *l)) {
+		*l = b->next;
+		stats.pooled -= b->size;
+		stats.reused++;
+	} else {
+		if (!(b = malloc(sizeof(block)))) {
+			LightLock_Unlock(&lock);
+			return NULL;
+		}
+		if (alloc_size >= LARGE_MIN && stats.pooled) {
+			pool_release();
+			stats.trims++;
+		}
+		b->mem = linearAlloc(alloc_size);
+		if (!b->mem && stats.pooled) {
+			pool_release();
+			stats.trims++;
+			b->mem = linearAlloc(alloc_size);
+		}
+		if (!b->mem) {
+			free(b);
+			stats.failed++;
+			LightLock_Unlock(&lock);
+			return NULL;
+		}
+		b->size = alloc_size;
+		b->cls = cls;
+	}
+	b->next = live;
+	live = b;
+	b->use = use;
+	b->requested = size;
+	stats.use[use].allocs++;
+	stats.use[use].bytes += size;
+	if (stats.use[use].bytes > stats.use[use].peak)
+		stats.use[use].peak = stats.use[use].bytes;
+	LightLock_Unlock(&lock);
+	return b->mem;
+}
+
+void linear_free(void *p)
+{
+	block *b, **l;
+
+	if (!p) return;
+	linear_lock();
+	// there are only a few buffers alive at any time
+	for (l = &live; *l && (*l)->mem != p; l = &(*l)->next);
+	if (!(b = *l)) {
+		// not ours, e.g. allocated before SDL got our allocator
+		LightLock_Unlock(&lock);
+		linearFree(p);
+		return;
+	}
+	*l = b->next;
+	stats.use[b->use].allocs--;
+	stats.use[b->use].bytes -= b->requested;
+	if (b->cls >= 0 && b->size < LARGE_MIN && stats.pooled + b->size <= POOL_MAX) {
+		b->next = pool[b->cls];
+		pool[b->cls] = b;
+		stats.pooled += b->size;
+	} else {
+		linearFree(b->mem);
+		free(b);
+	}
+	LightLock_Unlock(&lock);
+}
+
+void linear_trim()
+{
+	linear_lock();
+	if (stats.pooled) {
+		pool_release();
+		stats.trims++;
+	}
+	LightLock_Unlock(&lock);
+}
+
+void linear_get_stats(linear_stats *s)
+{
+	linear_lock();
+	*s = stats;
+	LightLock_Unlock(&lock);
+}
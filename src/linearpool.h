@@ -0,0 +1,46 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * linearpool.h - pooled allocation of linear (GPU and DSP visible) memory
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+#ifndef _LINEARPOOL_H
+#define _LINEARPOOL_H
+
+#include <3ds.h>
+
+// what a buffer is used for, for the statistics
+typedef enum {
+	LINEAR_FRAMEBUFFER,		// VNC and SDL screen buffers
+	LINEAR_STAGING,			// sources of display transfers into textures
+	LINEAR_GEOMETRY,		// vertex buffers
+	LINEAR_AUDIO,			// wave buffers
+	LINEAR_USES
+} linear_use;
+
+typedef struct {
+	u32 allocs;			// live buffers
+	u32 bytes;			// live bytes, as requested
+	u32 peak;			// high-water mark of bytes
+} linear_use_stats;
+
+typedef struct {
+	linear_use_stats use[LINEAR_USES];
+	u32 pooled;			// bytes of freed buffers kept for reuse
+	u32 reused;			// allocations served from the pool
+	u32 trims;			// times the pool was emptied to make room
+	u32 failed;			// allocations that failed even then
+} linear_stats;
+
+// like linearAlloc, the buffer is aligned to 0x80 bytes; returns NULL if
+// there is no room
+extern void *linear_alloc(size_t size, linear_use use);
+// buffers that did not come from linear_alloc are handed to linearFree
+extern void linear_free(void *p);
+// hands the freed buffers in the pool back to the system, for allocations
+// made elsewhere (e.g. textures)
+extern void linear_trim();
+extern void linear_get_stats(linear_stats *s);
+
+#endif // _LINEARPOOL_H
@@ -15,14 +15,18 @@
 #include <rfb/rfbclient.h>
 #include <arpa/inet.h>
 #include "streamclient.h"
+#include "inputsampler.h"
+#include "controllerfeed.h"
 #include "uibottom.h"
 #include "utilities.h"
 #include "vjoy-udp-feeder-client.h"
 #include "dsu-server.h"
+#include "linearpool.h"
 
 #define SOC_ALIGN       0x1000
 #define SOC_BUFFERSIZE  0x100000
 #define NUMCONF 25
+#define VNC_MEMORY_BUDGET (512 * 1024) // decoder memory kept per session between updates
 
 #define HEADERCOL COL_MAKE(0x47, 0x80, 0x82)
 
@@ -129,6 +133,7 @@ SDL_Surface* sdl_big=NULL; // unscaled
 int scaling_factor_top = 1;
 static int sdl_pos_x, sdl_pos_y;
 static vnc_config config;
+static int dualscreen=0; // the bottom screen shows the main connection (bottom screen port 0)
 static int have_scrollbars=0;
 aptHookCookie cookie;
 static int recalc_event_target = 0;
@@ -190,13 +195,13 @@ void log_err(const char *format, ...)
 
 static void handleFrameBufferUpdateTop (struct _rfbClient *client, int x, int y, int w, int h)
 {
+	int xa = x / scaling_factor_top;
+	int ya = y / scaling_factor_top;
+	int wa = (w + scaling_factor_top - 1) / scaling_factor_top;
+	int ha = (h + scaling_factor_top - 1) / scaling_factor_top;
+	if (xa + wa > sdl->w) wa = sdl->w - xa;
+	if (ya + ha > sdl->h) ha = sdl->h - ya;
 	if (sdl_big) {
-		int xa = x / scaling_factor_top;
-		int ya = y / scaling_factor_top;
-		int wa = (w + scaling_factor_top - 1) / scaling_factor_top;
-		int ha = (h + scaling_factor_top - 1) / scaling_factor_top;
-		if (xa + wa > sdl->w) wa = sdl->w - xa;
-		if (ya + ha > sdl->h) ha = sdl->h - ya;
 		fastscale(
 			sdl->pixels + xa * 4 + ya * sdl->pitch,
 			sdl->pitch,
@@ -206,6 +211,9 @@ static void handleFrameBufferUpdateTop (struct _rfbClient *client, int x, int y,
 			sdl_big->pitch,
 			scaling_factor_top);
 	}
+	// in dual screen mode the bottom screen shows the same surface
+	if (dualscreen)
+		uibvnc_damage(xa, ya, wa, ha);
 }
 
 static rfbBool resize(rfbClient* client) {
@@ -250,13 +258,13 @@ static rfbBool resize(rfbClient* client) {
 				return FALSE;
 			}
 			SDL_FillRect(sdl_big,NULL, 0x00000000);
-			if (client->GotFrameBufferUpdate != handleFrameBufferUpdateTop) {
-				oldGotFrameBufferUpdate = client->GotFrameBufferUpdate;
-				client->GotFrameBufferUpdate = handleFrameBufferUpdateTop;
-			}
 			rfbClientLog("req size >1024px, set client scale 1/%d", scaling_factor_top);
 		}
 	}
+	if ((sdl_big || dualscreen) && client->GotFrameBufferUpdate != handleFrameBufferUpdateTop) {
+		oldGotFrameBufferUpdate = client->GotFrameBufferUpdate;
+		client->GotFrameBufferUpdate = handleFrameBufferUpdateTop;
+	}
 	client->updateRect.x = client->updateRect.y = 0;
 	client->updateRect.w = width;
 	client->updateRect.h = height;
@@ -291,6 +299,8 @@ static rfbBool resize(rfbClient* client) {
 	}
 	SDL_FillRect(sdl,NULL, 0x00000000);
 	SDL_Flip(sdl);
+	if (dualscreen)
+		uibvnc_mirror(sdl);
 
 	client->width = (sdl_big?sdl_big:sdl)->pitch / (depth / 8);
 	client->frameBuffer=(sdl_big?sdl_big:sdl)->pixels;
@@ -309,13 +319,23 @@ static rfbBool resize(rfbClient* client) {
 }
 
 
+static void log_footprint(rfbClient *c, const char *name)
+{
+	rfbClientLog("%s: %u KB decoder memory, trimmed %u times",
+		name, (unsigned)(rfbClientFootprint(c) / 1024), c->memoryTrims);
+}
+
 static void cleanup()
 {
-	if(cl)
+	if(cl) {
+		log_footprint(cl, "VNC");
 		rfbClientCleanup(cl);
+	}
 	cl = NULL;
-	if (cl2)
+	if (cl2) {
+		log_footprint(cl2, "BottomVNC");
 		rfbClientCleanup(cl2);
+	}
 	cl2 = NULL;
 	if (sdl_big)
 		SDL_FreeSurface(sdl_big);
@@ -551,6 +571,11 @@ static void push_scheduled_event() {
 	}
 }
 
+// is there VNC on the bottom screen, of its own or the main connection?
+static int bottom_vnc() {
+	return cl2 || (cl && dualscreen);
+}
+
 static void checkconfig() {
 	if (!cl && cl2) config.eventtarget = 1;
 	if (!cl && !cl2) config.ctr_vnc_keys = config.ctr_vnc_touch = 0;
@@ -578,9 +603,10 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 		if (viewOnly)
 			break;
 
+		int bottom = bottom_vnc() && config.eventtarget;
 		rfbClient *tcl = (cl2 && config.eventtarget)?cl2:cl;
 
-		if (tcl != cl) { // bottom screen always uses direct coodinates, not relative
+		if (bottom) { // bottom screen always uses direct coodinates, not relative
 			// get and translate the positions
 			int x1=(e->type == SDL_MOUSEMOTION ? e->motion.x : e->button.x) * 320 / sdl->w;
 			int y1=(e->type == SDL_MOUSEMOTION ? e->motion.y : e->button.y) * 240 / sdl->h;
@@ -651,7 +677,7 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 		}
 
 		if (e->type == SDL_MOUSEMOTION) {
-			if (tcl && tcl == cl) {
+			if (tcl && !bottom) {
 				float xrel = (float)e->motion.xrel * (config.scaling?1.0:(400.0 / (float)sdl->w)) * scaling_factor_top;
 				float yrel = (float)e->motion.yrel * (config.scaling?1.0:(240.0 / (float)sdl->h)) * scaling_factor_top;
 				xf += xrel;
@@ -763,6 +789,10 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 					uibvnc_resize(cl2);
 					SendFramebufferUpdateRequest(cl2, 0, 0, cl2->updateRect.w, cl2->updateRect.h, FALSE);
 					uib_show_message(3000,"Bottom screen scaling %s",config.scaling2?"on":"off");
+				} else if (bottom_vnc()) {
+					uibvnc_setScaling(config.scaling2);
+					uibvnc_mirror(sdl);
+					uib_show_message(3000,"Bottom screen scaling %s",config.scaling2?"on":"off");
 				}
 			}
 			break;
@@ -774,14 +804,14 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 			}
 			break;
 		case COM_EVENTTARGET:
-			if (cl2 && cl && e->type == SDL_KEYDOWN) {
+			if (bottom_vnc() && cl && e->type == SDL_KEYDOWN) {
 				config.eventtarget = !config.eventtarget;
 				recalc_event_target = 1;
 				uib_show_message(3000,"Event target = %s",config.eventtarget?"botton":"top");
 			}
 			break;
 		case COM_TAPHANDLING:
-			if (cl2  && e->type == SDL_KEYDOWN) {
+			if (bottom_vnc() && e->type == SDL_KEYDOWN) {
 				config.notaphandling = !config.notaphandling;
 				recalc_event_target = 1;
 				uib_show_message(3000,"Bottom tap handling turned %s",config.notaphandling?"off":"on");
@@ -828,6 +858,12 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 }
 
 //static void get_selection(rfbClient *cl, const char *text, int len){}
+
+// audio over the VNC connection (QEMU audio extension)
+static void got_audio(rfbClient* cl, const char *data, int size) {
+	stream_feed(data, size);
+}
+
 char *user1, *pass1;
 
 static char* get_password(rfbClient* cl) {
@@ -1094,7 +1130,7 @@ static int editconfig(vnc_config *c) {
 					uib_set_position(0,++l);
 					uib_printf(	"Bottom screen port: ");
 					if (sel == EDITCONF_PORT2)uib_invert_colors();
-					uib_printf(	"%-20d", nc.port2);
+					uib_printf(	"%-20s", nc.port2?itoa(nc.port2,input,10):"main connection");
 					if (sel == EDITCONF_PORT2) uib_reset_colors();
 					uib_set_position(0,++l);
 					uib_printf(nc.scaling2?"\x91 ":"\x90 ");
@@ -1150,7 +1186,7 @@ static int editconfig(vnc_config *c) {
 					uib_set_position(0,++l);
 					uib_printf(	"Audio Stream Port: ");
 					if (sel == EDITCONF_AUDIOPORT) uib_invert_colors();
-					uib_printf(	"%-21s", nc.audioport?itoa(nc.audioport,input,10):"");
+					uib_printf(	"%-21s", nc.audioport?itoa(nc.audioport,input,10):"VNC connection");
 					if (sel == EDITCONF_AUDIOPORT) uib_reset_colors();
 					uib_set_position(0,++l);
 					uib_printf(	"Audio Stream Path: ");
@@ -1257,6 +1293,10 @@ static int editconfig(vnc_config *c) {
 						!nc.ctr_dsu_enable)
 					{
 						msg = "Nothing to do?";
+					} else if (nc.enableaudio && !nc.audioport && nc.vncoff) {
+						msg = "VNC audio needs the top screen VNC";
+					} else if (nc.enablevnc2 && !nc.port2 && nc.vncoff) {
+						msg = "Bottom screen needs the top screen VNC";
 					} else ret=1;
 					break;
 				case BUT_CPDOWN:
@@ -1369,14 +1409,14 @@ static int editconfig(vnc_config *c) {
 						break;
 					case EDITCONF_PORT2: // bottom screen port
 						swkbdInit(&swkbd, SWKBD_TYPE_NUMPAD, 2, 5);
-						swkbdSetHintText(&swkbd, "Bottom Screen Port");
+						swkbdSetHintText(&swkbd, "Bottom Screen Port, 0: main connection");
 						sprintf(input, "%d", nc.port2);
 						swkbdSetInitialText(&swkbd, input);
 						//swkbdSetFeatures(&swkbd, SWKBD_DEFAULT_QWERTY);
 						button = swkbdInputText(&swkbd, input, 6);
 						if(button != SWKBD_BUTTON_LEFT) {
 							int po = atoi(input);
-							if (po <= 0) po=1;
+							if (po < 0) po=0;
 							if (po > 0xffff) po=0xffff;
 							nc.port2 = po;
 						}
@@ -1395,14 +1435,14 @@ static int editconfig(vnc_config *c) {
 						break;
 					case EDITCONF_AUDIOPORT: // audio port
 						swkbdInit(&swkbd, SWKBD_TYPE_NUMPAD, 2, 5);
-						swkbdSetHintText(&swkbd, "Audio Port");
+						swkbdSetHintText(&swkbd, "Audio Port, 0: VNC connection");
 						sprintf(input, "%d", nc.audioport);
 						swkbdSetInitialText(&swkbd, input);
 						//swkbdSetFeatures(&swkbd, SWKBD_DEFAULT_QWERTY);
 						button = swkbdInputText(&swkbd, input, 6);
 						if(button != SWKBD_BUTTON_LEFT) {
 							int po = atoi(input);
-							if (po <= 0) po=1;
+							if (po < 0) po=0; // 0: audio over the VNC connection
 							if (po > 0xffff) po=0xffff;
 							nc.audioport = po;
 						}
@@ -1721,6 +1761,23 @@ static void readkeymaps(char *cname) {
 	if (p) free(p);
 }
 
+// SDL's screen and wave buffers come from the same pool as ours
+static void *sdl_linear_alloc(size_t size, int use)
+{
+	return linear_alloc(size, use == SDL_N3DS_LINEAR_AUDIO ? LINEAR_AUDIO : LINEAR_FRAMEBUFFER);
+}
+
+static void log_linear_stats()
+{
+	linear_stats ls;
+
+	linear_get_stats(&ls);
+	rfbClientLog("Linear memory: peak %u/%u/%u/%u KB (framebuffer/staging/geometry/audio), %u KB pooled, %u reused, %u trims, %u failed",
+		ls.use[LINEAR_FRAMEBUFFER].peak / 1024, ls.use[LINEAR_STAGING].peak / 1024,
+		ls.use[LINEAR_GEOMETRY].peak / 1024, ls.use[LINEAR_AUDIO].peak / 1024,
+		ls.pooled / 1024, ls.reused, ls.trims, ls.failed);
+}
+
 void aptHookFunc(APT_HookType hookType, void *param)
 {
 
@@ -1748,12 +1805,7 @@ int main() {
 	char buf[512];
 	struct vjoy_udp_client udpclient;
 	struct dsu_server dsuserver;
-	u32 kHeld;
-	circlePosition posCp, posStk;
-	touchPosition touch;
-	accelVector accel;
-	angularRate gyro;
-	float slider3d = 0.0;
+	input_stats in_stats;
 
 	osSetSpeedupEnable(1);
 
@@ -1762,6 +1814,7 @@ int main() {
 	romfsInit();
 	atexit((void (*)())romfsExit);
 	
+	SDL_N3DS_SetLinearAllocator(sdl_linear_alloc, linear_free);
 	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_JOYSTICK);
 	SDL_JoystickOpen(0);
 
@@ -1808,13 +1861,21 @@ int main() {
 
 		readkeymaps(config.name);
 
+		// one connection for both screens saves the server a second
+		// encoder and the network the second copy of what both show
+		dualscreen = config.enablevnc2 && !config.port2;
+		uibvnc_setScaling(config.scaling2);
+
 		// top screen VNC
 		if (!config.vncoff) {
 			cl=rfbGetClient(8,3,4); // int bitsPerSample, int samplesPerPixel, int bytesPerPixel
 			cl->MallocFrameBuffer = resize;
 			cl->canHandleNewFBSize = TRUE;
+			cl->decodeThreads = 2; // decode JPEG rects on the spare cores (if available)
+			cl->memoryBudget = VNC_MEMORY_BUDGET;
 			cl->GetCredential = get_credential;
 			cl->GetPassword = get_password;
+			if (config.enableaudio && !config.audioport) cl->GotAudio = got_audio;
 			snprintf(buf, sizeof(buf),"%s:%d",config.host, config.port);
 			rfbClientLog("Connecting to %s", buf);
 			if(!rfbInitClient(cl, &argc, argv))
@@ -1823,13 +1884,15 @@ int main() {
 			} else ++active;
 		}
 		// bottom screen VNC
-		if (config.enablevnc2) {
+		if (config.enablevnc2 && !dualscreen) {
 			cl2=rfbGetClient(8,3,4); // int bitsPerSample, int samplesPerPixel, int bytesPerPixel
 			cl2->MallocFrameBuffer = uibvnc_resize;
 			cl2->canHandleNewFBSize = TRUE;
+			cl2->memoryBudget = VNC_MEMORY_BUDGET;
+			// both sessions are handled by this thread, one after the other
+			if (cl) rfbClientShareScratch(cl2, cl);
 			cl2->GetCredential = get_credential;
 			cl2->GetPassword = get_password;
-			uibvnc_setScaling(config.scaling2);
 			snprintf(buf, sizeof(buf),"%s:%d",config.host, config.port2);
 			rfbClientLog("Connecting2 to %s", buf);
 			if(!rfbInitClient(cl2, &argc, argv))
@@ -1838,12 +1901,16 @@ int main() {
 			} else ++active;
 		}
 
-		if (config.enableaudio) {
+		if (config.enableaudio && config.audioport) {
 			snprintf(buf, sizeof(buf),"http://%s:%d%s%s",config.host, config.audioport,
 				(config.audiopath[0]=='/'?"":"/"), config.audiopath);
-			start_stream(buf, config.user, config.pass);
+			stream_start(buf, config.user, config.pass);
 			++active;
-		}
+		} else if (config.enableaudio && cl) {
+			// the server starts sending once it has seen the encoding
+			stream_start_fed(cl->audioFrequency, cl->audioChannels);
+			++active;
+		} else config.enableaudio = 0;
 
 		if (config.ctr_udp_enable) {
 			// init UDP client
@@ -1853,6 +1920,7 @@ int main() {
 				//udpclient.mouse_relative = 1;
 				//udpclient.mouse_sensitivity = 500;
 				//udpclient.interval = 100;
+				//udpclient.batch = 1; // for receivers that read batch datagrams, not the stock feeder
 				rfbClientLog("vJoy-UDP-feeder client started");
 				++active;
 			}
@@ -1861,15 +1929,23 @@ int main() {
 			if (dsu_server_init(&dsuserver, config.ctr_dsu_port))
 				rfbClientErr("Cemuhook server: %s", dsuserver.lasterrmsg);
 			else {
-				//dsuserver.interval = 0;
+				dsuserver.interval = 0; // every sample, as the controller thread takes it
 				rfbClientLog("Cemuhook started: %s:%d", dsuserver.ipstr, dsuserver.port);
 				++active;
 			}
 		}
-		if ((config.ctr_udp_enable && config.ctr_udp_motion) || config.ctr_dsu_enable) {
+		int motion = (config.ctr_udp_enable && config.ctr_udp_motion) || config.ctr_dsu_enable;
+		if (motion) {
 			HIDUSER_EnableAccelerometer();
 			HIDUSER_EnableGyroscope();
 		}
+		// sample the input at a steady rate, whatever the VNC load
+		if (input_start(motion))
+			rfbClientErr("cannot start the input thread");
+		// the controller servers get every sample as it is taken
+		if (controller_start(config.ctr_udp_enable ? &udpclient : NULL, config.ctr_udp_motion,
+				config.ctr_dsu_enable ? &dsuserver : NULL))
+			rfbClientErr("cannot start the controller thread");
 		checkconfig();
 
 		// clear mouse state
@@ -1907,9 +1983,11 @@ int main() {
 		while(active) {
 			// set up event handling
 			if (recalc_event_target) {
-				evtarget = (cl2!=NULL && config.eventtarget!=0);
+				evtarget = (bottom_vnc() && config.eventtarget!=0);
 				taphandling = evtarget ? !config.notaphandling : 1;
 				int i = evtarget;
+				// a shared framebuffer shows the cursor unless the bottom screen is touched directly
+				if (dualscreen) i = evtarget && !taphandling;
 				if (cl && cl->appData.useRemoteCursor != i) {
 					cl->appData.useRemoteCursor = i;
 					SetFormatAndEncodings(cl);
@@ -1942,36 +2020,17 @@ int main() {
 
 			if (ext) break;
 			push_scheduled_event();
-			// vjoy udp feeder && cemuhook server
-			if (config.ctr_udp_enable || config.ctr_dsu_enable) {
-				kHeld = hidKeysHeld();
-				hidCircleRead(&posCp);
-				irrstCstickRead(&posStk);
-				hidTouchRead(&touch);
-				if (config.ctr_udp_enable) slider3d = osGet3DSliderState();
-				if ((config.ctr_udp_enable && config.ctr_udp_motion) || config.ctr_dsu_enable) {
-					hidAccelRead(&accel);
-					hidGyroRead(&gyro);
-				}
-			}
-			if (config.ctr_udp_enable) {
-				if (config.ctr_udp_motion)
-					vjoy_udp_client_update(&udpclient, kHeld, &posCp, &posStk, &touch, &accel, &gyro, slider3d);
-				else
-					vjoy_udp_client_update(&udpclient, kHeld, &posCp, &posStk, &touch, NULL, NULL, slider3d);
-			}
-			if (config.ctr_dsu_enable &&
-				(dsu_server_run(&dsuserver) ||
-				dsu_server_update(&dsuserver, kHeld, &posCp, &posStk, &touch, &accel, &gyro)))
-			{
+			// cemuhook server, fed on the controller thread
+			if (config.ctr_dsu_enable && (controller_health() & CONTROLLER_DSU)) {
+				rfbClientErr("Cemuhook server: %s", dsuserver.lasterrmsg);
 				dsu_server_shutdown(&dsuserver);
 				config.ctr_dsu_enable = 0;
 				--active;
 			}
 
 			// audio stream
-			if (config.enableaudio && run_stream()) {
-				stop_stream();
+			if (config.enableaudio && stream_health()) {
+				stream_stop();
 				config.enableaudio = 0;
 				--active;
 			}
@@ -1980,17 +2039,19 @@ int main() {
 				i=WaitForMessage(cl,10);
 				if(i<0 || (i>0 && !HandleRFBServerMessage(cl))) {
 					rfbClientErr("VNC: error waiting for or processing messages");				
+					log_footprint(cl, "VNC");
 					rfbClientCleanup(cl);
 					cl=NULL;
 					recalc_event_target = 1;
 					--active;
 					checkconfig();
-				}
+				} else if (i>0 && dualscreen) uib_update(UIB_NO);
 			}
 			if (cl2) {
 				i=WaitForMessage(cl2,10);
 				if(i<0 || (i>0 && !HandleRFBServerMessage(cl2))) {
 					rfbClientErr("BottomVNC: error waiting for or processing messages");
+					log_footprint(cl2, "BottomVNC");
 					rfbClientCleanup(cl2);
 					cl2=NULL;
 					recalc_event_target = 1;
@@ -1999,6 +2060,14 @@ int main() {
 				} else if (i>0) uib_update(UIB_RECALC_VNC);
 			}
 		}
+		// stop sampling before the SDL event pump is needed on its own again,
+		// and before reading the counters of the threads
+		controller_stop();
+		input_stop();
+		input_get_stats(&in_stats);
+		if (in_stats.samples)
+			rfbClientLog("Input: %u samples, %u late, %u lost by SDL, %u by the controller servers, %llu us max jitter",
+				in_stats.samples, in_stats.late, in_stats.overruns, controller_overruns(), in_stats.jitter_max);
 		// cleanup udp client / dsu server
 		if (config.ctr_dsu_enable)
 			dsu_server_shutdown(&dsuserver);
@@ -2009,9 +2078,12 @@ int main() {
 
 		// clean up audio stream
 		if (config.enableaudio)
-			stop_stream();
+			stream_stop();
 		// clean up VNC clients
 		cleanup();
+		log_linear_stats();
+		// the next connection may need the room for other sizes
+		linear_trim();
 
 		uib_enable_keyboard(0);
 		uib_enable_log(1);
@@ -33,34 +33,42 @@ static int mp3_feed(void *data, int size)
 	return mpg123_feed(mp3_handle, (const unsigned char *)data, size);
 }
 
-// returns the number of bytes decoded or a negative number on error
-static int mp3_decode(void **outdata, int *outsize)
+static void mp3_newformat()
 {
-	if (!mp3_handle) return -1;
-	size_t os;
-	off_t frame_offset;
 	int encoding;
-	int err = mpg123_decode_frame(mp3_handle, &frame_offset, (unsigned char **)outdata, &os);
-	*outsize = os;
+	struct mpg123_frameinfo mi;
+
+	mpg123_getformat(mp3_handle, &mp3_rate, &mp3_channels, &encoding);
+	// Ensure that this output format will not change (it might, when we allow it).
+	mpg123_format_none(mp3_handle);
+	mpg123_format(mp3_handle, mp3_rate, mp3_channels, MPG123_ENC_SIGNED_16);
+	mpg123_info(mp3_handle, &mi);
+	mp3_bitrate=mi.bitrate;
+	infoavailable = 1;
+}
+
+// decodes up to outsize bytes straight into outdata. Returns the number of
+// bytes decoded, 0 if more data is needed or a negative number on error.
+// Call with outsize 0 to find the stream format.
+static int mp3_decode(void *outdata, int outsize)
+{
+	if (!mp3_handle) return -1;
+	size_t done, total = 0;
+	int err;
+	do {
+		err = mpg123_read(mp3_handle, (unsigned char *)outdata + total, outsize - total, &done);
+		total += done;
+		if (err == MPG123_NEW_FORMAT) mp3_newformat();
+	} while (err == MPG123_NEW_FORMAT && total < outsize);
 	switch(err) {
-	case MPG123_NEW_FORMAT:
-		mpg123_getformat(mp3_handle, &mp3_rate, &mp3_channels, &encoding);
-		// Ensure that this output format will not change (it might, when we allow it).
-		mpg123_format_none(mp3_handle);
-		mpg123_format(mp3_handle, mp3_rate, mp3_channels, MPG123_ENC_SIGNED_16);
-		struct mpg123_frameinfo mi;
-		mpg123_info(mp3_handle, &mi);
-		mp3_bitrate=mi.bitrate;
-		infoavailable = 1;
-		return 0;
 	case MPG123_OK:
-		return *outsize;
 	case MPG123_NEED_MORE:
-		return 0;
+	case MPG123_DONE:
+	case MPG123_NEW_FORMAT:
+		return total;
 	default: // we have an mpg error
 		return -1;
 	}
-	return -1;
 }
 
 // return 0 on success, -1 on failure
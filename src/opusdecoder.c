@@ -0,0 +1,349 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * opusdecoder.c - functions for handling Ogg/Opus decoding
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <opus/opus.h>
+#include <stdlib.h>
+#include <string.h>
+#include "decoder.h"
+#include "opusdecoder.h"
+
+#define OPUS_RATE 48000
+#define OPUS_MAX_FRAME (OPUS_RATE * 120 / 1000)	// longest packet: 120 ms
+
+// Ogg page header (RFC 3533)
+#define OGG_HEADER_SIZE 27
+#define OGG_CONTINUED 0x01
+#define OGG_BOS 0x02
+
+static OpusDecoder *opus_dec = NULL;
+static int opus_channels;
+static int opus_bitrate;
+static int opus_preskip;		// samples still to be dropped at the start
+static int infoavailable = 0;
+static int headers;				// header packets of the stream seen so far
+static const char *opus_error = NULL;
+
+// data fed, not yet demuxed
+static unsigned char *in_buf = NULL;
+static int in_size, in_len, in_pos;
+
+// the page being demuxed, in in_buf at in_pos
+static int page_open;			// page header parsed
+static int page_segs, page_seg;	// segments of the page, next segment
+static int page_data;			// offset of the next segment data
+static unsigned int page_serial;
+static unsigned int stream_serial;
+static unsigned int stream_seq;	// sequence number of the next page
+static int stream_seq_known;
+static int page_skip;			// dropping the rest of a packet from a lost page
+static int lost;				// pages lost since the last packet
+static int last_n;				// samples in the last packet, concealed for a lost one
+
+// the packet being assembled
+static unsigned char *pkt = NULL;
+static int pkt_size, pkt_len;
+
+// decoded samples that did not fit into the caller's buffer
+static opus_int16 *spill = NULL;
+static int spill_len, spill_pos;	// in samples per channel
+
+static int opus_init()
+{
+	in_len = in_pos = 0;
+	page_open = 0;
+	pkt_len = 0;
+	spill_len = spill_pos = 0;
+	headers = 0;
+	infoavailable = 0;
+	stream_seq_known = 0;
+	page_skip = 0;
+	lost = 0;
+	last_n = OPUS_RATE / 50;
+	opus_error = NULL;
+	return 0;
+}
+
+// returns 0 on success, non-zero on error
+static int opus_feed(void *data, int size)
+{
+	unsigned char *b;
+
+	// drop what has been demuxed already
+	if (in_pos > 0) {
+		memmove(in_buf, in_buf + in_pos, in_len - in_pos);
+		page_data -= in_pos;
+		in_len -= in_pos;
+		in_pos = 0;
+	}
+	if (in_len + size > in_size) {
+		if (!(b = realloc(in_buf, in_len + size))) {
+			opus_error = "out of memory";
+			return -1;
+		}
+		in_buf = b;
+		in_size = in_len + size;
+	}
+	memcpy(in_buf + in_len, data, size);
+	in_len += size;
+	return 0;
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+// assembles the next packet of the stream in pkt; returns 1 if there is
+// one, 2 if pages of the stream were lost before it, 0 if more data is
+// needed or -1 on error
+static int opus_next_packet()
+{
+	unsigned char *p, *b;
+	int i, len, lacing;
+
+	while (1) {
+		if (!page_open) {
+			p = in_buf + in_pos;
+			if (in_len - in_pos < OGG_HEADER_SIZE) return 0;
+			if (memcmp(p, "OggS", 4) || p[4] != 0) {
+				opus_error = "lost Ogg page sync";
+				return -1;
+			}
+			page_segs = p[26];
+			if (in_len - in_pos < OGG_HEADER_SIZE + page_segs) return 0;
+			for (i = 0, len = 0; i < page_segs; i++)
+				len += p[OGG_HEADER_SIZE + i];
+			// demux only once the whole page is there
+			if (in_len - in_pos < OGG_HEADER_SIZE + page_segs + len) return 0;
+			page_serial = le32(p + 14);
+			page_seg = 0;
+			page_data = in_pos + OGG_HEADER_SIZE + page_segs;
+			page_open = 1;
+			// follow the first Opus stream and those chained to it, other
+			// streams multiplexed with it are skipped
+			if ((p[5] & OGG_BOS) && len >= 8 && !memcmp(in_buf + page_data, "OpusHead", 8)) {
+				stream_serial = page_serial;
+				stream_seq_known = 0;
+				headers = 0;
+				pkt_len = 0;
+			}
+			if (page_serial == stream_serial) {
+				// after a gap in the page sequence, the packet being
+				// assembled is incomplete, and so is the first one on this
+				// page if it continues from the lost ones
+				if (stream_seq_known && le32(p + 18) != stream_seq) {
+					pkt_len = 0;
+					page_skip = p[5] & OGG_CONTINUED;
+					lost = headers >= 2;
+				}
+				stream_seq = le32(p + 18) + 1;
+				stream_seq_known = 1;
+				if (lost) return 2;
+			}
+		}
+
+		while (page_seg < page_segs) {
+			lacing = in_buf[in_pos + OGG_HEADER_SIZE + page_seg++];
+			if (page_serial == stream_serial && !page_skip) {
+				if (pkt_len + lacing > pkt_size) {
+					if (!(b = realloc(pkt, pkt_len + lacing + 1024))) {
+						opus_error = "out of memory";
+						return -1;
+					}
+					pkt = b;
+					pkt_size = pkt_len + lacing + 1024;
+				}
+				memcpy(pkt + pkt_len, in_buf + page_data, lacing);
+				pkt_len += lacing;
+			}
+			page_data += lacing;
+			// a segment shorter than 255 bytes ends a packet
+			if (lacing < 255 && page_serial == stream_serial) {
+				if (!page_skip) return 1;
+				page_skip = 0;
+			}
+		}
+
+		// the page is done, a packet may continue on the next one
+		in_pos = page_data;
+		page_open = 0;
+	}
+}
+
+// parses the identification header
+static int opus_head()
+{
+	int err;
+	opus_int16 gain;
+
+	if (pkt_len < 19 || memcmp(pkt, "OpusHead", 8)) {
+		opus_error = "not an Opus stream";
+		return -1;
+	}
+	if (pkt[18] != 0 || pkt[9] < 1 || pkt[9] > 2) {
+		opus_error = "unsupported Opus channel mapping";
+		return -1;
+	}
+	if (opus_dec && opus_channels != pkt[9]) {
+		opus_error = "Opus channel count changed";
+		return -1;
+	}
+	opus_channels = pkt[9];
+	opus_preskip = pkt[10] | pkt[11] << 8;
+	gain = pkt[16] | pkt[17] << 8;
+
+	if (!opus_dec) {
+		opus_dec = opus_decoder_create(OPUS_RATE, opus_channels, &err);
+		if (!opus_dec) {
+			opus_error = opus_strerror(err);
+			return -1;
+		}
+	} else {
+		opus_decoder_ctl(opus_dec, OPUS_RESET_STATE);
+	}
+	opus_decoder_ctl(opus_dec, OPUS_SET_GAIN(gain));
+	if (!spill && !(spill = malloc(OPUS_MAX_FRAME * 2 * sizeof(opus_int16)))) {
+		opus_error = "out of memory";
+		return -1;
+	}
+	return 0;
+}
+
+// decodes up to outsize bytes straight into outdata. Returns the number of
+// bytes decoded, 0 if more data is needed or a negative number on error.
+// Call with outsize 0 to find the stream format.
+// Packets that do not decode are skipped, lost and empty ones concealed;
+// only an Ogg stream that cannot be demuxed is an error.
+static int opus_decode_packets(void *outdata, int outsize)
+{
+	opus_int16 *out = outdata;
+	int room = outsize / (opus_channels ? opus_channels * sizeof(opus_int16) : 1);
+	int done = 0, n, r, len;
+	unsigned char *data;
+
+	if (!headers && !opus_dec) room = 0;	// format not known yet
+
+	while (1) {
+		// first hand out what is left of the last packet
+		if (spill_len > spill_pos && room > 0) {
+			n = spill_len - spill_pos < room ? spill_len - spill_pos : room;
+			memcpy(out + done * opus_channels, spill + spill_pos * opus_channels,
+				n * opus_channels * sizeof(opus_int16));
+			spill_pos += n;
+			done += n;
+			room -= n;
+		}
+		if (room == 0 && infoavailable) break;
+
+		if (lost) {
+			// a packet's worth of concealment for the pages lost
+			lost = 0;
+			if (!infoavailable) continue;
+			data = NULL;
+			len = 0;
+			n = last_n;
+		} else {
+			if ((r = opus_next_packet()) <= 0) {
+				if (r < 0) return -1;
+				break;
+			}
+			if (r == 2) continue;
+
+			if (headers < 2) {
+				// OpusHead, then OpusTags
+				if (headers == 0 && opus_head() != 0) return -1;
+				headers++;
+				pkt_len = 0;
+				continue;
+			}
+
+			data = pkt;
+			len = pkt_len;
+			pkt_len = 0;
+			if (len == 0) {
+				// an empty packet is a lost one, for libopus too
+				if (!infoavailable) continue;
+				data = NULL;
+				n = last_n;
+			} else if ((n = opus_packet_get_nb_samples(data, len, OPUS_RATE)) <= 0) {
+				continue;
+			}
+			if (!infoavailable) {
+				opus_bitrate = len * 8 * (OPUS_RATE / 1000) / n;
+				infoavailable = 1;
+			}
+		}
+
+		// the packet goes straight into the caller's buffer if it fits
+		if (n <= room && !opus_preskip) {
+			r = opus_decode(opus_dec, data, len, out + done * opus_channels, n, 0);
+			if (r > 0) {
+				done += r;
+				room -= r;
+			}
+		} else {
+			r = opus_decode(opus_dec, data, len, spill, n, 0);
+			if (r > 0) {
+				spill_pos = opus_preskip < r ? opus_preskip : r;
+				opus_preskip -= spill_pos;
+				spill_len = r;
+			}
+		}
+		if (r > 0 && data) last_n = r;
+	}
+	return done * opus_channels * sizeof(opus_int16);
+}
+
+// return 0 on success, -1 on failure
+static int opus_info(char **type, int *rate, int *channels, int *bitrate)
+{
+	if (!infoavailable) return -1;
+	if (type) *type = "opus";
+	if (rate) *rate = OPUS_RATE;
+	if (channels) *channels = opus_channels;
+	if (bitrate) *bitrate = opus_bitrate;
+	return 0;
+}
+
+static int opus_close()
+{
+	if (opus_dec) opus_decoder_destroy(opus_dec);
+	opus_dec = NULL;
+	free(in_buf);
+	free(pkt);
+	free(spill);
+	in_buf = pkt = NULL;
+	spill = NULL;
+	in_size = pkt_size = 0;
+	opus_channels = 0;
+	infoavailable = 0;
+	return 0;
+}
+
+// returns the last error string
+static const char *opus_errstr()
+{
+	return opus_error;
+}
+
+// return 0 on success, -1 on failure
+int opus_checkmagic(char *m) {
+	if (memcmp(m, "OggS", 4))
+		return -1;
+	return 0;
+}
+
+// initializes an audioDecoder struct with Ogg/Opus-Decoder methods
+void opus_create_decoder(audioDecoder *d) {
+	d->init = opus_init;
+	d->feed = opus_feed;
+	d->decode = opus_decode_packets;
+	d->info = opus_info;
+	d->close = opus_close;
+	d->errstr = opus_errstr;
+}
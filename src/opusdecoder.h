@@ -0,0 +1,11 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * opusdecoder.h - functions for handling Ogg/Opus decoding
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include "decoder.h"
+extern void opus_create_decoder(audioDecoder* decoder);
+extern int opus_checkmagic(char *magic);
@@ -0,0 +1,99 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * pcmdecoder.c - functions for handling raw PCM audio
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "decoder.h"
+#include "pcmdecoder.h"
+
+#define PCM_BUFFER_MS 1000	// audio that may be fed ahead of decoding
+
+// signed 16-bit samples in host order, interleaved by channel
+static int pcm_rate;
+static int pcm_channels;
+static const char *pcm_error = NULL;
+
+// a ring of the data fed, not yet decoded
+static unsigned char *in_buf = NULL;
+static int in_size, in_pos, in_len;
+
+static int pcm_init()
+{
+	in_size = pcm_rate * pcm_channels * 2 * PCM_BUFFER_MS / 1000;
+	in_buf = malloc(in_size);
+	in_pos = in_len = 0;
+	pcm_error = in_buf ? NULL : "out of memory";
+	return in_buf ? 0 : -1;
+}
+
+// returns 0 on success, non-zero if the data does not fit
+static int pcm_feed(void *data, int size)
+{
+	int end, n;
+
+	if (!in_buf || in_len + size > in_size) return -1;
+	end = (in_pos + in_len) % in_size;
+	n = in_size - end < size ? in_size - end : size;
+	memcpy(in_buf + end, data, n);
+	memcpy(in_buf, (unsigned char *)data + n, size - n);
+	in_len += size;
+	return 0;
+}
+
+// copies up to outsize bytes of whole sample frames into outdata. Returns
+// the number of bytes copied, 0 if more data is needed.
+static int pcm_decode(void *outdata, int outsize)
+{
+	int frame = pcm_channels * 2;
+	int size = (in_len < outsize ? in_len : outsize) / frame * frame;
+	int n;
+
+	if (!in_buf) return -1;
+	n = in_size - in_pos < size ? in_size - in_pos : size;
+	memcpy(outdata, in_buf + in_pos, n);
+	memcpy((unsigned char *)outdata + n, in_buf, size - n);
+	in_pos = (in_pos + size) % in_size;
+	in_len -= size;
+	return size;
+}
+
+// return 0 on success, -1 on failure
+static int pcm_info(char **type, int *rate, int *channels, int *bitrate)
+{
+	if (type) *type = "pcm";
+	if (rate) *rate = pcm_rate;
+	if (channels) *channels = pcm_channels;
+	if (bitrate) *bitrate = pcm_rate * pcm_channels * 16 / 1000;
+	return 0;
+}
+
+static int pcm_close()
+{
+	free(in_buf);
+	in_buf = NULL;
+	in_size = in_pos = in_len = 0;
+	return 0;
+}
+
+// returns the last error string
+static const char *pcm_errstr()
+{
+	return pcm_error;
+}
+
+// initializes an audioDecoder struct for raw PCM in the given format
+void pcm_create_decoder(audioDecoder *d, int rate, int channels) {
+	pcm_rate = rate;
+	pcm_channels = channels;
+	d->init = pcm_init;
+	d->feed = pcm_feed;
+	d->decode = pcm_decode;
+	d->info = pcm_info;
+	d->close = pcm_close;
+	d->errstr = pcm_errstr;
+}
@@ -0,0 +1,10 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * pcmdecoder.h - functions for handling raw PCM audio
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include "decoder.h"
+extern void pcm_create_decoder(audioDecoder* decoder, int rate, int channels);
@@ -36,7 +36,8 @@ HandleCoRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     int i;
     CARDBPP pix;
     uint8_t *ptr;
-    int x, y, w, h;
+    int n;
+    rfbClientSubrect subrects[128];
 
     if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbRREHeader))
 	return FALSE;
@@ -46,23 +47,33 @@ HandleCoRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     if (!ReadFromRFBServer(client, (char *)&pix, sizeof(pix)))
 	return FALSE;
 
-    client->GotFillRect(client, rx, ry, rw, rh, pix);
+    subrects[0].x = subrects[0].y = 0;
+    subrects[0].w = rw;
+    subrects[0].h = rh;
+    subrects[0].colour = pix;
+    n = 1;
 
     if (hdr.nSubrects > RFB_BUFFER_SIZE / (4 + (BPP / 8)) || !ReadFromRFBServer(client, client->buffer, hdr.nSubrects * (4 + (BPP / 8))))
 	return FALSE;
 
     ptr = (uint8_t *)client->buffer;
 
+    /* draw the subrects in batches, the rectangle is bounds-checked once per batch */
     for (i = 0; i < hdr.nSubrects; i++) {
-	pix = *(CARDBPP *)ptr;
+	if (n == sizeof(subrects) / sizeof(subrects[0])) {
+	    rfbClientFillRects(client, rx, ry, rw, rh, subrects, n);
+	    n = 0;
+	}
+	memcpy(&pix, ptr, sizeof(pix));
 	ptr += BPP/8;
-	x = *ptr++;
-	y = *ptr++;
-	w = *ptr++;
-	h = *ptr++;
-
-	client->GotFillRect(client, rx+x, ry+y, w, h, pix);
+	subrects[n].x = *ptr++;
+	subrects[n].y = *ptr++;
+	subrects[n].w = *ptr++;
+	subrects[n].h = *ptr++;
+	subrects[n].colour = pix;
+	n++;
     }
+    rfbClientFillRects(client, rx, ry, rw, rh, subrects, n);
 
     return TRUE;
 }
@@ -0,0 +1,368 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * decodepool.c - decode independent rectangles of a framebuffer update
+ * on worker threads while the main thread reads the next rectangle.
+ *
+ * Only Tight JPEG rectangles are queued: their payload is length-prefixed
+ * and self-contained, so it can be read completely before decoding and
+ * does not touch any shared decoder state (zlib streams, palettes,
+ * client->buffer). Each worker owns its own TurboJPEG handle and writes
+ * straight into the rectangle's area of the framebuffer.
+ *
+ * Ordering is kept by the caller: a rectangle decoded on the main thread
+ * first waits for all queued rectangles it overlaps, CopyRect and pseudo
+ * encodings wait for everything, and the framebuffer update is finished
+ * only after all queued rectangles are done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <rfb/rfbclient.h>
+#include "decodepool.h"
+
+#if defined(_3DS) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+
+#include <3ds.h>
+#include "turbojpeg.h"
+
+#define DECODE_MAX_THREADS 2
+#define DECODE_MAX_PENDING 32
+#define DECODE_STACK_SIZE (64*1024)
+#define DECODE_ERROR_SIZE 200   /* JMSG_LENGTH_MAX */
+
+enum {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE,
+  JOB_FAILED
+};
+
+typedef struct rfbDecodeJob {
+  struct rfbDecodeJob *next;
+  uint8_t *data;
+  int len;
+  int x, y, w, h;
+  int state;
+  char error[DECODE_ERROR_SIZE];  /* why it failed, set by the worker */
+} rfbDecodeJob;
+
+typedef struct rfbDecodePool {
+  rfbClient *client;
+  Thread thread[DECODE_MAX_THREADS];
+  int nthreads;
+  LightLock lock;
+  CondVar work;           /* a job was queued or the pool shuts down */
+  CondVar done;           /* a job finished */
+  rfbDecodeJob *pending;  /* jobs in submission order until delivered */
+  int npending;
+  rfbBool quit;
+  rfbBool failed;
+  rfbBool deferred;
+} rfbDecodePool;
+
+static rfbBool
+DecodeJpegJob(rfbClient* client, tjhandle tj, rfbDecodeJob* job)
+{
+  int pitch = client->width * 4;
+  uint8_t *dst = &client->frameBuffer[job->y * pitch + job->x * 4];
+
+  if (tjDecompress(tj, job->data, (unsigned long)job->len,
+                   dst, job->w, pitch, job->h, 4, TJ_ALPHAFIRST | TJ_BGR)==-1) {
+    /* the message of the handle, the global one belongs to every thread */
+    snprintf(job->error, sizeof(job->error), "%s", tjGetErrorStr2(tj));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+DecodeWorker(void *arg)
+{
+  rfbDecodePool *pool = (rfbDecodePool *)arg;
+  rfbDecodeJob *job;
+  rfbBool ok;
+  tjhandle tj = tjInitDecompress();
+
+  /* errors are logged by the main thread when the job is delivered */
+  LightLock_Lock(&pool->lock);
+  while (1) {
+    for (job = pool->pending; job != NULL && job->state != JOB_QUEUED; job = job->next);
+    if (job == NULL) {
+      if (pool->quit)
+        break;
+      CondVar_Wait(&pool->work, &pool->lock);
+      continue;
+    }
+    job->state = JOB_RUNNING;
+    LightLock_Unlock(&pool->lock);
+
+    /* only the main thread unlinks jobs, and only finished ones */
+    if (tj == NULL)
+      snprintf(job->error, sizeof(job->error), "no decompressor");
+    ok = tj != NULL && DecodeJpegJob(pool->client, tj, job);
+    free(job->data);
+    job->data = NULL;
+
+    LightLock_Lock(&pool->lock);
+    job->state = ok ? JOB_DONE : JOB_FAILED;
+    CondVar_Broadcast(&pool->done);
+  }
+  LightLock_Unlock(&pool->lock);
+
+  if (tj != NULL)
+    tjDestroy(tj);
+}
+
+static rfbDecodePool*
+CreatePool(rfbClient* client)
+{
+  static const int cores_n3ds[DECODE_MAX_THREADS] = { 2, 1 };
+  static const int cores_o3ds[DECODE_MAX_THREADS] = { 1, -1 };
+  rfbDecodePool *pool;
+  const int *cores;
+  bool isNew3DS = false;
+  s32 prio = 0x30;
+  int i;
+
+  pool = (rfbDecodePool *)calloc(1, sizeof(rfbDecodePool));
+  if (pool == NULL)
+    return NULL;
+  pool->client = client;
+  LightLock_Init(&pool->lock);
+  CondVar_Init(&pool->work);
+  CondVar_Init(&pool->done);
+
+  /* Workers go to the cores the main thread is not using: core 2 on the
+     New 3DS, the system core otherwise. Thread creation on the system core
+     fails unless the application was granted CPU time there, in which case
+     we just run with fewer workers. */
+  APT_CheckNew3DS(&isNew3DS);
+  cores = isNew3DS ? cores_n3ds : cores_o3ds;
+  svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+
+  for (i = 0; i < client->decodeThreads && i < DECODE_MAX_THREADS; i++) {
+    if (cores[i] < 0)
+      break;
+    pool->thread[pool->nthreads] = threadCreate(DecodeWorker, pool,
+      DECODE_STACK_SIZE, prio, cores[i], false);
+    if (pool->thread[pool->nthreads] != NULL)
+      pool->nthreads++;
+  }
+
+  if (pool->nthreads == 0) {
+    rfbClientLog("No decode threads available, decoding serially\n");
+    free(pool);
+    return NULL;
+  }
+  rfbClientLog("Using %d decode thread(s)\n", pool->nthreads);
+  return pool;
+}
+
+static rfbBool
+Overlaps(rfbDecodeJob* job, int x, int y, int w, int h)
+{
+  return job->x < x + w && x < job->x + job->w &&
+         job->y < y + h && y < job->y + job->h;
+}
+
+/*
+ * Waits for the queued jobs overlapping the given rectangle (or all jobs),
+ * then delivers every finished job to GotFrameBufferUpdate.
+ */
+static void
+DeliverJobs(rfbClient* client, int x, int y, int w, int h, rfbBool all)
+{
+  rfbDecodePool *pool = client->decodePool;
+  rfbDecodeJob **pj, *job, *finished = NULL;
+
+  LightLock_Lock(&pool->lock);
+  pj = &pool->pending;
+  while ((job = *pj) != NULL) {
+    if (job->state == JOB_QUEUED || job->state == JOB_RUNNING) {
+      if (all || Overlaps(job, x, y, w, h))
+        CondVar_Wait(&pool->done, &pool->lock);
+      else
+        pj = &job->next;
+      continue;
+    }
+    *pj = job->next;
+    pool->npending--;
+    if (job->state == JOB_FAILED)
+      pool->failed = TRUE;
+    job->next = finished;
+    finished = job;
+  }
+  LightLock_Unlock(&pool->lock);
+
+  while ((job = finished) != NULL) {
+    finished = job->next;
+    if (job->state == JOB_DONE)
+      client->GotFrameBufferUpdate(client, job->x, job->y, job->w, job->h);
+    else
+      rfbClientLog("TurboJPEG error: %s\n", job->error);
+    free(job);
+  }
+}
+
+rfbBool
+rfbDecodePoolSubmitJpeg(rfbClient* client, uint8_t* data, int len, int x, int y, int w, int h)
+{
+  rfbDecodePool *pool = client->decodePool;
+  rfbDecodeJob *job, **pj;
+
+  if (pool == NULL) {
+    if (client->decodeThreads <= 0)
+      return FALSE;
+    if ((pool = client->decodePool = CreatePool(client)) == NULL) {
+      client->decodeThreads = 0;
+      return FALSE;
+    }
+  }
+
+  /* keep the amount of compressed data in flight bounded */
+  if (pool->npending >= DECODE_MAX_PENDING)
+    DeliverJobs(client, pool->pending->x, pool->pending->y,
+                pool->pending->w, pool->pending->h, FALSE);
+
+  if ((job = (rfbDecodeJob *)malloc(sizeof(rfbDecodeJob))) == NULL)
+    return FALSE;
+  job->next = NULL;
+  job->data = data;
+  job->len = len;
+  job->x = x; job->y = y; job->w = w; job->h = h;
+  job->state = JOB_QUEUED;
+
+  LightLock_Lock(&pool->lock);
+  for (pj = &pool->pending; *pj != NULL; pj = &(*pj)->next);
+  *pj = job;
+  pool->npending++;
+  CondVar_Signal(&pool->work);
+  LightLock_Unlock(&pool->lock);
+
+  pool->deferred = TRUE;
+  return TRUE;
+}
+
+rfbBool
+rfbDecodePoolWait(rfbClient* client, int x, int y, int w, int h)
+{
+  rfbDecodePool *pool = client->decodePool;
+  rfbBool ok;
+
+  if (pool == NULL)
+    return TRUE;
+  DeliverJobs(client, x, y, w, h, FALSE);
+  ok = !pool->failed;
+  pool->failed = FALSE;
+  return ok;
+}
+
+rfbBool
+rfbDecodePoolWaitAll(rfbClient* client)
+{
+  rfbDecodePool *pool = client->decodePool;
+  rfbBool ok;
+
+  if (pool == NULL)
+    return TRUE;
+  DeliverJobs(client, 0, 0, 0, 0, TRUE);
+  ok = !pool->failed;
+  pool->failed = FALSE;
+  return ok;
+}
+
+rfbBool
+rfbDecodePoolTakeDeferred(rfbClient* client)
+{
+  rfbDecodePool *pool = client->decodePool;
+  rfbBool deferred;
+
+  if (pool == NULL)
+    return FALSE;
+  deferred = pool->deferred;
+  pool->deferred = FALSE;
+  return deferred;
+}
+
+void
+rfbDecodePoolDestroy(rfbClient* client)
+{
+  rfbDecodePool *pool = client->decodePool;
+  rfbDecodeJob *job;
+  int i;
+
+  if (pool == NULL)
+    return;
+
+  LightLock_Lock(&pool->lock);
+  pool->quit = TRUE;
+  CondVar_Broadcast(&pool->work);
+  LightLock_Unlock(&pool->lock);
+
+  /* workers drain the queue before they quit */
+  for (i = 0; i < pool->nthreads; i++) {
+    threadJoin(pool->thread[i], U64_MAX);
+    threadFree(pool->thread[i]);
+  }
+
+  while ((job = pool->pending) != NULL) {
+    pool->pending = job->next;
+    free(job->data);
+    free(job);
+  }
+  free(pool);
+  client->decodePool = NULL;
+}
+
+#else
+
+/* no worker threads on this platform: everything is decoded serially */
+
+rfbBool
+rfbDecodePoolSubmitJpeg(rfbClient* client, uint8_t* data, int len, int x, int y, int w, int h)
+{
+  return FALSE;
+}
+
+rfbBool
+rfbDecodePoolWait(rfbClient* client, int x, int y, int w, int h)
+{
+  return TRUE;
+}
+
+rfbBool
+rfbDecodePoolWaitAll(rfbClient* client)
+{
+  return TRUE;
+}
+
+rfbBool
+rfbDecodePoolTakeDeferred(rfbClient* client)
+{
+  return FALSE;
+}
+
+void
+rfbDecodePoolDestroy(rfbClient* client)
+{
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * decodepool.h - internal interface for decoding independent rectangles
+ * of a framebuffer update on worker threads.
+ */
+
+#ifndef _RFB_DECODEPOOL_H
+#define _RFB_DECODEPOOL_H
+
+#include <rfb/rfbclient.h>
+
+/**
+ * Queues a Tight JPEG rectangle for decoding on a worker thread.
+ * On success the pool takes ownership of data (allocated with malloc)
+ * and the rectangle is reported via GotFrameBufferUpdate once decoded.
+ * Returns FALSE if the pool is disabled or unavailable; the caller still
+ * owns data and has to decode the rectangle itself.
+ */
+extern rfbBool rfbDecodePoolSubmitJpeg(rfbClient* client, uint8_t* data, int len, int x, int y, int w, int h);
+
+/**
+ * Waits for all queued rectangles overlapping the given one.
+ * Returns FALSE if any rectangle failed to decode since the last call.
+ */
+extern rfbBool rfbDecodePoolWait(rfbClient* client, int x, int y, int w, int h);
+
+/**
+ * Waits for all queued rectangles (barrier).
+ * Returns FALSE if any rectangle failed to decode since the last call.
+ */
+extern rfbBool rfbDecodePoolWaitAll(rfbClient* client);
+
+/**
+ * Returns TRUE once if the last handled rectangle was queued, i.e. its
+ * GotFrameBufferUpdate notification is sent by the pool later on.
+ */
+extern rfbBool rfbDecodePoolTakeDeferred(rfbClient* client);
+
+/** Waits for all workers and releases the pool of a client. */
+extern void rfbDecodePoolDestroy(rfbClient* client);
+
+#endif
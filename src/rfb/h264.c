@@ -0,0 +1,322 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * h264.c - decode the Open H.264 encoding with the video decoder of a
+ * client.
+ *
+ * The server runs an encoder for every rectangle position and size, so
+ * the client keeps a decoder context for each of them. If there are more
+ * than H264_MAX_CONTEXTS, the least recently used one is dropped; the
+ * server starts a rectangle it has not sent for a while with a key frame
+ * anyway. Decoded pictures are I420. They are handed to GotVideoFrame, or
+ * converted into the framebuffer through per-channel tables built for
+ * the current pixel format (BT.601, limited range).
+ */
+
+#include <sys/time.h>
+#include <rfb/rfbclient.h>
+#include "h264.h"
+
+#define H264_MAX_CONTEXTS 64
+
+typedef struct {
+  int x, y, w, h;
+  void *dec;
+  uint32_t used;        /* clock of the last rectangle decoded with it */
+} rfbH264Context;
+
+typedef struct rfbH264State {
+  rfbH264Context ctx[H264_MAX_CONTEXTS];
+  int n;
+  uint32_t clock;
+  uint8_t *data;        /* rectangles too large for client->buffer */
+  int dataSize;
+  rfbPixelFormat format;  /* the tables below are built for */
+  uint32_t red[256], green[256], blue[256];
+  uint64_t windowStart;   /* bitrate measurement */
+  uint64_t windowBytes;
+} rfbH264State;
+
+static uint64_t
+Microseconds(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+CloseContext(rfbClient* client, rfbH264State* st, int i)
+{
+  client->videoDecoder.close(st->ctx[i].dec);
+  st->ctx[i] = st->ctx[--st->n];
+}
+
+static rfbH264Context*
+GetContext(rfbClient* client, rfbH264State* st, int x, int y, int w, int h)
+{
+  rfbH264Context *ctx;
+  void *dec;
+  int i, lru = 0;
+
+  for (i = 0; i < st->n; i++) {
+    ctx = &st->ctx[i];
+    if (ctx->x == x && ctx->y == y && ctx->w == w && ctx->h == h)
+      return ctx;
+    if (ctx->used < st->ctx[lru].used)
+      lru = i;
+  }
+
+  if ((dec = client->videoDecoder.open(w, h)) == NULL) {
+    rfbClientLog("H.264: cannot open a %s decoder for %dx%d\n",
+		 client->videoDecoder.name, w, h);
+    return NULL;
+  }
+  if (st->n == H264_MAX_CONTEXTS)
+    CloseContext(client, st, lru);
+
+  ctx = &st->ctx[st->n++];
+  ctx->x = x;
+  ctx->y = y;
+  ctx->w = w;
+  ctx->h = h;
+  ctx->dec = dec;
+  return ctx;
+}
+
+static void
+BuildTables(rfbClient* client, rfbH264State* st)
+{
+  rfbPixelFormat *f = &client->format;
+  int v;
+
+  for (v = 0; v < 256; v++) {
+    st->red[v] = (uint32_t)((v * f->redMax + 127) / 255) << f->redShift;
+    st->green[v] = (uint32_t)((v * f->greenMax + 127) / 255) << f->greenShift;
+    st->blue[v] = (uint32_t)((v * f->blueMax + 127) / 255) << f->blueShift;
+  }
+  st->format = *f;
+}
+
+#define CLAMP255(v) ((v) < 0 ? 0 : (v) > 255 ? 255 : (v))
+
+/* converts the pixels i and i+1 of a row, which share their chroma */
+#define CONVERT_PAIR(dst)						\
+  do {									\
+    int u = pu[i >> 1] - 128, v = pv[i >> 1] - 128;			\
+    int cr = 409 * v + 128, cg = -100 * u - 208 * v + 128, cb = 516 * u + 128; \
+    int k, l, c;							\
+    for (k = i; k < i + 2 && k < w; k++) {				\
+      c = 298 * (py[k] - 16);						\
+      l = (c + cr) >> 8;						\
+      dst[k] = st->red[CLAMP255(l)];					\
+      l = (c + cg) >> 8;						\
+      dst[k] |= st->green[CLAMP255(l)];					\
+      l = (c + cb) >> 8;						\
+      dst[k] |= st->blue[CLAMP255(l)];					\
+    }									\
+  } while (0)
+
+static void
+DrawFrame(rfbClient* client, rfbH264State* st, const rfbVideoFrame* f,
+	  int x, int y, int w, int h)
+{
+  int bpp = client->format.bitsPerPixel / 8;
+  int pitch = client->width * bpp;
+  uint8_t *row = client->frameBuffer + y * pitch + x * bpp;
+  const uint8_t *py, *pu, *pv;
+  int i, j;
+
+  if (memcmp(&st->format, &client->format, sizeof(rfbPixelFormat)))
+    BuildTables(client, st);
+
+  for (j = 0; j < h; j++, row += pitch) {
+    py = f->plane[0] + j * f->stride[0];
+    pu = f->plane[1] + (j >> 1) * f->stride[1];
+    pv = f->plane[2] + (j >> 1) * f->stride[2];
+
+    switch (bpp) {
+    case 4: {
+      uint32_t *dst = (uint32_t *)row;
+      for (i = 0; i < w; i += 2)
+	CONVERT_PAIR(dst);
+      break;
+    }
+    case 2: {
+      uint16_t *dst = (uint16_t *)row;
+      for (i = 0; i < w; i += 2)
+	CONVERT_PAIR(dst);
+      break;
+    }
+    default: {
+      uint8_t *dst = row;
+      for (i = 0; i < w; i += 2)
+	CONVERT_PAIR(dst);
+      break;
+    }
+    }
+  }
+}
+
+rfbBool
+rfbHandleOpenH264(rfbClient* client, int x, int y, int w, int h)
+{
+  rfbOpenH264Header hdr;
+  rfbH264State *st = client->h264;
+  rfbH264Context *ctx;
+  rfbVideoFrame frame;
+  uint32_t length, flags;
+  uint64_t start, now;
+  uint8_t *data;
+  int i, ret;
+
+  if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbOpenH264Header))
+    return FALSE;
+  length = rfbClientSwap32IfLE(hdr.length);
+  flags = rfbClientSwap32IfLE(hdr.flags);
+
+  if (client->videoDecoder.decode == NULL || client->frameBuffer == NULL) {
+    rfbClientLog("H.264: no video decoder\n");
+    return FALSE;
+  }
+  /* HandleRFBServerMessage checks this too, but the pictures are drawn
+     straight into the framebuffer */
+  if (x < 0 || y < 0 || w < 0 || h < 0 ||
+      x + w > client->width || y + h > client->height) {
+    rfbClientLog("H.264: %dx%d rectangle at (%d, %d) outside the %dx%d framebuffer\n",
+		 w, h, x, y, client->width, client->height);
+    return FALSE;
+  }
+  if (st == NULL && (st = client->h264 = calloc(1, sizeof(rfbH264State))) == NULL) {
+    rfbClientLog("H.264: out of memory\n");
+    return FALSE;
+  }
+
+  start = Microseconds();
+  client->videoStats.rects++;
+  client->videoStats.bytes += length;
+  if (st->windowStart == 0)
+    st->windowStart = start;
+  st->windowBytes += length;
+  if (start - st->windowStart >= 1000000) {
+    client->videoStats.bitrate = st->windowBytes * 8 * 1000000 / (start - st->windowStart);
+    st->windowStart = start;
+    st->windowBytes = 0;
+  }
+
+  if (flags & rfbOpenH264ResetAllContexts) {
+    client->videoStats.resets += st->n;
+    while (st->n > 0)
+      CloseContext(client, st, st->n - 1);
+  } else if (flags & rfbOpenH264ResetContext) {
+    for (i = 0; i < st->n; i++)
+      if (st->ctx[i].x == x && st->ctx[i].y == y &&
+	  st->ctx[i].w == w && st->ctx[i].h == h) {
+	CloseContext(client, st, i);
+	client->videoStats.resets++;
+	break;
+      }
+  }
+  client->videoStats.contexts = st->n;
+
+  if (length == 0)
+    return TRUE;
+
+  if (length <= RFB_BUFFER_SIZE) {
+    data = (uint8_t *)client->buffer;
+  } else {
+    if ((int)length > st->dataSize) {
+      free(st->data);
+      st->dataSize = 0;
+      if ((st->data = malloc(length)) == NULL) {
+	rfbClientLog("H.264: no memory for a %u byte rectangle\n", length);
+	return FALSE;
+      }
+      st->dataSize = length;
+    }
+    data = st->data;
+  }
+  if (!ReadFromRFBServer(client, (char *)data, length))
+    return FALSE;
+
+  /* A picture that cannot be decoded is lost, but the next key frame
+     for the rectangle brings it back. */
+  if ((ctx = GetContext(client, st, x, y, w, h)) == NULL) {
+    client->videoStats.errors++;
+    return TRUE;
+  }
+  ctx->used = ++st->clock;
+
+  ret = client->videoDecoder.decode(ctx->dec, data, length, &frame);
+  if (ret < 0) {
+    rfbClientLog("H.264: %s\n", client->videoDecoder.errstr(ctx->dec));
+    client->videoStats.errors++;
+    CloseContext(client, st, ctx - st->ctx);
+  } else if (ret > 0) {
+    if (frame.width < w || frame.height < h) {
+      rfbClientLog("H.264: %dx%d picture for a %dx%d rectangle\n",
+		   frame.width, frame.height, w, h);
+      client->videoStats.errors++;
+    } else {
+      if (client->GotVideoFrame == NULL || !client->GotVideoFrame(client, &frame, x, y, w, h))
+	DrawFrame(client, st, &frame, x, y, w, h);
+      client->videoStats.frames++;
+    }
+  }
+  client->videoStats.contexts = st->n;
+
+  now = Microseconds();
+  client->videoStats.decodeTime += now - start;
+  return TRUE;
+}
+
+void
+rfbH264Destroy(rfbClient* client)
+{
+  rfbH264State *st = client->h264;
+
+  if (st == NULL)
+    return;
+  while (st->n > 0)
+    CloseContext(client, st, st->n - 1);
+  free(st->data);
+  free(st);
+  client->h264 = NULL;
+  client->videoStats.contexts = 0;
+}
+
+size_t
+rfbH264ScratchSize(rfbClient* client)
+{
+  return client->h264 ? client->h264->dataSize : 0;
+}
+
+void
+rfbH264TrimScratch(rfbClient* client)
+{
+  rfbH264State *st = client->h264;
+
+  if (st == NULL)
+    return;
+  free(st->data);
+  st->data = NULL;
+  st->dataSize = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * h264.h - internal interface for the Open H.264 encoding.
+ */
+
+#ifndef _RFB_H264_H
+#define _RFB_H264_H
+
+#include <rfb/rfbclient.h>
+
+/**
+ * Reads and decodes an Open H.264 rectangle with client->videoDecoder.
+ * Returns FALSE if the connection is unusable; pictures that fail to
+ * decode are only logged and counted in client->videoStats.
+ */
+extern rfbBool rfbHandleOpenH264(rfbClient* client, int x, int y, int w, int h);
+
+/** Closes all decoder contexts of a client. */
+extern void rfbH264Destroy(rfbClient* client);
+
+/** Bytes held for rectangles too large for client->buffer. */
+extern size_t rfbH264ScratchSize(rfbClient* client);
+
+/** Frees the memory counted by rfbH264ScratchSize(). */
+extern void rfbH264TrimScratch(rfbClient* client);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * h264avcodec.c - an rfbVideoDecoder on top of libavcodec.
+ *
+ * Every rectangle carries complete access units, so the decoder runs with
+ * a single thread and low delay: frame threading would hold pictures back
+ * by a frame per thread.
+ */
+
+#include <rfb/rfbclient.h>
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+
+typedef struct {
+  AVCodecContext *codec;
+  AVPacket *packet;
+  AVFrame *frame;       /* the picture returned last */
+  AVFrame *next;
+  char err[64];
+} AvcodecContext;
+
+static void
+AvcodecClose(void *p)
+{
+  AvcodecContext *c = p;
+
+  if (c == NULL)
+    return;
+  avcodec_free_context(&c->codec);
+  av_packet_free(&c->packet);
+  av_frame_free(&c->frame);
+  av_frame_free(&c->next);
+  free(c);
+}
+
+static void *
+AvcodecOpen(int width, int height)
+{
+  const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  AvcodecContext *c;
+
+  if (codec == NULL || (c = calloc(1, sizeof(AvcodecContext))) == NULL)
+    return NULL;
+  if ((c->codec = avcodec_alloc_context3(codec)) == NULL ||
+      (c->packet = av_packet_alloc()) == NULL ||
+      (c->frame = av_frame_alloc()) == NULL ||
+      (c->next = av_frame_alloc()) == NULL) {
+    AvcodecClose(c);
+    return NULL;
+  }
+
+  av_opt_set_int(c->codec, "threads", 1, 0);
+  av_opt_set(c->codec, "flags", "+low_delay", 0);
+  if (avcodec_open2(c->codec, codec, NULL) < 0) {
+    AvcodecClose(c);
+    return NULL;
+  }
+  return c;
+}
+
+static int
+AvcodecDecode(void *p, const uint8_t *data, int size, rfbVideoFrame *frame)
+{
+  AvcodecContext *c = p;
+  int err, got = 0;
+
+  c->packet->data = (uint8_t *)data;
+  c->packet->size = size;
+  if ((err = avcodec_send_packet(c->codec, c->packet)) < 0)
+    goto fail;
+
+  /* Keep the newest picture if a packet completes more than one. The
+     call that ends the loop clears its frame, hence the second one. */
+  while ((err = avcodec_receive_frame(c->codec, c->next)) >= 0) {
+    av_frame_unref(c->frame);
+    av_frame_move_ref(c->frame, c->next);
+    got = 1;
+  }
+  if (err != AVERROR(EAGAIN) && err != AVERROR_EOF)
+    goto fail;
+  if (!got)
+    return 0;
+
+  if (c->frame->format != AV_PIX_FMT_YUV420P && c->frame->format != AV_PIX_FMT_YUVJ420P) {
+    snprintf(c->err, sizeof(c->err), "unsupported pixel format %d", c->frame->format);
+    return -1;
+  }
+  frame->width = c->frame->width;
+  frame->height = c->frame->height;
+  frame->plane[0] = c->frame->data[0];
+  frame->plane[1] = c->frame->data[1];
+  frame->plane[2] = c->frame->data[2];
+  frame->stride[0] = c->frame->linesize[0];
+  frame->stride[1] = c->frame->linesize[1];
+  frame->stride[2] = c->frame->linesize[2];
+  return 1;
+
+fail:
+  av_strerror(err, c->err, sizeof(c->err));
+  return -1;
+}
+
+static const char *
+AvcodecErrstr(void *p)
+{
+  return ((AvcodecContext *)p)->err;
+}
+
+void
+rfbAvcodecCreateVideoDecoder(rfbVideoDecoder* decoder)
+{
+  decoder->name = "libavcodec";
+  decoder->open = AvcodecOpen;
+  decoder->decode = AvcodecDecode;
+  decoder->close = AvcodecClose;
+  decoder->errstr = AvcodecErrstr;
+}
+
+#endif
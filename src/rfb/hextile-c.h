@@ -29,16 +29,26 @@
 #define HandleHextileBPP CONCAT2E(HandleHextile,BPP)
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 
+/*
+ * Each tile is decoded into a 16x16 scratch tile (rows w pixels apart)
+ * and handed to GotBitmap in one go. Solid tiles are filled directly.
+ * Per tile there are at most three reads: the subencoding byte, the
+ * tile header (background, foreground, subrect count) and the subrects.
+ */
+
 static rfbBool
 HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 {
-  CARDBPP bg = 0, fg;
-  int i;
+  CARDBPP bg = 0, fg = 0;
+  CARDBPP tile[16 * 16];
+  CARDBPP *p;
+  uint8_t hdr[2 * (BPP / 8) + 1];
+  int i, j, n;
   uint8_t *ptr;
   int x, y, w, h;
   int sx, sy, sw, sh;
   uint8_t subencoding;
-  uint8_t nSubrects;
+  int nSubrects;
 
   for (y = ry; y < ry+rh; y += 16) {
     for (x = rx; x < rx+rw; x += 16) {
@@ -52,6 +62,16 @@ HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 	return FALSE;
 
       if (subencoding & rfbHextileRaw) {
+	uint8_t *dst = rfbClientDirectFrameBuffer(client, x, y, w, h);
+
+	if (dst != NULL) {
+	  /* read the tile rows straight into the framebuffer */
+	  for (i = 0; i < h; i++, dst += client->width * (BPP / 8))
+	    if (!ReadFromRFBServer(client, (char *)dst, w * (BPP / 8)))
+	      return FALSE;
+	  continue;
+	}
+
 	if (!ReadFromRFBServer(client, client->buffer, w * h * (BPP / 8)))
 	  return FALSE;
 
@@ -60,30 +80,40 @@ HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 	continue;
       }
 
+      /* background, foreground and subrect count in one read */
+      n = 0;
       if (subencoding & rfbHextileBackgroundSpecified)
-	if (!ReadFromRFBServer(client, (char *)&bg, sizeof(bg)))
-	  return FALSE;
-
-      client->GotFillRect(client, x, y, w, h, bg);
+	n += BPP / 8;
+      if (subencoding & rfbHextileForegroundSpecified)
+	n += BPP / 8;
+      if (subencoding & rfbHextileAnySubrects)
+	n++;
+      if (n && !ReadFromRFBServer(client, (char *)hdr, n))
+	return FALSE;
 
+      ptr = hdr;
+      if (subencoding & rfbHextileBackgroundSpecified)
+	memcpy(&bg, ptr, BPP / 8), ptr += BPP / 8;
       if (subencoding & rfbHextileForegroundSpecified)
-	if (!ReadFromRFBServer(client, (char *)&fg, sizeof(fg)))
-	  return FALSE;
+	memcpy(&fg, ptr, BPP / 8), ptr += BPP / 8;
 
       if (!(subencoding & rfbHextileAnySubrects)) {
+	client->GotFillRect(client, x, y, w, h, bg);
 	continue;
       }
 
-      if (!ReadFromRFBServer(client, (char *)&nSubrects, 1))
+      nSubrects = *ptr;
+      n = nSubrects * (2 + ((subencoding & rfbHextileSubrectsColoured) ? BPP / 8 : 0));
+      if (!ReadFromRFBServer(client, client->buffer, n))
 	return FALSE;
 
-      ptr = (uint8_t*)client->buffer;
-
-      if (subencoding & rfbHextileSubrectsColoured) {
-	if (!ReadFromRFBServer(client, client->buffer, nSubrects * (2 + (BPP / 8))))
-	  return FALSE;
+      /* paint the tile in the scratch buffer */
+      for (i = 0; i < w * h; i++)
+	tile[i] = bg;
 
-	for (i = 0; i < nSubrects; i++) {
+      ptr = (uint8_t*)client->buffer;
+      for (i = 0; i < nSubrects; i++) {
+	if (subencoding & rfbHextileSubrectsColoured) {
 #if BPP==8
 	  GET_PIXEL8(fg, ptr);
 #elif BPP==16
@@ -93,31 +123,28 @@ HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 #else
 #error "Invalid BPP"
 #endif
-	  sx = rfbHextileExtractX(*ptr);
-	  sy = rfbHextileExtractY(*ptr);
-	  ptr++;
-	  sw = rfbHextileExtractW(*ptr);
-	  sh = rfbHextileExtractH(*ptr);
-	  ptr++;
-
-	  client->GotFillRect(client, x+sx, y+sy, sw, sh, fg);
-	}
-
-      } else {
-	if (!ReadFromRFBServer(client, client->buffer, nSubrects * 2))
-	  return FALSE;
-
-	for (i = 0; i < nSubrects; i++) {
-	  sx = rfbHextileExtractX(*ptr);
-	  sy = rfbHextileExtractY(*ptr);
-	  ptr++;
-	  sw = rfbHextileExtractW(*ptr);
-	  sh = rfbHextileExtractH(*ptr);
-	  ptr++;
-
-	  client->GotFillRect(client, x+sx, y+sy, sw, sh, fg);
 	}
+	sx = rfbHextileExtractX(*ptr);
+	sy = rfbHextileExtractY(*ptr);
+	ptr++;
+	sw = rfbHextileExtractW(*ptr);
+	sh = rfbHextileExtractH(*ptr);
+	ptr++;
+
+	/* clip to the tile, a broken server must not write past it */
+	if (sx >= w || sy >= h)
+	  continue;
+	if (sw > w - sx)
+	  sw = w - sx;
+	if (sh > h - sy)
+	  sh = h - sy;
+
+	for (p = tile + sy * w + sx; sh > 0; sh--, p += w)
+	  for (j = 0; j < sw; j++)
+	    p[j] = fg;
       }
+
+      client->GotBitmap(client, (uint8_t *)tile, x, y, w, h);
     }
   }
 
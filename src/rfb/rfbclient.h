@@ -228,6 +228,11 @@ typedef void (*BellProc)(struct _rfbClient* client);
 typedef void (*GotCursorShapeProc)(struct _rfbClient* client, int xhot, int yhot, int width, int height, int bytesPerPixel);
 typedef void (*GotCopyRectProc)(struct _rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y);
 typedef void (*GotFillRectProc)(struct _rfbClient* client, int x, int y, int w, int h, uint32_t colour);
+/** A solid subrectangle, relative to its enclosing rectangle (see rfbClientFillRects()) */
+typedef struct {
+  uint16_t x, y, w, h;
+  uint32_t colour;
+} rfbClientSubrect;
 typedef void (*GotBitmapProc)(struct _rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h);
 typedef rfbBool (*GotJpegProc)(struct _rfbClient* client, const uint8_t* buffer, int length, int x, int y, int w, int h);
 typedef rfbBool (*LockWriteToTLSProc)(struct _rfbClient* client);   /** @deprecated */
@@ -238,6 +243,58 @@ typedef char* (*GetUserProc)(struct _rfbClient* client);
 typedef char* (*GetSASLMechanismProc)(struct _rfbClient* client, char* mechlist);
 #endif /* LIBVNCSERVER_HAVE_SASL */
 
+/** A picture in YUV 4:2:0 (I420) as returned by an rfbVideoDecoder. */
+typedef struct {
+  int width, height;
+  const uint8_t *plane[3]; /* Y, U, V */
+  int stride[3];
+} rfbVideoFrame;
+
+/**
+ * A video decoder for the Open H.264 encoding, filled in by a create
+ * function like rfbAvcodecCreateVideoDecoder(). Each rectangle position
+ * gets a context of its own.
+ */
+typedef struct {
+  const char *name;
+  /** Returns a new decoding context for a width x height rectangle, NULL on errors. */
+  void *(*open)(int width, int height);
+  /** Decodes size bytes. Returns 1 with a picture in *frame, 0 if there is none yet, -1 on errors. */
+  int (*decode)(void *ctx, const uint8_t *data, int size, rfbVideoFrame *frame);
+  void (*close)(void *ctx);
+  const char *(*errstr)(void *ctx);
+} rfbVideoDecoder;
+
+/** Open H.264 counters (see rfbClient.videoStats) */
+typedef struct {
+  uint32_t rects;       /* rectangles received */
+  uint32_t frames;      /* pictures drawn */
+  uint32_t errors;      /* rectangles that failed to decode */
+  uint32_t resets;      /* contexts reset by the server */
+  int contexts;         /* open decoder contexts */
+  uint64_t bytes;       /* H.264 data received */
+  uint32_t bitrate;     /* H.264 bits per second, updated every second */
+  uint64_t decodeTime;  /* microseconds spent decoding and drawing */
+} rfbVideoStats;
+
+typedef rfbBool (*GotVideoFrameProc)(struct _rfbClient* client, const rfbVideoFrame* frame, int x, int y, int w, int h);
+
+/**
+ * Called with the samples of a QEMU audio data message, in pieces of up to
+ * RFB_BUFFER_SIZE bytes. The samples are signed 16-bit little-endian,
+ * interleaved by channel, at client->audioFrequency.
+ * @param client The client which received the audio
+ * @param data The samples, only valid during the call
+ * @param size The number of bytes
+ */
+typedef void (*GotAudioProc)(struct _rfbClient* client, const char *data, int size);
+/**
+ * Called when the server starts or stops playing QEMU audio.
+ * @param client The client which received the message
+ * @param playing TRUE on rfbQemuAudioBegin, FALSE on rfbQemuAudioEnd
+ */
+typedef void (*AudioStateProc)(struct _rfbClient* client, rfbBool playing);
+
 typedef struct _rfbClient {
 	uint8_t* frameBuffer;
 	int width, height;
@@ -259,10 +316,12 @@ typedef struct _rfbClient {
 	/** Note that the CoRRE encoding uses this buffer and assumes it is big enough
 	   to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes.
 	   Hextile also assumes it is big enough to hold 16 * 16 * 32 bits.
-	   Tight encoding assumes BUFFER_SIZE is at least 16384 bytes. */
+	   Tight encoding assumes BUFFER_SIZE is at least 16384 bytes.
+	   It is allocated when an encoding first needs it and may be shared
+	   with other clients, see rfbClientShareScratch(); NULL until then. */
 
 #define RFB_BUFFER_SIZE (640*480)
-	char buffer[RFB_BUFFER_SIZE];
+	char *buffer;
 
 	/* rfbproto.c */
 
@@ -304,9 +363,9 @@ typedef struct _rfbClient {
 	 * Variables for the ``tight'' encoding implementation.
 	 */
 
-	/** Separate buffer for compressed data. */
+	/** Separate buffer for compressed data, allocated like buffer. */
 #define ZLIB_BUFFER_SIZE 30000
-	char zlib_buffer[ZLIB_BUFFER_SIZE];
+	char *zlib_buffer;
 
 	/* Four independent compression streams for zlib library. */
 	z_stream zlibStream[4];
@@ -317,6 +376,12 @@ typedef struct _rfbClient {
 	int rectWidth, rectColors;
 	char tightPalette[256*4];
 	uint8_t tightPrevRow[2048*3*sizeof(uint16_t)];
+	/* Gradient filter row for rectangles too wide for tightPrevRow. */
+	uint8_t *tightWideRow;
+	int tightWideRowSize;
+	/* Byte order of 24 bit Tight pixels in the negotiated 32 bpp format,
+	 * set by SetFormatAndEncodings(). */
+	int tightRGB24Layout;
 
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	/** JPEG decoder state (obsolete-- do not use). */
@@ -471,6 +536,65 @@ typedef struct _rfbClient {
 	 * For internal use only.
 	 */
 	MUTEX(tlsRwMutex);
+
+	/**
+	 * Number of worker threads used to decode independent rectangles of a
+	 * framebuffer update (currently Tight JPEG rectangles with 32 bpp and
+	 * no GotJpeg hook) while the next rectangle is read from the network.
+	 * 0 (the default) decodes everything on the calling thread. Set before
+	 * the first framebuffer update; reset to 0 if no thread can be started.
+	 */
+	int decodeThreads;
+	/** Decode worker pool, created on first use. For internal use only. */
+	struct rfbDecodePool *decodePool;
+
+	/**
+	 * Decoder for the Open H.264 encoding, which is only requested if
+	 * decode is set. rfbGetClient() installs the libavcodec decoder when
+	 * it is available.
+	 */
+	rfbVideoDecoder videoDecoder;
+	/**
+	 * Called with every decoded picture, e.g. to draw it as a YUV texture.
+	 * Return FALSE (or leave it NULL) to have the picture converted into the
+	 * framebuffer.
+	 */
+	GotVideoFrameProc GotVideoFrame;
+	rfbVideoStats videoStats;
+	/** Open H.264 decoder contexts. For internal use only. */
+	struct rfbH264State *h264;
+
+	/**
+	 * Receives audio over the connection with the QEMU audio extension,
+	 * which is only requested if GotAudio is set. Audio is enabled as soon
+	 * as the server acknowledges the extension.
+	 */
+	GotAudioProc GotAudio;
+	AudioStateProc AudioState;
+	/** The format asked for, 44100 Hz stereo unless changed before rfbInitClient() */
+	int audioFrequency;
+	int audioChannels;
+	/** TRUE once the server has acknowledged the QEMU audio extension */
+	rfbBool audioSupported;
+
+	/**
+	 * Upper limit in bytes for the decoder memory kept between framebuffer
+	 * updates, as reported by rfbClientFootprint(). Above it, the decoder
+	 * buffers no rectangle of the last update needed are freed after the
+	 * update; they are allocated again when needed. 0 (the default) keeps
+	 * everything.
+	 */
+	size_t memoryBudget;
+	/** Times memory was freed to stay within memoryBudget */
+	uint32_t memoryTrims;
+	/** Decoder scratch memory, see rfbClientShareScratch(). For internal use only. */
+	struct rfbScratch *scratch;
+	/** Scratch memory needed during this update. For internal use only. */
+	int scratchUsed;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	/** Bytes held by the zlib streams. For internal use only. */
+	size_t inflateMemory;
+#endif
 } rfbClient;
 
 /* cursor.c */
@@ -482,6 +606,24 @@ typedef struct _rfbClient {
  */
 extern rfbBool HandleCursorShape(rfbClient* client,int xhot, int yhot, int width, int height, uint32_t enc);
 
+/* scratch.c */
+/**
+ * Makes client decode in the scratch memory (client->buffer and
+ * client->zlib_buffer) of other instead of its own. Only for clients whose
+ * messages are handled one after another on the same thread. Call before
+ * the first message of client is handled.
+ * @return FALSE if there was no memory for the scratch structure or it has
+ * too many users already
+ */
+extern rfbBool rfbClientShareScratch(rfbClient* client, rfbClient* other);
+/**
+ * Returns the bytes of memory the client holds for decoding: its own
+ * structure, its part of the scratch memory, the buffers that grow with
+ * the rectangles and the zlib streams. The framebuffer and the H.264
+ * decoder contexts are not counted.
+ */
+extern size_t rfbClientFootprint(rfbClient* client);
+
 /* listen.c */
 
 extern void listenForIncomingConnections(rfbClient* viewer);
@@ -581,6 +723,15 @@ extern rfbBool SendKeyEvent(rfbClient* client,uint32_t key, rfbBool down);
  * successfully, false otherwise
  */
 extern rfbBool SendExtendedKeyEvent(rfbClient* client, uint32_t keysym, uint32_t keycode, rfbBool down);
+/**
+ * Turns QEMU audio on or off. Enabling sends the format in
+ * client->audioFrequency and client->audioChannels first.
+ * @param client The client through which to send the request
+ * @param enable TRUE to have the server send audio, FALSE to stop it
+ * @return true if the server supports QEMU audio and the request was sent
+ * successfully, false otherwise
+ */
+extern rfbBool SendQemuAudioEnable(rfbClient* client, rfbBool enable);
 /**
  * Places a string on the server's clipboard. Use this function if you want to
  * be able to copy and paste between the server and your application. For
@@ -815,6 +966,36 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv);
  * @param client The client to clean up
  */
 void rfbClientCleanup(rfbClient* client);
+/**
+ * Returns a pointer to the framebuffer pixel at (x,y) if decoders may write
+ * the rectangle straight into the framebuffer instead of passing it through
+ * GotBitmap. This is the case if the default GotBitmap hook is in use and
+ * the rectangle lies inside the framebuffer. Rows are client->width pixels
+ * apart. For internal use only.
+ * @return the destination pointer or NULL if the pixels have to go through GotBitmap
+ */
+uint8_t* rfbClientDirectFrameBuffer(rfbClient* client, int x, int y, int w, int h);
+/**
+ * Fills a list of solid subrectangles of one enclosing rectangle, e.g. the
+ * background and subrects of a Hextile tile. With the default GotFillRect
+ * hook, the enclosing rectangle is bounds-checked once and each subrect is
+ * clipped to it; otherwise GotFillRect is called for every subrect.
+ * For internal use only.
+ * @param client The client whose framebuffer to draw to
+ * @param x, y, w, h The enclosing rectangle
+ * @param rects The subrects, relative to (x,y), drawn in order
+ * @param n The number of subrects
+ */
+void rfbClientFillRects(rfbClient* client, int x, int y, int w, int h, const rfbClientSubrect* rects, int n);
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+/**
+ * Fills in a video decoder for the Open H.264 encoding that uses
+ * libavcodec's software H.264 decoder.
+ * @param decoder The decoder to fill in, usually &client->videoDecoder
+ */
+void rfbAvcodecCreateVideoDecoder(rfbVideoDecoder* decoder);
+#endif
 
 #if(defined __cplusplus)
 }
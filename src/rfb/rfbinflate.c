@@ -0,0 +1,138 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * rfbinflate.c - the decompression loop shared by the zlib based decoders.
+ *
+ * All RFB zlib streams are persistent and sync flushed after every
+ * rectangle. What matters for speed is how inflate() is called: it only
+ * takes its fast path while at least 258 bytes of output space are left,
+ * and every call has a fixed cost. The decoders therefore inflate into
+ * the largest contiguous window the rectangle allows, and a payload that
+ * was read completely is inflated by a single call.
+ */
+
+#include <stdlib.h>
+#include <rfb/rfbclient.h>
+#include "rfbinflate.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+
+/* The streams allocate through these to count what they hold in
+   client->inflateMemory, for rfbClientFootprint(). The size is kept in
+   front of each block, 8 bytes keep the alignment of malloc(). */
+#define ALLOC_HEADER 8
+
+static voidpf
+CountingAlloc(voidpf opaque, uInt items, uInt size)
+{
+  rfbClient* client = opaque;
+  size_t n = (size_t)items * size;
+  char *p = malloc(n + ALLOC_HEADER);
+
+  if (p == NULL)
+    return Z_NULL;
+  *(size_t *)p = n;
+  client->inflateMemory += n;
+  return p + ALLOC_HEADER;
+}
+
+static void
+CountingFree(voidpf opaque, voidpf address)
+{
+  rfbClient* client = opaque;
+  char *p = (char *)address - ALLOC_HEADER;
+
+  client->inflateMemory -= *(size_t *)p;
+  free(p);
+}
+
+int
+rfbInflateInit(rfbClient* client, z_streamp zs)
+{
+  zs->zalloc = CountingAlloc;
+  zs->zfree = CountingFree;
+  zs->opaque = client;
+  return inflateInit(zs);
+}
+
+rfbBool
+rfbInflateRead(rfbClient* client, z_streamp zs, int compressedLen,
+	       char* in, int inSize, uint8_t* out, int rowLen, int pitch, int rows)
+{
+  uint8_t spare;
+  rfbBool full = FALSE;
+  int err, toRead;
+
+  zs->next_out = (Bytef *)out;
+  zs->avail_out = rowLen;
+
+  while (compressedLen > 0) {
+    toRead = compressedLen < inSize ? compressedLen : inSize;
+    if (!ReadFromRFBServer(client, in, toRead))
+      return FALSE;
+    compressedLen -= toRead;
+
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = toRead;
+
+    while (1) {
+      if (zs->avail_out == 0) {
+	if (full) {
+	  rfbClientLog("zlib inflate ran out of space!\n");
+	  return FALSE;
+	}
+	if (--rows > 0) {
+	  out += pitch;
+	  zs->next_out = (Bytef *)out;
+	  zs->avail_out = rowLen;
+	} else {
+	  /* The output is complete, but the empty block that ends a sync
+	     flush may still be pending. Anything it inflates to is too much. */
+	  full = TRUE;
+	  zs->next_out = &spare;
+	  zs->avail_out = 1;
+	}
+      }
+
+      err = inflate(zs, Z_SYNC_FLUSH);
+
+      /* We never supply a dictionary for compression. */
+      if (err == Z_NEED_DICT) {
+	rfbClientLog("zlib inflate needs a dictionary!\n");
+	return FALSE;
+      }
+      if (err != Z_OK && err != Z_STREAM_END) {
+	rfbClientLog("zlib inflate returned error: %d, msg: %s\n",
+		     err, zs->msg);
+	return FALSE;
+      }
+      if (err == Z_STREAM_END || zs->avail_in == 0)
+	break;
+    }
+  }
+
+  if (full ? zs->avail_out == 0 : rows > 1 || zs->avail_out != 0) {
+    rfbClientLog("zlib inflate returned too %s data.\n", full ? "much" : "little");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+#endif
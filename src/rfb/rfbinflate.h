@@ -0,0 +1,51 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * rfbinflate.h - the decompression loop shared by the zlib based decoders.
+ */
+
+#ifndef _RFB_INFLATE_H
+#define _RFB_INFLATE_H
+
+#include <rfb/rfbclient.h>
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+
+/**
+ * inflateInit() for a stream of the client, with allocators that count
+ * what the stream holds in client->inflateMemory.
+ */
+extern int rfbInflateInit(rfbClient* client, z_streamp zs);
+
+/**
+ * Reads compressedLen bytes of a sync flushed stream from the server,
+ * inSize bytes at a time into in, and inflates them into rows rows of
+ * rowLen bytes, pitch bytes apart, at out. Pass a single row for
+ * contiguous output; a payload that fits into in is then inflated by a
+ * single call. Logs and returns FALSE on errors and if the payload does
+ * not inflate to exactly rows * rowLen bytes.
+ */
+extern rfbBool rfbInflateRead(rfbClient* client, z_streamp zs, int compressedLen,
+			      char* in, int inSize, uint8_t* out,
+			      int rowLen, int pitch, int rows);
+
+#endif
+
+#endif
@@ -46,6 +46,9 @@
 #define Z_NULL NULL
 #endif
 #endif
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+#include <png.h>
+#endif
 
 #ifndef _MSC_VER
 /* Strings.h is not available in MSVC */
@@ -64,6 +67,10 @@
 #include "minilzo.h"
 #endif
 #include "tls.h"
+#include "decodepool.h"
+#include "rfbinflate.h"
+#include "h264.h"
+#include "scratch.h"
 
 #define MAX_TEXTCHAT_SIZE 10485760 /* 10MB */
 
@@ -170,6 +177,11 @@ static rfbBool HandleZlib32(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleTight8(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleTight16(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleTight32(rfbClient* client, int rx, int ry, int rw, int rh);
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+static rfbBool HandleTightPng8(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleTightPng16(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleTightPng32(rfbClient* client, int rx, int ry, int rw, int rh);
+#endif
 
 static long ReadCompactLen (rfbClient* client);
 #endif
@@ -1197,6 +1209,35 @@ InitialiseRFBConnection(rfbClient* client)
 }
 
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/*
+ * Tight sends true colour pixels of 32 bpp formats with depth 24 as three
+ * bytes (r, g, b). Record once per pixel format where these bytes go, so
+ * the filters can repack them without reading the shifts for every pixel.
+ */
+
+#define TIGHT_RGB24_ANY  0	/* shifts from client->format */
+#define TIGHT_RGB24_RGBX 1	/* red 0, green 8, blue 16 */
+#define TIGHT_RGB24_BGRX 2	/* red 16, green 8, blue 0 */
+#define TIGHT_RGB24_XBGR 3	/* red 24, green 16, blue 8 */
+
+static void
+SetTightRGB24Layout(rfbClient* client)
+{
+  rfbPixelFormat *f = &client->format;
+
+  client->tightRGB24Layout = TIGHT_RGB24_ANY;
+  if (f->bitsPerPixel != 32)
+    return;
+  if (f->redShift == 0 && f->greenShift == 8 && f->blueShift == 16)
+    client->tightRGB24Layout = TIGHT_RGB24_RGBX;
+  else if (f->redShift == 16 && f->greenShift == 8 && f->blueShift == 0)
+    client->tightRGB24Layout = TIGHT_RGB24_BGRX;
+  else if (f->redShift == 24 && f->greenShift == 16 && f->blueShift == 8)
+    client->tightRGB24Layout = TIGHT_RGB24_XBGR;
+}
+#endif
+
 /*
  * SetFormatAndEncodings.
  */
@@ -1218,6 +1259,10 @@ SetFormatAndEncodings(rfbClient* client)
   rfbBool requestLastRectEncoding = FALSE;
   rfbClientProtocolExtension* e;
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  SetTightRGB24Layout(client);
+#endif
+
   if (!SupportsClient2Server(client, rfbSetPixelFormat)) return TRUE;
 
   spf.type = rfbSetPixelFormat;
@@ -1263,6 +1308,15 @@ SetFormatAndEncodings(rfbClient* client)
 	  requestCompressLevel = TRUE;
 	if (client->appData.enableJPEG)
 	  requestQualityLevel = TRUE;
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+      } else if (strncasecmp(encStr,"tightpng",encStrLen) == 0) {
+	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingTightPng);
+	requestLastRectEncoding = TRUE;
+	if (client->appData.compressLevel >= 0 && client->appData.compressLevel <= 9)
+	  requestCompressLevel = TRUE;
+	if (client->appData.enableJPEG)
+	  requestQualityLevel = TRUE;
+#endif
 #endif
 #endif
       } else if (strncasecmp(encStr,"hextile",encStrLen) == 0) {
@@ -1292,6 +1346,11 @@ SetFormatAndEncodings(rfbClient* client)
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingCoRRE);
       } else if (strncasecmp(encStr,"rre",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingRRE);
+      } else if (strncasecmp(encStr,"h264",encStrLen) == 0) {
+	if (client->videoDecoder.decode)
+	  encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingOpenH264);
+	else
+	  rfbClientLog("No video decoder for encoding '%.*s'\n",encStrLen,encStr);
       } else {
 	rfbClientLog("Unknown encoding '%.*s'\n",encStrLen,encStr);
       }
@@ -1326,9 +1385,15 @@ SetFormatAndEncodings(rfbClient* client)
     }
 
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingCopyRect);
+    /* whoever installs a video decoder wants video */
+    if (client->videoDecoder.decode)
+      encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingOpenH264);
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingTight);
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingTightPng);
+#endif
     requestLastRectEncoding = TRUE;
 #endif
 #endif
@@ -1401,6 +1466,10 @@ SetFormatAndEncodings(rfbClient* client)
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingQemuExtendedKeyEvent);
 
+  /* audio over the connection, if the application plays it */
+  if (se->nEncodings < MAX_ENCODINGS && client->GotAudio)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingQemuAudio);
+
   /* client extensions */
   for(e = rfbClientExtensions; e; e = e->next)
     if(e->encodings) {
@@ -1662,6 +1731,37 @@ SendExtendedKeyEvent(rfbClient* client, uint32_t keysym, uint32_t keycode, rfbBo
 }
 
 
+/*
+ * SendQemuAudioEnable.
+ */
+
+rfbBool
+SendQemuAudioEnable(rfbClient* client, rfbBool enable)
+{
+  rfbQemuAudioFormatMsg fmt;
+  rfbQemuAudioMsg qa;
+
+  if (!client->audioSupported) return FALSE;
+
+  if (enable) {
+    fmt.type = rfbQemuEvent;
+    fmt.subtype = rfbQemuAudio;
+    fmt.operation = rfbClientSwap16IfLE(rfbQemuAudioSetFormat);
+    fmt.format = rfbQemuAudioS16;
+    fmt.channels = client->audioChannels;
+    fmt.frequencyHi = rfbClientSwap16IfLE(client->audioFrequency >> 16);
+    fmt.frequencyLo = rfbClientSwap16IfLE(client->audioFrequency & 0xffff);
+    if (!WriteToRFBServer(client, (char *)&fmt, sz_rfbQemuAudioFormatMsg))
+      return FALSE;
+  }
+
+  qa.type = rfbQemuEvent;
+  qa.subtype = rfbQemuAudio;
+  qa.operation = rfbClientSwap16IfLE(enable ? rfbQemuAudioEnable : rfbQemuAudioDisable);
+  return WriteToRFBServer(client, (char *)&qa, sz_rfbQemuAudioMsg);
+}
+
+
 /*
  * SendClientCutText.
  */
@@ -1681,6 +1781,34 @@ SendClientCutText(rfbClient* client, char *str, int len)
 }
 
 
+/*
+ * Encodings whose decoders only write pixels inside their own rectangle
+ * and may therefore run while other rectangles are still being decoded.
+ */
+
+static rfbBool
+IsSelfContainedEncoding(int32_t encoding)
+{
+  switch (encoding) {
+  case rfbEncodingRaw:
+  case rfbEncodingRRE:
+  case rfbEncodingCoRRE:
+  case rfbEncodingHextile:
+  case rfbEncodingUltra:
+  case rfbEncodingUltraZip:
+  case rfbEncodingZlib:
+  case rfbEncodingTight:
+  case rfbEncodingTightPng:
+  case rfbEncodingTRLE:
+  case rfbEncodingZRLE:
+  case rfbEncodingZYWRLE:
+  case rfbEncodingOpenH264:
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
 
 /*
  * HandleRFBServerMessage.
@@ -1696,6 +1824,8 @@ HandleRFBServerMessage(rfbClient* client)
   if (!ReadFromRFBServer(client, (char *)&msg, 1))
     return FALSE;
 
+  rfbScratchRefresh(client);
+
   switch (msg.type) {
 
   case rfbSetColourMapEntries:
@@ -1753,6 +1883,16 @@ HandleRFBServerMessage(rfbClient* client)
       rect.r.w = rfbClientSwap16IfLE(rect.r.w);
       rect.r.h = rfbClientSwap16IfLE(rect.r.h);
 
+      /* Rectangles may still be decoding on the decode threads. Pixel
+         data that stays inside its own rectangle only has to wait for
+         overlapping ones, anything else (CopyRect, pseudo encodings) is
+         a barrier. */
+      if (client->decodePool) {
+        if (!(IsSelfContainedEncoding(rect.encoding) ?
+            rfbDecodePoolWait(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h) :
+            rfbDecodePoolWaitAll(client)))
+          return FALSE;
+      }
 
       if (rect.encoding == rfbEncodingXCursor ||
 	  rect.encoding == rfbEncodingRichCursor) {
@@ -1879,16 +2019,38 @@ HandleRFBServerMessage(rfbClient* client)
         client->SoftCursorLockArea(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
       }
 
+      if (!rfbScratchForEncoding(client, rect.encoding))
+        return FALSE;
+
       switch (rect.encoding) {
 
       case rfbEncodingRaw: {
 	int y=rect.r.y, h=rect.r.h;
+	uint8_t *dst;
 
 	bytesPerLine = rect.r.w * client->format.bitsPerPixel / 8;
+
+	/* read straight into the framebuffer rows if we may */
+	if ((dst = rfbClientDirectFrameBuffer(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h)) != NULL) {
+	  int pitch = client->width * client->format.bitsPerPixel / 8;
+
+	  if (bytesPerLine == pitch) {
+	    if (!ReadFromRFBServer(client, (char *)dst, bytesPerLine * h))
+	      return FALSE;
+	  } else {
+	    for (; h > 0; h--, dst += pitch)
+	      if (!ReadFromRFBServer(client, (char *)dst, bytesPerLine))
+	        return FALSE;
+	  }
+	  break;
+	}
+
 	/* RealVNC 4.x-5.x on OSX can induce bytesPerLine==0, 
 	   usually during GPU accel. */
 	/* Regardless of cause, do not divide by zero. */
 	linesToRead = bytesPerLine ? (RFB_BUFFER_SIZE / bytesPerLine) : 0;
+	if (linesToRead && !rfbScratchNeed(client, RFB_SCRATCH_BUFFER))
+	  return FALSE;
 
 	while (linesToRead && h > 0) {
 	  if (linesToRead > h)
@@ -2103,7 +2265,31 @@ HandleRFBServerMessage(rfbClient* client)
 	}
 	break;
       }
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+      case rfbEncodingTightPng:
+      {
+	switch (client->format.bitsPerPixel) {
+	case 8:
+	  if (!HandleTightPng8(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return FALSE;
+	  break;
+	case 16:
+	  if (!HandleTightPng16(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return FALSE;
+	  break;
+	case 32:
+	  if (!HandleTightPng32(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    return FALSE;
+	  break;
+	}
+	break;
+      }
+#endif
 #endif
+      case rfbEncodingOpenH264:
+	if (!rfbHandleOpenH264(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	  return FALSE;
+	break;
       case rfbEncodingZRLE:
 	/* Fail safe for ZYWRLE unsupport VNC server. */
 	client->appData.qualityLevel = 9;
@@ -2153,6 +2339,18 @@ HandleRFBServerMessage(rfbClient* client)
         SetClient2Server(client, rfbQemuEvent);
         break;
 
+      case rfbEncodingQemuAudio:
+        SetClient2Server(client, rfbQemuEvent);
+        SetServer2Client(client, rfbQemuEvent);
+        if (!client->audioSupported && client->GotAudio) {
+          client->audioSupported = TRUE;
+          if (!SendQemuAudioEnable(client, TRUE))
+            return FALSE;
+          rfbClientLog("Enabled QEMU audio: %d Hz, %d channels\n",
+                       client->audioFrequency, client->audioChannels);
+        }
+        break;
+
       default:
 	 {
 	   rfbBool handled = FALSE;
@@ -2173,15 +2371,23 @@ HandleRFBServerMessage(rfbClient* client)
       /* Now we may discard "soft cursor locks". */
       client->SoftCursorUnlockScreen(client);
 
-      client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      /* queued rectangles are reported once they are decoded */
+      if (!rfbDecodePoolTakeDeferred(client))
+        client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
     }
 
+    /* request the next update before waiting for the decode threads */
     if (!SendIncrementalFramebufferUpdateRequest(client))
       return FALSE;
 
+    if (!rfbDecodePoolWaitAll(client))
+      return FALSE;
+
     if (client->FinishedFrameBufferUpdate)
       client->FinishedFrameBufferUpdate(client);
 
+    rfbTrimMemory(client);
+
     break;
   }
 
@@ -2285,6 +2491,46 @@ HandleRFBServerMessage(rfbClient* client)
     break;
   }
 
+  case rfbQemuEvent:
+  {
+    uint32_t length, n;
+
+    if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
+                           sz_rfbQemuAudioMsg - 1))
+      return FALSE;
+    if (msg.qa.subtype != rfbQemuAudio) {
+      rfbClientLog("Unknown QEMU message %d from VNC server\n", msg.qa.subtype);
+      return FALSE;
+    }
+
+    switch (rfbClientSwap16IfLE(msg.qa.operation)) {
+    case rfbQemuAudioBegin:
+    case rfbQemuAudioEnd:
+      if (client->AudioState)
+        client->AudioState(client, rfbClientSwap16IfLE(msg.qa.operation) == rfbQemuAudioBegin);
+      break;
+    case rfbQemuAudioData:
+      if (!ReadFromRFBServer(client, (char *)&length, 4))
+        return FALSE;
+      /* hand the samples on as they come in, in buffer sized pieces */
+      if (!rfbScratchNeed(client, RFB_SCRATCH_BUFFER))
+        return FALSE;
+      for (length = rfbClientSwap32IfLE(length); length > 0; length -= n) {
+        n = length < RFB_BUFFER_SIZE ? length : RFB_BUFFER_SIZE;
+        if (!ReadFromRFBServer(client, client->buffer, n))
+          return FALSE;
+        if (client->GotAudio)
+          client->GotAudio(client, client->buffer, n);
+      }
+      break;
+    default:
+      rfbClientLog("Unknown QEMU audio operation %d from VNC server\n",
+                   rfbClientSwap16IfLE(msg.qa.operation));
+      return FALSE;
+    }
+    break;
+  }
+
   case rfbResizeFrameBuffer:
   {
     if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
@@ -2367,6 +2613,7 @@ HandleRFBServerMessage(rfbClient* client)
 #include "ultra-c.h"
 #include "zlib-c.h"
 #include "tight-c.h"
+#include "rletile-c.h"
 #include "trle-c.h"
 #include "zrle-c.h"
 #undef BPP
@@ -2377,9 +2624,12 @@ HandleRFBServerMessage(rfbClient* client)
 #include "ultra-c.h"
 #include "zlib-c.h"
 #include "tight-c.h"
+#include "rletile-c.h"
 #include "trle-c.h"
 #include "zrle-c.h"
 #define REALBPP 15
+#include "rletile-c.h"
+#define REALBPP 15
 #include "trle-c.h"
 #define REALBPP 15
 #include "zrle-c.h"
@@ -2391,20 +2641,29 @@ HandleRFBServerMessage(rfbClient* client)
 #include "ultra-c.h"
 #include "zlib-c.h"
 #include "tight-c.h"
+#include "rletile-c.h"
 #include "trle-c.h"
 #include "zrle-c.h"
 #define REALBPP 24
+#include "rletile-c.h"
+#define REALBPP 24
 #include "trle-c.h"
 #define REALBPP 24
 #include "zrle-c.h"
 #define REALBPP 24
 #define UNCOMP 8
+#include "rletile-c.h"
+#define REALBPP 24
+#define UNCOMP 8
 #include "trle-c.h"
 #define REALBPP 24
 #define UNCOMP 8
 #include "zrle-c.h"
 #define REALBPP 24
 #define UNCOMP -8
+#include "rletile-c.h"
+#define REALBPP 24
+#define UNCOMP -8
 #include "trle-c.h"
 #define REALBPP 24
 #define UNCOMP -8
@@ -454,6 +454,7 @@ typedef struct {
 #define rfbEncodingZYWRLE 17
 
 #define rfbEncodingH264               0x48323634
+#define rfbEncodingOpenH264 50
 
 /* Cache & XOR-Zlib - rdv@2002 */
 #define rfbEncodingCache                 0xFFFF0000
@@ -522,6 +523,7 @@ typedef struct {
 #define rfbEncodingQualityLevel9   0xFFFFFFE9
 
 #define rfbEncodingQemuExtendedKeyEvent 0xFFFFFEFE /* -258 */
+#define rfbEncodingQemuAudio       0xFFFFFEFD /* -259 */
 #define rfbEncodingExtendedClipboard 0xC0A1E5CE
 
 /* LibVNCServer additions.   We claim 0xFFFE0000 - 0xFFFE00FF */
@@ -944,6 +946,24 @@ typedef struct {
 #define rfbZRLETileHeight 64
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Open H.264 - each rectangle carries length bytes of an H.264 (Annex B)
+ * stream. The client keeps one decoder context per rectangle position and
+ * size; the flags ask it to reset that context or all contexts before
+ * decoding.
+ */
+
+typedef struct {
+    uint32_t length;
+    uint32_t flags;
+} rfbOpenH264Header;
+
+#define sz_rfbOpenH264Header 8
+
+#define rfbOpenH264ResetContext (1 << 0)
+#define rfbOpenH264ResetAllContexts (1 << 1)
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * ZLIBHEX - zlib compressed Hextile Encoding.  Essentially, this is the
  * hextile encoding with zlib compression on the tiles that can not be
@@ -1242,6 +1262,54 @@ typedef struct {
 #define sz_rfbPalmVNCReSizeFrameBufferMsg (12)
 
 
+/*-----------------------------------------------------------------------------
+ * QEMU audio - PCM audio in both directions of the connection.
+ *
+ * The server acknowledges the rfbEncodingQemuAudio pseudo-encoding with an
+ * empty rectangle of that encoding. The client then sets the sample format
+ * and enables audio. The server sends rfbQemuAudioBegin and rfbQemuAudioEnd
+ * around playback, and rfbQemuAudioData messages followed by a 32-bit byte
+ * count and the little-endian samples, interleaved by channel.
+ */
+
+typedef struct {
+    uint8_t type;       /* always rfbQemuEvent */
+    uint8_t subtype;    /* always rfbQemuAudio */
+    uint16_t operation;
+} rfbQemuAudioMsg;
+
+#define sz_rfbQemuAudioMsg 4
+
+typedef struct {
+    uint8_t type;       /* always rfbQemuEvent */
+    uint8_t subtype;    /* always rfbQemuAudio */
+    uint16_t operation; /* always rfbQemuAudioSetFormat */
+    uint8_t format;
+    uint8_t channels;
+    uint16_t frequencyHi; /* the 32-bit frequency is not 4-byte aligned */
+    uint16_t frequencyLo;
+} rfbQemuAudioFormatMsg;
+
+#define sz_rfbQemuAudioFormatMsg 10
+
+#define rfbQemuAudio 1
+/* client operations */
+#define rfbQemuAudioEnable 0
+#define rfbQemuAudioDisable 1
+#define rfbQemuAudioSetFormat 2
+/* server operations */
+#define rfbQemuAudioEnd 0
+#define rfbQemuAudioBegin 1
+#define rfbQemuAudioData 2
+/* sample formats */
+#define rfbQemuAudioU8 0
+#define rfbQemuAudioS8 1
+#define rfbQemuAudioU16 2
+#define rfbQemuAudioS16 3
+#define rfbQemuAudioU32 4
+#define rfbQemuAudioS32 5
+
+
 
 
 /*-----------------------------------------------------------------------------
@@ -1260,6 +1328,7 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbExtDesktopSizeMsg eds;
+	rfbQemuAudioMsg qa;
 } rfbServerToClientMsg;
 
 
@@ -1408,6 +1477,7 @@ typedef struct {
 #define sz_rfbQemuExtendedKeyEventMsg 12
 
 
+
 /*-----------------------------------------------------------------------------
  * PointerEvent - mouse/pen move and/or button press.
  */
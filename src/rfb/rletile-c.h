@@ -0,0 +1,220 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * rletile.c - tile kernels shared by the trle and zrle decoders.
+ *
+ * This file shouldn't be compiled directly.  It is included by rfbproto.c
+ * once for every combination of BPP, REALBPP and UNCOMP that trle-c.h and
+ * zrle-c.h are included with, right before them.  Function names get the
+ * same suffix as HandleTRLE / HandleZRLE (e.g. RLEFillRun24Up).
+ *
+ * A compressed pixel (CPIXEL) is REALBPP/8 bytes and has no alignment, so
+ * it is assembled from bytes; 24 bit CPIXELs are shifted into place at
+ * compile time instead of reading a whole (unaligned) word.
+ */
+
+#ifndef REALBPP
+#define REALBPP BPP
+#endif
+
+#if !defined(UNCOMP) || UNCOMP==0
+#define RLEKernel(name) CONCAT2E(name,REALBPP)
+#elif UNCOMP>0
+#define RLEKernel(name) CONCAT3E(name,REALBPP,Down)
+#else
+#define RLEKernel(name) CONCAT3E(name,REALBPP,Up)
+#endif
+#define RLEReadCPixel RLEKernel(RLEReadCPixel)
+#define RLEReadPalette RLEKernel(RLEReadPalette)
+#define RLECopyTile RLEKernel(RLECopyTile)
+#define RLEUnpackPalette RLEKernel(RLEUnpackPalette)
+#define RLEFillRun RLEKernel(RLEFillRun)
+#define RLEFillPixels RLEKernel(RLEFillPixels)
+#define CARDBPP CONCAT3E(uint,BPP,_t)
+
+static inline CARDBPP
+RLEReadCPixel(const uint8_t* p)
+{
+#if REALBPP==24 && (!defined(UNCOMP) || UNCOMP==0)
+  return (CARDBPP)p[0] | ((CARDBPP)p[1] << 8) | ((CARDBPP)p[2] << 16);
+#elif REALBPP==24
+  /* Up (little endian, colours in the top bytes) and Down (big endian,
+     colours in the bottom bytes) both leave out the first byte of the
+     pixel in memory */
+  return ((CARDBPP)p[0] << 8) | ((CARDBPP)p[1] << 16) | ((CARDBPP)p[2] << 24);
+#elif BPP==8
+  return p[0];
+#else
+  CARDBPP pixel;
+  memcpy(&pixel, p, sizeof(pixel));
+  return pixel;
+#endif
+}
+
+/* reads n palette entries and returns the first byte after them */
+static const uint8_t*
+RLEReadPalette(CARDBPP* palette, const uint8_t* p, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++, p += REALBPP/8)
+    palette[i] = RLEReadCPixel(p);
+  return p;
+}
+
+/* raw tile: w*h CPIXELs */
+static void
+RLECopyTile(rfbClient* client, const uint8_t* p, int x, int y, int w, int h)
+{
+#if REALBPP!=BPP
+  CARDBPP *dst = (CARDBPP*)client->frameBuffer + y * client->width + x;
+  int i;
+
+  for (; h > 0; h--, dst += client->width)
+    for (i = 0; i < w; i++, p += REALBPP/8)
+      dst[i] = RLEReadCPixel(p);
+#else
+  client->GotBitmap(client, p, x, y, w, h);
+#endif
+}
+
+static inline void
+RLEFillPixels(CARDBPP* d, CARDBPP colour, int n)
+{
+#if BPP==8
+  memset(d, colour, n);
+#elif BPP==16
+  uint32_t pair = colour | ((uint32_t)colour << 16), *d32;
+
+  if (((uintptr_t)d & 2) && n > 0) {
+    *d++ = colour;
+    n--;
+  }
+  for (d32 = (uint32_t*)d; n >= 8; n -= 8, d32 += 4) {
+    d32[0] = pair; d32[1] = pair; d32[2] = pair; d32[3] = pair;
+  }
+  for (; n >= 2; n -= 2)
+    *d32++ = pair;
+  if (n)
+    *(uint16_t*)d32 = colour;
+#else
+  for (; n >= 4; n -= 4, d += 4) {
+    d[0] = colour; d[1] = colour; d[2] = colour; d[3] = colour;
+  }
+  for (; n > 0; n--)
+    *d++ = colour;
+#endif
+}
+
+/*
+ * Writes a run of "length" pixels at tile position (*i, *j), wrapping at
+ * the tile width, and advances the position. Each row segment is filled
+ * word-wide. Returns the part of the run that did not fit into the tile.
+ */
+static int
+RLEFillRun(rfbClient* client, int x, int y, int w, int h,
+           int* i, int* j, CARDBPP colour, int length)
+{
+  CARDBPP *dst = (CARDBPP*)client->frameBuffer + (y + *j) * client->width + x;
+  int n;
+
+  /* runs of a single pixel are the common case for text */
+  if (length == 1 && *j < h) {
+    dst[*i] = colour;
+    if (++*i >= w) {
+      *i = 0;
+      ++*j;
+    }
+    return 0;
+  }
+
+  while (*j < h && length > 0) {
+    n = w - *i < length ? w - *i : length;
+    RLEFillPixels(dst + *i, colour, n);
+    length -= n;
+    if ((*i += n) >= w) {
+      *i = 0;
+      ++*j;
+      dst += client->width;
+    }
+  }
+  return length;
+}
+
+/*
+ * Expands a tile of packed palette indices (bpp 1, 2 or 4 bits per pixel,
+ * rows padded to whole bytes, or 8 bits per pixel) and returns the first
+ * byte after it. For packed indices a table maps each nibble to the 4/bpp
+ * pixels it holds, so one lookup stores up to four pixels at once.
+ */
+static const uint8_t*
+RLEUnpackPalette(rfbClient* client, const uint8_t* p, const CARDBPP* palette,
+                 int bpp, int x, int y, int w, int h)
+{
+  CARDBPP *dst = (CARDBPP*)client->frameBuffer + y * client->width + x;
+  CARDBPP expand[16 * 4];
+  int mask = (1 << bpp) - 1;
+  int i, k, n;
+
+  if (bpp == 8) {
+    for (; h > 0; h--, dst += client->width)
+      for (i = 0; i < w; i++)
+        dst[i] = palette[*p++ & 0x7f];
+    return p;
+  }
+
+  for (k = 0; k < 16; k++)
+    for (n = 0; n < 4 / bpp; n++)
+      expand[k * (4 / bpp) + n] = palette[(k >> (4 - bpp * (n + 1))) & mask];
+
+#define UNPACK_ROWS(ppn)                                                     \
+  for (; h > 0; h--, dst += client->width) {                                 \
+    CARDBPP *d = dst;                                                        \
+    for (i = w; i >= 2 * (ppn); i -= 2 * (ppn), d += 2 * (ppn), p++) {       \
+      memcpy(d, &expand[(*p >> 4) * (ppn)], (ppn) * sizeof(CARDBPP));        \
+      memcpy(d + (ppn), &expand[(*p & 15) * (ppn)], (ppn) * sizeof(CARDBPP)); \
+    }                                                                        \
+    if (i > 0) {                                                             \
+      for (k = 0; k < i; k++)                                                \
+        d[k] = palette[(*p >> (8 - bpp * (k + 1))) & mask];                  \
+      p++;                                                                   \
+    }                                                                        \
+  }
+
+  switch (bpp) {
+  case 1: UNPACK_ROWS(4); break;
+  case 2: UNPACK_ROWS(2); break;
+  default: UNPACK_ROWS(1); break;
+  }
+#undef UNPACK_ROWS
+
+  return p;
+}
+
+#undef RLEKernel
+#undef RLEReadCPixel
+#undef RLEReadPalette
+#undef RLECopyTile
+#undef RLEUnpackPalette
+#undef RLEFillRun
+#undef RLEFillPixels
+#undef CARDBPP
+#undef REALBPP
+#undef UNCOMP
@@ -36,6 +36,8 @@ HandleRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   int i;
   CARDBPP pix;
   rfbRectangle subrect;
+  int n;
+  rfbClientSubrect subrects[128];
 
   if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbRREHeader))
     return FALSE;
@@ -45,9 +47,19 @@ HandleRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   if (!ReadFromRFBServer(client, (char *)&pix, sizeof(pix)))
     return FALSE;
 
-  client->GotFillRect(client, rx, ry, rw, rh, pix);
+  subrects[0].x = subrects[0].y = 0;
+  subrects[0].w = rw;
+  subrects[0].h = rh;
+  subrects[0].colour = pix;
+  n = 1;
 
+  /* draw the subrects in batches, the rectangle is bounds-checked once per batch */
   for (i = 0; i < hdr.nSubrects; i++) {
+    if (n == sizeof(subrects) / sizeof(subrects[0])) {
+      rfbClientFillRects(client, rx, ry, rw, rh, subrects, n);
+      n = 0;
+    }
+
     if (!ReadFromRFBServer(client, (char *)&pix, sizeof(pix)))
       return FALSE;
 
@@ -59,8 +71,14 @@ HandleRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     subrect.w = rfbClientSwap16IfLE(subrect.w);
     subrect.h = rfbClientSwap16IfLE(subrect.h);
 
-    client->GotFillRect(client, rx+subrect.x, ry+subrect.y, subrect.w, subrect.h, pix);
+    subrects[n].x = subrect.x;
+    subrects[n].y = subrect.y;
+    subrects[n].w = subrect.w;
+    subrects[n].h = subrect.h;
+    subrects[n].colour = pix;
+    n++;
   }
+  rfbClientFillRects(client, rx, ry, rw, rh, subrects, n);
 
   return TRUE;
 }
@@ -0,0 +1,269 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+
+/*
+ * scratch.c - decoder scratch memory allocated on demand, shared between
+ * clients and trimmed to a memory budget.
+ *
+ * client->buffer and client->zlib_buffer used to be arrays in rfbClient,
+ * 330 KB per client whether or not an encoding working in them was ever
+ * received. They now live in an rfbScratch and are allocated when the
+ * first rectangle needs them. Clients whose messages are handled one after
+ * another never decode at the same time and may share one rfbScratch.
+ * Each of them holds a claim on it while its last update needed it; the
+ * memory is trimmed only once no claim is left.
+ */
+
+#include <stdlib.h>
+#include <rfb/rfbclient.h>
+#include "scratch.h"
+#include "h264.h"
+
+#define SCRATCH_USERS 8
+
+struct rfbScratch {
+  char *buffer;         /* RFB_BUFFER_SIZE bytes */
+  char *zlibBuffer;     /* ZLIB_BUFFER_SIZE bytes */
+  unsigned claims;      /* a bit per user whose last update needed it */
+  int users;
+  rfbClient *user[SCRATCH_USERS];
+};
+
+static struct rfbScratch *
+GetScratch(rfbClient* client)
+{
+  if (client->scratch == NULL &&
+      (client->scratch = calloc(1, sizeof(struct rfbScratch))) != NULL) {
+    client->scratch->users = 1;
+    client->scratch->user[0] = client;
+  }
+  return client->scratch;
+}
+
+/* the bit of client in s->claims */
+static unsigned
+Claim(struct rfbScratch *s, rfbClient* client)
+{
+  int i;
+
+  for (i = 0; i < SCRATCH_USERS; i++)
+    if (s->user[i] == client)
+      return 1U << i;
+  return 0;
+}
+
+void
+rfbScratchRefresh(rfbClient* client)
+{
+  struct rfbScratch *s = client->scratch;
+
+  client->buffer = s ? s->buffer : NULL;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  client->zlib_buffer = s ? s->zlibBuffer : NULL;
+#endif
+}
+
+rfbBool
+rfbScratchNeed(rfbClient* client, int what)
+{
+  struct rfbScratch *s = GetScratch(client);
+
+  if (s == NULL)
+    goto fail;
+  client->scratchUsed |= what;
+  if (what & (RFB_SCRATCH_BUFFER | RFB_SCRATCH_ZLIB))
+    s->claims |= Claim(s, client);
+  if ((what & RFB_SCRATCH_BUFFER) && s->buffer == NULL &&
+      (s->buffer = malloc(RFB_BUFFER_SIZE)) == NULL)
+    goto fail;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  if ((what & RFB_SCRATCH_ZLIB) && s->zlibBuffer == NULL &&
+      (s->zlibBuffer = malloc(ZLIB_BUFFER_SIZE)) == NULL)
+    goto fail;
+#endif
+  rfbScratchRefresh(client);
+  return TRUE;
+
+fail:
+  rfbClientErr("Could not allocate decoder scratch memory\n");
+  return FALSE;
+}
+
+rfbBool
+rfbScratchForEncoding(rfbClient* client, int32_t encoding)
+{
+  switch (encoding) {
+  case rfbEncodingCoRRE:
+  case rfbEncodingHextile:
+    return rfbScratchNeed(client, RFB_SCRATCH_BUFFER);
+  case rfbEncodingZlib:
+    return rfbScratchNeed(client, RFB_SCRATCH_BUFFER | RFB_SCRATCH_RAW);
+  case rfbEncodingOpenH264:
+    return rfbScratchNeed(client, RFB_SCRATCH_BUFFER | RFB_SCRATCH_VIDEO);
+  case rfbEncodingTight:
+  case rfbEncodingTightPng:
+    return rfbScratchNeed(client, RFB_SCRATCH_BUFFER | RFB_SCRATCH_ZLIB |
+			  RFB_SCRATCH_RAW | RFB_SCRATCH_WIDEROW);
+  case rfbEncodingZRLE:
+  case rfbEncodingZYWRLE:
+    return rfbScratchNeed(client, RFB_SCRATCH_BUFFER | RFB_SCRATCH_ZLIB | RFB_SCRATCH_RAW);
+  case rfbEncodingTRLE:
+    return rfbScratchNeed(client, RFB_SCRATCH_RAW);
+  case rfbEncodingUltra:
+  case rfbEncodingUltraZip:
+    return rfbScratchNeed(client, RFB_SCRATCH_RAW | RFB_SCRATCH_ULTRA);
+  default:
+    /* Raw asks for it only if it cannot read into the framebuffer */
+    return TRUE;
+  }
+}
+
+void
+rfbScratchRelease(rfbClient* client)
+{
+  struct rfbScratch *s = client->scratch;
+  int i;
+
+  if (s != NULL) {
+    s->claims &= ~Claim(s, client);
+    for (i = 0; i < SCRATCH_USERS; i++)
+      if (s->user[i] == client)
+        s->user[i] = NULL;
+    if (--s->users == 0) {
+      free(s->buffer);
+      free(s->zlibBuffer);
+      free(s);
+    }
+  }
+  client->scratch = NULL;
+  rfbScratchRefresh(client);
+}
+
+rfbBool
+rfbClientShareScratch(rfbClient* client, rfbClient* other)
+{
+  struct rfbScratch *s = GetScratch(other);
+  int i;
+
+  if (s == NULL)
+    return FALSE;
+  if (s == client->scratch)
+    return TRUE;
+  for (i = 0; i < SCRATCH_USERS && s->user[i] != NULL; i++)
+    ;
+  if (i == SCRATCH_USERS)
+    return FALSE;
+  rfbScratchRelease(client);
+  client->scratch = s;
+  s->user[i] = client;
+  s->users++;
+  rfbScratchRefresh(client);
+  return TRUE;
+}
+
+size_t
+rfbClientFootprint(rfbClient* client)
+{
+  struct rfbScratch *s = client->scratch;
+  size_t n = sizeof(rfbClient);
+
+  /* shared scratch memory is split between its users */
+  if (s != NULL) {
+    if (s->buffer)
+      n += RFB_BUFFER_SIZE / s->users;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (s->zlibBuffer)
+      n += ZLIB_BUFFER_SIZE / s->users;
+#endif
+  }
+  if (client->raw_buffer != NULL && client->raw_buffer_size > 0)
+    n += client->raw_buffer_size;
+  if (client->ultra_buffer != NULL)
+    n += client->ultra_buffer_size;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  if (client->tightWideRow != NULL)
+    n += client->tightWideRowSize;
+  n += client->inflateMemory;
+#endif
+  return n + rfbH264ScratchSize(client);
+}
+
+void
+rfbTrimMemory(rfbClient* client)
+{
+  struct rfbScratch *s = client->scratch;
+  int unused = ~client->scratchUsed;
+  size_t footprint;
+  int i;
+
+  /* the client keeps its claim on the shared scratch memory while its
+     updates need it, and gives it up with the first one that does not */
+  if (s != NULL) {
+    if (client->scratchUsed & (RFB_SCRATCH_BUFFER | RFB_SCRATCH_ZLIB))
+      s->claims |= Claim(s, client);
+    else
+      s->claims &= ~Claim(s, client);
+  }
+
+  if (client->memoryBudget == 0)
+    goto done;
+  footprint = rfbClientFootprint(client);
+  if (footprint <= client->memoryBudget)
+    goto done;
+
+  /* Only what the last update did without is freed, anything else would
+     just be allocated again with the next one. The zlib streams always
+     stay: the server goes on compressing against their dictionaries. */
+  if ((unused & RFB_SCRATCH_RAW) && client->raw_buffer != NULL) {
+    free(client->raw_buffer);
+    client->raw_buffer = NULL;
+    client->raw_buffer_size = -1;
+  }
+  if ((unused & RFB_SCRATCH_ULTRA) && client->ultra_buffer != NULL) {
+    free(client->ultra_buffer);
+    client->ultra_buffer = NULL;
+    client->ultra_buffer_size = 0;
+  }
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  if ((unused & RFB_SCRATCH_WIDEROW) && client->tightWideRow != NULL) {
+    free(client->tightWideRow);
+    client->tightWideRow = NULL;
+    client->tightWideRowSize = 0;
+  }
+#endif
+  if (unused & RFB_SCRATCH_VIDEO)
+    rfbH264TrimScratch(client);
+
+  /* The shared scratch memory goes only if none of its users needed it
+     in its last update; none of them may point at it afterwards. */
+  if (s != NULL && !s->claims && (s->buffer != NULL || s->zlibBuffer != NULL)) {
+    free(s->buffer);
+    free(s->zlibBuffer);
+    s->buffer = s->zlibBuffer = NULL;
+    for (i = 0; i < SCRATCH_USERS; i++)
+      if (s->user[i] != NULL)
+        rfbScratchRefresh(s->user[i]);
+  }
+  if (rfbClientFootprint(client) < footprint)
+    client->memoryTrims++;
+
+done:
+  client->scratchUsed = 0;
+}
@@ -0,0 +1,64 @@
+/*
+ *  Copyright (C) 2022 Sebastian Weber
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+
+/*
+ * scratch.h - internal interface to the decoder scratch memory and the
+ * memory budget of a client.
+ */
+
+#ifndef _RFB_SCRATCH_H
+#define _RFB_SCRATCH_H
+
+#include <rfb/rfbclient.h>
+
+#define RFB_SCRATCH_BUFFER  1   /* client->buffer */
+#define RFB_SCRATCH_ZLIB    2   /* client->zlib_buffer */
+/* grown by the decoders themselves, only marked as used */
+#define RFB_SCRATCH_RAW     4   /* client->raw_buffer */
+#define RFB_SCRATCH_ULTRA   8   /* client->ultra_buffer */
+#define RFB_SCRATCH_WIDEROW 16  /* client->tightWideRow */
+#define RFB_SCRATCH_VIDEO   32  /* H.264 rectangles too large for buffer */
+
+/**
+ * Allocates the scratch memory in what (RFB_SCRATCH_* bits) unless it is
+ * there and marks it as used during this update. Logs and returns FALSE
+ * if there is no memory.
+ */
+extern rfbBool rfbScratchNeed(rfbClient* client, int what);
+
+/** Allocates the scratch memory the decoder of an encoding works in. */
+extern rfbBool rfbScratchForEncoding(rfbClient* client, int32_t encoding);
+
+/**
+ * Points client->buffer and client->zlib_buffer at the scratch memory,
+ * which another client sharing it may have trimmed meanwhile.
+ */
+extern void rfbScratchRefresh(rfbClient* client);
+
+/** Drops the client's reference to its scratch memory. */
+extern void rfbScratchRelease(rfbClient* client);
+
+/**
+ * Frees memory the decoders can allocate again if the client is above
+ * client->memoryBudget. Call between framebuffer updates.
+ */
+extern void rfbTrimMemory(rfbClient* client);
+
+#endif
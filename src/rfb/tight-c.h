@@ -41,6 +41,7 @@
 #define filterPtrBPP CONCAT2E(filterPtr,BPP)
 
 #define HandleTightBPP CONCAT2E(HandleTight,BPP)
+#define HandleTightRectBPP CONCAT2E(HandleTightRect,BPP)
 #define InitFilterCopyBPP CONCAT2E(InitFilterCopy,BPP)
 #define InitFilterPaletteBPP CONCAT2E(InitFilterPalette,BPP)
 #define InitFilterGradientBPP CONCAT2E(InitFilterGradient,BPP)
@@ -52,6 +53,13 @@
 #define DecompressJpegRectBPP CONCAT2E(DecompressJpegRect,BPP)
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+#define HandleTightPngBPP CONCAT2E(HandleTightPng,BPP)
+#if BPP != 8
+#define DecompressPngRectBPP CONCAT2E(DecompressPngRect,BPP)
+#endif
+#endif
+
 #ifndef RGB_TO_PIXEL
 
 #define RGB_TO_PIXEL(bpp,r,g,b)						\
@@ -72,6 +80,27 @@
    ((uint32_t)(g) & 0xFF) << client->format.greenShift |			\
    ((uint32_t)(b) & 0xFF) << client->format.blueShift)
 
+/* gradient filter prediction clamped to 0..max */
+#if defined(__ARM_FEATURE_SAT)
+#include <arm_acle.h>
+#define TIGHT_CLAMP255(x) __usat(x, 8)
+#else
+#define TIGHT_CLAMP255(x) ((((x) & ~((x) >> 31)) | ((255 - (x)) >> 31)) & 0xFF)
+#endif
+#define TIGHT_CLAMP(x,max) ((x) > (max) ? (max) : (x) & ~((x) >> 31))
+
+/* bytes needed for the previous row of the gradient filter */
+#define TightPrevRowSize(client) \
+  ((client)->rectWidth * 3 * ((client)->cutZeros ? 1 : (int)sizeof(uint16_t)))
+
+static uint8_t*
+TightPrevRow(rfbClient* client)
+{
+  if (TightPrevRowSize(client) <= (int)sizeof(client->tightPrevRow))
+    return client->tightPrevRow;
+  return client->tightWideRow;
+}
+
 #endif
 
 /* Type declarations */
@@ -89,12 +118,19 @@ static void FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRow
 
 #if BPP != 8
 static rfbBool DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h);
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+static rfbBool DecompressPngRectBPP(rfbClient* client, int x, int y, int w, int h);
+#endif
 #endif
 
 /* Definitions */
 
+/*
+ * TightPng rectangles are Tight rectangles whose "basic without zlib"
+ * compression type (0x0A) carries a PNG image instead.
+ */
 static rfbBool
-HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
+HandleTightRectBPP (rfbClient* client, int rx, int ry, int rw, int rh, rfbBool png)
 {
 //log_citra("%s: %d %d %d %d",__func__,rx,ry,rw,rh);
   CARDBPP fill_colour;
@@ -110,7 +146,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     return FALSE;
 
   if (rx + rw > client->width || ry + rh > client->height) {
-    rfbClientLog("Rect out of bounds: %dx%d at (%d, %d)\n", rx, ry, rw, rh);
+    rfbClientLog("Rect out of bounds: %dx%d at (%d, %d)\n", rw, rh, rx, ry);
     return FALSE;
   }
 
@@ -128,6 +164,17 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     comp_ctl >>= 1;
   }
 
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+  if (png && comp_ctl == rfbTightPng) {
+#if BPP == 8
+    rfbClientLog("TightPng encoding: PNG is not supported in 8 bpp mode.\n");
+    return FALSE;
+#else
+    return DecompressPngRectBPP(client, rx, ry, rw, rh);
+#endif
+  }
+#endif
+
   if ((comp_ctl & rfbTightNoZlib) == rfbTightNoZlib) {
      comp_ctl &= ~(rfbTightNoZlib);
      readUncompressed = TRUE;
@@ -238,10 +285,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   stream_id = comp_ctl & 0x03;
   zs = &client->zlibStream[stream_id];
   if (!client->zlibStreamActive[stream_id]) {
-    zs->zalloc = Z_NULL;
-    zs->zfree = Z_NULL;
-    zs->opaque = Z_NULL;
-    err = inflateInit(zs);
+    err = rfbInflateInit(client, zs);
     if (err != Z_OK) {
       if (zs->msg != NULL)
 	rfbClientLog("InflateInit error: %s.\n", zs->msg);
@@ -259,6 +303,18 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     return FALSE;
   }
 
+  /* Usually the whole rectangle fits: inflate it in one go. */
+  if (rh * rowSize <= bufferSize) {
+    if (!rfbInflateRead(client, zs, compressedLen,
+			client->zlib_buffer, ZLIB_BUFFER_SIZE,
+			(uint8_t *)client->buffer, rh * rowSize, 0, 1))
+      return FALSE;
+
+    filterFn(client, rx, ry, rh);
+
+    return TRUE;
+  }
+
   rowsProcessed = 0;
   extraBytes = 0;
 
@@ -313,6 +369,20 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   return TRUE;
 }
 
+static rfbBool
+HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  return HandleTightRectBPP(client, rx, ry, rw, rh, FALSE);
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+static rfbBool
+HandleTightPngBPP (rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  return HandleTightRectBPP(client, rx, ry, rw, rh, TRUE);
+}
+#endif
+
 /*----------------------------------------------------------------------------
  *
  * Filter stuff.
@@ -323,20 +393,63 @@ static int
 InitFilterCopyBPP (rfbClient* client, int rw, int rh)
 {
   client->rectWidth = rw;
+  client->cutZeros = FALSE;
 
 #if BPP == 32
   if (client->format.depth == 24 && client->format.redMax == 0xFF &&
       client->format.greenMax == 0xFF && client->format.blueMax == 0xFF) {
     client->cutZeros = TRUE;
     return 24;
-  } else {
-    client->cutZeros = FALSE;
   }
 #endif
 
   return BPP;
 }
 
+#if BPP == 32
+
+/*
+ * Converts a row of 24 bit pixels. For the common byte orders four pixels
+ * are repacked at once from three little endian words.
+ */
+static void
+CopyRGB24Row (rfbClient* client, uint32_t *dst, const uint8_t *src, int n)
+{
+  int x = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint32_t w[3];
+
+#define RGBX(v) (v)
+#define BGRX(v) (((v) & 0xFF00) | ((v) & 0xFF) << 16 | (v) >> 16)
+#define XBGR(v) __builtin_bswap32(v)
+#define REPACK4(swizzle)						\
+  for (; x + 4 <= n; x += 4, src += 12, dst += 4) {			\
+    memcpy(w, src, 12);							\
+    dst[0] = swizzle(w[0] & 0xFFFFFF);					\
+    dst[1] = swizzle(w[0] >> 24 | (w[1] & 0xFFFF) << 8);		\
+    dst[2] = swizzle(w[1] >> 16 | (w[2] & 0xFF) << 16);			\
+    dst[3] = swizzle(w[2] >> 8);					\
+  }
+
+  switch (client->tightRGB24Layout) {
+  case TIGHT_RGB24_RGBX: REPACK4(RGBX); break;
+  case TIGHT_RGB24_BGRX: REPACK4(BGRX); break;
+  case TIGHT_RGB24_XBGR: REPACK4(XBGR); break;
+  }
+
+#undef REPACK4
+#undef XBGR
+#undef BGRX
+#undef RGBX
+#endif
+
+  for (; x < n; x++, src += 3)
+    *dst++ = RGB24_TO_PIXEL32(src[0], src[1], src[2]);
+}
+
+#endif
+
 static void
 FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
 {
@@ -345,16 +458,11 @@ FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
   int y;
 
 #if BPP == 32
-  int x;
-
   if (client->cutZeros) {
     for (y = 0; y < numRows; y++) {
-      for (x = 0; x < client->rectWidth; x++) {
-	dst[y*client->width+x] =
-	  RGB24_TO_PIXEL32(client->buffer[(y*client->rectWidth+x)*3],
-			   client->buffer[(y*client->rectWidth+x)*3+1],
-			   client->buffer[(y*client->rectWidth+x)*3+2]);
-      }
+      CopyRGB24Row(client, &dst[y*client->width],
+		   (uint8_t *)&client->buffer[y*client->rectWidth*3],
+		   client->rectWidth);
     }
     return;
   }
@@ -370,54 +478,68 @@ FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
 static int
 InitFilterGradientBPP (rfbClient* client, int rw, int rh)
 {
-  int bits;
+  int bits, size;
 
   bits = InitFilterCopyBPP(client, rw, rh);
-  if (client->cutZeros)
-    memset(client->tightPrevRow, 0, rw * 3);
-  else
-    memset(client->tightPrevRow, 0, rw * 3 * sizeof(uint16_t));
+  size = TightPrevRowSize(client);
+
+  /* the protocol limits Tight rectangles to 2048 pixels, but not all
+     servers keep to that */
+  if (size > (int)sizeof(client->tightPrevRow) && size > client->tightWideRowSize) {
+    uint8_t *row = (uint8_t *)realloc(client->tightWideRow, size);
+    if (row == NULL) {
+      rfbClientLog("Tight encoding: no memory for a %d pixel wide rectangle.\n", rw);
+      return 0;
+    }
+    client->tightWideRow = row;
+    client->tightWideRowSize = size;
+  }
+  memset(TightPrevRow(client), 0, size);
 
   return bits;
 }
 
 #if BPP == 32
 
+/*
+ * The previous row is updated in place: the pixel above-left is kept in
+ * upLeft before it is overwritten.
+ */
 static void
 FilterGradient24 (rfbClient* client, int srcx, int srcy, int numRows)
 {
   CARDBPP *dst =
     (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
-  int x, y, c;
-  uint8_t thisRow[2048*3];
-  uint8_t pix[3];
-  int est[3];
+  const uint8_t *src = (const uint8_t *)client->buffer;
+  uint8_t *prevRow = TightPrevRow(client);
+  int rs = client->format.redShift;
+  int gs = client->format.greenShift;
+  int bs = client->format.blueShift;
+  int x, y, c, est, up;
+  int pix[3], upLeft[3];
 
-  for (y = 0; y < numRows; y++) {
+  for (y = 0; y < numRows; y++, dst += client->width) {
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
-      pix[c] = client->tightPrevRow[c] + client->buffer[y*client->rectWidth*3+c];
-      thisRow[c] = pix[c];
+      upLeft[c] = prevRow[c];
+      pix[c] = (prevRow[c] + src[c]) & 0xFF;
+      prevRow[c] = pix[c];
     }
-    dst[y*client->width] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+    dst[0] = (uint32_t)pix[0] << rs | (uint32_t)pix[1] << gs | (uint32_t)pix[2] << bs;
+    src += 3;
 
     /* Remaining pixels of a row */
-    for (x = 1; x < client->rectWidth; x++) {
+    for (x = 1; x < client->rectWidth; x++, src += 3) {
       for (c = 0; c < 3; c++) {
-	est[c] = (int)client->tightPrevRow[x*3+c] + (int)pix[c] -
-		 (int)client->tightPrevRow[(x-1)*3+c];
-	if (est[c] > 0xFF) {
-	  est[c] = 0xFF;
-	} else if (est[c] < 0x00) {
-	  est[c] = 0x00;
-	}
-	pix[c] = (uint8_t)est[c] + client->buffer[(y*client->rectWidth+x)*3+c];
-	thisRow[x*3+c] = pix[c];
+	up = prevRow[x*3+c];
+	est = up + pix[c] - upLeft[c];
+	upLeft[c] = up;
+	pix[c] = (TIGHT_CLAMP255(est) + src[c]) & 0xFF;
+	prevRow[x*3+c] = pix[c];
       }
-      dst[y*client->width+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+      dst[x] = (uint32_t)pix[0] << rs | (uint32_t)pix[1] << gs | (uint32_t)pix[2] << bs;
     }
-    memcpy(client->tightPrevRow, thisRow, client->rectWidth * 3);
   }
 }
 
@@ -430,12 +552,11 @@ FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
     (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
   int x, y, c;
   CARDBPP *src = (CARDBPP *)client->buffer;
-  uint16_t *thatRow = (uint16_t *)client->tightPrevRow;
-  uint16_t thisRow[2048*3];
-  uint16_t pix[3];
-  uint16_t max[3];
+  uint16_t *thatRow = (uint16_t *)TightPrevRow(client);
+  int pix[3], upLeft[3];
+  int max[3];
   int shift[3];
-  int est[3];
+  int est, up;
 
 #if BPP == 32
   if (client->cutZeros) {
@@ -456,26 +577,24 @@ FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
+      upLeft[c] = thatRow[c];
       pix[c] = (uint16_t)(((src[y*client->rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
-      thisRow[c] = pix[c];
+      thatRow[c] = pix[c];
     }
     dst[y*client->width] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
 
     /* Remaining pixels of a row */
     for (x = 1; x < client->rectWidth; x++) {
       for (c = 0; c < 3; c++) {
-	est[c] = (int)thatRow[x*3+c] + (int)pix[c] - (int)thatRow[(x-1)*3+c];
-	if (est[c] > (int)max[c]) {
-	  est[c] = (int)max[c];
-	} else if (est[c] < 0) {
-	  est[c] = 0;
-	}
-	pix[c] = (uint16_t)(((src[y*client->rectWidth+x] >> shift[c]) + est[c]) & max[c]);
-	thisRow[x*3+c] = pix[c];
+	up = thatRow[x*3+c];
+	est = up + pix[c] - upLeft[c];
+	upLeft[c] = up;
+	est = TIGHT_CLAMP(est, max[c]);
+	pix[c] = (uint16_t)(((src[y*client->rectWidth+x] >> shift[c]) + est) & max[c]);
+	thatRow[x*3+c] = pix[c];
       }
       dst[y*client->width+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
     }
-    memcpy(thatRow, thisRow, client->rectWidth * 3 * sizeof(uint16_t));
   }
 }
 
@@ -527,21 +646,29 @@ FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows)
   CARDBPP *palette = (CARDBPP *)client->tightPalette;
 
   if (client->rectColors == 2) {
+    /* each nibble of the bitmap expands to four pixels in one lookup */
+    CARDBPP expand[16][4];
+
+    for (x = 0; x < 16; x++)
+      for (b = 0; b < 4; b++)
+	expand[x][b] = palette[x >> (3 - b) & 1];
+
     w = (client->rectWidth + 7) / 8;
-    for (y = 0; y < numRows; y++) {
-      for (x = 0; x < client->rectWidth / 8; x++) {
-	for (b = 7; b >= 0; b--) {
-	  dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
-	}
+    for (y = 0; y < numRows; y++, dst += client->width, src += w) {
+      CARDBPP *d = dst;
+
+      for (x = 0; x < client->rectWidth / 8; x++, d += 8) {
+	memcpy(d, expand[src[x] >> 4], sizeof(expand[0]));
+	memcpy(d + 4, expand[src[x] & 15], sizeof(expand[0]));
       }
       for (b = 7; b >= 8 - client->rectWidth % 8; b--) {
-	dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
+	*d++ = palette[src[x] >> b & 1];
       }
     }
   } else {
-    for (y = 0; y < numRows; y++)
+    for (y = 0; y < numRows; y++, dst += client->width, src += client->rectWidth)
       for (x = 0; x < client->rectWidth; x++) {
-	dst[y*client->width+x] = palette[(int)src[y*client->rectWidth+x]];
+	dst[x] = palette[src[x]];
     }
   }
 }
@@ -580,7 +707,13 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
 
   if(client->GotJpeg != NULL)
     return client->GotJpeg(client, compressedData, compressedLen, x, y, w, h);
-  
+
+#if BPP == 32
+  /* Let a decode thread handle it, which takes over compressedData. */
+  if (rfbDecodePoolSubmitJpeg(client, compressedData, compressedLen, x, y, w, h))
+    return TRUE;
+#endif
+
   if (!client->tjhnd) {
     if ((client->tjhnd = tjInitDecompress()) == NULL) {
       rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
@@ -609,7 +742,7 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
 
   if (tjDecompress(client->tjhnd, compressedData, (unsigned long)compressedLen,
                    dst, w, pitch, h, pixelSize, flags)==-1) {
-    rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+    rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr2(client->tjhnd));
     free(compressedData);
     return FALSE;
   }
@@ -637,6 +770,127 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
   return TRUE;
 }
 
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+
+/*----------------------------------------------------------------------------
+ *
+ * PNG decompression (TightPng).
+ *
+ */
+
+static rfbBool
+DecompressPngRectBPP(rfbClient* client, int x, int y, int w, int h)
+{
+  png_image image;
+  int compressedLen, pitch, rgbSize;
+  uint8_t *compressedData, *dst, *rgb;
+  rfbBool ok;
+
+  compressedLen = (int)ReadCompactLen(client);
+  if (compressedLen <= 0) {
+    rfbClientLog("Incorrect data received from the server.\n");
+    return FALSE;
+  }
+
+  /* TightPng does not use the zlib streams, so their buffer is free */
+  if (compressedLen <= ZLIB_BUFFER_SIZE) {
+    compressedData = (uint8_t *)client->zlib_buffer;
+  } else if ((compressedData = malloc(compressedLen)) == NULL) {
+    rfbClientLog("Memory allocation error.\n");
+    return FALSE;
+  }
+
+  if (!ReadFromRFBServer(client, (char*)compressedData, compressedLen)) {
+    ok = FALSE;
+    goto done;
+  }
+
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_memory(&image, compressedData, compressedLen)) {
+    rfbClientLog("PNG error: %s\n", image.message);
+    ok = FALSE;
+    goto done;
+  }
+  if ((int)image.width != w || (int)image.height != h) {
+    rfbClientLog("TightPng encoding: %ux%u image for a %dx%d rectangle.\n",
+		 image.width, image.height, w, h);
+    png_image_free(&image);
+    ok = FALSE;
+    goto done;
+  }
+
+  /* libpng writes the rows where it is told to, so the rectangle is checked
+     here as well as by the caller */
+  if (x < 0 || y < 0 || x + w > client->width || y + h > client->height) {
+    rfbClientLog("TightPng encoding: %dx%d rectangle at (%d, %d) out of bounds.\n",
+		 w, h, x, y);
+    png_image_free(&image);
+    ok = FALSE;
+    goto done;
+  }
+
+  pitch = client->width * (BPP / 8);
+  dst = &client->frameBuffer[y * pitch + x * (BPP / 8)];
+
+#if BPP == 32
+  /* libpng writes the common byte orders straight into the framebuffer;
+     the alpha channel lands in the unused byte */
+  image.format = PNG_FORMAT_RGB;
+  switch (client->tightRGB24Layout) {
+  case TIGHT_RGB24_RGBX: image.format = PNG_FORMAT_RGBA; break;
+  case TIGHT_RGB24_BGRX: image.format = PNG_FORMAT_BGRA; break;
+  case TIGHT_RGB24_XBGR: image.format = PNG_FORMAT_ABGR; break;
+  }
+  if (image.format != PNG_FORMAT_RGB) {
+    ok = png_image_finish_read(&image, NULL, dst, client->width * 4, NULL);
+    if (!ok)
+      rfbClientLog("PNG error: %s\n", image.message);
+    goto done;
+  }
+#endif
+
+  /* otherwise decode to RGB and convert like JPEG rectangles */
+  image.format = PNG_FORMAT_RGB;
+  rgbSize = w * h * 3;
+  if (rgbSize <= RFB_BUFFER_SIZE) {
+    rgb = (uint8_t *)client->buffer;
+  } else {
+    if (client->raw_buffer_size < rgbSize) {
+      free(client->raw_buffer);
+      client->raw_buffer_size = rgbSize;
+      client->raw_buffer = (char*) malloc( client->raw_buffer_size );
+    }
+    rgb = (uint8_t *)client->raw_buffer;
+  }
+  if (rgb == NULL) {
+    client->raw_buffer_size = 0;
+    rfbClientLog("Memory allocation error.\n");
+    png_image_free(&image);
+    ok = FALSE;
+    goto done;
+  }
+
+  ok = png_image_finish_read(&image, NULL, rgb, w * 3, NULL);
+  if (!ok) {
+    rfbClientLog("PNG error: %s\n", image.message);
+  } else {
+    CARDBPP *dst2;
+    int i, j;
+
+    for (j = 0; j < h; j++, dst += pitch)
+      for (i = 0, dst2 = (CARDBPP *)dst; i < w; i++, rgb += 3)
+	dst2[i] = RGB24_TO_PIXEL(BPP, rgb[0], rgb[1], rgb[2]);
+  }
+
+done:
+  if (compressedData != (uint8_t *)client->zlib_buffer)
+    free(compressedData);
+  return ok;
+}
+
+#endif
+
 #else
 
 static long
@@ -32,23 +32,22 @@
 
 #if !defined(UNCOMP) || UNCOMP == 0
 #define HandleTRLE CONCAT2E(HandleTRLE, REALBPP)
+#define RLEKernel(name) CONCAT2E(name, REALBPP)
 #elif UNCOMP > 0
 #define HandleTRLE CONCAT3E(HandleTRLE, REALBPP, Down)
+#define RLEKernel(name) CONCAT3E(name, REALBPP, Down)
 #else
 #define HandleTRLE CONCAT3E(HandleTRLE, REALBPP, Up)
+#define RLEKernel(name) CONCAT3E(name, REALBPP, Up)
 #endif
 #define CARDBPP CONCAT3E(uint, BPP, _t)
 #define CARDREALBPP CONCAT3E(uint, REALBPP, _t)
 
-#if REALBPP != BPP && defined(UNCOMP) && UNCOMP != 0
-#if UNCOMP > 0
-#define UncompressCPixel(pointer) ((*(CARDBPP *)pointer) >> UNCOMP)
-#else
-#define UncompressCPixel(pointer) ((*(CARDBPP *)pointer) << (-(UNCOMP)))
-#endif
-#else
-#define UncompressCPixel(pointer) (*(CARDBPP *)pointer)
-#endif
+#define RLEReadCPixel RLEKernel(RLEReadCPixel)
+#define RLEReadPalette RLEKernel(RLEReadPalette)
+#define RLECopyTile RLEKernel(RLECopyTile)
+#define RLEUnpackPalette RLEKernel(RLEUnpackPalette)
+#define RLEFillRun RLEKernel(RLEFillRun)
 
 static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
   int x, y, w, h;
@@ -56,7 +55,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
   int min_buffer_size = 16 * 16 * (REALBPP / 8) * 2;
   uint8_t *buffer;
   CARDBPP palette[128];
-  int bpp = 0, mask = 0, divider = 0;
+  int bpp = 0, divider = 0;
   CARDBPP color = 0;
 
   /* First make sure we have a large enough raw buffer to hold the
@@ -95,16 +94,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
       case 0: {
         if (!ReadFromRFBServer(client, (char *)buffer, w * h * REALBPP / 8))
           return FALSE;
-#if REALBPP != BPP
-        int i, j;
-
-        for (j = y * client->width; j < (y + h) * client->width;
-             j += client->width)
-          for (i = x; i < x + w; i++, buffer += REALBPP / 8)
-            ((CARDBPP *)client->frameBuffer)[j + i] = UncompressCPixel(buffer);
-#else
-        client->GotBitmap(client, buffer, x, y, w, h);
-#endif
+        RLECopyTile(client, buffer, x, y, w, h);
         type = last_type;
         break;
       }
@@ -112,7 +102,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
         if (!ReadFromRFBServer(client, (char *)buffer, REALBPP / 8))
           return FALSE;
 
-        color = UncompressCPixel(buffer);
+        color = RLEReadCPixel(buffer);
 
         client->GotFillRect(client, x, y, w, h, color);
 
@@ -135,33 +125,17 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
             last_type = last_type & 0x7f;
 
             bpp = (last_type > 4 ? (last_type > 16 ? 8 : 4)
-                                 : (last_type > 2 ? 2 : 1)),
-            mask = (1 << bpp) - 1, divider = (8 / bpp);
+                                 : (last_type > 2 ? 2 : 1));
+            divider = 8 / bpp;
           }
           if (last_type <= 16) {
-            int i, j, shift;
-
             if (!ReadFromRFBServer(client, (char*)buffer,
                                    (w + divider - 1) / divider * h))
               return FALSE;
 
             /* read palettized pixels */
-            for (j = y * client->width; j < (y + h) * client->width;
-                 j += client->width) {
-              for (i = x, shift = 8 - bpp; i < x + w; i++) {
-                ((CARDBPP *)client->frameBuffer)[j + i] =
-                    palette[((*buffer) >> shift) & mask];
-                shift -= bpp;
-                if (shift < 0) {
-                  shift = 8 - bpp;
-                  buffer++;
-                }
-              }
-              if (shift < 8 - bpp)
-                buffer++;
-
-              type = last_type;
-            }
+            RLEUnpackPalette(client, buffer, palette, bpp, x, y, w, h);
+            type = last_type;
           } else
             return FALSE;
         }
@@ -169,11 +143,12 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
       case 128: {
         int i = 0, j = 0;
         while (j < h) {
-          int color, length;
+          CARDBPP color;
+          int length;
           /* read color */
           if (!ReadFromRFBServer(client, (char*)buffer, REALBPP / 8 + 1))
             return FALSE;
-          color = UncompressCPixel(buffer);
+          color = RLEReadCPixel(buffer);
           buffer += REALBPP / 8;
           /* read run length */
           length = 1;
@@ -185,17 +160,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           }
           length += *buffer;
           buffer++;
-          while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
-                color;
-            length--;
-            i++;
-            if (i >= w) {
-              i = 0;
-              j++;
-            }
-          }
-          if (length > 0)
+          if (RLEFillRun(client, x, y, w, h, &i, &j, color, length) > 0)
             rfbClientLog("Warning: possible TRLE corruption\n");
         }
 
@@ -209,7 +174,8 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
         /* read palettized pixels */
         i = j = 0;
         while (j < h) {
-          int color, length;
+          CARDBPP color;
+          int length;
           /* read color */
           if (!ReadFromRFBServer(client, (char *)buffer, 1))
             return FALSE;
@@ -229,17 +195,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
             length += *buffer;
           }
           buffer++;
-          while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
-                color;
-            length--;
-            i++;
-            if (i >= w) {
-              i = 0;
-              j++;
-            }
-          }
-          if (length > 0)
+          if (RLEFillRun(client, x, y, w, h, &i, &j, color, length) > 0)
             rfbClientLog("Warning: possible TRLE corruption\n");
         }
 
@@ -251,29 +207,23 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
       }
       default:
         if (type <= 16) {
-          int i;
-
-          bpp = (type > 4 ? 4 : (type > 2 ? 2 : 1)),
-          mask = (1 << bpp) - 1, divider = (8 / bpp);
+          bpp = (type > 4 ? 4 : (type > 2 ? 2 : 1));
+          divider = 8 / bpp;
 
           if (!ReadFromRFBServer(client, (char *)buffer, type * REALBPP / 8))
             return FALSE;
 
           /* read palette */
-          for (i = 0; i < type; i++, buffer += REALBPP / 8)
-            palette[i] = UncompressCPixel(buffer);
+          RLEReadPalette(palette, buffer, type);
 
           last_type = type;
           goto case_127;
         } else if (type >= 130) {
-          int i;
-
           if (!ReadFromRFBServer(client, (char *)buffer, (type - 128) * REALBPP / 8))
             return FALSE;
 
           /* read palette */
-          for (i = 0; i < type - 128; i++, buffer += REALBPP / 8)
-            palette[i] = UncompressCPixel(buffer);
+          RLEReadPalette(palette, buffer, type - 128);
 
           last_type = type;
           goto case_129;
@@ -290,6 +240,11 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 #undef CARDBPP
 #undef CARDREALBPP
 #undef HandleTRLE
-#undef UncompressCPixel
+#undef RLEKernel
+#undef RLEReadCPixel
+#undef RLEReadPalette
+#undef RLECopyTile
+#undef RLEUnpackPalette
+#undef RLEFillRun
 #undef REALBPP
 #undef UNCOMP
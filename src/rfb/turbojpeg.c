@@ -62,9 +62,18 @@ struct my_error_mgr
 {
 	struct jpeg_error_mgr pub;
 	jmp_buf setjmp_buffer;
+	char errStr[JMSG_LENGTH_MAX]; /* last error of this instance */
 };
 typedef struct my_error_mgr *my_error_ptr;
 
+/* The global message is shared by all threads, the one of the instance
+   (see tjGetErrorStr2()) is not. */
+static void setError(my_error_ptr myerr, const char *m)
+{
+	snprintf(errStr, JMSG_LENGTH_MAX, "%s", m);
+	if(myerr) snprintf(myerr->errStr, JMSG_LENGTH_MAX, "%s", m);
+}
+
 static void my_error_exit(j_common_ptr cinfo)
 {
 	my_error_ptr myerr=(my_error_ptr)cinfo->err;
@@ -76,7 +85,9 @@ static void my_error_exit(j_common_ptr cinfo)
 
 static void my_output_message(j_common_ptr cinfo)
 {
-	(*cinfo->err->format_message)(cinfo, errStr);
+	my_error_ptr myerr=(my_error_ptr)cinfo->err;
+	(*cinfo->err->format_message)(cinfo, myerr->errStr);
+	snprintf(errStr, JMSG_LENGTH_MAX, "%s", myerr->errStr);
 }
 
 
@@ -104,7 +115,9 @@ static const tjscalingfactor sf[NUMSF]={
 	{1, 8}
 };
 
-#define _throw(m) {snprintf(errStr, JMSG_LENGTH_MAX, "%s", m);  \
+#define _throw(m) {setError(&this->jerr, m);  \
+	retval=-1;  goto bailout;}
+#define _throwg(m) {setError(NULL, m);  \
 	retval=-1;  goto bailout;}
 #define getinstance(handle) tjinstance *this=(tjinstance *)handle;  \
 	j_compress_ptr cinfo=NULL;  j_decompress_ptr dinfo=NULL;  \
@@ -248,7 +261,8 @@ static int setDecompDefaults(struct jpeg_decompress_struct *dinfo,
 			dinfo->out_color_space=JCS_RGB;  break;
 		#endif
 		default:
-			_throw("Unsupported pixel format");
+			setError((my_error_ptr)dinfo->err, "Unsupported pixel format");
+			retval=-1;  goto bailout;
 	}
 
 	bailout:
@@ -435,6 +449,14 @@ DLLEXPORT char* DLLCALL tjGetErrorStr(void)
 }
 
 
+DLLEXPORT char* DLLCALL tjGetErrorStr2(tjhandle handle)
+{
+	tjinstance *this=(tjinstance *)handle;
+	if(!this) return errStr;
+	return this->jerr.errStr;
+}
+
+
 DLLEXPORT int DLLCALL tjDestroy(tjhandle handle)
 {
 	getinstance(handle);
@@ -492,6 +514,7 @@ DLLEXPORT tjhandle DLLCALL tjInitCompress(void)
 		return NULL;
 	}
 	MEMZERO(this, sizeof(tjinstance));
+	snprintf(this->jerr.errStr, JMSG_LENGTH_MAX, "No error");
 	return _tjInitCompress(this);
 }
 
@@ -501,7 +524,7 @@ DLLEXPORT unsigned long DLLCALL tjBufSize(int width, int height,
 {
 	unsigned long retval=0;  int mcuw, mcuh, chromasf;
 	if(width<1 || height<1 || jpegSubsamp<0 || jpegSubsamp>=NUMSUBOPT)
-		_throw("tjBufSize(): Invalid argument");
+		_throwg("tjBufSize(): Invalid argument");
 
 	/*
 	 * This allows for rare corner cases in which a JPEG image can actually be
@@ -522,7 +545,7 @@ DLLEXPORT unsigned long DLLCALL TJBUFSIZE(int width, int height)
 {
 	unsigned long retval=0;
 	if(width<1 || height<1)
-		_throw("TJBUFSIZE(): Invalid argument");
+		_throwg("TJBUFSIZE(): Invalid argument");
 
 	/*
 	 * This allows for rare corner cases in which a JPEG image can actually be
@@ -679,6 +702,7 @@ DLLEXPORT tjhandle DLLCALL tjInitDecompress(void)
 		return NULL;
 	}
 	MEMZERO(this, sizeof(tjinstance));
+	snprintf(this->jerr.errStr, JMSG_LENGTH_MAX, "No error");
 	return _tjInitDecompress(this);
 }
 
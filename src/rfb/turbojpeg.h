@@ -492,6 +492,19 @@ DLLEXPORT int DLLCALL tjDestroy(tjhandle handle);
 DLLEXPORT char* DLLCALL tjGetErrorStr(void);
 
 
+/**
+ * Returns a descriptive error message explaining why the last command
+ * using the given instance failed. Unlike #tjGetErrorStr(), the message is
+ * not shared with other instances and so can be used from several threads.
+ *
+ * @param handle a handle to a TurboJPEG compressor or decompressor instance,
+ *        or NULL for the same message as #tjGetErrorStr()
+ *
+ * @return a descriptive error message explaining why the last command failed.
+ */
+DLLEXPORT char* DLLCALL tjGetErrorStr2(tjhandle handle);
+
+
 /* Backward compatibility functions and macros (nothing to see here) */
 #define NUMSUBOPT TJ_NUMSAMP
 #define TJ_444 TJSAMP_444
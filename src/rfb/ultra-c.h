@@ -38,6 +38,7 @@ HandleUltraBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   int toRead=0;
   int inflateResult=0;
   lzo_uint uncompressedBytes = (( rw * rh ) * ( BPP / 8 ));
+  uint8_t *dst;
 
   if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbZlibHeader))
     return FALSE;
@@ -51,13 +52,18 @@ HandleUltraBPP (rfbClient* client, int rx, int ry, int rw, int rh)
       return FALSE;
   }
 
-  /* First make sure we have a large enough raw buffer to hold the
+  /* LZO output is linear, so a rectangle spanning the whole framebuffer
+   * width can be decompressed right into the framebuffer.
+   */
+  dst = rw == client->width ? rfbClientDirectFrameBuffer(client, rx, ry, rw, rh) : NULL;
+
+  /* Otherwise make sure we have a large enough raw buffer to hold the
    * decompressed data.  In practice, with a fixed BPP, fixed frame
    * buffer size and the first update containing the entire frame
    * buffer, this buffer allocation should only happen once, on the
    * first update.
    */
-  if ( client->raw_buffer_size < (int)uncompressedBytes) {
+  if ( dst == NULL && client->raw_buffer_size < (int)uncompressedBytes) {
     if ( client->raw_buffer != NULL ) {
       free( client->raw_buffer );
     }
@@ -87,11 +93,18 @@ HandleUltraBPP (rfbClient* client, int rx, int ry, int rw, int rh)
       return FALSE;
 
   /* uncompress the data */
-  uncompressedBytes = client->raw_buffer_size;
-  inflateResult = lzo1x_decompress_safe(
+  if (dst != NULL) {
+    inflateResult = lzo1x_decompress_safe(
+              (lzo_byte *)client->ultra_buffer, toRead,
+              (lzo_byte *)dst, (lzo_uintp) &uncompressedBytes,
+              NULL);
+  } else {
+    uncompressedBytes = client->raw_buffer_size;
+    inflateResult = lzo1x_decompress_safe(
               (lzo_byte *)client->ultra_buffer, toRead,
               (lzo_byte *)client->raw_buffer, (lzo_uintp) &uncompressedBytes,
               NULL);
+  }
   
   /* Note that uncompressedBytes will be 0 on output overrun */
   if ((rw * rh * (BPP / 8)) != uncompressedBytes)
@@ -100,7 +113,8 @@ HandleUltraBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   /* Put the uncompressed contents of the update on the screen. */
   if ( inflateResult == LZO_E_OK ) 
   {
-    client->GotBitmap(client, (unsigned char *)client->raw_buffer, rx, ry, rw, rh);
+    if (dst == NULL)
+      client->GotBitmap(client, (unsigned char *)client->raw_buffer, rx, ry, rw, rh);
   }
   else
   {
@@ -39,6 +39,9 @@
 #include <time.h>
 #include <rfb/rfbclient.h>
 #include "tls.h"
+#include "decodepool.h"
+#include "h264.h"
+#include "scratch.h"
 
 static void Dummy(rfbClient* client) {
 }
@@ -100,9 +103,62 @@ static rfbBool CheckRect(rfbClient* client, int x, int y, int w, int h) {
   return x + w <= client->width && y + h <= client->height;
 }
 
-static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
-  int i,j;
+/*
+ * Row-wise fills, one per pixel size. Stores are done a word at a time
+ * where possible, rows are client->width pixels apart.
+ */
+
+static void FillRect8(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
+  uint8_t *dst = (uint8_t*)client->frameBuffer + y * client->width + x;
+
+  if (w == client->width) {
+    memset(dst, colour, w * h);
+    return;
+  }
+  for (; h > 0; h--, dst += client->width)
+    memset(dst, colour, w);
+}
+
+static void FillRect16(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
+  uint16_t *dst = (uint16_t*)client->frameBuffer + y * client->width + x;
+  uint32_t pair = (colour & 0xffff) | (colour << 16);
+  int i, n;
+
+  for (; h > 0; h--, dst += client->width) {
+    uint16_t *d = dst;
+    uint32_t *d32;
+
+    n = w;
+    if (((uintptr_t)d & 2) && n > 0) {
+      *d++ = colour;
+      n--;
+    }
+    d32 = (uint32_t*)d;
+    for (i = n >> 1; i >= 4; i -= 4, d32 += 4) {
+      d32[0] = pair; d32[1] = pair; d32[2] = pair; d32[3] = pair;
+    }
+    for (; i > 0; i--)
+      *d32++ = pair;
+    if (n & 1)
+      *(uint16_t*)d32 = colour;
+  }
+}
+
+static void FillRect32(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
+  uint32_t *dst = (uint32_t*)client->frameBuffer + y * client->width + x;
+  int i;
 
+  for (; h > 0; h--, dst += client->width) {
+    uint32_t *d = dst;
+    for (i = w; i >= 4; i -= 4, d += 4) {
+      d[0] = colour; d[1] = colour; d[2] = colour; d[3] = colour;
+    }
+    for (; i > 0; i--)
+      *d++ = colour;
+  }
+}
+
+static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
   if (client->frameBuffer == NULL) {
       return;
   }
@@ -112,22 +168,24 @@ static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_
     return;
   }
 
-#define FILL_RECT(BPP) \
-    for(j=y*client->width;j<(y+h)*client->width;j+=client->width) \
-      for(i=x;i<x+w;i++) \
-	((uint##BPP##_t*)client->frameBuffer)[j+i]=colour;
-
   switch(client->format.bitsPerPixel) {
-  case  8: FILL_RECT(8);  break;
-  case 16: FILL_RECT(16); break;
-  case 32: FILL_RECT(32); break;
+  case  8: FillRect8(client, x, y, w, h, colour);  break;
+  case 16: FillRect16(client, x, y, w, h, colour); break;
+  case 32: FillRect32(client, x, y, w, h, colour); break;
   default:
     rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
   }
 }
 
-static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h) {
-  int j;
+void rfbClientFillRects(rfbClient* client, int x, int y, int w, int h, const rfbClientSubrect* rects, int n) {
+  void (*fill)(rfbClient*, int, int, int, int, uint32_t);
+  int i, sw, sh;
+
+  if (client->GotFillRect != FillRectangle) {
+    for (i = 0; i < n; i++)
+      client->GotFillRect(client, x + rects[i].x, y + rects[i].y, rects[i].w, rects[i].h, rects[i].colour);
+    return;
+  }
 
   if (client->frameBuffer == NULL) {
       return;
@@ -138,27 +196,72 @@ static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y
     return;
   }
 
-#define COPY_RECT(BPP) \
-  { \
-    int rs = w * BPP / 8, rs2 = client->width * BPP / 8; \
-    for (j = ((x * (BPP / 8)) + (y * rs2)); j < (y + h) * rs2; j += rs2) { \
-      memcpy(client->frameBuffer + j, buffer, rs); \
-      buffer += rs; \
-    } \
+  switch(client->format.bitsPerPixel) {
+  case  8: fill = FillRect8;  break;
+  case 16: fill = FillRect16; break;
+  case 32: fill = FillRect32; break;
+  default:
+    rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (rects[i].x >= w || rects[i].y >= h)
+      continue;
+    sw = rects[i].w <= w - rects[i].x ? rects[i].w : w - rects[i].x;
+    sh = rects[i].h <= h - rects[i].y ? rects[i].h : h - rects[i].y;
+    fill(client, x + rects[i].x, y + rects[i].y, sw, sh, rects[i].colour);
+  }
+}
+
+static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h) {
+  int rs, pitch;
+  uint8_t *dst;
+
+  if (client->frameBuffer == NULL) {
+      return;
+  }
+
+  if (!CheckRect(client, x, y, w, h)) {
+    rfbClientLog("Rect out of bounds: %dx%d at (%d, %d)\n", x, y, w, h);
+    return;
   }
 
   switch(client->format.bitsPerPixel) {
-  case  8: COPY_RECT(8);  break;
-  case 16: COPY_RECT(16); break;
-  case 32: COPY_RECT(32); break;
+  case  8:
+  case 16:
+  case 32:
+    break;
   default:
     rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
+    return;
   }
+
+  rs = w * client->format.bitsPerPixel / 8;
+  pitch = client->width * client->format.bitsPerPixel / 8;
+  dst = client->frameBuffer + y * pitch + x * client->format.bitsPerPixel / 8;
+
+  /* full width rows are contiguous in the framebuffer */
+  if (rs == pitch) {
+    memcpy(dst, buffer, rs * h);
+    return;
+  }
+  for (; h > 0; h--, dst += pitch, buffer += rs)
+    memcpy(dst, buffer, rs);
+}
+
+uint8_t* rfbClientDirectFrameBuffer(rfbClient* client, int x, int y, int w, int h) {
+  /* the default GotBitmap copies verbatim, so nobody else needs to see the pixels */
+  if (client->GotBitmap != CopyRectangle || client->frameBuffer == NULL ||
+      x < 0 || y < 0 || !CheckRect(client, x, y, w, h))
+    return NULL;
+
+  return client->frameBuffer + (y * client->width + x) * (client->format.bitsPerPixel / 8);
 }
 
-/* TODO: test */
 static void CopyRectangleFromRectangle(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y) {
-  int i,j;
+  int rs, pitch, bpp = client->format.bitsPerPixel / 8;
+  uint8_t *src, *dst;
 
   if (client->frameBuffer == NULL) {
       return;
@@ -174,43 +277,34 @@ static void CopyRectangleFromRectangle(rfbClient* client, int src_x, int src_y,
     return;
   }
 
-#define COPY_RECT_FROM_RECT(BPP) \
-  { \
-    uint##BPP##_t* _buffer=((uint##BPP##_t*)client->frameBuffer)+(src_y-dest_y)*client->width+src_x-dest_x; \
-    if (dest_y < src_y) { \
-      for(j = dest_y*client->width; j < (dest_y+h)*client->width; j += client->width) { \
-        if (dest_x < src_x) { \
-          for(i = dest_x; i < dest_x+w; i++) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } else { \
-          for(i = dest_x+w-1; i >= dest_x; i--) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } \
-      } \
-    } else { \
-      for(j = (dest_y+h-1)*client->width; j >= dest_y*client->width; j-=client->width) { \
-        if (dest_x < src_x) { \
-          for(i = dest_x; i < dest_x+w; i++) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } else { \
-          for(i = dest_x+w-1; i >= dest_x; i--) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } \
-      } \
-    } \
-  }
-
   switch(client->format.bitsPerPixel) {
-  case  8: COPY_RECT_FROM_RECT(8);  break;
-  case 16: COPY_RECT_FROM_RECT(16); break;
-  case 32: COPY_RECT_FROM_RECT(32); break;
+  case  8:
+  case 16:
+  case 32:
+    break;
   default:
     rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
+    return;
   }
+
+  if (h <= 0 || w <= 0)
+    return;
+
+  rs = w * bpp;
+  pitch = client->width * bpp;
+  src = client->frameBuffer + src_y * pitch + src_x * bpp;
+  dst = client->frameBuffer + dest_y * pitch + dest_x * bpp;
+
+  /* Source and destination may overlap. Moving down, start with the last
+     row so no source row is overwritten before it is copied. Within a row
+     (same source and destination line) memmove takes care of the direction. */
+  if (dest_y > src_y) {
+    src += (h - 1) * pitch;
+    dst += (h - 1) * pitch;
+    pitch = -pitch;
+  }
+  for (; h > 0; h--, src += pitch, dst += pitch)
+    memmove(dst, src, rs);
 }
 
 static void initAppData(AppData* data) {
@@ -319,6 +413,11 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   client->GotCopyRect = CopyRectangleFromRectangle;
   client->GotFillRect = FillRectangle;
   client->GotBitmap = CopyRectangle;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+  rfbAvcodecCreateVideoDecoder(&client->videoDecoder);
+#endif
+  client->audioFrequency = 44100;
+  client->audioChannels = 2;
   client->FinishedFrameBufferUpdate = NULL;
   client->GetPassword = ReadPassword;
   client->MallocFrameBuffer = MallocFrameBuffer;
@@ -493,6 +592,13 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
 void rfbClientCleanup(rfbClient* client) {
 #ifdef LIBVNCSERVER_HAVE_LIBZ
   int i;
+#endif
+
+  /* the decode threads may still write to the framebuffer */
+  rfbDecodePoolDestroy(client);
+  rfbH264Destroy(client);
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
 
   for ( i = 0; i < 4; i++ ) {
     if (client->zlibStreamActive[i] == TRUE ) {
@@ -507,6 +613,8 @@ void rfbClientCleanup(rfbClient* client) {
 	client->decompStream.msg != NULL)
       rfbClientLog("inflateEnd: %s\n", client->decompStream.msg );
   }
+
+  free(client->tightWideRow);
 #endif
 
   if (client->ultra_buffer)
@@ -515,6 +623,8 @@ void rfbClientCleanup(rfbClient* client) {
   if (client->raw_buffer)
     free(client->raw_buffer);
 
+  rfbScratchRelease(client);
+
   FreeTLS(client);
 
   while (client->clientData) {
@@ -32,21 +32,42 @@
 #define HandleZlibBPP CONCAT2E(HandleZlib,BPP)
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 
+#ifndef ZLIB_MIN_DIRECT_ROW
+/* narrower framebuffer rows are not inflated into directly */
+#define ZLIB_MIN_DIRECT_ROW 1024
+#endif
+
 static rfbBool
 HandleZlibBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 {
   rfbZlibHeader hdr;
-  int remaining;
   int inflateResult;
-  int toRead;
+  uint8_t *dst;
+  int pitch, rowBytes, rows;
+
+  /* If we may write to the framebuffer directly, inflate straight into
+   * its rows. A rectangle spanning the whole width is one output window.
+   * Narrow rows would keep inflate off its fast path most of the time, so
+   * those rectangles are inflated into the raw buffer in one piece.
+   */
+  dst = rfbClientDirectFrameBuffer(client, rx, ry, rw, rh);
+  pitch = client->width * ( BPP / 8 );
+  rowBytes = rw * ( BPP / 8 );
+  rows = rh;
+  if ( rowBytes == pitch ) {
+    rowBytes *= rh;
+    rows = 1;
+  } else if ( rowBytes < ZLIB_MIN_DIRECT_ROW ) {
+    dst = NULL;
+  }
 
-  /* First make sure we have a large enough raw buffer to hold the
+  /* Otherwise make sure we have a large enough raw buffer to hold the
    * decompressed data.  In practice, with a fixed BPP, fixed frame
    * buffer size and the first update containing the entire frame
    * buffer, this buffer allocation should only happen once, on the
    * first update.
    */
-  if ( client->raw_buffer_size < (( rw * rh ) * ( BPP / 8 ))) {
+  if ( dst == NULL && client->raw_buffer_size < (( rw * rh ) * ( BPP / 8 ))) {
 
     if ( client->raw_buffer != NULL ) {
 
@@ -62,19 +83,12 @@ HandleZlibBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbZlibHeader))
     return FALSE;
 
-  remaining = rfbClientSwap32IfLE(hdr.nBytes);
-
-  /* Need to initialize the decompressor state. */
-  client->decompStream.next_in   = ( Bytef * )client->buffer;
-  client->decompStream.avail_in  = 0;
-  client->decompStream.next_out  = ( Bytef * )client->raw_buffer;
-  client->decompStream.avail_out = client->raw_buffer_size;
-  client->decompStream.data_type = Z_BINARY;
-
   /* Initialize the decompression stream structures on the first invocation. */
   if ( client->decompStreamInited == FALSE ) {
 
-    inflateResult = inflateInit( &client->decompStream );
+    client->decompStream.next_in   = ( Bytef * )client->buffer;
+    client->decompStream.avail_in  = 0;
+    inflateResult = rfbInflateInit( client, &client->decompStream );
 
     if ( inflateResult != Z_OK ) {
       rfbClientLog(
@@ -88,71 +102,20 @@ HandleZlibBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 
   }
 
-  inflateResult = Z_OK;
-
-  /* Process buffer full of data until no more to process, or
-   * some type of inflater error, or Z_STREAM_END.
-   */
-  while (( remaining > 0 ) &&
-         ( inflateResult == Z_OK )) {
-  
-    if ( remaining > RFB_BUFFER_SIZE ) {
-      toRead = RFB_BUFFER_SIZE;
-    }
-    else {
-      toRead = remaining;
-    }
-
-    /* Fill the buffer, obtaining data from the server. */
-    if (!ReadFromRFBServer(client, client->buffer,toRead))
-      return FALSE;
-
-    client->decompStream.next_in  = ( Bytef * )client->buffer;
-    client->decompStream.avail_in = toRead;
-
-    /* Need to uncompress buffer full. */
-    inflateResult = inflate( &client->decompStream, Z_SYNC_FLUSH );
-
-    /* We never supply a dictionary for compression. */
-    if ( inflateResult == Z_NEED_DICT ) {
-      rfbClientLog("zlib inflate needs a dictionary!\n");
-      return FALSE;
-    }
-    if ( inflateResult < 0 ) {
-      rfbClientLog(
-              "zlib inflate returned error: %d, msg: %s\n",
-              inflateResult,
-              client->decompStream.msg);
-      return FALSE;
-    }
-
-    /* Result buffer allocated to be at least large enough.  We should
-     * never run out of space!
-     */
-    if (( client->decompStream.avail_in > 0 ) &&
-        ( client->decompStream.avail_out <= 0 )) {
-      rfbClientLog("zlib inflate ran out of space!\n");
-      return FALSE;
-    }
-
-    remaining -= toRead;
-
-  } /* while ( remaining > 0 ) */
+  if ( dst != NULL )
+    return rfbInflateRead(client, &client->decompStream,
+                          rfbClientSwap32IfLE(hdr.nBytes),
+                          client->buffer, RFB_BUFFER_SIZE,
+                          dst, rowBytes, pitch, rows);
 
-  if ( inflateResult == Z_OK ) {
-
-    /* Put the uncompressed contents of the update on the screen. */
-    client->GotBitmap(client, (uint8_t *)client->raw_buffer, rx, ry, rw, rh);
-  }
-  else {
-
-    rfbClientLog(
-            "zlib inflate returned error: %d, msg: %s\n",
-            inflateResult,
-            client->decompStream.msg);
+  if (!rfbInflateRead(client, &client->decompStream,
+                      rfbClientSwap32IfLE(hdr.nBytes),
+                      client->buffer, RFB_BUFFER_SIZE,
+                      (uint8_t *)client->raw_buffer, rw * rh * ( BPP / 8 ), 0, 1))
     return FALSE;
 
-  }
+  /* Put the uncompressed contents of the update on the screen. */
+  client->GotBitmap(client, (uint8_t *)client->raw_buffer, rx, ry, rw, rh);
 
   return TRUE;
 }
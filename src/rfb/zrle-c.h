@@ -35,15 +35,26 @@
 #if !defined(UNCOMP) || UNCOMP==0
 #define HandleZRLE CONCAT2E(HandleZRLE,REALBPP)
 #define HandleZRLETile CONCAT2E(HandleZRLETile,REALBPP)
+#define FillZRLEWindow CONCAT2E(FillZRLEWindow,REALBPP)
+#define RLEKernel(name) CONCAT2E(name,REALBPP)
 #elif UNCOMP>0
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Down)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Down)
+#define FillZRLEWindow CONCAT3E(FillZRLEWindow,REALBPP,Down)
+#define RLEKernel(name) CONCAT3E(name,REALBPP,Down)
 #else
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Up)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Up)
+#define FillZRLEWindow CONCAT3E(FillZRLEWindow,REALBPP,Up)
+#define RLEKernel(name) CONCAT3E(name,REALBPP,Up)
 #endif
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 #define CARDREALBPP CONCAT3E(uint,REALBPP,_t)
+#define RLEReadCPixel RLEKernel(RLEReadCPixel)
+#define RLEReadPalette RLEKernel(RLEReadPalette)
+#define RLECopyTile RLEKernel(RLECopyTile)
+#define RLEUnpackPalette RLEKernel(RLEUnpackPalette)
+#define RLEFillRun RLEKernel(RLEFillRun)
 
 #define ENDIAN_LITTLE 0
 #define ENDIAN_BIG 1
@@ -80,22 +91,92 @@ static int HandleZRLETile(rfbClient* client,
 	uint8_t* buffer,size_t buffer_length,
 	int x,int y,int w,int h);
 
+/*
+ * Upper bound of the encoded size of one tile: plain RLE with runs of one
+ * pixel (a colour and a length byte per pixel), or a palette plus two
+ * bytes per pixel for palette RLE, whichever is larger, plus the type.
+ */
+#define ZRLE_MAX_TILE_SIZE (1 + rfbZRLETileWidth * rfbZRLETileHeight * (REALBPP / 8 + 1) + 128 * (REALBPP / 8))
+
+/*
+ * Inflates more data into the window until it holds at least "need" bytes
+ * after "start", or the rectangle's data is exhausted. Consumed bytes in
+ * front of "start" are dropped first. Returns FALSE on errors.
+ */
+static rfbBool
+FillZRLEWindow (rfbClient* client, int* remaining,
+	int* start, int* end, int need)
+{
+	int inflateResult, toRead;
+
+	if (*end - *start >= need)
+		return TRUE;
+
+	/* move the unconsumed bytes to the front */
+	if (*start > 0) {
+		memmove(client->raw_buffer, client->raw_buffer + *start, *end - *start);
+		*end -= *start;
+		*start = 0;
+	}
+
+	while (*end < need) {
+		if (client->decompStream.avail_in == 0) {
+			if (*remaining <= 0)
+				break;
+
+			toRead = *remaining > RFB_BUFFER_SIZE ? RFB_BUFFER_SIZE : *remaining;
+
+			/* Fill the buffer, obtaining data from the server. */
+			if (!ReadFromRFBServer(client, client->buffer,toRead))
+				return FALSE;
+
+			client->decompStream.next_in  = ( Bytef * )client->buffer;
+			client->decompStream.avail_in = toRead;
+			*remaining -= toRead;
+		}
+
+		client->decompStream.next_out  = ( Bytef * )client->raw_buffer + *end;
+		client->decompStream.avail_out = client->raw_buffer_size - *end;
+
+		inflateResult = inflate( &client->decompStream, Z_SYNC_FLUSH );
+
+		/* We never supply a dictionary for compression. */
+		if ( inflateResult == Z_NEED_DICT ) {
+			rfbClientLog("zlib inflate needs a dictionary!\n");
+			return FALSE;
+		}
+		/* no progress possible: wait for more input */
+		if ( inflateResult == Z_BUF_ERROR && client->decompStream.avail_in == 0 )
+			inflateResult = Z_OK;
+		if ( inflateResult != Z_OK ) {
+			rfbClientLog(
+					"zlib inflate returned error: %d, msg: %s\n",
+					inflateResult,
+					client->decompStream.msg);
+			return FALSE;
+		}
+
+		*end = client->raw_buffer_size - client->decompStream.avail_out;
+	}
+
+	return TRUE;
+}
+
 static rfbBool
 HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 {
 	rfbZRLEHeader header;
 	int remaining;
 	int inflateResult;
-	int toRead;
-	int min_buffer_size = rw * rh * (REALBPP / 8) * 2;
-
-	/* First make sure we have a large enough raw buffer to hold the
-	 * decompressed data.  In practice, with a fixed REALBPP, fixed frame
-	 * buffer size and the first update containing the entire frame
-	 * buffer, this buffer allocation should only happen once, on the
-	 * first update.
+	int start = 0, end = 0;
+	int window_size = 2 * ZRLE_MAX_TILE_SIZE;
+	int i, j;
+
+	/* Tiles are decoded as soon as they are inflated, so the raw buffer
+	 * only needs to hold a window of a few tiles, independent of the
+	 * rectangle size. It is shared with other decoders and allocated once.
 	 */
-	if ( client->raw_buffer_size < min_buffer_size) {
+	if ( client->raw_buffer_size < window_size) {
 
 		if ( client->raw_buffer != NULL ) {
 
@@ -103,8 +184,12 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 
 		}
 
-		client->raw_buffer_size = min_buffer_size;
+		client->raw_buffer_size = window_size;
 		client->raw_buffer = (char*) malloc( client->raw_buffer_size );
+		if ( client->raw_buffer == NULL ) {
+			client->raw_buffer_size = -1;
+			return FALSE;
+		}
 
 	}
 
@@ -123,7 +208,7 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 	/* Initialize the decompression stream structures on the first invocation. */
 	if ( client->decompStreamInited == FALSE ) {
 
-		inflateResult = inflateInit( &client->decompStream );
+		inflateResult = rfbInflateInit( client, &client->decompStream );
 
 		if ( inflateResult != Z_OK ) {
 			rfbClientLog(
@@ -137,101 +222,43 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 
 	}
 
-	inflateResult = Z_OK;
-
-	/* Process buffer full of data until no more to process, or
-	 * some type of inflater error, or Z_STREAM_END.
-	 */
-	while (( remaining > 0 ) &&
-			( inflateResult == Z_OK )) {
-
-		if ( remaining > RFB_BUFFER_SIZE ) {
-			toRead = RFB_BUFFER_SIZE;
-		}
-		else {
-			toRead = remaining;
-		}
+	for(j=0; j<rh; j+=rfbZRLETileHeight)
+		for(i=0; i<rw; i+=rfbZRLETileWidth) {
+			int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
+			int subHeight=(j+rfbZRLETileHeight>rh)?rh-j:rfbZRLETileHeight;
+			int result;
 
-		/* Fill the buffer, obtaining data from the server. */
-		if (!ReadFromRFBServer(client, client->buffer,toRead))
-			return FALSE;
+			/* make sure the whole tile is in the window */
+			if (!FillZRLEWindow(client, &remaining, &start, &end, ZRLE_MAX_TILE_SIZE))
+				return FALSE;
 
-		client->decompStream.next_in  = ( Bytef * )client->buffer;
-		client->decompStream.avail_in = toRead;
+			result=HandleZRLETile(client,(uint8_t *)client->raw_buffer+start,end-start,rx+i,ry+j,subWidth,subHeight);
 
-		/* Need to uncompress buffer full. */
-		inflateResult = inflate( &client->decompStream, Z_SYNC_FLUSH );
+			if(result<0) {
+				/* skip the rest of the rectangle, but keep the stream in sync */
+				rfbClientLog("ZRLE decoding failed (%d)\n",result);
+				j=rh;
+				break;
+			}
 
-		/* We never supply a dictionary for compression. */
-		if ( inflateResult == Z_NEED_DICT ) {
-			rfbClientLog("zlib inflate needs a dictionary!\n");
-			return FALSE;
-		}
-		if ( inflateResult < 0 ) {
-			rfbClientLog(
-					"zlib inflate returned error: %d, msg: %s\n",
-					inflateResult,
-					client->decompStream.msg);
-			return FALSE;
+			start+=result;
 		}
 
-		/* Result buffer allocated to be at least large enough.  We should
-		 * never run out of space!
-		 */
-		if (( client->decompStream.avail_in > 0 ) &&
-				( client->decompStream.avail_out <= 0 )) {
-			rfbClientLog("zlib inflate ran out of space!\n");
+	/* Consume what is left of the rectangle's data (usually just the
+	 * flush marker) so the stream stays in sync for the next one.
+	 */
+	while (remaining > 0 || client->decompStream.avail_in > 0) {
+		start = end = 0;
+		if (!FillZRLEWindow(client, &remaining, &start, &end, client->raw_buffer_size))
 			return FALSE;
-		}
-
-		remaining -= toRead;
-
-	} /* while ( remaining > 0 ) */
-
-	if ( inflateResult == Z_OK ) {
-		char* buf=client->raw_buffer;
-		int i,j;
-
-		remaining = client->raw_buffer_size-client->decompStream.avail_out;
-
-		for(j=0; j<rh; j+=rfbZRLETileHeight)
-			for(i=0; i<rw; i+=rfbZRLETileWidth) {
-				int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
-				int subHeight=(j+rfbZRLETileHeight>rh)?rh-j:rfbZRLETileHeight;
-				int result=HandleZRLETile(client,(uint8_t *)buf,remaining,rx+i,ry+j,subWidth,subHeight);
-
-				if(result<0) {
-					rfbClientLog("ZRLE decoding failed (%d)\n",result);
-return TRUE;
-					return FALSE;
-				}
-
-				buf+=result;
-				remaining-=result;
-			}
-	}
-	else {
-
-		rfbClientLog(
-				"zlib inflate returned error: %d, msg: %s\n",
-				inflateResult,
-				client->decompStream.msg);
-		return FALSE;
-
+		if (end == 0 && remaining == 0)
+			break;
 	}
 
 	return TRUE;
 }
 
-#if REALBPP!=BPP && defined(UNCOMP) && UNCOMP!=0
-#if UNCOMP>0
-#define UncompressCPixel(pointer) ((*(CARDBPP*)pointer)>>UNCOMP)
-#else
-#define UncompressCPixel(pointer) ((*(CARDBPP*)pointer)<<(-(UNCOMP)))
-#endif
-#else
-#define UncompressCPixel(pointer) (*(CARDBPP*)pointer)
-#endif
+#undef ZRLE_MAX_TILE_SIZE
 
 static int HandleZRLETile(rfbClient* client,
 		uint8_t* buffer,size_t buffer_length,
@@ -266,74 +293,47 @@ static int HandleZRLETile(rfbClient* client,
 		  }else
 #endif
 		{
-#if REALBPP!=BPP
-			int i,j;
-
 			if(1+w*h*REALBPP/8>buffer_length) {
 				rfbClientLog("expected %d bytes, got only %d (%dx%d)\n",1+w*h*REALBPP/8,buffer_length,w,h);
 				return -3;
 			}
 
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width)
-				for(i=x; i<x+w; i++,buffer+=REALBPP/8)
-					((CARDBPP*)client->frameBuffer)[j+i] = UncompressCPixel(buffer);
-#else
-			client->GotBitmap(client, buffer, x, y, w, h);
+			RLECopyTile(client, buffer, x, y, w, h);
 			buffer+=w*h*REALBPP/8;
-#endif
 		}
 		else if( type == 1 ) /* solid */
 		{
-			CARDBPP color = UncompressCPixel(buffer);
-
 			if(1+REALBPP/8>buffer_length)
 				return -4;
-				
-			client->GotFillRect(client, x, y, w, h, color);
+
+			client->GotFillRect(client, x, y, w, h, RLEReadCPixel(buffer));
 
 			buffer+=REALBPP/8;
 
 		}
 		else if( type <= 127 ) /* packed Palette */
 		{
-			CARDBPP palette[16];
-			int i,j,shift,
-				bpp=(type>4?(type>16?8:4):(type>2?2:1)),
-				mask=(1<<bpp)-1,
+			CARDBPP palette[128];
+			int bpp=(type>4?(type>16?8:4):(type>2?2:1)),
 				divider=(8/bpp);
 
 			if(1+type*REALBPP/8+((w+divider-1)/divider)*h>buffer_length)
 				return -5;
 
-			/* read palette */
-			for(i=0; i<type; i++,buffer+=REALBPP/8)
-				palette[i] = UncompressCPixel(buffer);
-
-			/* read palettized pixels */
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width) {
-				for(i=x,shift=8-bpp; i<x+w; i++) {
-					((CARDBPP*)client->frameBuffer)[j+i] = palette[((*buffer)>>shift)&mask];
-					shift-=bpp;
-					if(shift<0) {
-						shift=8-bpp;
-						buffer++;
-					}
-				}
-				if(shift<8-bpp)
-					buffer++;
-			}
-
+			buffer=(uint8_t*)RLEReadPalette(palette, buffer, type);
+			buffer=(uint8_t*)RLEUnpackPalette(client, buffer, palette, bpp, x, y, w, h);
 		}
 		/* case 17 ... 127: not used, but valid */
 		else if( type == 128 ) /* plain RLE */
 		{
 			int i=0,j=0;
 			while(j<h) {
-				int color,length;
+				CARDBPP color;
+				int length;
 				/* read color */
 				if(buffer+REALBPP/8+1>buffer_end)
 					return -7;
-				color = UncompressCPixel(buffer);
+				color = RLEReadCPixel(buffer);
 				buffer+=REALBPP/8;
 				/* read run length */
 				length=1;
@@ -345,16 +345,7 @@ static int HandleZRLETile(rfbClient* client,
 				}
 				length+=*buffer;
 				buffer++;
-				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
-					length--;
-					i++;
-					if(i>=w) {
-						i=0;
-						j++;
-					}
-				}
-				if(length>0)
+				if(RLEFillRun(client, x, y, w, h, &i, &j, color, length)>0)
 					rfbClientLog("Warning: possible ZRLE corruption\n");
 			}
 
@@ -371,13 +362,12 @@ static int HandleZRLETile(rfbClient* client,
 			if(2+(type-128)*REALBPP/8>buffer_length)
 				return -9;
 
-			/* read palette */
-			for(i=0; i<type-128; i++,buffer+=REALBPP/8)
-				palette[i] = UncompressCPixel(buffer);
+			buffer=(uint8_t*)RLEReadPalette(palette, buffer, type-128);
 			/* read palettized pixels */
 			i=j=0;
 			while(j<h) {
-				int color,length;
+				CARDBPP color;
+				int length;
 				/* read color */
 				if(buffer>=buffer_end)
 					return -10;
@@ -397,16 +387,7 @@ static int HandleZRLETile(rfbClient* client,
 					length+=*buffer;
 				}
 				buffer++;
-				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
-					length--;
-					i++;
-					if(i>=w) {
-						i=0;
-						j++;
-					}
-				}
-				if(length>0)
+				if(RLEFillRun(client, x, y, w, h, &i, &j, color, length)>0)
 					rfbClientLog("Warning: possible ZRLE corruption\n");
 			}
 		}
@@ -419,7 +400,13 @@ static int HandleZRLETile(rfbClient* client,
 #undef CARDREALBPP
 #undef HandleZRLE
 #undef HandleZRLETile
-#undef UncompressCPixel
+#undef FillZRLEWindow
+#undef RLEKernel
+#undef RLEReadCPixel
+#undef RLEReadPalette
+#undef RLECopyTile
+#undef RLEUnpackPalette
+#undef RLEFillRun
 
 #endif
 
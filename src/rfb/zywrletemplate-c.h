@@ -69,6 +69,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define ZYWRLE_RGBYUV __RFB_CONCAT3E(zywrleRGBYUV,BPP,END_FIX)
 #define ZYWRLE_YUVRGB __RFB_CONCAT3E(zywrleYUVRGB,BPP,END_FIX)
+#define ZYWRLE_INVYUVRGB __RFB_CONCAT3E(zywrleInvYUVRGB,BPP,END_FIX)
 #define ZYWRLE_YMASK __RFB_CONCAT2E(ZYWRLE_YMASK,BPP)
 #define ZYWRLE_UVMASK __RFB_CONCAT2E(ZYWRLE_UVMASK,BPP)
 #define ZYWRLE_LOAD_PIXEL __RFB_CONCAT2E(ZYWRLE_LOAD_PIXEL,BPP)
@@ -374,7 +375,91 @@ static InlineX void WaveletLevel(int* data, int size, int l, int SkipPixel)
 		pX0 += s;
 	}
 }
-#define InvWaveletLevel(d,s,l,pix) WaveletLevel(d,s,l,pix)
+
+/*
+ Packed (SWAR) inverse transform.
+
+ Harr() works on the three coefficient bytes of an int independently and
+ all of its arithmetic is modulo 256 (only bit 7 of each byte is tested),
+ so the three bytes can be transformed at once with carry-free byte
+ adds/subtracts on the whole word and the branches replaced by byte masks.
+ ARMv6 has these adds/subtracts as single instructions (UADD8/USUB8).
+ Elsewhere they take several masks each, which makes the packed form
+ slower than three calls of Harr(), so it is only used with SIMD32.
+ The top byte is left untouched.
+ InvWavelet() and ZYWRLE_YUVRGB() are kept as the reference; define
+ ZYWRLE_SCALAR_DECODE to decode with them.
+*/
+#if defined(__ARM_FEATURE_SIMD32) || defined(__ARM_FEATURE_SAT)
+#include <arm_acle.h>
+#endif
+#if defined(__ARM_FEATURE_SIMD32)
+#define ZYWRLE_ADD8(a,b) __uadd8(a,b)
+#define ZYWRLE_SUB8(a,b) __usub8(a,b)
+#else
+#define ZYWRLE_ADD8(a,b) ((((a)&0x7F7F7F7F)+((b)&0x7F7F7F7F))^(((a)^(b))&0x80808080))
+#define ZYWRLE_SUB8(a,b) ((((a)|0x80808080)-((b)&0x7F7F7F7F))^(((a)^~(b))&0x80808080))
+#endif
+/* 0xFF in every byte whose bit 7 is set in x */
+#define ZYWRLE_BYTEMASK(x) ((((x)&0x80808080)>>7)*0xFF)
+
+static InlineX void HarrPacked(unsigned int* pX0, unsigned int* pX1)
+{
+	unsigned int X0 = *pX0, X1 = *pX1;
+	unsigned int sum = ZYWRLE_ADD8(X1, X0);
+	unsigned int dif = ZYWRLE_SUB8(X0, X1);
+	unsigned int differ = ZYWRLE_BYTEMASK(X0 ^ X1);
+	unsigned int mX0 = ZYWRLE_BYTEMASK(~(sum ^ X1));	/* |X1| > |X0| */
+	unsigned int mX1 = ZYWRLE_BYTEMASK(~(dif ^ X0));	/* |X0| > |X1| */
+	unsigned int H, L;
+
+	/* differ sign: L = X1+X0, H = X0-L or X0; same sign: H = X0-X1, L = X1+H or X1 */
+	H = (differ & ((ZYWRLE_SUB8(X0, sum) & mX0) | (X0 & ~mX0))) | (~differ & dif);
+	L = (differ & sum) | (~differ & ((ZYWRLE_ADD8(X1, dif) & mX1) | (X1 & ~mX1)));
+	*pX0 = (L & 0x00FFFFFF) | (X0 & 0xFF000000);
+	*pX1 = (H & 0x00FFFFFF) | (X1 & 0xFF000000);
+}
+
+static InlineX void HarrBytes(unsigned int* pX0, unsigned int* pX1)
+{
+	Harr((signed char*)pX0, (signed char*)pX1);
+	Harr((signed char*)pX0+1, (signed char*)pX1+1);
+	Harr((signed char*)pX0+2, (signed char*)pX1+2);
+}
+
+#if defined(__ARM_FEATURE_SIMD32)
+#define InvHarr(pX0,pX1) HarrPacked(pX0,pX1)
+#else
+#define InvHarr(pX0,pX1) HarrBytes(pX0,pX1)
+#endif
+
+/*
+ One level of the inverse transform in a single pass.
+ At level l the vertical and the horizontal step both pair coefficients
+ 1<<l apart on the grid of every (1<<l)th row and column, so the 2x2 blocks
+ of that grid don't share coefficients: transforming a block's two columns,
+ then its two rows, gives what InvWavelet() gets from a vertical pass over
+ the whole tile followed by a horizontal one.
+*/
+static InlineX void InvWaveletLevel2D(int* pBuf, int width, int height, int l)
+{
+	unsigned int* pRow = (unsigned int*)pBuf;
+	unsigned int* pEnd = pRow+height*width;
+	unsigned int* pLine;
+	unsigned int* p;
+	int s = 1<<l;
+	int sw = s*width;
+
+	for (; pRow < pEnd; pRow += 2*sw) {
+		pLine = pRow+width;
+		for (p = pRow; p < pLine; p += 2*s) {
+			InvHarr(p, p+sw);
+			InvHarr(p+s, p+s+sw);
+			InvHarr(p, p+s);
+			InvHarr(p+sw, p+sw+s);
+		}
+	}
+}
 
 #ifdef ZYWRLE_ENCODE
 #  ifndef ZYWRLE_QUANTIZE
@@ -512,14 +597,14 @@ static InlineX void InvWavelet(int* pBuf, int width, int height, int level)
 		pEnd = pBuf+width;
 		s = 1<<l;
 		while (pTop < pEnd) {
-			InvWaveletLevel(pTop, height,l, width);
+			WaveletLevel(pTop, height,l, width);
 			pTop += s;
 		}
 		pTop = pBuf;
 		pEnd = pBuf+height*width;
 		s = width<<l;
 		while (pTop < pEnd) {
-			InvWaveletLevel(pTop, width, l, 1);
+			WaveletLevel(pTop, width, l, 1);
 			pTop += s;
 		}
 	}
@@ -553,6 +638,10 @@ static InlineX void InvWavelet(int* pBuf, int width, int height, int level)
    V = R-G (-256<=V<=255)
 */
 #define ROUND(x) (((x)<0)?0:(((x)>255)?255:(x)))
+#if defined(__ARM_FEATURE_SAT) && !defined(ZYWRLE_SCALAR_DECODE)
+#undef ROUND
+#define ROUND(x) __usat(x,8)	/* one USAT instead of two compares */
+#endif
 	/* RCT is N-bit RGB to N-bit Y and N+1-bit UV.
 	 For make Same N-bit, UV is lossy.
 	 More exact PLHarr, we reduce to odd range(-127<=x<=127). */
@@ -584,6 +673,11 @@ static InlineX void InvWavelet(int* pBuf, int width, int height, int level)
 	B = ROUND(B);	\
 	R = ROUND(R);	\
 }
+#define ZYWRLE_COEFF_TO_PIXEL(pSrc,pDst) { \
+	ZYWRLE_LOAD_COEFF((pSrc),V,Y,U);	\
+	ZYWRLE_YUVRGB1(R,G,B,Y,U,V);	\
+	ZYWRLE_SAVE_PIXEL((pDst),R,G,B);	\
+}
 
 /*
  coefficient packing/unpacking stuffs.
@@ -747,6 +841,37 @@ static InlineX void ZYWRLE_YUVRGB(int* pBuf, PIXEL_T* data, int width, int heigh
 		data += scanline-width;
 	}
 }
+
+/*
+ The last level of the inverse transform and the colour conversion in one
+ pass: each 2x2 block is converted as soon as InvWaveletLevel2D() would
+ have finished it, while it is still in registers.
+*/
+static InlineX void ZYWRLE_INVYUVRGB(int* pBuf, PIXEL_T* data, int width, int height, int scanline) {
+	int R, G, B;
+	int Y, U, V;
+	unsigned int* p = (unsigned int*)pBuf;
+	unsigned int* pEnd = p+height*width;
+	unsigned int* pLine;
+
+	while (p < pEnd) {
+		pLine = p+width;
+		while (p < pLine) {
+			InvHarr(p, p+width);
+			InvHarr(p+1, p+width+1);
+			InvHarr(p, p+1);
+			InvHarr(p+width, p+width+1);
+			ZYWRLE_COEFF_TO_PIXEL(p, data);
+			ZYWRLE_COEFF_TO_PIXEL(p+1, data+1);
+			ZYWRLE_COEFF_TO_PIXEL(p+width, data+scanline);
+			ZYWRLE_COEFF_TO_PIXEL(p+width+1, data+scanline+1);
+			p += 2;
+			data += 2;
+		}
+		p += width;
+		data += 2*scanline-width;
+	}
+}
 #endif
 
 #ifdef ZYWRLE_ENCODE
@@ -814,8 +939,15 @@ PIXEL_T* ZYWRLE_SYNTHESIZE(PIXEL_T* dst, PIXEL_T* src, int w, int h, int scanlin
 		}
 	}
 	ZYWRLE_SAVE_UNALIGN(src,*(PIXEL_T*)pTop=*src;)
+#ifdef ZYWRLE_SCALAR_DECODE
 	InvWavelet(pBuf, w, h, level);
 	ZYWRLE_YUVRGB(pBuf, dst, w, h, scanline);
+#else
+	/* level is at least 1, and w and h are multiples of 1<<level */
+	for (l = level - 1; l > 0; l--)
+		InvWaveletLevel2D(pBuf, w, h, l);
+	ZYWRLE_INVYUVRGB(pBuf, dst, w, h, scanline);
+#endif
 	ZYWRLE_LOAD_UNALIGN(dst,*pData=*(PIXEL_T*)pTop;)
 	return src;
 }
@@ -824,5 +956,6 @@ PIXEL_T* ZYWRLE_SYNTHESIZE(PIXEL_T* dst, PIXEL_T* src, int w, int h, int scanlin
 
 #undef ZYWRLE_RGBYUV
 #undef ZYWRLE_YUVRGB
+#undef ZYWRLE_INVYUVRGB
 #undef ZYWRLE_LOAD_PIXEL
 #undef ZYWRLE_SAVE_PIXEL
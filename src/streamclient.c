@@ -11,21 +11,66 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <string.h>
+#include <math.h>
 #include <curl/curl.h>
 #include <rfb/rfbclient.h> // only for logging functions
 #include "httpstatuscodes_c.h"
 #include "streamclient.h"
 #include "decoder.h"
 #include "mp3decoder.h"
-//#include "opusdecoder.h"
+#include "opusdecoder.h"
+#include "pcmdecoder.h"
+#include "linearpool.h"
 
 /* Channel to play music on */
 #define CHANNEL	0x08
 
-typedef struct _waveBuffer {
-	struct _waveBuffer *next;
-	ndspWaveBuf buf;
-} waveBuffer;
+/* Decoded audio goes into a ring of wave buffers in a single block of
+ * linear memory, allocated once per stream. The decoder writes straight
+ * into the slot at wave_fill, which is queued as soon as it is full. */
+#define WAVEBUF_SLOTS		64
+#define WAVEBUF_PER_SECOND	50	// slots per second of audio
+
+/* The ring works as a jitter buffer. Playback starts once it holds the
+ * target latency, which follows the measured arrival jitter, and an
+ * underrun is bridged by a faded repeat of the last slot before buffering
+ * again. Audio fed by the VNC session is paced by the server: clock drift
+ * is taken up by playing slightly faster or slower, and what arrives far
+ * too late is dropped. An HTTP stream may come faster than real time; it
+ * is decoded STREAM_AHEAD_MS ahead at most, the rest is left waiting in
+ * curl, and none of it is dropped. */
+#define JITTER_MIN_MS		80
+#define JITTER_MAX_MS		150
+#define JITTER_LATE_MS		(2 * JITTER_MAX_MS)	// drop fed audio beyond this
+#define JITTER_MAX_SKEW		0.005f	// playback rate correction, +-0.5%
+#define STREAM_AHEAD_MS		1000
+
+/* Fetching, decoding and queueing run on a thread of their own. Audio
+ * from the VNC connection is fed to it by the session instead. */
+#define STREAM_STACK_SIZE	(64 * 1024)
+#define STREAM_POLL_MS		5	// longest sleep of the stream thread
+#define STREAM_MAX_MSGS		4
+
+// thread variables
+static Thread			stream_tid = NULL;
+static volatile int		stream_quit = 0;
+static volatile int		stream_ended = 0;
+
+// The stream thread must not log itself, as logging draws on the screen.
+// It leaves its messages for stream_health() to print, and a snapshot of
+// its statistics for stream_get_stats().
+static LightLock		msg_lock;
+static struct {
+	int err;
+	char text[128];
+} msgs[STREAM_MAX_MSGS];
+static int				nmsgs = 0;
+static stream_stats		published_stats;
+
+// audio fed by the VNC session, guarded by feed_lock
+static LightLock		feed_lock;
+static int				feed_arrived = 0;	// data fed since the last round
+static u32				feed_overruns = 0;	// data dropped for lack of room
 
 // CURL variables
 static CURL				*curl = NULL;
@@ -34,90 +79,335 @@ static int				still_running = 0;
 static int				curl_paused = 0;
 
 // audio / ndsp variables
-static waveBuffer		*waveBuf_tail = NULL;
-static waveBuffer		*waveBuf_head = NULL;
+static ndspWaveBuf		waveBuf[WAVEBUF_SLOTS];
+static int16_t			*waveData = NULL;
+static int				wave_play = 0;		// oldest queued slot
+static int				wave_fill = 0;		// slot being filled
+static int				wave_queued = 0;	// slots queued for playing
+static u32				wave_filled = 0;	// samples in the slot being filled
+static u32				wave_slot_samples = 0;
 static u32				queuedSamples = 0;
 static int				ndsp_channels = 0;
 static int				ndsp_rate = 0;
-static int				max_wavbuf_size = 0;
+
+// jitter buffer variables
+static int				sound_live = 0;		// fed by the VNC session
+static int				sound_playing = 0;	// 0 while buffering
+static int				sound_concealed = 0;	// an underrun is being bridged
+static int				sound_dropping = 0;	// catching up on late audio
+static u64				arrival_tick = 0;	// last data from the server
+static u64				arrival_samples = 0;	// decodedSamples at that time
+static float			jitter_ms = 0;		// mean deviation
+static float			jitter_peak = 0;	// slowly decaying maximum
+static float			avg_depth = 0;		// in samples
+static float			rate_skew = 0;
+static float			drift_skew = 0;		// integral part of rate_skew
+static u32				underruns = 0;
+static u32				skippedSamples = 0;
+
+// statistics, logged when the stream stops
+static u32				sound_allocs = 0;	// linear memory allocations
+static u64				decodedSamples = 0;
+static u64				decodeTicks = 0;
 
 // decoder specific variables
 static audioDecoder		decoder={0};
 static int				stream_bitrate=0;
 static char				*stream_type=NULL;
 
-void sound_close()
+static void stream_msg(int err, const char *format, ...)
+{
+	va_list argptr;
+
+	LightLock_Lock(&msg_lock);
+	if (nmsgs < STREAM_MAX_MSGS) {
+		va_start(argptr, format);
+		vsnprintf(msgs[nmsgs].text, sizeof(msgs[nmsgs].text), format, argptr);
+		va_end(argptr);
+		msgs[nmsgs++].err = err;
+	}
+	LightLock_Unlock(&msg_lock);
+}
+
+static void stream_flush_msgs()
+{
+	int i;
+
+	LightLock_Lock(&msg_lock);
+	for (i = 0; i < nmsgs; i++) {
+		if (msgs[i].err) rfbClientErr("%s", msgs[i].text);
+		else rfbClientLog("%s", msgs[i].text);
+	}
+	nmsgs = 0;
+	LightLock_Unlock(&msg_lock);
+}
+
+static void sound_close()
 {
 	// stop playing
 	ndspChnReset(CHANNEL);
 	ndspChnWaveBufClear(CHANNEL);
-	// free all sound buffers
-	while (waveBuf_tail) {
-		waveBuffer *next = waveBuf_tail->next;
-		if (waveBuf_tail->buf.data_vaddr) linearFree(waveBuf_tail->buf.data_pcm8);
-		free(waveBuf_tail);
-		waveBuf_tail=next;
-	}
-	waveBuf_head=NULL;
+	// free the sound buffers
+	if (waveData) linear_free(waveData);
+	waveData = NULL;
+	wave_play = wave_fill = wave_queued = 0;
+	wave_filled = wave_slot_samples = 0;
 	queuedSamples = ndsp_channels = ndsp_rate = 0;
+	sound_playing = sound_concealed = sound_dropping = 0;
+	arrival_tick = arrival_samples = 0;
+	jitter_ms = jitter_peak = avg_depth = rate_skew = drift_skew = 0;
+	underruns = skippedSamples = 0;
+	memset(&published_stats, 0, sizeof(published_stats));
 }
 
-static void sound_open(long rate, int channels)
+static int sound_open(long rate, int channels)
 {
-	max_wavbuf_size = rate; // 1 second max delay
+	int i;
+
+	wave_slot_samples = (rate + WAVEBUF_PER_SECOND - 1) / WAVEBUF_PER_SECOND;
+	waveData = linear_alloc(WAVEBUF_SLOTS * wave_slot_samples * channels * sizeof(int16_t), LINEAR_AUDIO);
+	if (!waveData) {
+		stream_msg(1, "cannot allocate audio buffers");
+		return -1;
+	}
+	sound_allocs++;
+	memset(waveBuf, 0, sizeof(waveBuf));
+	for (i = 0; i < WAVEBUF_SLOTS; i++)
+		waveBuf[i].data_pcm16 = waveData + i * wave_slot_samples * channels;
 
 	ndspSetOutputMode(channels == 2 ? NDSP_OUTPUT_STEREO : NDSP_OUTPUT_MONO);
 	ndspChnSetInterp(CHANNEL, NDSP_INTERP_POLYPHASE);
 	ndspChnSetRate(CHANNEL, (float)rate);
 	ndspChnSetFormat(CHANNEL,
 		channels == 2 ? NDSP_FORMAT_STEREO_PCM16 : NDSP_FORMAT_MONO_PCM16);
+	ndspChnSetPaused(CHANNEL, true); // until the jitter buffer is filled
 	ndsp_channels = channels;
+	return 0;
 }
 
 static void sound_clean_buffers() {
-	// free played sound buffers
-	waveBuffer *w;
-	while (waveBuf_tail && waveBuf_tail->buf.status == NDSP_WBUF_DONE) {
-		w = waveBuf_tail->next;
-		if (waveBuf_tail->buf.data_vaddr) linearFree(waveBuf_tail->buf.data_pcm8);
-		queuedSamples -= waveBuf_tail->buf.nsamples;
-		free(waveBuf_tail);
-		waveBuf_tail = w;
+	// release played sound buffers
+	while (wave_queued && waveBuf[wave_play].status == NDSP_WBUF_DONE) {
+		queuedSamples -= waveBuf[wave_play].nsamples;
+		wave_play = (wave_play + 1) % WAVEBUF_SLOTS;
+		wave_queued--;
 	}
-	if (!waveBuf_tail) waveBuf_head=NULL;
 }
 
-static int sound_play(unsigned char *pbuf, size_t size)
+// returns the samples buffered, including the slot being filled
+static u32 sound_depth()
 {
-	waveBuffer *w;
-	w = calloc(1, sizeof(waveBuffer));
-	if (!w) {
-		rfbClientErr("alloc1 error");
-		return -1;
+	u32 depth = queuedSamples + wave_filled;
+	u32 pos;
+
+	if (sound_playing && wave_queued) {
+		pos = ndspChnGetSamplePos(CHANNEL);
+		depth -= pos < waveBuf[wave_play].nsamples ? pos : waveBuf[wave_play].nsamples;
 	}
-	w->buf.data_vaddr = linearAlloc(size);
-	if (!w->buf.data_vaddr) {
-		rfbClientErr("alloc2 error");
-		return -1;
+	return depth;
+}
+
+// returns 1 if the decoder may write more: fed audio may fill all slots,
+// an HTTP stream no more than STREAM_AHEAD_MS
+static int sound_room()
+{
+	if (wave_queued == WAVEBUF_SLOTS) return 0;
+	return sound_live || sound_depth() < STREAM_AHEAD_MS * ndsp_rate / 1000;
+}
+
+// returns where the decoder may write up to *size bytes, NULL if there is
+// no room
+static void *sound_buffer(int *size)
+{
+	if (!sound_room()) return NULL;
+	*size = (wave_slot_samples - wave_filled) * ndsp_channels * sizeof(int16_t);
+	return waveBuf[wave_fill].data_pcm16 + wave_filled * ndsp_channels;
+}
+
+// queues the slot being filled
+static void sound_submit()
+{
+	ndspWaveBuf *w = &waveBuf[wave_fill];
+
+	w->nsamples = wave_filled;
+	DSP_FlushDataCache(w->data_pcm16, wave_filled * ndsp_channels * sizeof(int16_t));
+	ndspChnWaveBufAdd(CHANNEL, w);
+	queuedSamples += wave_filled;
+	wave_fill = (wave_fill + 1) % WAVEBUF_SLOTS;
+	wave_queued++;
+	wave_filled = 0;
+}
+
+// queues the slot being filled once size more bytes make it full
+static void sound_play(size_t size)
+{
+	wave_filled += size / (ndsp_channels * sizeof(int16_t));
+	if (wave_filled < wave_slot_samples) return;
+
+	if (sound_dropping) {
+		skippedSamples += wave_filled;
+		wave_filled = 0;
+		return;
+	}
+	sound_submit();
+	sound_concealed = 0;
+}
+
+// queues the last slot again, fading out, to bridge an underrun
+static void sound_conceal()
+{
+	ndspWaveBuf *last = &waveBuf[(wave_fill + WAVEBUF_SLOTS - 1) % WAVEBUF_SLOTS];
+	int16_t *in = last->data_pcm16, *out = waveBuf[wave_fill].data_pcm16;
+	u32 i, n = last->nsamples * ndsp_channels;
+
+	for (i = 0; i < n; i++)
+		out[i] = in[i] * (int)(n - i) / (int)n;
+	wave_filled = last->nsamples;
+	sound_submit();
+}
+
+static int jitter_target_ms()
+{
+	int target = JITTER_MIN_MS + (int)jitter_peak;
+	return target < JITTER_MAX_MS ? target : JITTER_MAX_MS;
+}
+
+// measures the arrival jitter of the data fed to the decoder, comparing
+// the time since the last arrival with the audio that arrived then
+static void jitter_arrival()
+{
+	u64 now = svcGetSystemTick();
+	float d;
+
+	if (arrival_tick && ndsp_rate) {
+		d = (float)(now - arrival_tick) * 1000 / SYSCLOCK_ARM11 -
+			(float)(decodedSamples - arrival_samples) * 1000 / ndsp_rate;
+		jitter_ms += (fabsf(d) - jitter_ms) / 16;
+		jitter_peak = fabsf(d) > jitter_peak ? fabsf(d) : jitter_peak * 1023 / 1024;
+	}
+	arrival_tick = now;
+	arrival_samples = decodedSamples;
+}
+
+// runs the jitter buffer: releases played slots, starts and stops
+// playback, bridges underruns and corrects drift
+static void sound_update()
+{
+	u32 depth, target;
+	float err, skew;
+
+	if (!waveData) return;
+	sound_clean_buffers();
+	depth = sound_depth();
+	target = jitter_target_ms() * ndsp_rate / 1000;
+
+	if (!sound_playing) {
+		if (depth < target) return;
+		if (wave_filled) sound_submit();
+		ndspChnSetPaused(CHANNEL, false);
+		sound_playing = 1;
+		avg_depth = depth;
+		return;
+	}
+
+	if (!wave_queued) {
+		// ran dry, buffer up again
+		ndspChnSetPaused(CHANNEL, true);
+		sound_playing = sound_concealed = 0;
+		return;
+	}
+
+	// less than a slot left for the DSP: queue what there is, or bridge
+	if (depth - wave_filled < wave_slot_samples) {
+		if (wave_filled) {
+			sound_submit();
+			sound_concealed = 0;
+		} else if (!sound_concealed) {
+			sound_conceal();
+			sound_concealed = 1;
+			underruns++;
+		}
+	}
+
+	// play faster while the buffer is above its target and slower below
+	// it; the integral part settles at the drift between the clocks. An
+	// HTTP stream is read ahead instead, drift only changes how far, so
+	// it is played at its own rate
+	if (!sound_live) return;
+	avg_depth += ((float)depth - avg_depth) / 32;
+	err = (avg_depth - target) / target;
+	drift_skew += err * JITTER_MAX_SKEW / 1024;
+	if (drift_skew > JITTER_MAX_SKEW) drift_skew = JITTER_MAX_SKEW;
+	if (drift_skew < -JITTER_MAX_SKEW) drift_skew = -JITTER_MAX_SKEW;
+	skew = drift_skew + err * JITTER_MAX_SKEW;
+	if (skew > JITTER_MAX_SKEW) skew = JITTER_MAX_SKEW;
+	if (skew < -JITTER_MAX_SKEW) skew = -JITTER_MAX_SKEW;
+	if (fabsf(skew - rate_skew) >= JITTER_MAX_SKEW / 10) {
+		rate_skew = skew;
+		ndspChnSetRate(CHANNEL, ndsp_rate * (1 + rate_skew));
+	}
+
+	// too far behind to catch up by playing faster
+	if (depth > JITTER_LATE_MS * ndsp_rate / 1000) sound_dropping = 1;
+	else if (depth <= target) sound_dropping = 0;
+}
+
+// leaves the state of the jitter buffer for stream_get_stats(), called by
+// the stream thread after every round
+static void stream_publish_stats()
+{
+	stream_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	if (waveData && ndsp_rate) {
+		stats.depth_ms = (u64)sound_depth() * 1000 / ndsp_rate;
+		stats.target_ms = jitter_target_ms();
+		stats.jitter_ms = jitter_ms;
+		stats.underruns = underruns;
+		stats.skipped_ms = (u64)skippedSamples * 1000 / ndsp_rate;
+		stats.rate_skew = rate_skew;
 	}
-	memcpy((void *)w->buf.data_vaddr, pbuf, size);
-	w->buf.nsamples = size / (ndsp_channels * sizeof(int16_t));
-	ndspChnWaveBufAdd(CHANNEL, &(w->buf));
-	if (!waveBuf_tail) waveBuf_tail = w;
-	if (waveBuf_head) waveBuf_head->next = w;
-	waveBuf_head = w;
-	queuedSamples += w->buf.nsamples;
+	LightLock_Lock(&msg_lock);
+	published_stats = stats;
+	LightLock_Unlock(&msg_lock);
+}
+
+// decodes what has been fed until the decoder needs more data or the
+// ring is full; returns 0 on success, -1 on errors
+static int sound_decode()
+{
+	void *audio;
+	int size, done;
+
+	do {
+		if (!ndsp_rate) {
+			// find the stream format first
+			if (decoder.decode(NULL, 0) < 0) return -1;
+			if (decoder.info(&stream_type, &ndsp_rate, &ndsp_channels, &stream_bitrate) != 0)
+				return 0;
+			stream_msg(0, "Audio stream: %s %dkbps, %dHz, %d channels",stream_type, stream_bitrate, ndsp_rate, ndsp_channels);
+			if (sound_open(ndsp_rate, ndsp_channels) != 0) return -1;
+		}
+		if (!(audio = sound_buffer(&size))) return 0;
+		done = decoder.decode(audio, size);
+		if (done < 0) return -1;
+		sound_play(done);
+		decodedSamples += done / (ndsp_channels * sizeof(int16_t));
+	} while (done > 0);
 	return 0;
 }
 
 static size_t stream_write_callback(void *buffer, size_t size, size_t nmemb, void *userp) {
 //log_citra("enter %s",__func__);
-	unsigned char *audio;
-	int done;
+	u64 start = svcGetSystemTick();
+	int err;
 
-	// choke if we have already buffered enough
-	sound_clean_buffers();
-	if (queuedSamples > max_wavbuf_size) {
+	// decode what the decoder still holds, and choke while there is no
+	// room for more; curl keeps the data, so the decoder holds no more
+	// than one write ahead
+	sound_update();
+	if (decoder.init && sound_decode() != 0) return 0;
+	if (waveData && !sound_room()) {
 		curl_paused = 1;
 		return CURL_WRITEFUNC_PAUSE;
 	}
@@ -125,74 +415,130 @@ static size_t stream_write_callback(void *buffer, size_t size, size_t nmemb, voi
 	// do we have an encoder ready already?
 	if (decoder.init == NULL) {
 		if (mp3_checkmagic(buffer) == 0) mp3_create_decoder(&decoder);
-		//else if (opus_checkmagic(buffer) == 0) opus_create_decoder(&decoder);
+		else if (opus_checkmagic(buffer) == 0) opus_create_decoder(&decoder);
 		// ... add more decoders here
 		else return 0;
 		decoder.init();
 	}
 
 	// feed the decoder
+	jitter_arrival();
 	if (decoder.feed(buffer, size * nmemb) !=0)
 		return 0;
 
-	// retreive decoded data and play
-	do {
-		decoder.decode((void **)&audio, &done);
-//log_citra("decoder.decode set done to %d", done);
-		if (done < 0) return 0;
-		if (done > 0) {
-			if (!ndsp_rate) {
-				decoder.info(&stream_type, &ndsp_rate, &ndsp_channels, &stream_bitrate);
-				rfbClientLog("Audio stream: %s %dkbps, %dHz, %d channels",stream_type, stream_bitrate, ndsp_rate, ndsp_channels);
-				sound_open(ndsp_rate, ndsp_channels);
-			}
-			sound_play(audio, done);
-		}
-	} while (done > 0);
-	return size * nmemb;
+	// decode into the sound buffers
+	err = sound_decode();
+	decodeTicks += svcGetSystemTick() - start;
+	return err ? 0 : size * nmemb;
 }
 
 #define HTTP_MAX_REDIRECTS 50
 #define HTTP_TIMEOUT_SEC 15
 
-int stream_check_health() {
+// returns 1 once the transfer has ended, leaving a message if it failed
+static int stream_finished() {
 	CURLMsg *msg=NULL;
 	int msgs_left, return_code;
 	long int http_status_code;
 
-	if (still_running <= 0) {
-		// fresh disconnect?
-		if (mcurl) {
-			// was there an error?
-			do { // dump all messages
-				msg = curl_multi_info_read(mcurl, &msgs_left);
-				if (msg && msg->msg == CURLMSG_DONE) {
-					CURL *eh = msg->easy_handle;
-					return_code = msg->data.result;
-					if (return_code == CURLE_HTTP_RETURNED_ERROR) {
-						// Get HTTP status code
-						curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &http_status_code);
-						if(http_status_code!=200) {
-							rfbClientErr("audio stream HTTP error: %d %s", http_status_code, HttpStatus_reasonPhrase(http_status_code));
-						}
-					} else if (return_code != CURLE_OK) {
-						if (decoder.errstr && decoder.errstr()) {
-							rfbClientErr("%s error: %s", stream_type, decoder.errstr());
-						} else {
-							rfbClientErr("audio stream error: %s", curl_easy_strerror(return_code));
-						}
-					}
+	if (still_running > 0)
+		return 0;
+	// was there an error?
+	do { // dump all messages
+		msg = curl_multi_info_read(mcurl, &msgs_left);
+		if (msg && msg->msg == CURLMSG_DONE) {
+			CURL *eh = msg->easy_handle;
+			return_code = msg->data.result;
+			if (return_code == CURLE_HTTP_RETURNED_ERROR) {
+				// Get HTTP status code
+				curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &http_status_code);
+				if(http_status_code!=200) {
+					stream_msg(1, "audio stream HTTP error: %d %s", http_status_code, HttpStatus_reasonPhrase(http_status_code));
 				}
-			} while (msgs_left);
-			stop_stream();
+			} else if (return_code != CURLE_OK) {
+				if (decoder.errstr && decoder.errstr()) {
+					stream_msg(1, "%s error: %s", stream_type, decoder.errstr());
+				} else {
+					stream_msg(1, "audio stream error: %s", curl_easy_strerror(return_code));
+				}
+			}
 		}
+	} while (msgs_left);
+	return 1;
+}
+
+// one round of the stream thread for audio fed by the session
+static int stream_run_fed()
+{
+	u64 start = svcGetSystemTick();
+	int err;
+
+	sound_update();
+	LightLock_Lock(&feed_lock);
+	if (feed_arrived) jitter_arrival();
+	feed_arrived = 0;
+	err = sound_decode();
+	LightLock_Unlock(&feed_lock);
+	decodeTicks += svcGetSystemTick() - start;
+	if (err) {
+		stream_msg(1, "%s error: %s", stream_type, decoder.errstr() ? decoder.errstr() : "cannot decode");
 		return 1;
 	}
 	return 0;
 }
 
+// one round of the stream thread, returns 1 once the stream has ended
+static int stream_run()
+{
+	if (!mcurl) return stream_run_fed();
 
-int start_stream(char *url, char *username, char *password)
+	sound_update();
+	if (curl_paused) {
+		// decode what the decoder still holds before asking for more
+		if (sound_decode() != 0) {
+			stream_msg(1, "%s error: %s", stream_type, decoder.errstr() ? decoder.errstr() : "cannot decode");
+			return 1;
+		}
+		if (sound_room()) {
+			curl_paused = 0;
+			curl_easy_pause(curl, CURLPAUSE_CONT);
+		}
+		return 0;
+	}
+
+	curl_multi_perform(mcurl, &still_running);
+	return stream_finished();
+}
+
+static void stream_thread(void *arg)
+{
+	while (!stream_quit) {
+		if (stream_run()) break;
+		stream_publish_stats();
+		// sleep until there is data, but keep the jitter buffer running
+		if (mcurl) curl_multi_wait(mcurl, NULL, 0, STREAM_POLL_MS, NULL);
+		else svcSleepThread(STREAM_POLL_MS * 1000000LL);
+	}
+	stream_ended = 1;
+}
+
+// starts the stream thread, above the main thread, so that VNC updates
+// do not starve the audio
+static int stream_thread_start()
+{
+	s32 prio;
+
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	stream_tid = threadCreate(stream_thread, NULL, STREAM_STACK_SIZE, prio - 1, -2, false);
+	if (!stream_tid) {
+		rfbClientErr("cannot start the audio stream thread");
+		stream_ended = 1;
+		return -1;
+	}
+	return 0;
+}
+
+int stream_start(char *url, char *username, char *password)
 {
 	static char sysversion[32]={0};
 
@@ -200,6 +546,9 @@ int start_stream(char *url, char *username, char *password)
 		osGetSystemVersionDataString(NULL, NULL, sysversion, sizeof(sysversion));
 
 	rfbClientLog("Starting stream %s", url);
+	LightLock_Init(&msg_lock);
+	stream_quit = stream_ended = 0;
+	sound_live = 0;
 	ndspInit();
 	sound_close();
 
@@ -222,43 +571,89 @@ int start_stream(char *url, char *username, char *password)
 
 	mcurl = curl_multi_init();
 	curl_multi_add_handle(mcurl, curl);
-	curl_multi_perform(mcurl, &still_running);
-	return stream_check_health();
+
+	return stream_thread_start();
+}
+
+int stream_start_fed(int rate, int channels)
+{
+	rfbClientLog("Starting VNC audio");
+	LightLock_Init(&msg_lock);
+	LightLock_Init(&feed_lock);
+	stream_quit = stream_ended = 0;
+	feed_arrived = feed_overruns = 0;
+	sound_live = 1;
+	ndspInit();
+	sound_close();
+
+	pcm_create_decoder(&decoder, rate, channels);
+	if (decoder.init() != 0) {
+		rfbClientErr("cannot allocate the audio buffer");
+		stream_ended = 1;
+		return -1;
+	}
+	return stream_thread_start();
 }
 
-void stop_stream()
+void stream_feed(const void *data, int size)
 {
-	if (mcurl != NULL) {
+	if (!stream_tid || mcurl) return;
+	LightLock_Lock(&feed_lock);
+	if (decoder.feed((void *)data, size) != 0) feed_overruns++;
+	feed_arrived = 1;
+	LightLock_Unlock(&feed_lock);
+}
+
+void stream_stop()
+{
+	if (mcurl != NULL || decoder.init != NULL) {
+		// stop the stream thread
+		if (stream_tid) {
+			stream_quit = 1;
+			threadJoin(stream_tid, U64_MAX);
+			threadFree(stream_tid);
+			stream_tid = NULL;
+		}
+		stream_flush_msgs();
 		rfbClientLog("Audio stream stopped");
 		// stop curl
-		curl_multi_remove_handle(mcurl, curl);
-		curl_easy_cleanup(curl);
-		curl_multi_cleanup(mcurl);
-		mcurl = curl = NULL;
+		if (mcurl) {
+			curl_multi_remove_handle(mcurl, curl);
+			curl_easy_cleanup(curl);
+			curl_multi_cleanup(mcurl);
+			mcurl = curl = NULL;
+			curl_paused = still_running = 0;
+		}
+		if (feed_overruns)
+			rfbClientLog("Audio: %u VNC audio messages dropped", feed_overruns);
 		// stop ndsp
+		if (decodedSamples && ndsp_rate)
+			rfbClientLog("Audio: %u buffer allocations, %.2f ms CPU per second of audio, %u underruns, %lu ms dropped",
+				sound_allocs, (double)decodeTicks * 1000 / SYSCLOCK_ARM11 * ndsp_rate / decodedSamples,
+				underruns, (unsigned long)((u64)skippedSamples * 1000 / ndsp_rate));
 		sound_close();
 		ndspExit();
 		// stop decoder
 		if (decoder.close) decoder.close();
 		stream_type = (char*)(stream_bitrate = 0);
+		sound_allocs = decodedSamples = decodeTicks = 0;
 		bzero(&decoder,sizeof(decoder));
 	}
 }
 
-int run_stream()
+int stream_health()
 {
-	if (curl_paused) {
-		sound_clean_buffers();
-		if (queuedSamples < max_wavbuf_size) {
-			curl_paused = 0;
-			curl_easy_pause(curl, CURLPAUSE_CONT);
-		}
-		return stream_check_health();
-	}
+	stream_flush_msgs();
+	return stream_ended;
+}
 
-	if (still_running > 0) {
-		curl_multi_perform(mcurl, &still_running);
+void stream_get_stats(stream_stats *stats)
+{
+	if (!stream_tid) {
+		memset(stats, 0, sizeof(stream_stats));
+		return;
 	}
-
-	return stream_check_health();
+	LightLock_Lock(&msg_lock);
+	*stats = published_stats;
+	LightLock_Unlock(&msg_lock);
 }
@@ -6,6 +6,28 @@
  * Copyright 2020 Sebastian Weber
  */
 
-int start_stream(char *url, char *username, char *password);
-void stop_stream();
-int run_stream();
+typedef struct {
+	int depth_ms;		// audio buffered
+	int target_ms;		// latency the jitter buffer aims for
+	int jitter_ms;		// measured arrival jitter
+	int underruns;		// times the buffer ran dry
+	int skipped_ms;		// audio dropped to catch up
+	float rate_skew;	// playback rate correction, 0.001 is 0.1% faster
+} stream_stats;
+
+// starts fetching, decoding and playing a stream on a thread of its own;
+// returns 0 if the thread is running
+int stream_start(char *url, char *username, char *password);
+// starts playing signed 16-bit audio handed over with stream_feed(), e.g.
+// from the VNC connection; returns 0 if the thread is running
+int stream_start_fed(int rate, int channels);
+// queues audio for a stream started with stream_start_fed()
+void stream_feed(const void *data, int size);
+// stops the stream thread and releases everything
+void stream_stop();
+// prints what the stream thread has to report; returns non-zero once the
+// stream has ended, stream_stop() must be called then
+int stream_health();
+// copies the state of the jitter buffer as of the last round of the stream
+// thread, all zero while no stream is running
+void stream_get_stats(stream_stats *stats);
@@ -8,13 +8,17 @@
  
 #include <stdlib.h>
 #include <png.h>
+#include <zlib.h>
 #include <SDL/SDL.h>
 #include <3ds.h>
 #include <citro3d.h>
+#include <tex3ds.h>
 #include <rfb/rfbclient.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include "uibottom.h"
 #include "utilities.h"
+#include "linearpool.h"
 
 #define ENTER //log_citra("enter %s",__func__);
 #define DEF_TXT_COL COL_WHITE
@@ -123,6 +127,7 @@ typedef struct {
 	unsigned w;
 	unsigned h;
 	float fw,fh;
+	float ftop;	// texture row of the top edge, 0 unless loaded from the texture pack
 	C3D_Tex tex;
 } DS3_Image;
 
@@ -138,15 +143,13 @@ static DS3_Image keymask_spr;
 
 // dynamic sprites
 static DS3_Image message_spr;
-static DS3_Image menu_spr;
-static DS3_Image menu_spr;
 static DS3_Image qmenu_spr;
+static DS3_Image chars_spr;
 static DS3_Image whitepixel_spr;
 static DS3_Image blackpixel_spr;
 static DS3_Image uibvnc_spr;
 
 // SDL Surfaces
-SDL_Surface *menu_img=NULL;
 SDL_Surface *chars_img=NULL;
 static SDL_Surface *message_img=NULL;
 
@@ -162,6 +165,8 @@ static u8* uibvnc_buffer = NULL;
 static int uibvnc_pitch = 0;
 static u8* uibvnc_buffer_big = NULL;
 static int scaling_factor_bot=1;
+static int uibvnc_shared=0;	// uibvnc_buffer is the top screen surface, see uibvnc_mirror()
+static int uibvnc_stale=0;	// changed out of sight since the texture was made
 
 static Handle repaintRequired;
 static int uib_isinit=0;
@@ -194,9 +199,62 @@ extern void SDL_RequestCall(void(*callback)(void*), void *param);
 
 #define TEX_MIN_SIZE 64
 
+// converted textures are kept on SD if they are not in the texture pack
+#define TEX_CACHE_DIR "/3ds/TinyVNC/cache"
+
+typedef struct {
+	char magic[4];		// "TVT2"
+	u16 w, h;			// image
+	u16 hw, hh;			// texture
+	u32 srcsize;		// of the PNG it was converted from
+	u32 srccrc;			// CRC-32 of the PNG; romfs has no usable mtime
+} tex_cache_header;
+
+static struct {
+	int pack, cache, converted;
+} asset_stats;
+
 #define QMENU_WIDTH 256
 #define QMENU_HEIGHT 128
 
+// Log and menus are a grid of character cells. The rows form a ring, so
+// scrolling only moves text_top. The grid is drawn from the font atlas as
+// one batch of quads per color, rebuilt only when the text has changed.
+#define TEXT_COLS 40
+#define TEXT_ROWS 30
+#define TEXT_RUNS 32	// distinct colors drawn, further ones get the nearest of them
+#define TEXT_RGBA(c) ((c).r | (c).g << 8 | (c).b << 16 | (u32)(c).unused << 24)
+
+typedef struct {
+	u8 c;		// 0: empty
+	u32 fg;		// TEXT_RGBA
+	u32 bg;
+} text_cell;
+
+typedef struct {
+	float x, y, z;
+	float u, v;
+} text_vertex;
+
+typedef struct {
+	u32 color;
+	int first;	// vertex
+	int count;
+} text_run;
+
+// the main thread prints into the ring, the video thread copies it under
+// text_lock to draw it
+static text_cell text_ring[TEXT_ROWS][TEXT_COLS];
+static int text_top = 0;			// ring row shown on top
+static volatile int text_dirty = 1;
+static LightLock text_lock;
+static int text_lock_init = 0;
+static int text_merged = 0;			// a color has been drawn in another, for lack of runs
+static text_vertex *text_vbuf = NULL;	// in linear RAM, 6 vertices per quad
+static text_run text_bg[TEXT_RUNS], text_fg[TEXT_RUNS];
+static int text_nbg = 0, text_nfg = 0;
+static int text_yoff = 0;			// where the vertices were built for
+
 // key repeat functions for the simulated key repeat
 static int keydown = 0;
 static u32 key_ts = 0;
@@ -333,24 +391,38 @@ static void  drawImage( DS3_Image *img, int x, int y, int w, int h, int deg) {
 	// Draw a textured quad directly
 	C3D_ImmDrawBegin(GPU_TRIANGLE_STRIP);
 		C3D_ImmSendAttrib( x1, y1, 0.5f, 0.0f);	// v0 = position
-		C3D_ImmSendAttrib( 0.0f, 0.0f, 0.0f, 0.0f);	// v1 = texcoord0
+		C3D_ImmSendAttrib( 0.0f, img->ftop, 0.0f, 0.0f);	// v1 = texcoord0
 
 		C3D_ImmSendAttrib( x2, y2, 0.5f, 0.0f);
 		C3D_ImmSendAttrib( 0.0f, img->fh, 0.0f, 0.0f);
 
 		C3D_ImmSendAttrib( x3, y3, 0.5f, 0.0f);		// v0 = position
-		C3D_ImmSendAttrib( img->fw, 0.0f, 0.0f, 0.0f);
+		C3D_ImmSendAttrib( img->fw, img->ftop, 0.0f, 0.0f);
 
 		C3D_ImmSendAttrib( x4, y4, 0.5f, 0.0f);		// v0 = position
 		C3D_ImmSendAttrib( img->fw, img->fh, 0.0f, 0.0f);
 	C3D_ImmDrawEnd();
 }
 
+// textures come from citro3d, not from the pool; if one does not fit, the
+// buffers kept for reuse make room
+static bool texInit(C3D_Tex *tex, unsigned hw, unsigned hh) {
+	if (C3D_TexInit(tex, hw, hh, GSP_RGBA8_OES)) return true;
+	linear_trim();
+	return C3D_TexInit(tex, hw, hh, GSP_RGBA8_OES);
+}
+
 static void makeTexture(C3D_Tex *tex, const u8 *mygpusrc, unsigned hw, unsigned hh) {
-	// init texture
-	C3D_TexDelete(tex);
-	C3D_TexInit(tex, hw, hh, GSP_RGBA8_OES);
-	C3D_TexSetFilter(tex, GPU_NEAREST, GPU_NEAREST);
+	// init texture; the VNC texture is remade with every update, keep it
+	// if the size did not change rather than reallocating it each time
+	if (!tex->data || tex->width != hw || tex->height != hh || tex->fmt != GPU_RGBA8) {
+		C3D_TexDelete(tex);
+		if (!texInit(tex, hw, hh)) {
+			rfbClientErr("%s: no room for a %ux%u texture", __func__, hw, hh);
+			return;
+		}
+		C3D_TexSetFilter(tex, GPU_NEAREST, GPU_NEAREST);
+	}
 
 	// Convert image to 3DS tiled texture format
 	GSPGPU_FlushDataCache(mygpusrc, hw*hh*4);
@@ -365,11 +437,16 @@ static void makeImage(DS3_Image *img, const u8 *pixels, unsigned w, unsigned h,
 	img->fw=(float)(w)/hw;
 	unsigned hh=mynext_pow2(h);
 	img->fh=(float)(h)/hh;
+	img->ftop=0.0f;
 	if (noconv) { // pixels are already in a transferable format (buffer in linear RAM, ABGR pixel format, pow2-dimensions)
 		makeTexture(&(img->tex), pixels, hw, hh);
 	} else {
 		// GX_DisplayTransfer needs input buffer in linear RAM
-		u8 *gpusrc = (u8*)linearAlloc(hh*hw*4);
+		u8 *gpusrc = (u8*)linear_alloc(hh*hw*4, LINEAR_STAGING);
+		if (!gpusrc) {
+			rfbClientErr("%s: alloc failed", __func__);
+			return;
+		}
 		// copy to linear buffer, convert from RGBA to ABGR
 		const u8* src=pixels; u8 *dst;
 		for(unsigned y = 0; y < h; y++) {
@@ -387,7 +464,7 @@ static void makeImage(DS3_Image *img, const u8 *pixels, unsigned w, unsigned h,
 			}
 		}
 		makeTexture(&(img->tex), gpusrc, hw, hh);
-		linearFree(gpusrc);
+		linear_free(gpusrc);
 	}
 	return;
 }
@@ -417,15 +494,279 @@ SDL_Surface *myIMG_Load(char *fname)
 	return s;
 }
 
-static int loadImage(DS3_Image *img, char *fname) {
+// identifies the PNG a cached texture was converted from by its contents,
+// a few KB read against a conversion that takes far longer
+static int pngChecksum(char *fname, u32 *size, u32 *crc) {
+	u8 buf[4096];
+	size_t n;
+	FILE *f;
+
+	if (!(f = fopen(fname, "rb"))) return -1;
+	*size = 0;
+	*crc = crc32(0L, Z_NULL, 0);
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		*crc = crc32(*crc, buf, n);
+		*size += n;
+	}
+	n = ferror(f);
+	fclose(f);
+	return n ? -1 : 0;
+}
+
+// reads a texture converted on an earlier start, if its PNG is unchanged
+static int loadCachedImage(DS3_Image *img, char *name, u32 srcsize, u32 srccrc) {
+	char fname[64];
+	tex_cache_header h;
+	FILE *f;
+
+	snprintf(fname, sizeof(fname), TEX_CACHE_DIR "/%s.tex", name);
+	if (!(f = fopen(fname, "rb"))) return -1;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, "TVT2", 4) ||
+		h.srcsize != srcsize || h.srccrc != srccrc ||
+		!texInit(&(img->tex), h.hw, h.hh)) {
+		fclose(f);
+		return -1;
+	}
+	if (fread(img->tex.data, h.hw*h.hh*4, 1, f) != 1) {
+		C3D_TexDelete(&(img->tex));
+		img->tex.data = NULL;	// makeTexture keeps a texture that is there
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	GSPGPU_FlushDataCache(img->tex.data, h.hw*h.hh*4);
+	C3D_TexSetFilter(&(img->tex), GPU_NEAREST, GPU_NEAREST);
+	img->w = h.w;
+	img->h = h.h;
+	img->fw = (float)h.w/h.hw;
+	img->fh = (float)h.h/h.hh;
+	img->ftop = 0.0f;
+	return 0;
+}
+
+static void saveCachedImage(DS3_Image *img, char *name, u32 srcsize, u32 srccrc) {
+	char fname[64];
+	tex_cache_header h = {
+		.magic = "TVT2",
+		.w = img->w, .h = img->h,
+		.hw = img->tex.width, .hh = img->tex.height,
+		.srcsize = srcsize, .srccrc = srccrc
+	};
+	FILE *f;
+
+	mkdir("/3ds", 0644);
+	mkdir("/3ds/TinyVNC", 0644);
+	mkdir(TEX_CACHE_DIR, 0644);
+	snprintf(fname, sizeof(fname), TEX_CACHE_DIR "/%s.tex", name);
+	if (!(f = fopen(fname, "wb"))) return;
+	if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(img->tex.data, h.hw*h.hh*4, 1, f) != 1) {
+		fclose(f);
+		remove(fname);
+		return;
+	}
+	fclose(f);
+}
+
+// loads romfs:/gfx/<name>.t3x, which the build converts from the PNG in
+// gfx/<name>.t3s. Without it, romfs:/<name>.png is converted once and the
+// result cached on SD.
+static int loadImage(DS3_Image *img, char *name) {
+	char fname[64];
+	u32 srcsize, srccrc;
+	FILE *f;
+
+	snprintf(fname, sizeof(fname), "romfs:/gfx/%s.t3x", name);
+	if ((f = fopen(fname, "rb"))) {
+		Tex3DS_Texture t = Tex3DS_TextureImportStdio(f, &(img->tex), NULL, false);
+		fclose(f);
+		if (t) {
+			const Tex3DS_SubTexture *sub = Tex3DS_GetSubTexture(t, 0);
+			img->w = sub->width;
+			img->h = sub->height;
+			img->fw = sub->right;
+			img->fh = sub->bottom;
+			img->ftop = sub->top;
+			Tex3DS_TextureFree(t);
+			C3D_TexSetFilter(&(img->tex), GPU_NEAREST, GPU_NEAREST);
+			asset_stats.pack++;
+			return 0;
+		}
+		img->tex.data = NULL;
+	}
+
+	snprintf(fname, sizeof(fname), "romfs:/%s.png", name);
+	if (pngChecksum(fname, &srcsize, &srccrc)) return -1;
+	if (!loadCachedImage(img, name, srcsize, srccrc)) {
+		asset_stats.cache++;
+		return 0;
+	}
+
 	SDL_Surface *s=myIMG_Load(fname);
 	if (!s) return -1;
 
 	makeImage(img, (u8*)s->pixels, s->w,s->h,0);
 	SDL_FreeSurface(s);
+	saveCachedImage(img, name, srcsize, srccrc);
+	asset_stats.converted++;
 	return 0;
 }
 
+static void text_lock_setup()
+{
+	// by the main thread, at the first print or in uib_init before the
+	// video thread draws any text
+	if (!text_lock_init) {
+		LightLock_Init(&text_lock);
+		text_lock_init = 1;
+	}
+}
+
+// the run of color; -1 if there is none but room for one, or the run of
+// the nearest color if all are taken
+static int text_run_find(text_run *runs, int nruns, u32 color)
+{
+	int i, d, best = 0, best_d = 0x7fffffff;
+
+	for (i = 0; i < nruns; i++) {
+		if (runs[i].color == color) return i;
+		d = 0;
+		for (int s = 0; s < 24; s += 8) {
+			int c = (int)((runs[i].color >> s) & 0xff) - (int)((color >> s) & 0xff);
+			d += c * c;
+		}
+		if (d < best_d) {
+			best_d = d;
+			best = i;
+		}
+	}
+	return nruns < TEXT_RUNS ? -1 : best;
+}
+
+static void text_run_add(text_run *runs, int *nruns, u32 color)
+{
+	int i = text_run_find(runs, *nruns, color);
+	if (i < 0) {
+		i = (*nruns)++;
+		runs[i].color = color;
+		runs[i].count = 0;
+	} else if (runs[i].color != color && !text_merged) {
+		text_merged = 1;
+		log_citra("text: more than %d colors, %08lx drawn as %08lx", TEXT_RUNS, (unsigned long)color, (unsigned long)runs[i].color);
+	}
+	runs[i].count += 6;
+}
+
+static void text_quad(text_vertex *v, int x, int y, float u0, float v0, float u1, float v1)
+{
+	float x0 = B2T(x), x1 = B2T(x + 8);
+	float y0 = y, y1 = y + 8;
+
+	// two triangles with the winding of drawImage's strip
+	v[0] = (text_vertex){x0, y0, 0.5f, u0, v0};
+	v[1] = (text_vertex){x0, y1, 0.5f, u0, v1};
+	v[2] = (text_vertex){x1, y0, 0.5f, u1, v0};
+	v[3] = (text_vertex){x1, y0, 0.5f, u1, v0};
+	v[4] = (text_vertex){x0, y1, 0.5f, u0, v1};
+	v[5] = (text_vertex){x1, y1, 0.5f, u1, v1};
+}
+
+// sorts the cells into color runs and writes their quads
+static void buildText(int yoff)
+{
+	static text_cell shown[TEXT_ROWS][TEXT_COLS];
+	int row, col, i, n;
+	int fill_bg[TEXT_RUNS], fill_fg[TEXT_RUNS];
+	text_cell *t;
+
+	// the main thread goes on printing once the text is copied
+	LightLock_Lock(&text_lock);
+	text_dirty = 0;
+	i = text_top;
+	memcpy(shown, text_ring[i], (TEXT_ROWS - i) * sizeof(text_ring[0]));
+	memcpy(shown[TEXT_ROWS - i], text_ring, i * sizeof(text_ring[0]));
+	LightLock_Unlock(&text_lock);
+
+	text_nbg = text_nfg = 0;
+	for (row = 0; row < TEXT_ROWS; row++) {
+		for (col = 0; col < TEXT_COLS; col++) {
+			t = &shown[row][col];
+			if (!t->c) continue;
+			// the screen is cleared to opaque black anyway
+			if ((t->bg >> 24) && t->bg != 0xFF000000) text_run_add(text_bg, &text_nbg, t->bg);
+			if (t->c != ' ') text_run_add(text_fg, &text_nfg, t->fg | 0xFF000000);
+		}
+	}
+	n = 0;
+	for (i = 0; i < text_nbg; i++) {
+		fill_bg[i] = text_bg[i].first = n;
+		n += text_bg[i].count;
+	}
+	for (i = 0; i < text_nfg; i++) {
+		fill_fg[i] = text_fg[i].first = n;
+		n += text_fg[i].count;
+	}
+
+	for (row = 0; row < TEXT_ROWS; row++) {
+		for (col = 0; col < TEXT_COLS; col++) {
+			t = &shown[row][col];
+			if (!t->c) continue;
+			if ((t->bg >> 24) && t->bg != 0xFF000000) {
+				i = text_run_find(text_bg, text_nbg, t->bg);
+				text_quad(text_vbuf + fill_bg[i], col * 8, yoff + row * 8, 0, 0, 0, 0);
+				fill_bg[i] += 6;
+			}
+			if (t->c != ' ') {
+				i = text_run_find(text_fg, text_nfg, t->fg | 0xFF000000);
+				text_quad(text_vbuf + fill_fg[i], col * 8, yoff + row * 8,
+					(t->c & 0x0f) / 16.0f, (t->c >> 4) / 16.0f,
+					((t->c & 0x0f) + 1) / 16.0f, ((t->c >> 4) + 1) / 16.0f);
+				fill_fg[i] += 6;
+			}
+		}
+	}
+	GSPGPU_FlushDataCache(text_vbuf, n * sizeof(text_vertex));
+	text_yoff = yoff;
+}
+
+static void drawText(int yoff) {
+	int i;
+
+	if (!text_vbuf) return;
+	if (text_dirty || yoff != text_yoff)
+		buildText(yoff);
+
+	C3D_BufInfo *buf = C3D_GetBufInfo();
+	BufInfo_Init(buf);
+	BufInfo_Add(buf, text_vbuf, sizeof(text_vertex), 2, 0x10);
+	C3D_TexEnv *env = C3D_GetTexEnv(0);
+
+	// backgrounds in plain color
+	C3D_TexEnvInit(env);
+	C3D_TexEnvSrc(env, C3D_Both, GPU_CONSTANT, 0, 0);
+	C3D_TexEnvFunc(env, C3D_Both, GPU_REPLACE);
+	for (i = 0; i < text_nbg; i++) {
+		C3D_TexEnvColor(env, text_bg[i].color);
+		C3D_DrawArrays(GPU_TRIANGLES, text_bg[i].first, text_bg[i].count);
+	}
+
+	// glyphs in color, shaped by the alpha of the atlas
+	C3D_TexBind(0, &chars_spr.tex);
+	C3D_TexEnvInit(env);
+	C3D_TexEnvSrc(env, C3D_RGB, GPU_CONSTANT, 0, 0);
+	C3D_TexEnvSrc(env, C3D_Alpha, GPU_TEXTURE0, 0, 0);
+	C3D_TexEnvFunc(env, C3D_Both, GPU_REPLACE);
+	for (i = 0; i < text_nfg; i++) {
+		C3D_TexEnvColor(env, text_fg[i].color);
+		C3D_DrawArrays(GPU_TRIANGLES, text_fg[i].first, text_fg[i].count);
+	}
+
+	// back to what the other sprites expect
+	C3D_TexEnvInit(env);
+	C3D_TexEnvSrc(env, C3D_Both, GPU_TEXTURE0, 0, 0);
+	C3D_TexEnvFunc(env, C3D_Both, GPU_REPLACE);
+	BufInfo_Init(buf);
+}
+
 // bottom handling functions
 // =========================
 static inline void requestRepaint() {
@@ -478,7 +819,7 @@ static void uib_repaint(void *param) {
 	} else if (log_enabled) {
 		// menu
 		int y = kb_enabled ? MIN(0,-240 + kb_y_pos + (29-uib_y) * 8) : 0;
-		drawImage(&menu_spr, 0, y, 0, 0, 0);
+		drawText(y);
 	}
 
 	if (kb_enabled) {
@@ -504,11 +845,9 @@ static void uib_shutdown() {
 	SDL_RequestCall(NULL, NULL);
 	svcCloseHandle(repaintRequired);
 	
-	if (menu_img) {
-		u8 *p = menu_img->pixels;
-		SDL_FreeSurface(menu_img);
-		linearFree(p);
-		menu_img = NULL;
+	if (text_vbuf) {
+		linear_free(text_vbuf);
+		text_vbuf = NULL;
 	}
 	uib_isinit = 0;
 }
@@ -528,43 +867,6 @@ static void keypress_recalc() {
 	}
 }
 
-// threadworker-related vars / functions
-#define MAXPENDING 10
-
-static SDL_Thread *worker=NULL;
-static SDL_sem *worker_sem=NULL;
-static int (*worker_fn[MAXPENDING])(void *);
-static void *worker_data[MAXPENDING];
-
-static int worker_thread(void *data) {
-	static int p2=0;
-	while( 1 ) {
-		SDL_SemWait(worker_sem);
-		(worker_fn[p2])(worker_data[p2]);
-		worker_fn[p2]=NULL;
-		p2=(p2+1)%MAXPENDING;
-	}
-	return 0;
-}
-
-static void worker_init() {
-	worker_sem = SDL_CreateSemaphore(0);
-	worker = SDL_CreateThread(worker_thread,NULL);
-	memset(worker_fn, 0, sizeof(worker_fn));
-	memset(worker_data, 0, sizeof(worker_data));
-}
-
-static int start_worker(int (*fn)(void *), void *data) {
-	static int p1=0;
-	if (!worker_sem) worker_init();
-	if (worker_fn[p1] != NULL) return -1;
-	worker_fn[p1]=fn;
-	worker_data[p1]=data;
-	SDL_SemPost(worker_sem);	
-	p1=(p1+1)%MAXPENDING;
-	return 0;
-}
-
 // animation / keyboard toggle related functions
 static void *alloc_copy(void *p, size_t s) {
 	void *d=malloc(s);
@@ -607,6 +909,57 @@ static int animate(void *data){
 	return 0;
 }
 
+// the animation worker: one thread, as animations on the same variables
+// must not overlap anyway; they run in the order they were started
+#define MAXPENDING 10
+
+static SDL_Thread *worker=NULL;
+static SDL_mutex *worker_lock=NULL;
+static SDL_cond *worker_cond=NULL;
+static animation_set *pending[MAXPENDING];
+static int pending_first=0, pending_nr=0;
+
+static int worker_thread(void *data) {
+	animation_set *a;
+
+	SDL_mutexP(worker_lock);
+	while( 1 ) {
+		while (!pending_nr) SDL_CondWait(worker_cond, worker_lock);
+		a=pending[pending_first];
+		pending_first=(pending_first+1)%MAXPENDING;
+		--pending_nr;
+		SDL_mutexV(worker_lock);
+		animate(a);
+		SDL_mutexP(worker_lock);
+	}
+	return 0;
+}
+
+static void start_animation(animation_set *a) {
+	if (!worker_lock) {
+		worker_lock = SDL_CreateMutex();
+		worker_cond = SDL_CreateCond();
+		if (worker_lock && worker_cond) worker = SDL_CreateThread(worker_thread,NULL);
+		if (!worker) log_citra("animation worker: %s", SDL_GetError());
+	}
+	if (worker) {
+		SDL_mutexP(worker_lock);
+		if (pending_nr < MAXPENDING) {
+			pending[(pending_first+pending_nr++)%MAXPENDING]=a;
+			SDL_CondSignal(worker_cond);
+			a=NULL;
+		}
+		SDL_mutexV(worker_lock);
+	}
+	if (a) {
+		// no worker or too many animations queued: jump to the end state
+		for (int i=0; i < a->nr; i++) *(a->anim[i].var) = a->anim[i].to;
+		if (a->callback) (a->callback)(a->callback_data);
+		if (a->callback2) (a->callback2)(a->callback2_data);
+		free(a);
+	}
+}
+
 static void anim_callback(void *param) {
 	requestRepaint();
 }
@@ -624,7 +977,7 @@ void uib_enable_log(int enable) {
 void toggle_keyboard() {
 	int y1=240-kbd_spr.h;
 
-	start_worker(animate, alloc_copy(&((int[]){
+	start_animation(alloc_copy(&((int[]){
 		0, 0, 1, // steps, delay, nr
 		(int)anim_callback, 0, // callback, callback_data
 		0,0, // callback2, callback2_data
@@ -749,32 +1102,62 @@ void uib_reset_colors() {
 }
 
 void uib_clear() {
-	SDL_FillRect(menu_img, NULL, 0x000000ff);
+	text_lock_setup();
+	LightLock_Lock(&text_lock);
+	memset(text_ring, 0, sizeof(text_ring));
+	text_top = 0;
+	text_dirty = 1;
+	LightLock_Unlock(&text_lock);
 	uib_set_position(0,0);
 }
 
 static void uib_scrollup(int lines) {
-	if (lines) {
-		int offset = lines * 8 * menu_img->pitch;
-		int size = menu_img->h * menu_img->pitch - offset;
-		memmove(menu_img->pixels, menu_img->pixels + offset, size);
-		memset(menu_img->pixels + size, 0, offset);
+	while (lines--) {
+		memset(text_ring[text_top], 0, sizeof(text_ring[0]));
+		text_top = (text_top + 1) % TEXT_ROWS;
 	}
+	text_dirty = 1;
 }
 
 static void uib_nextline() {
 	uib_x = 0; ++uib_y;
-	if (uib_y >= 30) {
-		uib_scrollup(uib_y - 29);
-		uib_y=29;
+	if (uib_y >= TEXT_ROWS) {
+		uib_scrollup(uib_y - (TEXT_ROWS - 1));
+		uib_y = TEXT_ROWS - 1;
 	}
 }
 
+static void uib_putchars(const char *str, int n) {
+	text_cell *t = &text_ring[(text_top + uib_y) % TEXT_ROWS][uib_x];
+	u32 fg = TEXT_RGBA(txt_col), bg = TEXT_RGBA(bck_col);
+
+	for (int i = 0; i < n; i++) {
+		t[i].c = str[i];
+		t[i].fg = fg;
+		t[i].bg = bg;
+	}
+	text_dirty = 1;
+}
+
 int uib_vprintf(char *format, va_list arg) {
-	int l=vsnprintf(NULL, 0, format, arg);
-	if (!l) return 0;
-	char *p=(char*)malloc(l+1);
-	vsnprintf(p, l+1, format, arg);
+	char buf[256];
+	va_list arg2;
+	va_copy(arg2, arg);
+	int l=vsnprintf(buf, sizeof(buf), format, arg);
+	if (l <= 0) {
+		va_end(arg2);
+		return 0;
+	}
+	char *p = buf;
+	if (l >= sizeof(buf)) {
+		// only long messages need the heap
+		p=(char*)malloc(l+1);
+		vsnprintf(p, l+1, format, arg2);
+	}
+	va_end(arg2);
+	// the whole message shows up at once
+	text_lock_setup();
+	LightLock_Lock(&text_lock);
 	// split the string by newlines
 	char *line = p, *end_line;
 	int to_print, len;
@@ -787,9 +1170,9 @@ int uib_vprintf(char *format, va_list arg) {
 				uib_nextline();
 				--nlines_pending;
 			}
-			if (uib_x>=40) uib_nextline();
-			int i = MIN(to_print, 40-uib_x);
-			uib_printstring(menu_img, line + len - to_print, uib_x*8, uib_y*8, i, ALIGN_LEFT, txt_col, bck_col);
+			if (uib_x>=TEXT_COLS) uib_nextline();
+			int i = MIN(to_print, TEXT_COLS-uib_x);
+			uib_putchars(line + len - to_print, i);
 			to_print -= i;
 			uib_x += i;
 		}
@@ -800,7 +1183,8 @@ int uib_vprintf(char *format, va_list arg) {
 		}
 		line = end_line;
 	}
-	free(p);
+	LightLock_Unlock(&text_lock);
+	if (p != buf) free(p);
 	return l;
 }
 
@@ -818,19 +1202,30 @@ void uib_init() {
 
 	if (uib_isinit) return;
 	uib_isinit=1;
+	text_lock_setup();
 
 	chars_img=myIMG_Load("romfs:/chars.png");
 	SDL_SetColorKey(chars_img, SDL_SRCCOLORKEY, 0x00000000);
 
-	// init menusurface
-	u8* menu_gpusrc = (u8*)linearAlloc(512*256*4);
-	menu_img = SDL_CreateRGBSurfaceFrom(menu_gpusrc, 320, 240, 32, 512*4, 0xff000000,0x00ff0000,0x0000ff00,0x000000ff);
-	SDL_FillRect(menu_img, NULL, 0x000000ff);
+	// font atlas: white glyphs on transparent, colored when drawn
+	if (chars_img) {
+		u8 *atlas = malloc(chars_img->w * chars_img->h * 4);
+		for (int y = 0; y < chars_img->h; y++)
+			for (int x = 0; x < chars_img->w; x++)
+				memset(atlas + (y * chars_img->w + x) * 4,
+					((u8*)chars_img->pixels)[y * chars_img->pitch + x] ? 0xff : 0, 4);
+		makeImage(&chars_spr, atlas, chars_img->w, chars_img->h, 0);
+		free(atlas);
+	}
+	text_vbuf = linear_alloc(2 * TEXT_ROWS * TEXT_COLS * 6 * sizeof(text_vertex), LINEAR_GEOMETRY);
 
 	// pre-load sprites
-	loadImage(&kbd_spr,			"romfs:/kbd.png");
-	loadImage(&twistyup_spr,	"romfs:/twistyup.png");
-	loadImage(&twistydn_spr,	"romfs:/twistydn.png");
+	u64 t = getmicrotime();
+	loadImage(&kbd_spr,			"kbd");
+	loadImage(&twistyup_spr,	"twistyup");
+	loadImage(&twistydn_spr,	"twistydn");
+	log_citra("sprites loaded in %d ms: %d from texture pack, %d from SD cache, %d converted",
+		(int)((getmicrotime() - t) / 1000), asset_stats.pack, asset_stats.cache, asset_stats.converted);
 	makeImage(&keymask_spr, (const u8[]){0x00, 0x00, 0x00, 0x80},1,1,0);
 
 	makeImage(&whitepixel_spr, (const u8[]){0xff, 0xff, 0xff, 0xff},1,1,0);
@@ -860,10 +1255,15 @@ void uib_update(int what)
 			keypress_recalc();
 		}
 		if (uib_must_redraw & UIB_RECALC_MENU) {
-			makeImage(&menu_spr, menu_img->pixels, menu_img->w, menu_img->h, 1);
+			text_dirty = 1;
+		}
+		// changes kept from a shared texture may have come into sight
+		if ((uib_must_redraw & UIB_REPAINT) && uibvnc_stale && bottom_lcd_on) {
+			uib_must_redraw |= UIB_RECALC_VNC;
 		}
-		if (uib_must_redraw & UIB_RECALC_VNC) {
+		if ((uib_must_redraw & UIB_RECALC_VNC) && uibvnc_buffer) {
 			makeImage(&uibvnc_spr, uibvnc_buffer, uibvnc_spr.w, uibvnc_spr.h, 1);
+			uibvnc_stale = 0;
 		}
 		uib_must_redraw = UIB_NO;
 		requestRepaint();
@@ -1226,6 +1626,8 @@ void uib_setBacklight (int on) {
 	bottom_lcd_on=on;
 	if (on) {
 		GSPLCD_PowerOnBacklight(GSPLCD_SCREEN_BOTTOM);
+		// what has changed in the dark is made with the next update
+		if (uibvnc_stale) uib_must_redraw |= UIB_RECALC_VNC;
 	} else {
 		GSPLCD_PowerOffBacklight(GSPLCD_SCREEN_BOTTOM);
 	}
@@ -1234,16 +1636,19 @@ void uib_setBacklight (int on) {
 
 void uibvnc_cleanup() {
 	if (uibvnc_buffer) {
-		linearFree(uibvnc_buffer);
+		if (!uibvnc_shared) linear_free(uibvnc_buffer);
 		uibvnc_buffer=NULL;
 	}
+	uibvnc_shared = 0;
+	uibvnc_stale = 0;
 	if (uibvnc_buffer_big) {
 		free(uibvnc_buffer_big);
 		uibvnc_buffer_big=NULL;
 	}
 }
 
-static void uibvnc_handleFrameBufferUpdate_mask (struct _rfbClient *client, int x, int y, int w, int h)
+// makes the pixels opaque, the VNC client leaves the alpha channel alone
+static void uibvnc_opaque(int x, int y, int w, int h)
 {
 	int skip = uibvnc_pitch - w * 4;
 	u8* buffer = uibvnc_buffer + y * uibvnc_pitch + x * 4;
@@ -1256,6 +1661,11 @@ static void uibvnc_handleFrameBufferUpdate_mask (struct _rfbClient *client, int
 	}, h);
 }
 
+static void uibvnc_handleFrameBufferUpdate_mask (struct _rfbClient *client, int x, int y, int w, int h)
+{
+	uibvnc_opaque(x, y, w, h);
+}
+
 static void uibvnc_handleFrameBufferUpdate_scale (struct _rfbClient *client, int x, int y, int w, int h)
 {
 	if (uibvnc_buffer_big) {
@@ -1276,6 +1686,30 @@ static void uibvnc_handleFrameBufferUpdate_scale (struct _rfbClient *client, int
 	}
 }
 
+// places the VNC image on the bottom screen
+static void uibvnc_layout()
+{
+	if (uibvnc_scaling) {
+		int scale1024 = (uibvnc_spr.w) * 1024 / uibvnc_spr.h;
+		if (scale1024 < (320 * 1024) / 240) {
+			uibvnc_h = MIN(240, uibvnc_spr.h) ; uibvnc_w = (scale1024 * uibvnc_h + 512) / 1024;
+		} else {
+			uibvnc_w = MIN(320, uibvnc_spr.w); uibvnc_h = (uibvnc_w * 1024 + scale1024 / 2) / scale1024;
+		}
+		uibvnc_x = (320 - uibvnc_w) / 2;
+		uibvnc_y = (240 - uibvnc_h) / 2;
+	} else {
+		extern int x,y;
+		int w = uibvnc_spr.w > 320 ? 318 : 320;
+		int h = uibvnc_spr.h > 240 ? 238 : 240;
+		// center screen around mouse cursor if not scaling
+		uibvnc_w = uibvnc_spr.w;
+		uibvnc_h = uibvnc_spr.h;
+		uibvnc_x = uibvnc_w > w ? LIMIT(-x + w / 2, -uibvnc_w + w, 0) : ( w - uibvnc_w ) / 2;
+		uibvnc_y = uibvnc_h > h ? LIMIT(-y + h / 2, -uibvnc_h + h, 0) : ( h - uibvnc_h ) / 2;
+	}
+}
+
 rfbBool uibvnc_resize(rfbClient* client) {
 
 //log_citra("enter %s, %p, %d, %d",__func__, client, client->width, client->height);
@@ -1328,7 +1762,7 @@ rfbBool uibvnc_resize(rfbClient* client) {
 	uibvnc_pitch = hw * 4;
 
 	// alloc buffer in linear RAM, ABGR pixel format, pow2-dimensions
-	uibvnc_buffer = (u8*)linearAlloc(hh*hw*4);
+	uibvnc_buffer = (u8*)linear_alloc(hh*hw*4, LINEAR_FRAMEBUFFER);
 	if(!uibvnc_buffer) {
 		rfbClientErr("%s: alloc failed", __func__);
 		return FALSE;
@@ -1347,25 +1781,7 @@ rfbBool uibvnc_resize(rfbClient* client) {
 	client->format.redMax = client->format.greenMax = client->format.blueMax = 255;
 	SetFormatAndEncodings(client);
 
-	if (uibvnc_scaling) {
-		int scale1024 = (uibvnc_spr.w) * 1024 / uibvnc_spr.h;
-		if (scale1024 < (320 * 1024) / 240) {
-			uibvnc_h = MIN(240, uibvnc_spr.h) ; uibvnc_w = (scale1024 * uibvnc_h + 512) / 1024;
-		} else {
-			uibvnc_w = MIN(320, uibvnc_spr.w); uibvnc_h = (uibvnc_w * 1024 + scale1024 / 2) / scale1024;
-		}
-		uibvnc_x = (320 - uibvnc_w) / 2;
-		uibvnc_y = (240 - uibvnc_h) / 2;
-	} else {
-		extern int x,y;
-		int w = uibvnc_spr.w > 320 ? 318 : 320;
-		int h = uibvnc_spr.h > 240 ? 238 : 240;
-		// center screen around mouse cursor if not scaling
-		uibvnc_w = uibvnc_spr.w;
-		uibvnc_h = uibvnc_spr.h;
-		uibvnc_x = uibvnc_w > w ? LIMIT(-x + w / 2, -uibvnc_w + w, 0) : ( w - uibvnc_w ) / 2;
-		uibvnc_y = uibvnc_h > h ? LIMIT(-y + h / 2, -uibvnc_h + h, 0) : ( h - uibvnc_h ) / 2;
-	}
+	uibvnc_layout();
 	return TRUE;
 }
 
@@ -1373,42 +1789,67 @@ void uibvnc_setScaling(int scaling) {
 	uibvnc_scaling=scaling;
 }
 
+// shows the top screen surface on the bottom screen as well, so that one
+// connection feeds both. The texture is made straight from its pixels,
+// which SDL keeps in linear RAM with pow2-dimensions already.
+void uibvnc_mirror(SDL_Surface *s) {
+	uibvnc_cleanup();
+	uibvnc_shared = 1;
+	uibvnc_buffer = s->pixels;
+	uibvnc_pitch = s->pitch;
+	uibvnc_spr.w = s->w;
+	uibvnc_spr.h = s->h;
+	uibvnc_layout();
+	uib_update(UIB_RECALC_VNC);
+}
+
+// tells the bottom screen which part of the shared surface has changed.
+// The texture is remade with the next uib_update() if the change can be
+// seen there, else once it comes into sight.
+void uibvnc_damage(int x, int y, int w, int h) {
+	if (!uibvnc_shared || w <= 0 || h <= 0) return;
+	uibvnc_opaque(x, y, w, h);
+	if (bottom_lcd_on && (uibvnc_scaling || (
+		x < -uibvnc_x + 320 && x + w > -uibvnc_x &&
+		y < -uibvnc_y + 240 && y + h > -uibvnc_y)))
+	{
+		uib_must_redraw |= UIB_RECALC_VNC;
+	} else {
+		uibvnc_stale = 1;
+	}
+}
+
 void uib_qmenu_show() {
 	static int qmenu_isinit = 0;
 	if (!qmenu_isinit) {
-		int ox = uib_x, oy = uib_y;
 		// init menusurface
-		SDL_Surface *s = menu_img;
-		menu_img = 	SDL_CreateRGBSurface(SDL_SWSURFACE,QMENU_WIDTH,QMENU_HEIGHT,32,0x000000ff,0x0000ff00,0x00ff0000,0xff000000);
-		SDL_FillRect(menu_img, NULL, SDL_MapRGBA(menu_img->format,0,0,0,0));
+		SDL_Surface *s = SDL_CreateRGBSurface(SDL_SWSURFACE,QMENU_WIDTH,QMENU_HEIGHT,32,0x000000ff,0x0000ff00,0x00ff0000,0xff000000);
+		SDL_FillRect(s, NULL, SDL_MapRGBA(s->format,0,0,0,0));
 		// print menu
-		uib_set_position(0,0);
-		uib_set_colors((SDL_Color){0xff,0xff,0xff,0}, (SDL_Color){0,0,0,128});
-		uib_printf(
+		const char *menu[] = {
 		"\x0D" "\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B"
 		"\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B"
-		"\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B" "\x0E\n"
-		"\x0C \xF2   "       "Disconnect              " " \x0C\n"
-		"\x0C \xF6   "       "Toggle Top Scaling      " " \x0C\n"
-		"\x0C \xF8   "       "Toggle Bottom Scaling   " " \x0C\n"
-		"\x0C \xF7   "       "Toggle Event Target     " " \x0C\n"
-		"\x0C \xF9   "       "Toggle Tap Gestures     " " \x0C\n"
-		"\x0C \xF4   "       "Toggle Show Log         " " \x0C\n"
-		"\x0C \xF5   "       "Toggle Show Keyboard    " " \x0C\n"
-		"\x0C \xFD\xFE\xFF " "Toggle Bottom Backlight " " \x0C\n"
-		"\x0C \xF0   "       "Toggle Keys to VNC      " " \x0C\n"
-		"\x0C \xF1   "       "Toggle Mouse to VNC     " " \x0C\n"
-		"\x0C \xF3   "       "Exit Menu               " " \x0C\n"
+		"\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B" "\x0E",
+		"\x0C \xF2   "       "Disconnect              " " \x0C",
+		"\x0C \xF6   "       "Toggle Top Scaling      " " \x0C",
+		"\x0C \xF8   "       "Toggle Bottom Scaling   " " \x0C",
+		"\x0C \xF7   "       "Toggle Event Target     " " \x0C",
+		"\x0C \xF9   "       "Toggle Tap Gestures     " " \x0C",
+		"\x0C \xF4   "       "Toggle Show Log         " " \x0C",
+		"\x0C \xF5   "       "Toggle Show Keyboard    " " \x0C",
+		"\x0C \xFD\xFE\xFF " "Toggle Bottom Backlight " " \x0C",
+		"\x0C \xF0   "       "Toggle Keys to VNC      " " \x0C",
+		"\x0C \xF1   "       "Toggle Mouse to VNC     " " \x0C",
+		"\x0C \xF3   "       "Exit Menu               " " \x0C",
 		"\x0F" "\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B"
 		"\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B"
-		"\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B" "\x10\n"
-		);
-		uib_reset_colors();
-		makeImage(&qmenu_spr, menu_img->pixels, menu_img->w, menu_img->h, 0);
-		SDL_FreeSurface(menu_img);
-		menu_img = s;
+		"\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B" "\x10",
+		};
+		for (int i = 0; i < sizeof(menu) / sizeof(menu[0]); i++)
+			uib_printstring(s, menu[i], 0, i * 8, QMENU_WIDTH / 8, ALIGN_LEFT, (SDL_Color){0xff,0xff,0xff,0}, (SDL_Color){0,0,0,128});
+		makeImage(&qmenu_spr, s->pixels, s->w, s->h, 0);
+		SDL_FreeSurface(s);
 		qmenu_isinit = 1;
-		uib_x=ox; uib_y=oy;
 	}
 	uib_qmenu_active = 1;
 	uib_update(UIB_REPAINT);
@@ -73,6 +73,8 @@ extern void toggle_keyboard();
 extern rfbBool uibvnc_resize(rfbClient*);
 extern void uibvnc_cleanup();
 extern void uibvnc_setScaling(int);
+extern void uibvnc_mirror(SDL_Surface *);
+extern void uibvnc_damage(int x, int y, int w, int h);
 extern void uib_qmenu_show();
 
 // exposed variables
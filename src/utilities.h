@@ -41,6 +41,7 @@
 		_a < _l1 ? _l1 : (_a > _l2 ? _l2 : _a); })
 
 extern u64 getmicrotime();
+extern void log_citra(const char *format, ...);
 extern void printBits(size_t const size, void const * const ptr);
 extern void hex_dump(char *data, int size, char *caption);
 extern int fastscale(unsigned char *d, int dst_pitch, unsigned char *s, int src_width, int src_height, int src_pitch, int factor);
@@ -33,6 +33,41 @@ struct vjoy_packet {
 	u32 discPovs;	// discrete C-Stick Position on #1, D-Pad Pos on #2
 };
 
+// input summed up since the last packet was built
+struct vjoy_data {
+	u32 buttons;
+	int posCp_x;
+	int posCp_y;
+	int posStk_x;
+	int posStk_y;
+	int touch_x;
+	int touch_y;
+	int touch_dx;
+	int touch_dy;
+	int gyro_x;
+	int gyro_y;
+	int gyro_z;
+	float slider;
+	int accel_x;
+	int accel_y;
+	int accel_z;
+};
+
+// batch datagram, see vjoy-udp-feeder-client.h for the format
+#define BATCH_HEADER_SIZE 16
+#define BATCH_MAX_SIZE 1400		// stay below the MTU
+#define BATCH_FIELDS 17			// vjoy_packet of the pad, then the 6 axes of the motion packet
+#define BATCH_SAMPLE_MAX (2 * 5 + BATCH_FIELDS * 5)	// worst case encoded size of a sample
+
+static u8 batch_buf[BATCH_MAX_SIZE];
+static int batch_len = 0;
+static int batch_count = 0;
+static int batch_changed;
+static u64 batch_lasttime;
+static u16 batch_seq = 0;
+static u32 batch_prev[BATCH_FIELDS];	// last sample added to the batch
+static u32 batch_sent[BATCH_FIELDS];	// last sample of the last batch sent
+
 int vjoy_udp_client_init(struct vjoy_udp_client *client, char *hostname, int port, int motionport)
 {
 	bzero(client, sizeof(*client));
@@ -80,7 +115,11 @@ int vjoy_udp_client_init(struct vjoy_udp_client *client, char *hostname, int por
 	client->mouse_sensitivity = 10; // mouse sensitivity for relative movements (default 10)
 
 	// other default values
-	client->interval = 75; // 75ms
+	client->interval = 0; // every update
+	client->batch = 0;
+	client->batch_interval = 75; // 75ms
+	batch_count = 0;
+	bzero(batch_sent, sizeof(batch_sent));
 
 	// set default coeffs
 	client->coeffs.cp_deadzone = 20;
@@ -112,12 +151,6 @@ static int vjoy_udp_client_sendUDP(struct vjoy_udp_client *client, void *data, i
 	return ret;
 }
 
-int vjoy_udp_client_shutdown(struct vjoy_udp_client *client)
-{
-	if (client->socket >= 0) close(client->socket);
-	client->socket = -1;
-	return 0;
-}
 
 static const u32 buttons3ds[] = {
 	KEY_A,
@@ -159,8 +192,180 @@ static u32 vjoy_udp_client_transform(int a, int dead, int max, u32 thresh, u32 m
 	return a;
 }
 
+static void vjoy_udp_client_build(
+	struct vjoy_udp_client *client,
+	struct vjoy_data *data,
+	int count,
+	circlePosition *posCp,
+	circlePosition *posStk,
+	touchPosition *touch,
+	accelVector *accel,
+	angularRate *gyro,
+	struct vjoy_packet *newp,
+	struct vjoy_packet *newmp)
+{
+	// C-Pad
+	if (posCp) {
+		data->buttons &= 0x0FFFFFFF; // blank out the C-Pad buttons, we are sending real coordinates
+		newp->wAxisX = vjoy_udp_client_transform(data->posCp_x / count, client->coeffs.cp_deadzone, client->coeffs.cp_max, client->coeffs.cp_threshold, 0x8000, 0);
+		newp->wAxisY = vjoy_udp_client_transform(data->posCp_y / count, client->coeffs.cp_deadzone, client->coeffs.cp_max, client->coeffs.cp_threshold, 0x8000, 0);
+	} else {
+		if (data->buttons & KEY_CPAD_UP) newp->wAxisY=0x8000;
+		else if (data->buttons & KEY_CPAD_DOWN) newp->wAxisY=0;
+		else newp->wAxisY=0x4000;
+		if (data->buttons & KEY_CPAD_RIGHT) newp->wAxisX=0x8000;
+		else if (data->buttons & KEY_CPAD_LEFT) newp->wAxisX=0;
+		else newp->wAxisX=0x4000;
+	}
+	// C-Stick
+	int x=0,y=0;
+	if (posStk) {
+		data->buttons &= 0xF0FFFFFF; // blank out the C-Stick buttons, we are sending real coordinates
+		newp->wAxisXRot= vjoy_udp_client_transform(data->posStk_x / count, client->coeffs.cs_deadzone, client->coeffs.cs_max, client->coeffs.cs_threshold, 0x8000, 0);
+		newp->wAxisYRot= vjoy_udp_client_transform(data->posStk_y / count, client->coeffs.cs_deadzone, client->coeffs.cs_max, client->coeffs.cs_threshold, 0x8000, 0);
+		x=posStk->dx; y=posStk->dy;
+	} else {
+		if (data->buttons & KEY_CSTICK_UP) newp->wAxisYRot=0x8000;
+		else if (data->buttons & KEY_CSTICK_DOWN) newp->wAxisYRot=0;
+		else newp->wAxisYRot=0x4000;
+		if (data->buttons & KEY_CSTICK_RIGHT) newp->wAxisXRot=0x8000;
+		else if (data->buttons & KEY_CSTICK_LEFT) newp->wAxisXRot=0;
+		else newp->wAxisXRot=0x4000;
+		x=(newp->wAxisXRot>>8) - 0x40; y=(newp->wAxisYRot>>8) - 0x40;
+	}
+	// C-Stick on Pov hat #1
+	if (x * x + y * y > 40 * 40) {
+		newp->contPov  = ((int)(atan2(x, y) * 18000.0 * M_1_PI) + 36000) % 36000;
+		newp->discPovs = ((int)((newp->contPov + 4500) / 9000) % 4) | 0xFFFFFF00;
+	} else {
+		newp->contPov  = 0xFFFFFFFF;
+		newp->discPovs = 0xFFFFFF0F;
+	}
+	//D-Pad on Pov hat #2 (discrete only)
+	if (data->buttons & KEY_DRIGHT) newp->discPovs |= 0x10;
+	else if (data->buttons & KEY_DLEFT) newp->discPovs |= 0x30;
+	else if (data->buttons & KEY_DDOWN) newp->discPovs |= 0x20;
+	else if (!(data->buttons & KEY_DUP)) newp->discPovs |= 0xF0;
+
+	// Touch (relative or absolute)
+	if (touch) {
+		if (client->mouse_relative) {
+			newp->wAxisZ =    LIMIT((data->touch_dx * 0x4000 * client->mouse_sensitivity) / (320*10) + 0x4000, 0, 0x8000);
+			newp->wAxisZRot = LIMIT((data->touch_dy * 0x4000 * client->mouse_sensitivity) / (240*10) + 0x4000, 0, 0x8000);
+		} else {
+			newp->wAxisZ =    (data->touch_x / count) * 0x8000 / 320;
+			newp->wAxisZRot = (data->touch_y / count) * 0x8000 / 240;
+		}
+	}
+
+	//Slider
+	newp->wSlider = (u32)((data->slider / count) * 0x8000);
+
+	// Buttons
+	u32 nbut = 0;
+	// re-order buttons according to buttons3ds array, remove meta button
+	for (int i1=0, i2=0; buttons3ds[i1] && i2<32; ++i1) {
+		if (buttons3ds[i1] == client->metabutton) continue;
+		if ((data->buttons & buttons3ds[i1]) != 0) nbut |= BIT(i2);
+		i2++;
+	}
+	//  bitshift 16 if meta button is pressed
+	if (client->metabutton) {
+		if ((data->buttons & client->metabutton) != 0) nbut = nbut << 16;
+		else nbut &= 0x0000FFFF;
+	}
+	newp->lButtons = nbut;
+
+	// motion packet **************************************
+	// Accelerometer
+	if (client->addr2.sin_port) {
+		if (accel) {
+			newmp->wAxisX = vjoy_udp_client_transform(data->accel_x / count, client->coeffs.acc_deadzone, client->coeffs.acc_max, client->coeffs.acc_threshold, 0x8000, 1);
+			newmp->wAxisY = vjoy_udp_client_transform(data->accel_y / count, client->coeffs.acc_deadzone, client->coeffs.acc_max, client->coeffs.acc_threshold, 0x8000, 1);
+			newmp->wAxisZ = vjoy_udp_client_transform(data->accel_z / count, client->coeffs.acc_deadzone, client->coeffs.acc_max, client->coeffs.acc_threshold, 0x8000, 1);
+		}
+
+		// Gyro
+		if (gyro) {
+			newmp->wAxisXRot = vjoy_udp_client_transform(data->gyro_x / count, client->coeffs.gy_deadzone, client->coeffs.gy_max, client->coeffs.gy_threshold, 0x8000, 1);
+			newmp->wAxisYRot = vjoy_udp_client_transform(data->gyro_y / count, client->coeffs.gy_deadzone, client->coeffs.gy_max, client->coeffs.gy_threshold, 0x8000, 1);
+			newmp->wAxisZRot = vjoy_udp_client_transform(data->gyro_z / count, client->coeffs.gy_deadzone, client->coeffs.gy_max, client->coeffs.gy_threshold, 0x8000, 1);
+		}
+	}
+}
+
+static u8 *batch_put_varint(u8 *b, u32 v)
+{
+	while (v >= 0x80) {
+		*b++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*b++ = v;
+	return b;
+}
+
+static void vjoy_udp_client_batch_flush(struct vjoy_udp_client *client)
+{
+	if (batch_count && batch_changed) {
+		batch_buf[4] = batch_seq >> 8;
+		batch_buf[5] = batch_seq & 0xFF;
+		batch_buf[6] = batch_count;
+		vjoy_udp_client_sendUDP(client, batch_buf, batch_len, &client->addr1);
+		++batch_seq;
+		memcpy(batch_sent, batch_prev, sizeof(batch_sent));
+	}
+	batch_count = 0;
+}
+
+// appends a sample to the batch, the first one of a batch is coded against
+// zero so that every datagram can be decoded on its own
+static void vjoy_udp_client_batch_add(struct vjoy_udp_client *client, u64 timestamp, struct vjoy_packet *newp, struct vjoy_packet *newmp)
+{
+	u32 f[BATCH_FIELDS], mask = 0;
+	u8 *b;
+	int i;
+
+	memcpy(f, newp, sizeof(*newp));
+	f[11] = newmp->wAxisX;
+	f[12] = newmp->wAxisY;
+	f[13] = newmp->wAxisZ;
+	f[14] = newmp->wAxisXRot;
+	f[15] = newmp->wAxisYRot;
+	f[16] = newmp->wAxisZRot;
+
+	if (!batch_count) {
+		memcpy(batch_buf, "VJB\x01", 4);
+		batch_buf[7] = client->addr2.sin_port ? BATCH_FIELDS : 11;
+		for (i = 0; i < 8; i++)
+			batch_buf[8 + i] = timestamp >> (56 - i * 8);
+		batch_len = BATCH_HEADER_SIZE;
+		batch_lasttime = timestamp;
+		batch_changed = 0;
+		bzero(batch_prev, sizeof(batch_prev));
+	}
+	if (memcmp(f, batch_count ? batch_prev : batch_sent, sizeof(f))) batch_changed = 1;
+
+	b = batch_put_varint(batch_buf + batch_len, timestamp - batch_lasttime);
+	for (i = 0; i < batch_buf[7]; i++)
+		if (f[i] != batch_prev[i]) mask |= BIT(i);
+	b = batch_put_varint(b, mask);
+	for (i = 0; i < batch_buf[7]; i++) {
+		if (mask & BIT(i)) {
+			s32 d = f[i] - batch_prev[i];
+			b = batch_put_varint(b, ((u32)d << 1) ^ (u32)(d >> 31)); // zigzag, small either way
+		}
+	}
+	batch_len = b - batch_buf;
+	batch_lasttime = timestamp;
+	memcpy(batch_prev, f, sizeof(f));
+
+	if (++batch_count == 255 || batch_len + BATCH_SAMPLE_MAX > BATCH_MAX_SIZE)
+		vjoy_udp_client_batch_flush(client);
+}
+
 int vjoy_udp_client_update(	// all parameters can be NULL except client
 	struct vjoy_udp_client *client,
+	u64 timestamp,
 	u32 buttons,
 	circlePosition *posCp,
 	circlePosition *posStk,
@@ -172,24 +377,7 @@ int vjoy_udp_client_update(	// all parameters can be NULL except client
 	static struct vjoy_packet oldp = {0}, oldmp = {0};
 	static u64 lastupdate = 0;
 	static int count = 0;
-	static struct {
-		u32 buttons;
-		int posCp_x;
-		int posCp_y;
-		int posStk_x;
-		int posStk_y;
-		int touch_x;
-		int touch_y;
-		int touch_dx;
-		int touch_dy;
-		int gyro_x;
-		int gyro_y;
-		int gyro_z;
-		float slider;
-		int accel_x;
-		int accel_y;
-		int accel_z;
-	} data = {0};
+	static struct vjoy_data data = {0};
 
 	struct vjoy_packet newp = {0}, sendp = {0};
 	struct vjoy_packet newmp = {0}, sendmp = {0};
@@ -236,100 +424,27 @@ int vjoy_udp_client_update(	// all parameters can be NULL except client
 	}
 	++count;
 
-	// are we done collecting data? - if yes, prepare the data for vjoy feed and send
-	u64 now = getmicrotime();
+	u64 now = timestamp ? timestamp : getmicrotime();
 	if (!lastupdate) lastupdate = now;
-	if (now - lastupdate > client->interval) {
-		lastupdate = now;
 
-		// C-Pad
-		if (posCp) {
-			data.buttons &= 0x0FFFFFFF; // blank out the C-Pad buttons, we are sending real coordinates
-			newp.wAxisX = vjoy_udp_client_transform(data.posCp_x / count, client->coeffs.cp_deadzone, client->coeffs.cp_max, client->coeffs.cp_threshold, 0x8000, 0);
-			newp.wAxisY = vjoy_udp_client_transform(data.posCp_y / count, client->coeffs.cp_deadzone, client->coeffs.cp_max, client->coeffs.cp_threshold, 0x8000, 0);
-		} else {
-			if (data.buttons & KEY_CPAD_UP) newp.wAxisY=0x8000;
-			else if (data.buttons & KEY_CPAD_DOWN) newp.wAxisY=0;
-			else newp.wAxisY=0x4000;
-			if (data.buttons & KEY_CPAD_RIGHT) newp.wAxisX=0x8000;
-			else if (data.buttons & KEY_CPAD_LEFT) newp.wAxisX=0;
-			else newp.wAxisX=0x4000;
-		}
-		// C-Stick
-		int x=0,y=0;
-		if (posStk) {
-			data.buttons &= 0xF0FFFFFF; // blank out the C-Stick buttons, we are sending real coordinates
-			newp.wAxisXRot= vjoy_udp_client_transform(data.posStk_x / count, client->coeffs.cs_deadzone, client->coeffs.cs_max, client->coeffs.cs_threshold, 0x8000, 0);
-			newp.wAxisYRot= vjoy_udp_client_transform(data.posStk_y / count, client->coeffs.cs_deadzone, client->coeffs.cs_max, client->coeffs.cs_threshold, 0x8000, 0);
-			x=posStk->dx; y=posStk->dy;
-		} else {
-			if (data.buttons & KEY_CSTICK_UP) newp.wAxisYRot=0x8000;
-			else if (data.buttons & KEY_CSTICK_DOWN) newp.wAxisYRot=0;
-			else newp.wAxisYRot=0x4000;
-			if (data.buttons & KEY_CSTICK_RIGHT) newp.wAxisXRot=0x8000;
-			else if (data.buttons & KEY_CSTICK_LEFT) newp.wAxisXRot=0;
-			else newp.wAxisXRot=0x4000;
-			x=(newp.wAxisXRot>>8) - 0x40; y=(newp.wAxisYRot>>8) - 0x40;
-		}
-		// C-Stick on Pov hat #1
-		if (x * x + y * y > 40 * 40) {
-			newp.contPov  = ((int)(atan2(x, y) * 18000.0 * M_1_PI) + 36000) % 36000;
-			newp.discPovs = ((int)((newp.contPov + 4500) / 9000) % 4) | 0xFFFFFF00;
-		} else {
-			newp.contPov  = 0xFFFFFFFF;
-			newp.discPovs = 0xFFFFFF0F;
-		}
-		//D-Pad on Pov hat #2 (discrete only)
-		if (data.buttons & KEY_DRIGHT) newp.discPovs |= 0x10;
-		else if (data.buttons & KEY_DLEFT) newp.discPovs |= 0x30;
-		else if (data.buttons & KEY_DDOWN) newp.discPovs |= 0x20;
-		else if (!(data.buttons & KEY_DUP)) newp.discPovs |= 0xF0;
-
-		// Touch (relative or absolute)
-		if (touch) {
-			if (client->mouse_relative) {
-				newp.wAxisZ =    LIMIT((data.touch_dx * 0x4000 * client->mouse_sensitivity) / (320*10) + 0x4000, 0, 0x8000);
-				newp.wAxisZRot = LIMIT((data.touch_dy * 0x4000 * client->mouse_sensitivity) / (240*10) + 0x4000, 0, 0x8000);
-			} else {
-				newp.wAxisZ =    (data.touch_x / count) * 0x8000 / 320;
-				newp.wAxisZRot = (data.touch_y / count) * 0x8000 / 240;
-			}
+	// batch mode: every sample goes into the next datagram as it is
+	if (client->batch) {
+		vjoy_udp_client_build(client, &data, count, posCp, posStk, touch, accel, gyro, &newp, &newmp);
+		count = 0;
+		bzero(&data, sizeof(data));
+		vjoy_udp_client_batch_add(client, now, &newp, &newmp);
+		if (now - lastupdate >= client->batch_interval * 1000) {
+			lastupdate = now;
+			vjoy_udp_client_batch_flush(client);
 		}
+		return 0;
+	}
 
-		//Slider
-		newp.wSlider = (u32)((data.slider / count) * 0x8000);
-
-		// Buttons
-		u32 nbut = 0;
-		// re-order buttons according to buttons3ds array, remove meta button
-		for (int i1=0, i2=0; buttons3ds[i1] && i2<32; ++i1) {
-			if (buttons3ds[i1] == client->metabutton) continue;
-			if ((data.buttons & buttons3ds[i1]) != 0) nbut |= BIT(i2);
-			i2++;
-		}
-		//  bitshift 16 if meta button is pressed
-		if (client->metabutton) {
-			if ((data.buttons & client->metabutton) != 0) nbut = nbut << 16;
-			else nbut &= 0x0000FFFF;
-		}
-		newp.lButtons = nbut;
-
-		// motion packet **************************************
-		// Accelerometer
-		if (client->addr2.sin_port) {
-			if (accel) {
-				newmp.wAxisX = vjoy_udp_client_transform(data.accel_x / count, client->coeffs.acc_deadzone, client->coeffs.acc_max, client->coeffs.acc_threshold, 0x8000, 1);
-				newmp.wAxisY = vjoy_udp_client_transform(data.accel_y / count, client->coeffs.acc_deadzone, client->coeffs.acc_max, client->coeffs.acc_threshold, 0x8000, 1);
-				newmp.wAxisZ = vjoy_udp_client_transform(data.accel_z / count, client->coeffs.acc_deadzone, client->coeffs.acc_max, client->coeffs.acc_threshold, 0x8000, 1);
-			}
+	// are we done collecting data? - if yes, prepare the data for vjoy feed and send
+	if (now - lastupdate >= client->interval * 1000) {
+		lastupdate = now;
 
-			// Gyro
-			if (gyro) {
-				newmp.wAxisXRot = vjoy_udp_client_transform(data.gyro_x / count, client->coeffs.gy_deadzone, client->coeffs.gy_max, client->coeffs.gy_threshold, 0x8000, 1);
-				newmp.wAxisYRot = vjoy_udp_client_transform(data.gyro_y / count, client->coeffs.gy_deadzone, client->coeffs.gy_max, client->coeffs.gy_threshold, 0x8000, 1);
-				newmp.wAxisZRot = vjoy_udp_client_transform(data.gyro_z / count, client->coeffs.gy_deadzone, client->coeffs.gy_max, client->coeffs.gy_threshold, 0x8000, 1);
-			}
-		}
+		vjoy_udp_client_build(client, &data, count, posCp, posStk, touch, accel, gyro, &newp, &newmp);
 
 		count = 0;
 		bzero(&data, sizeof(data));
@@ -357,3 +472,11 @@ int vjoy_udp_client_update(	// all parameters can be NULL except client
 	}
 	return 0;
 }
+
+int vjoy_udp_client_shutdown(struct vjoy_udp_client *client)
+{
+	if (client->batch) vjoy_udp_client_batch_flush(client);
+	if (client->socket >= 0) close(client->socket);
+	client->socket = -1;
+	return 0;
+}
@@ -38,12 +38,34 @@ struct vjoy_udp_client {
 	u32 metabutton; // KEY_SELECT per default
 	int mouse_relative; // 0 for absolute, 1 for relative mouse movements (default 0)
 	int mouse_sensitivity; // mouse sensitivity for relative movements (default 10)
-	int interval; // in which intervals (ms) should we send new data to the server? (default 75)
+	int interval; // in which minimum intervals (ms) should we send new data to the server? (default 0: every update)
+	int batch; // 0 to send averaged packets, 1 to send all samples in batch datagrams (default 0)
+	int batch_interval; // in which intervals (ms) should batch datagrams be sent? (default 75)
 };
 
+/*
+Batch datagrams, sent to the button / joy / touch port, carry every sample
+since the last datagram instead of their average. Header (big endian):
+	"VJB\x01"	magic and version
+	u16		sequence number
+	u8		number of samples
+	u8		number of fields per sample: 11, or 17 with motion
+	u64		timestamp of the first sample in microseconds
+followed by the samples, each one as varints (7 bits per byte, least
+significant first, high bit set if more follow):
+	time since the previous sample in microseconds (0 for the first)
+	bit mask of the fields that changed from the previous sample
+	for each of them, the zigzag coded difference ((d << 1) ^ (d >> 31))
+The fields are those of the vJoy packet in order, then wAxisX, wAxisY,
+wAxisZ, wAxisXRot, wAxisYRot and wAxisZRot of the motion packet. The first
+sample of a datagram is coded against all zero fields, so every datagram
+can be decoded on its own. Datagrams without changes are not sent.
+*/
+
 extern int vjoy_udp_client_init(struct vjoy_udp_client *client, char *hostname, int port, int motionport);
 extern int vjoy_udp_client_update(
 	struct vjoy_udp_client *client,
+	u64 timestamp,	// of the sample in microseconds, 0 for now
 	u32 buttons,
 	circlePosition *posCp,
 	circlePosition *posStk,
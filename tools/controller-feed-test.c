@@ -0,0 +1,208 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * controller-feed-test.c - runs the input sampler and the controller feed
+ * on the host with a stand-in HID, while the main thread is held up as a
+ * long decode would, and checks that the Cemuhook server and the vJoy UDP
+ * client still send at the sampling rate
+ *
+ * A Cemuhook client on the loopback subscribes to the server, a socket
+ * stands in for the vJoy-UDP-feeder; every sample differs from the one
+ * before, so each one is sent. Counted are the packets per second and the
+ * longest gap between two of them.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -o controller-feed-test \
+ *      tools/controller-feed-test.c src/controllerfeed.c src/inputsampler.c \
+ *      src/dsu-server.c src/vjoy-udp-feeder-client.c -lz -lpthread -lm
+ * Usage: controller-feed-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <3ds.h>
+#include <SDL/SDL.h>
+#include "inputsampler.h"
+#include "controllerfeed.h"
+#include "vjoy-udp-feeder-client.h"
+#include "dsu-server.h"
+
+#define DSU_PORT 26799
+#define VJOY_PORT 16099
+#define RUN_MS 3000
+#define STALL_MS 100			// the main loop busy decoding
+#define MAX_GAP_MS 40			// a few sampling periods, with room for the host
+#define MIN_RATE (INPUT_RATE_HZ * 8 / 10)
+
+// the HID: every sample moves the circle pad
+
+static u32 hid_count;
+
+void hidScanInput(void) { hid_count++; }
+u32 hidKeysHeld(void) { return hid_count & 8 ? KEY_A : 0; }
+void hidCircleRead(circlePosition *pos) { pos->dx = 30 + hid_count % 50 * 2; pos->dy = -pos->dx; }
+void irrstCstickRead(circlePosition *pos) { pos->dx = pos->dy = 0; }
+void hidTouchRead(touchPosition *touch) { touch->px = touch->py = 0; }
+void hidAccelRead(accelVector *vector) { vector->x = vector->y = vector->z = 0; }
+void hidGyroRead(angularRate *rate) { rate->x = rate->y = rate->z = 0; }
+float osGet3DSliderState(void) { return 0; }
+Result HIDUSER_GetGyroscopeRawToDpsCoefficient(float *coeff) { *coeff = 14.375f; return 0; }
+Result PTMU_GetBatteryLevel(u8 *out) { *out = 5; return 0; }
+Result PTMU_GetBatteryChargeState(u8 *out) { *out = 0; return 0; }
+void SDL_N3DS_SetInputSource(void (*source)(SDL_N3DSInput *input)) { }
+
+char *itoa(int value, char *str, int base)
+{
+	sprintf(str, "%d", value);	// only ever called for port numbers
+	return str;
+}
+
+u64 getmicrotime()
+{
+	return host_ns() / 1000;
+}
+
+// the receivers
+
+typedef struct {
+	const char *name;
+	int socket;
+	u32 packets;
+	u64 first, last, max_gap;	// us
+} receiver;
+
+static volatile int receiving = 1;
+
+static void receive_thread(void *arg)
+{
+	receiver *r = arg;
+	u8 buf[1500];
+	struct timeval tv = { 0, 100000 };
+
+	setsockopt(r->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (receiving) {
+		int n = recv(r->socket, buf, sizeof(buf), 0);
+		u64 now = host_ns() / 1000;
+
+		// the Cemuhook server answers with other messages too
+		if (n <= 0 || (n >= 20 && !memcmp(buf, "DSUS", 4) && buf[16] != 0x02)) continue;
+		if (r->packets++) {
+			if (now - r->last > r->max_gap) r->max_gap = now - r->last;
+		} else
+			r->first = now;
+		r->last = now;
+	}
+}
+
+static int udp_socket(int port)
+{
+	struct sockaddr_in addr = { 0 };
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (port && bind(s, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind");
+		exit(1);
+	}
+	return s;
+}
+
+// asks the Cemuhook server for the data of all slots
+static void dsu_subscribe(int s, u32 id)
+{
+	struct sockaddr_in addr = { 0 };
+	u8 req[28] = "DSUC";
+	u32 crc;
+
+	*(u16 *)(req + 4) = 1001;
+	*(u16 *)(req + 6) = sizeof(req) - 16;
+	*(u32 *)(req + 12) = id;
+	*(u32 *)(req + 16) = 0x100002;
+	crc = crc32(0, req, sizeof(req));
+	*(u32 *)(req + 8) = crc;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(DSU_PORT);
+	sendto(s, req, sizeof(req), 0, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+static int check(const receiver *r, const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s: %s\n", r->name, what);
+	return !ok;
+}
+
+int main(int argc, char **argv)
+{
+	struct vjoy_udp_client udp;
+	struct dsu_server dsu;
+	receiver dsu_rx = { "Cemuhook" }, vjoy_rx = { "vJoy" };
+	receiver *rx[] = { &dsu_rx, &vjoy_rx };
+	Thread dsu_tid, vjoy_tid;
+	u64 start;
+	int fails = 0, i;
+
+	if (dsu_server_init(&dsu, DSU_PORT)) {
+		printf("FAIL: Cemuhook server: %s\n", dsu.lasterrmsg);
+		return 1;
+	}
+	dsu.interval = 0;
+	if (vjoy_udp_client_init(&udp, "127.0.0.1", VJOY_PORT, 0)) {
+		printf("FAIL: vJoy client: %s\n", udp.lasterrmsg);
+		return 1;
+	}
+	udp.interval = 0;
+	dsu_rx.socket = udp_socket(0);
+	vjoy_rx.socket = udp_socket(VJOY_PORT);
+	dsu_tid = threadCreate(receive_thread, &dsu_rx, 0, 0, 0, false);
+	vjoy_tid = threadCreate(receive_thread, &vjoy_rx, 0, 0, 0, false);
+	dsu_subscribe(dsu_rx.socket, 1);
+
+	input_start(1);
+	controller_start(&udp, 0, &dsu);
+
+	// the main loop, decoding for STALL_MS at a time
+	start = osGetTime();
+	while (osGetTime() - start < RUN_MS) {
+		if (controller_health()) {
+			printf("FAIL: a feed failed: %s\n", dsu.lasterrmsg);
+			fails++;
+			break;
+		}
+		svcSleepThread(STALL_MS * 1000000LL);
+	}
+
+	controller_stop();
+	input_stop();
+	receiving = 0;
+	threadJoin(dsu_tid, U64_MAX);
+	threadJoin(vjoy_tid, U64_MAX);
+	threadFree(dsu_tid);
+	threadFree(vjoy_tid);
+	dsu_server_shutdown(&dsu);
+	vjoy_udp_client_shutdown(&udp);
+
+	for (i = 0; i < 2; i++) {
+		receiver *r = rx[i];
+		double secs = (r->last - r->first) / 1e6;
+		int rate = secs > 0 ? (r->packets - 1) / secs : 0;
+
+		printf("%-9s %u packets, %d/s, longest gap %llu ms, main loop held up for %d ms at a time\n",
+			r->name, r->packets, rate, (unsigned long long)r->max_gap / 1000, STALL_MS);
+		fails += check(r, "sends below the sampling rate", rate >= MIN_RATE);
+		fails += check(r, "sends in bursts", r->max_gap <= MAX_GAP_MS * 1000);
+	}
+	printf("%u samples lost by the controller thread\n", controller_overruns());
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
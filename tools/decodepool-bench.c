@@ -0,0 +1,217 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * decodepool-bench.c - runs the Tight JPEG decode pool on the host: checks
+ * that the workers decode what the main thread would and that each failed
+ * rectangle reports its own error, then times 0, 1 and 2 worker threads
+ *
+ * Build (from the top directory):
+ *   cc -O2 -D_3DS -Itools/host -Isrc -Isrc/rfb -o decodepool-bench \
+ *      tools/decodepool-bench.c src/rfb/decodepool.c src/rfb/turbojpeg.c -ljpeg -lpthread
+ * Usage: decodepool-bench [frames]   (default 50)
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+#include "decodepool.h"
+#include "turbojpeg.h"
+
+#define FB_W 800
+#define FB_H 480
+#define TILE 64
+#define TILES_X ((FB_W + TILE - 1) / TILE)
+#define TILES_Y ((FB_H + TILE - 1) / TILE)
+#define NTILES (TILES_X * TILES_Y)
+#define NBAD 8
+
+static struct {
+	unsigned char *data;
+	unsigned long len;
+	int x, y, w, h;
+} tiles[NTILES];
+
+static char logged[NBAD * 2][256];
+static int nlogged;
+
+static void quiet(const char *format, ...)
+{
+	va_list args;
+	if (nlogged >= NBAD * 2 || !strstr(format, "TurboJPEG")) return;
+	va_start(args, format);
+	vsnprintf(logged[nlogged++], sizeof(logged[0]), format, args);
+	va_end(args);
+}
+
+rfbClientLogProc rfbClientLog = quiet;
+rfbClientLogProc rfbClientErr = quiet;
+
+static void got_update(rfbClient *client, int x, int y, int w, int h)
+{
+}
+
+// something that is neither flat nor noise, like a desktop
+static void make_image(unsigned char *img)
+{
+	int x, y;
+	unsigned seed = 1;
+
+	for (y = 0; y < FB_H; y++)
+		for (x = 0; x < FB_W; x++) {
+			unsigned char *p = img + (y * FB_W + x) * 3;
+			seed = seed * 1103515245 + 12345;
+			p[0] = x * 255 / FB_W;
+			p[1] = ((x / 40 + y / 40) & 1) ? 200 : 40;
+			p[2] = (y * 255 / FB_H) ^ ((seed >> 16) & 15);
+		}
+}
+
+static void make_tiles()
+{
+	unsigned char *img = malloc(FB_W * FB_H * 3);
+	tjhandle tj = tjInitCompress();
+	int i;
+
+	make_image(img);
+	for (i = 0; i < NTILES; i++) {
+		int x = (i % TILES_X) * TILE, y = (i / TILES_X) * TILE;
+		int w = FB_W - x < TILE ? FB_W - x : TILE;
+		int h = FB_H - y < TILE ? FB_H - y : TILE;
+		tiles[i].x = x; tiles[i].y = y; tiles[i].w = w; tiles[i].h = h;
+		tiles[i].data = malloc(tjBufSize(w, h, TJSAMP_420));
+		if (tjCompress2(tj, img + (y * FB_W + x) * 3, w, FB_W * 3, h, TJPF_RGB,
+				&tiles[i].data, &tiles[i].len, TJSAMP_420, 80, 0) == -1) {
+			fprintf(stderr, "compress: %s\n", tjGetErrorStr2(tj));
+			exit(1);
+		}
+	}
+	tjDestroy(tj);
+	free(img);
+}
+
+static rfbClient *make_client(int threads)
+{
+	rfbClient *client = calloc(1, sizeof(rfbClient));
+	client->width = FB_W;
+	client->height = FB_H;
+	client->frameBuffer = calloc(FB_W * FB_H, 4);
+	client->decodeThreads = threads;
+	client->GotFrameBufferUpdate = got_update;
+	return client;
+}
+
+static void free_client(rfbClient *client)
+{
+	rfbDecodePoolDestroy(client);
+	free(client->frameBuffer);
+	free(client);
+}
+
+// one framebuffer update of all tiles, as tight-c.h would handle it
+static int decode_frame(rfbClient *client, tjhandle tj)
+{
+	int i, pitch = client->width * 4;
+
+	for (i = 0; i < NTILES; i++) {
+		uint8_t *copy = malloc(tiles[i].len);
+		memcpy(copy, tiles[i].data, tiles[i].len);
+		if (rfbDecodePoolSubmitJpeg(client, copy, tiles[i].len, tiles[i].x, tiles[i].y, tiles[i].w, tiles[i].h))
+			continue;
+		if (tjDecompress(tj, copy, tiles[i].len,
+				&client->frameBuffer[tiles[i].y * pitch + tiles[i].x * 4],
+				tiles[i].w, pitch, tiles[i].h, 4, TJ_ALPHAFIRST | TJ_BGR) == -1) {
+			free(copy);
+			return 0;
+		}
+		free(copy);
+	}
+	return rfbDecodePoolWaitAll(client);
+}
+
+// corrupt rectangles decoded side by side must not swap their messages
+static int check_errors()
+{
+	rfbClient *client = make_client(2);
+	char want[64];
+	int i, j, found, fails = 0;
+
+	for (i = 0; i < NBAD; i++) {
+		uint8_t *bad = malloc(tiles[i].len);
+		memcpy(bad, tiles[i].data, tiles[i].len);
+		bad[0] = 0x10 + i;	// "Not a JPEG file: starts with 0x.. 0xd8"
+		if (!rfbDecodePoolSubmitJpeg(client, bad, tiles[i].len, tiles[i].x, tiles[i].y, tiles[i].w, tiles[i].h)) {
+			printf("FAIL: pool not available\n");
+			return 1;
+		}
+	}
+	if (rfbDecodePoolWaitAll(client)) {
+		printf("FAIL: corrupt rectangles decoded\n");
+		fails++;
+	}
+	for (i = 0; i < NBAD; i++) {
+		snprintf(want, sizeof(want), "starts with 0x%02x", 0x10 + i);
+		for (j = found = 0; j < nlogged; j++)
+			if (strstr(logged[j], want)) found++;
+		if (found != 1) {
+			printf("FAIL: \"%s\" logged %d times\n", want, found);
+			fails++;
+		}
+	}
+	if (nlogged != NBAD) {
+		printf("FAIL: %d errors logged for %d corrupt rectangles\n", nlogged, NBAD);
+		fails++;
+	}
+	free_client(client);
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 50;
+	tjhandle tj = tjInitDecompress();
+	unsigned char *ref;
+	int threads, i, fails = 0;
+	unsigned long bytes = 0;
+
+	make_tiles();
+	for (i = 0; i < NTILES; i++) bytes += tiles[i].len;
+	printf("%d x %d, %d JPEG rectangles of %dx%d, %lu bytes per frame\n",
+		FB_W, FB_H, NTILES, TILE, TILE, bytes);
+
+	fails += check_errors();
+
+	ref = malloc(FB_W * FB_H * 4);
+	for (threads = 0; threads <= 2; threads++) {
+		rfbClient *client = make_client(threads);
+		u64 t0, t1;
+
+		if (!decode_frame(client, tj)) {
+			printf("FAIL: %d threads: decoding failed\n", threads);
+			return 1;
+		}
+		if (threads == 0)
+			memcpy(ref, client->frameBuffer, FB_W * FB_H * 4);
+		else if (memcmp(ref, client->frameBuffer, FB_W * FB_H * 4)) {
+			printf("FAIL: %d threads: framebuffer differs from serial decoding\n", threads);
+			fails++;
+		}
+
+		t0 = host_ns();
+		for (i = 0; i < frames; i++) decode_frame(client, tj);
+		t1 = host_ns();
+		printf("%d decode thread(s): %7.2f ms per frame, %6.1f frames/s\n", threads,
+			(t1 - t0) / 1e6 / frames, frames * 1e9 / (t1 - t0));
+		free_client(client);
+	}
+	free(ref);
+	tjDestroy(tj);
+	for (i = 0; i < NTILES; i++) free(tiles[i].data);
+
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
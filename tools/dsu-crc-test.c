@@ -0,0 +1,203 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * dsu-crc-test.c - checks the CRC-32 of the Cemuhook server against zlib's
+ *
+ * crc32calc() is compared with crc32() for every length up to a few
+ * hundred bytes at every alignment. Then several Cemuhook clients on the
+ * loopback subscribe to the server, which is fed changing samples; the
+ * server checksums each controller data packet once and patches the CRC
+ * for every client's packet number (crc32patch()). Every packet received
+ * is checked against a full recompute, and its packet number against the
+ * one before. The clients' packet numbers start at values that carry into
+ * every byte of the number, so that all the patch tables are used.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -o dsu-crc-test tools/dsu-crc-test.c \
+ *      src/dsu-server.c -lz -lm
+ * Usage: dsu-crc-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <3ds.h>
+#include "dsu-server.h"
+
+#define DSU_PORT 26798
+#define CLIENTS 4
+#define UPDATES 1000
+#define PAD_DATA_LEN 100
+#define PAD_DATA_COUNTER 32
+
+extern unsigned int crc32calc(unsigned char *message, int msglen);
+
+// the packet numbers the clients start at, each one sent with the next
+static const u32 first_count[CLIENTS] = { 0, 0xFF - 10, 0xFFFF - 500, 0xFFFFFFFF - 300 };
+
+Result HIDUSER_GetGyroscopeRawToDpsCoefficient(float *coeff) { *coeff = 14.375f; return 0; }
+Result PTMU_GetBatteryLevel(u8 *out) { *out = 5; return 0; }
+Result PTMU_GetBatteryChargeState(u8 *out) { *out = 0; return 0; }
+
+u64 getmicrotime()
+{
+	return host_ns() / 1000;
+}
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static int check(const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s\n", what);
+	return !ok;
+}
+
+static int calc_test()
+{
+	u8 buf[512 + 8];
+	int len, align, bad = 0;
+
+	for (len = 0; len < (int)sizeof(buf); len++)
+		buf[len] = rnd(256);
+	for (len = 0; len <= 512; len++)
+		for (align = 0; align < 8; align++)
+			if (crc32calc(buf + align, len) != crc32(0, buf + align, len)) {
+				if (!bad++) printf("FAIL: crc32calc, %d bytes at offset %d\n", len, align);
+			}
+	return bad != 0;
+}
+
+static int udp_socket()
+{
+	struct sockaddr_in addr = { 0 };
+	struct timeval tv = { 0, 100000 };
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind");
+		exit(1);
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return s;
+}
+
+// asks the Cemuhook server for the data of all slots
+static void dsu_subscribe(int s, u32 id)
+{
+	struct sockaddr_in addr = { 0 };
+	u8 req[28] = "DSUC";
+
+	*(u16 *)(req + 4) = 1001;
+	*(u16 *)(req + 6) = sizeof(req) - 16;
+	*(u32 *)(req + 12) = id;
+	*(u32 *)(req + 16) = 0x100002;
+	*(u32 *)(req + 8) = crc32(0, req, sizeof(req));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(DSU_PORT);
+	sendto(s, req, sizeof(req), 0, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+// the server's client with the address of socket s
+static struct dsu_client *server_client(struct dsu_server *server, int s)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct dsu_client *c;
+
+	getsockname(s, (struct sockaddr *)&addr, &len);
+	for (c = server->cli_first; c; c = c->next)
+		if (c->addr.sin_port == addr.sin_port) return c;
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct dsu_server dsu;
+	int sock[CLIENTS], i, n, fails = 0;
+	u32 received[CLIENTS] = { 0 }, last[CLIENTS], bad_crc = 0, bad_count = 0;
+
+	fails += calc_test();
+
+	if (dsu_server_init(&dsu, DSU_PORT)) {
+		printf("FAIL: Cemuhook server: %s\n", dsu.lasterrmsg);
+		return 1;
+	}
+	dsu.interval = 0;
+
+	for (i = 0; i < CLIENTS; i++) {
+		struct dsu_client *c = NULL;
+
+		sock[i] = udp_socket();
+		dsu_subscribe(sock[i], i + 1);
+		for (n = 0; n < 100 && !c; n++) {
+			usleep(1000);
+			dsu_server_run(&dsu);
+			c = server_client(&dsu, sock[i]);
+		}
+		if (!c) {
+			printf("FAIL: client %d not subscribed\n", i);
+			return 1;
+		}
+		c->packet_count = last[i] = first_count[i];
+	}
+
+	for (n = 0; n < UPDATES; n++) {
+		circlePosition cpad = { 30 + n % 50 * 2, -(30 + n % 50 * 2) };
+		accelVector accel = { rnd(512), rnd(512), rnd(512) };
+
+		dsu_server_update(&dsu, 0, n & 8 ? KEY_A : 0, &cpad, NULL, NULL, &accel, NULL);
+
+		// every client gets the packet, with its own number
+		for (i = 0; i < CLIENTS; i++) {
+			u8 buf[1500];
+			u32 crc;
+			int len;
+
+			while ((len = recv(sock[i], buf, sizeof(buf), 0)) > 0 &&
+				!(len == PAD_DATA_LEN && !memcmp(buf, "DSUS", 4) && buf[16] == 0x02))
+				;
+			if (len != PAD_DATA_LEN) continue;
+			received[i]++;
+			crc = *(u32 *)(buf + 8);
+			*(u32 *)(buf + 8) = 0;
+			if (crc != crc32(0, buf, len)) {
+				if (!bad_crc++)
+					printf("FAIL: client %d, packet %u: CRC %08x, recomputed %08x\n",
+						i, *(u32 *)(buf + PAD_DATA_COUNTER), crc, (u32)crc32(0, buf, len));
+			}
+			if (*(u32 *)(buf + PAD_DATA_COUNTER) != last[i] + 1) {
+				if (!bad_count++)
+					printf("FAIL: client %d: packet %u after %u\n",
+						i, *(u32 *)(buf + PAD_DATA_COUNTER), last[i]);
+			}
+			last[i] = *(u32 *)(buf + PAD_DATA_COUNTER);
+		}
+	}
+	dsu_server_shutdown(&dsu);
+
+	for (i = 0; i < CLIENTS; i++) {
+		printf("client %d: %u packets, numbered from %u to %u\n", i, received[i], first_count[i] + 1, last[i]);
+		fails += check("packets lost", received[i] == UPDATES);
+		close(sock[i]);
+	}
+	fails += check("patched CRC differs from the recomputed one", !bad_crc);
+	fails += check("packet numbers not consecutive", !bad_count);
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,305 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * 3ds.h - the part of libctru the host test tools need, on top of pthreads
+ *
+ * The tools in tools/ build parts of TinyVNC on the host with -Itools/host,
+ * so that the sources include this file instead of the real <3ds.h>.
+ * Threads, locks and clocks work; the DSP functions are only declared, a
+ * tool that needs them brings its own stand-in.
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#ifndef TOOLS_HOST_3DS_H
+#define TOOLS_HOST_3DS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef s32 Result;
+typedef u32 Handle;
+
+#define BIT(n) (1U<<(n))
+#define U64_MAX UINT64_MAX
+#define CUR_THREAD_HANDLE 0xFFFF8000
+#define SYSCLOCK_ARM11 268111856ULL
+
+// clocks
+
+static inline u64 host_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline u64 svcGetSystemTick()
+{
+	u64 ns = host_ns();
+	return ns / 1000000000ULL * SYSCLOCK_ARM11 + ns % 1000000000ULL * SYSCLOCK_ARM11 / 1000000000ULL;
+}
+
+static inline u64 osGetTime()
+{
+	return host_ns() / 1000000;
+}
+
+static inline void svcSleepThread(s64 ns)
+{
+	struct timespec ts;
+	if (ns <= 0) return;
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
+	nanosleep(&ts, NULL);
+}
+
+// threads; priorities and cores are ignored
+
+typedef void (*ThreadFunc)(void *);
+typedef struct Thread_tag {
+	pthread_t t;
+	ThreadFunc f;
+	void *arg;
+} *Thread;
+
+static void *host_thread_main(void *arg)
+{
+	Thread t = arg;
+	t->f(t->arg);
+	return NULL;
+}
+
+static inline Thread threadCreate(ThreadFunc f, void *arg, size_t stack, int prio, int core, bool detached)
+{
+	Thread t = malloc(sizeof(*t));
+	if (!t) return NULL;
+	t->f = f;
+	t->arg = arg;
+	if (pthread_create(&t->t, NULL, host_thread_main, t)) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+static inline Result threadJoin(Thread t, u64 timeout)
+{
+	return pthread_join(t->t, NULL);
+}
+
+static inline void threadFree(Thread t)
+{
+	free(t);
+}
+
+static inline Result svcGetThreadPriority(s32 *prio, Handle h)
+{
+	*prio = 0x30;
+	return 0;
+}
+
+// a New 3DS: every tool gets all the worker threads it asks for
+static inline Result APT_CheckNew3DS(bool *n3ds)
+{
+	*n3ds = true;
+	return 0;
+}
+
+// synchronisation
+
+typedef pthread_mutex_t LightLock;
+static inline void LightLock_Init(LightLock *l) { pthread_mutex_init(l, NULL); }
+static inline void LightLock_Lock(LightLock *l) { pthread_mutex_lock(l); }
+static inline void LightLock_Unlock(LightLock *l) { pthread_mutex_unlock(l); }
+static inline int LightLock_TryLock(LightLock *l) { return pthread_mutex_trylock(l); }
+
+typedef pthread_cond_t CondVar;
+static inline void CondVar_Init(CondVar *c) { pthread_cond_init(c, NULL); }
+static inline void CondVar_Wait(CondVar *c, LightLock *l) { pthread_cond_wait(c, l); }
+static inline void CondVar_Signal(CondVar *c) { pthread_cond_signal(c); }
+static inline void CondVar_Broadcast(CondVar *c) { pthread_cond_broadcast(c); }
+
+static inline int CondVar_WaitTimeout(CondVar *c, LightLock *l, s64 ns)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ns / 1000000000LL;
+	ts.tv_nsec += ns % 1000000000LL;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return pthread_cond_timedwait(c, l, &ts) ? 1 : 0;
+}
+
+typedef enum { RESET_ONESHOT, RESET_STICKY, RESET_PULSE } ResetType;
+typedef struct {
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	int state;
+	ResetType type;
+} LightEvent;
+
+static inline void LightEvent_Init(LightEvent *e, ResetType type)
+{
+	pthread_mutex_init(&e->m, NULL);
+	pthread_cond_init(&e->c, NULL);
+	e->state = 0;
+	e->type = type;
+}
+
+static inline void LightEvent_Signal(LightEvent *e)
+{
+	pthread_mutex_lock(&e->m);
+	e->state = 1;
+	pthread_cond_broadcast(&e->c);
+	pthread_mutex_unlock(&e->m);
+}
+
+static inline void LightEvent_Clear(LightEvent *e)
+{
+	pthread_mutex_lock(&e->m);
+	e->state = 0;
+	pthread_mutex_unlock(&e->m);
+}
+
+static inline void LightEvent_Wait(LightEvent *e)
+{
+	pthread_mutex_lock(&e->m);
+	while (!e->state) pthread_cond_wait(&e->c, &e->m);
+	if (e->type == RESET_ONESHOT) e->state = 0;
+	pthread_mutex_unlock(&e->m);
+}
+
+static inline int LightEvent_WaitTimeout(LightEvent *e, s64 ns)
+{
+	struct timespec ts;
+	int s;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ns / 1000000000LL;
+	ts.tv_nsec += ns % 1000000000LL;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&e->m);
+	while (!e->state && !pthread_cond_timedwait(&e->c, &e->m, &ts));
+	s = e->state;
+	if (s && e->type == RESET_ONESHOT) e->state = 0;
+	pthread_mutex_unlock(&e->m);
+	return s ? 0 : 1;
+}
+
+static inline int LightEvent_TryWait(LightEvent *e)
+{
+	int s;
+	pthread_mutex_lock(&e->m);
+	s = e->state;
+	if (s && e->type == RESET_ONESHOT) e->state = 0;
+	pthread_mutex_unlock(&e->m);
+	return s;
+}
+
+// linear memory comes from the heap; a tool may cap it to model the 3DS
+
+extern size_t host_linear_limit;	// 0: no limit
+extern size_t host_linear_used;
+void *linearAlloc(size_t size);
+void *linearMemAlign(size_t size, size_t align);
+void linearFree(void *mem);
+u32 linearSpaceFree(void);
+
+// the HID, types and key bits only
+
+enum {
+	KEY_A = BIT(0), KEY_B = BIT(1), KEY_SELECT = BIT(2), KEY_START = BIT(3),
+	KEY_DRIGHT = BIT(4), KEY_DLEFT = BIT(5), KEY_DUP = BIT(6), KEY_DDOWN = BIT(7),
+	KEY_R = BIT(8), KEY_L = BIT(9), KEY_X = BIT(10), KEY_Y = BIT(11),
+	KEY_ZL = BIT(14), KEY_ZR = BIT(15), KEY_TOUCH = BIT(20),
+	KEY_CSTICK_RIGHT = BIT(24), KEY_CSTICK_LEFT = BIT(25), KEY_CSTICK_UP = BIT(26), KEY_CSTICK_DOWN = BIT(27),
+	KEY_CPAD_RIGHT = BIT(28), KEY_CPAD_LEFT = BIT(29), KEY_CPAD_UP = BIT(30), KEY_CPAD_DOWN = BIT(31),
+};
+
+typedef struct { s16 dx, dy; } circlePosition;
+typedef struct { u16 px, py; } touchPosition;
+typedef struct { s16 x, y, z; } accelVector;
+typedef struct { s16 x, z, y; } angularRate;
+
+// the HID itself, declared only; a tool that samples brings its stand-ins
+
+void hidScanInput(void);
+u32 hidKeysHeld(void);
+void hidCircleRead(circlePosition *pos);
+void irrstCstickRead(circlePosition *pos);
+void hidTouchRead(touchPosition *touch);
+void hidAccelRead(accelVector *vector);
+void hidGyroRead(angularRate *rate);
+float osGet3DSliderState(void);
+Result HIDUSER_GetGyroscopeRawToDpsCoefficient(float *coeff);
+Result PTMU_GetBatteryLevel(u8 *out);
+Result PTMU_GetBatteryChargeState(u8 *out);
+
+// the system, declared only
+
+typedef struct OS_VersionBin OS_VersionBin;
+Result osGetSystemVersionDataString(OS_VersionBin *nver, OS_VersionBin *cver, char *sysverstr, u32 size);
+char *itoa(int value, char *str, int base);	// newlib
+
+static inline Result DSP_FlushDataCache(const void *p, u32 size) { return 0; }
+static inline Result GSPGPU_FlushDataCache(const void *p, u32 size) { return 0; }
+
+// the DSP, declared only
+
+typedef struct {
+	union {
+		s8 *data_pcm8;
+		s16 *data_pcm16;
+		u8 *data_adpcm;
+		const void *data_vaddr;
+	};
+	u32 nsamples;
+	void *adpcm_data;
+	u32 offset;
+	bool looping;
+	u8 status;
+	u16 sequence_id;
+	void *next;
+} ndspWaveBuf;
+
+enum { NDSP_WBUF_FREE, NDSP_WBUF_QUEUED, NDSP_WBUF_PLAYING, NDSP_WBUF_DONE };
+#define NDSP_FORMAT_MONO_PCM16 5
+#define NDSP_FORMAT_STEREO_PCM16 10
+#define NDSP_INTERP_POLYPHASE 0
+#define NDSP_INTERP_LINEAR 1
+#define NDSP_OUTPUT_MONO 0
+#define NDSP_OUTPUT_STEREO 1
+
+Result ndspInit(void);
+void ndspExit(void);
+void ndspSetOutputMode(int mode);
+void ndspChnReset(int id);
+void ndspChnSetInterp(int id, int type);
+void ndspChnSetRate(int id, float rate);
+void ndspChnSetFormat(int id, u16 format);
+void ndspChnSetMix(int id, float mix[12]);
+void ndspChnSetPaused(int id, bool paused);
+void ndspChnWaveBufAdd(int id, ndspWaveBuf *buf);
+void ndspChnWaveBufClear(int id);
+u32 ndspChnGetSamplePos(int id);
+bool ndspChnIsPlaying(int id);
+
+#endif
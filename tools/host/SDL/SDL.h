@@ -0,0 +1,30 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * SDL.h - the part of SDL the host test tools need: the hook through which
+ * the input thread feeds the event pump, declared only
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#ifndef TOOLS_HOST_SDL_H
+#define TOOLS_HOST_SDL_H
+
+#include <stdint.h>
+
+typedef uint32_t Uint32;
+typedef uint16_t Uint16;
+typedef int16_t Sint16;
+
+typedef struct SDL_N3DSInput {
+	Uint32 held;
+	Uint32 down;
+	Uint32 up;
+	Uint16 touch_x, touch_y;
+	Sint16 cpad_x, cpad_y;
+	Sint16 cstick_x, cstick_y;
+} SDL_N3DSInput;
+
+void SDL_N3DS_SetInputSource(void (*source)(SDL_N3DSInput *input));
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * opus.h - the part of libopus opusdecoder.c uses, declared only, for
+ * host tools that bring a stand-in decoder
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#ifndef TOOLS_HOST_OPUS_H
+#define TOOLS_HOST_OPUS_H
+
+#include <stdint.h>
+
+typedef int16_t opus_int16;
+typedef int32_t opus_int32;
+typedef struct OpusDecoder OpusDecoder;
+
+#define OPUS_OK 0
+#define OPUS_BAD_ARG -1
+#define OPUS_INVALID_PACKET -4
+
+#define OPUS_RESET_STATE 4028
+#define OPUS_SET_GAIN_REQUEST 4034
+#define OPUS_SET_GAIN(x) OPUS_SET_GAIN_REQUEST, (opus_int32)(x)
+
+OpusDecoder *opus_decoder_create(opus_int32 Fs, int channels, int *error);
+void opus_decoder_destroy(OpusDecoder *st);
+int opus_decoder_ctl(OpusDecoder *st, int request, ...);
+int opus_decode(OpusDecoder *st, const unsigned char *data, opus_int32 len,
+	opus_int16 *pcm, int frame_size, int decode_fec);
+int opus_packet_get_nb_samples(const unsigned char packet[], opus_int32 len, opus_int32 Fs);
+const char *opus_strerror(int error);
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * linear-soak-test.c - reconnects and resizes a model of the VNC session
+ * hundreds of times against linearpool.c on a first-fit linear heap, and
+ * checks that the pool neither hands out a buffer twice nor loses one
+ *
+ * The heap stands in for the one of libctru: a fixed arena, first fit,
+ * neighbouring free blocks merged. On it the session allocates what the
+ * viewer does: the SDL screen buffers and the text vertex buffer once, per
+ * connection the VNC framebuffer and maybe the wave buffers of a stream,
+ * and per update the VNC texture (straight from the heap, as citro3d
+ * does; kept while its size stays, the pool trimmed when it does not fit)
+ * and now and then a sprite with its staging buffer. Every live buffer
+ * carries a tag at both ends that must survive until it is freed.
+ *
+ * Every scenario runs twice on each heap size, once with the pool and once
+ * with plain linearAlloc/linearFree, and the pool must not fail more
+ * textures or framebuffers than the plain heap; the heaps of 20 and 24 MB
+ * are tight enough for both to fail. With the server alternating between
+ * two sizes, every texture must fit in a 32 MB heap. -m runs one heap size
+ * only.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -o linear-soak-test \
+ *      tools/linear-soak-test.c src/linearpool.c -lpthread
+ * Usage: linear-soak-test [-m MB] [-v]   (-v: print every failed allocation)
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <3ds.h>
+#include "linearpool.h"
+
+#define POOL_MAX (8 * 1024 * 1024)	// see linearpool.c
+#define TAG_BYTES 256
+#define MAX_SEGS 4096
+#define HEAP_MB 32			// the textures must fit in a heap this large
+
+static int verbose = 0;
+static int nopool = 0;
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+// the linear heap: first fit over an arena of host_linear_limit bytes
+
+size_t host_linear_limit = 0;
+size_t host_linear_used = 0;
+
+typedef struct {
+	u32 off, size;
+	int used;
+} seg;
+
+static u8 *arena;
+static seg segs[MAX_SEGS];	// by offset, covering the arena
+static int nsegs;
+static int bad_frees;
+static LightLock heap_lock;
+
+static void heap_init(size_t size)
+{
+	free(arena);
+	arena = aligned_alloc(0x80, size);
+	host_linear_limit = size;
+	host_linear_used = 0;
+	segs[0] = (seg){ 0, size, 0 };
+	nsegs = 1;
+	bad_frees = 0;
+	LightLock_Init(&heap_lock);
+}
+
+void *linearAlloc(size_t size)
+{
+	void *p = NULL;
+
+	size = (size + 0x7f) & ~0x7f;
+	LightLock_Lock(&heap_lock);
+	for (int i = 0; i < nsegs; i++) {
+		if (segs[i].used || segs[i].size < size) continue;
+		if (segs[i].size > size && nsegs < MAX_SEGS) {
+			memmove(&segs[i + 2], &segs[i + 1], (nsegs - i - 1) * sizeof(seg));
+			segs[i + 1] = (seg){ segs[i].off + size, segs[i].size - size, 0 };
+			segs[i].size = size;
+			nsegs++;
+		}
+		segs[i].used = 1;
+		host_linear_used += segs[i].size;
+		p = arena + segs[i].off;
+		break;
+	}
+	LightLock_Unlock(&heap_lock);
+	return p;
+}
+
+void linearFree(void *mem)
+{
+	int i;
+
+	if (!mem) return;
+	LightLock_Lock(&heap_lock);
+	for (i = 0; i < nsegs && (segs[i].off != (u8*)mem - arena || !segs[i].used); i++);
+	if (i == nsegs) {
+		bad_frees++;
+		LightLock_Unlock(&heap_lock);
+		return;
+	}
+	segs[i].used = 0;
+	host_linear_used -= segs[i].size;
+	if (i + 1 < nsegs && !segs[i + 1].used) {
+		segs[i].size += segs[i + 1].size;
+		memmove(&segs[i + 1], &segs[i + 2], (nsegs - i - 2) * sizeof(seg));
+		nsegs--;
+	}
+	if (i > 0 && !segs[i - 1].used) {
+		segs[i - 1].size += segs[i].size;
+		memmove(&segs[i], &segs[i + 1], (nsegs - i - 1) * sizeof(seg));
+		nsegs--;
+	}
+	LightLock_Unlock(&heap_lock);
+}
+
+static u32 largest_free()
+{
+	u32 largest = 0;
+
+	for (int i = 0; i < nsegs; i++)
+		if (!segs[i].used && segs[i].size > largest) largest = segs[i].size;
+	return largest;
+}
+
+// the buffers of the session, tagged at both ends
+
+typedef struct {
+	u8 *mem;
+	u32 size;
+	u8 tag;
+	int pooled;		// from linear_alloc, else straight from the heap
+} buf;
+
+static u8 next_tag = 1;
+static int clobbered;
+
+static void buf_tag(buf *b)
+{
+	u32 n = b->size < TAG_BYTES ? b->size : TAG_BYTES;
+
+	b->tag = next_tag++ ? next_tag : ++next_tag;
+	memset(b->mem, b->tag, n);
+	memset(b->mem + b->size - n, b->tag, n);
+}
+
+static void buf_check(buf *b, const char *what)
+{
+	u32 n = b->size < TAG_BYTES ? b->size : TAG_BYTES;
+
+	if (!b->mem) return;
+	for (u32 i = 0; i < n; i++) {
+		if (b->mem[i] != b->tag || b->mem[b->size - n + i] != b->tag) {
+			if (!clobbered++) printf("FAIL: the %s at %p was overwritten\n", what, b->mem);
+			return;
+		}
+	}
+}
+
+static int buf_alloc(buf *b, u32 size, linear_use use)
+{
+	b->pooled = !nopool;
+	b->size = size;
+	b->mem = nopool ? linearAlloc(size) : linear_alloc(size, use);
+	if (!b->mem) return -1;
+	buf_tag(b);
+	return 0;
+}
+
+static void buf_free(buf *b, const char *what)
+{
+	buf_check(b, what);
+	if (b->pooled) linear_free(b->mem);
+	else linearFree(b->mem);
+	b->mem = NULL;
+}
+
+// makeTexture in uibottom.c: keep the texture if the size did not change,
+// else make a new one, trimming the pool if it does not fit
+static int make_texture(buf *tex, u32 size)
+{
+	if (tex->mem && tex->size == size) {
+		buf_tag(tex);
+		return 0;
+	}
+	if (tex->mem) buf_free(tex, "texture");
+	tex->pooled = 0;
+	tex->size = size;
+	if (!(tex->mem = linearAlloc(size)) && !nopool) {
+		linear_trim();
+		tex->mem = linearAlloc(size);
+	}
+	if (!tex->mem) return -1;
+	buf_tag(tex);
+	return 0;
+}
+
+static u32 next_pow2(u32 v)
+{
+	u32 p = 64;
+
+	while (p < v) p <<= 1;
+	return p;
+}
+
+// the session
+
+typedef struct {
+	const char *name;
+	int random_sizes;
+	int sessions;
+} scenario;
+
+typedef struct {
+	int frames, failed_frames, failed_connects, reconnects;
+	u32 peak_used, min_largest;
+	linear_stats ls;
+} observed;
+
+static const struct { u16 w, h; } server_sizes[] = {
+	{ 1280, 720 }, { 800, 600 }, { 1024, 768 }, { 640, 480 }, { 1366, 768 }, { 1600, 900 }, { 400, 240 },
+};
+
+#define RESIZES 3
+#define FRAMES 20
+#define WAVE_BYTES (64 * 960 * 2 * 2)	// streamclient.c at 48 kHz stereo
+
+static u32 server_size(const scenario *s, int n)
+{
+	int i = s->random_sizes ? rnd(sizeof(server_sizes) / sizeof(server_sizes[0])) : n & 1;
+
+	return next_pow2(server_sizes[i].w) * next_pow2(server_sizes[i].h) * 4;
+}
+
+static void run(const scenario *s, size_t heap, observed *o)
+{
+	buf screen[2], vbuf, fb = { 0 }, wave = { 0 }, tex = { 0 }, sprite = { 0 }, staging = { 0 };
+	linear_stats before;
+	int n = 0;
+
+	memset(o, 0, sizeof(*o));
+	linear_get_stats(&before);	// the counts go on from the last run
+	heap_init(heap);
+	o->min_largest = heap;
+	seed = 1;
+	clobbered = 0;
+
+	// SDL's double buffered top screen and the text vertex buffer stay
+	buf_alloc(&screen[0], 512 * 256 * 4, LINEAR_FRAMEBUFFER);
+	buf_alloc(&screen[1], 512 * 256 * 4, LINEAR_FRAMEBUFFER);
+	buf_alloc(&vbuf, 2 * 30 * 40 * 6 * 20, LINEAR_GEOMETRY);
+
+	for (int session = 0; session < s->sessions; session++) {
+		// every session the same, whatever became of the ones before
+		seed = session + 1;
+		if (rnd(2) && buf_alloc(&wave, WAVE_BYTES, LINEAR_AUDIO)) wave.mem = NULL;
+		for (int r = 0; r <= RESIZES; r++) {
+			// uibvnc_cleanup, then the buffer for the new size
+			if (fb.mem) buf_free(&fb, "framebuffer");
+			if (buf_alloc(&fb, server_size(s, n++), LINEAR_FRAMEBUFFER)) {
+				if (verbose) printf("%s: session %d: no room for a %u KB framebuffer\n", s->name, session, fb.size / 1024);
+				fb.mem = NULL;
+				o->failed_connects++;
+				break;
+			}
+			for (int frame = 0; frame < FRAMES; frame++) {
+				o->frames++;
+				if (make_texture(&tex, fb.size)) {
+					if (verbose) printf("%s: session %d: no room for a %u KB texture\n", s->name, session, fb.size / 1024);
+					o->failed_frames++;
+				}
+				// the status line, sprite and staging buffer alike
+				if (!rnd(8) && !buf_alloc(&staging, 512 * 16 * 4, LINEAR_STAGING)) {
+					if (make_texture(&sprite, staging.size)) o->failed_frames++;
+					buf_free(&staging, "staging buffer");
+				}
+				buf_check(&screen[0], "screen buffer");
+				buf_check(&screen[1], "screen buffer");
+				buf_check(&vbuf, "vertex buffer");
+				buf_check(&fb, "framebuffer");
+				buf_check(&wave, "wave buffer");
+				buf_check(&tex, "texture");
+				buf_check(&sprite, "sprite");
+				if (host_linear_used > o->peak_used) o->peak_used = host_linear_used;
+			}
+			if (largest_free() < o->min_largest) o->min_largest = largest_free();
+		}
+		if (fb.mem) buf_free(&fb, "framebuffer");
+		if (wave.mem) buf_free(&wave, "wave buffer");
+		// the end of the session in main.c hands the pool back
+		if (!nopool) linear_trim();
+		o->reconnects++;
+	}
+
+	// the end of the program: nothing may be left behind
+	if (tex.mem) buf_free(&tex, "texture");
+	if (sprite.mem) buf_free(&sprite, "sprite");
+	buf_free(&screen[0], "screen buffer");
+	buf_free(&screen[1], "screen buffer");
+	buf_free(&vbuf, "vertex buffer");
+	linear_get_stats(&o->ls);
+	o->ls.reused -= before.reused;
+	o->ls.trims -= before.trims;
+	linear_trim();
+}
+
+static int check(const scenario *s, const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s: %s\n", s->name, what);
+	return !ok;
+}
+
+// linear_free must hand what it does not know to linearFree
+static int foreign_free()
+{
+	void *p;
+	size_t used;
+
+	heap_init(1024 * 1024);
+	linear_free(NULL);
+	p = linearAlloc(20000);
+	used = host_linear_used;
+	linear_free(p);
+	if (!p || !used || host_linear_used || bad_frees) {
+		printf("FAIL: a buffer from linearAlloc was not freed by linear_free\n");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const scenario scenarios[] = {
+		// name                   random  sessions
+		{ "two sizes alternating",  0,      300 },
+		{ "random sizes",           1,      500 },
+	};
+	int heaps[] = { 20, 24, HEAP_MB }, nheaps = 3;
+	int i, h, fails = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-v")) verbose = 1;
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+			heaps[0] = atoi(argv[++i]);
+			nheaps = 1;
+		}
+	}
+	fails += foreign_free();
+	for (h = 0; h < nheaps; h++) {
+		size_t heap = heaps[h] * 1024 * 1024;
+
+		for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+			const scenario *s = &scenarios[i];
+			observed o, plain;
+			int f = 0;
+
+			nopool = 1;
+			run(s, heap, &plain);
+			nopool = 0;
+			run(s, heap, &o);
+			printf("%2d MB %-22s %d reconnects, %d/%d frames without a texture (%d without the pool), %d without a framebuffer (%d), peak %u KB, largest hole at worst %u KB, %u reused, %u trims\n",
+				heaps[h], s->name, o.reconnects, o.failed_frames, o.frames, plain.failed_frames,
+				o.failed_connects, plain.failed_connects,
+				o.peak_used / 1024, o.min_largest / 1024, o.ls.reused, o.ls.trims);
+
+			f += check(s, "a live buffer was overwritten", !clobbered);
+			f += check(s, "freed what the heap did not hand out", !bad_frees);
+			f += check(s, "linear memory left behind", !host_linear_used);
+			for (int u = 0; u < LINEAR_USES; u++)
+				f += check(s, "buffers still counted as live", !o.ls.use[u].allocs && !o.ls.use[u].bytes);
+			f += check(s, "more than POOL_MAX pooled", o.ls.pooled <= POOL_MAX);
+			f += check(s, "more textures failed than without the pool", o.failed_frames <= plain.failed_frames);
+			f += check(s, "more framebuffers failed than without the pool", o.failed_connects <= plain.failed_connects);
+			if (!s->random_sizes && heap >= HEAP_MB * 1024 * 1024)
+				f += check(s, "textures did not fit", !o.failed_frames && !o.failed_connects);
+			fails += f;
+		}
+	}
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,442 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * opus-demux-test.c - runs Ogg streams through the Opus decoder's demuxer
+ * on the host, with a stand-in for libopus
+ *
+ * The stand-in takes packets that name themselves and their length in
+ * samples, and "decodes" them to that many samples of their number, so
+ * the output tells which packets were decoded, in which order and how
+ * much of each. Lost packets are concealed with samples of -1.
+ *
+ * The streams have packets of every length that matters to the lacing:
+ * empty ones, multiples of 255 bytes and packets spanning several pages.
+ * They also have packets the stand-in refuses, pages of another stream
+ * multiplexed in, a chained second stream, and pages left out. Each one
+ * is fed in random pieces and decoded into buffers of random size. The
+ * output must be the packets with the pre-skip dropped, a packet's worth
+ * of concealment for each empty packet and for each gap, and nothing for
+ * refused packets or for packets with a part on a missing page. A stream
+ * that loses the Ogg page sync must be an error.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -o opus-demux-test tools/opus-demux-test.c \
+ *      src/opusdecoder.c
+ * Usage: opus-demux-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <opus/opus.h>
+#include "opusdecoder.h"
+
+#define STREAMS 200
+#define CHANNELS 2
+#define LOST -1
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static int check(const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s\n", what);
+	return !ok;
+}
+
+// the stand-in: 'P', the packet number (16 bits), the length in 10 ms
+// units, then anything; 'X' is not a packet, 'D' one that does not decode
+
+struct OpusDecoder {
+	int channels;
+};
+
+OpusDecoder *opus_decoder_create(opus_int32 Fs, int channels, int *error)
+{
+	OpusDecoder *d = malloc(sizeof(OpusDecoder));
+
+	d->channels = channels;
+	*error = OPUS_OK;
+	return d;
+}
+
+void opus_decoder_destroy(OpusDecoder *st)
+{
+	free(st);
+}
+
+int opus_decoder_ctl(OpusDecoder *st, int request, ...)
+{
+	return OPUS_OK;
+}
+
+int opus_packet_get_nb_samples(const unsigned char packet[], opus_int32 len, opus_int32 Fs)
+{
+	// 120 ms at most, as in Opus
+	if (len < 4 || packet[0] == 'X' || packet[3] > 12) return OPUS_INVALID_PACKET;
+	return Fs / 100 * packet[3];
+}
+
+int opus_decode(OpusDecoder *st, const unsigned char *data, opus_int32 len,
+	opus_int16 *pcm, int frame_size, int decode_fec)
+{
+	int n = frame_size, v = LOST, i;
+
+	if (data && len) {
+		if ((n = opus_packet_get_nb_samples(data, len, 48000)) < 0 || data[0] == 'D')
+			return OPUS_INVALID_PACKET;
+		if (n > frame_size) return OPUS_BAD_ARG;
+		v = data[1] | data[2] << 8;
+	}
+	for (i = 0; i < n * st->channels; i++)
+		pcm[i] = v;
+	return n;
+}
+
+const char *opus_strerror(int error)
+{
+	return "stand-in error";
+}
+
+// the stream, and the samples it should decode to
+
+typedef struct {
+	unsigned char *data;
+	int len, size;
+} buffer;
+
+static void put(buffer *b, const void *data, int len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put_le(buffer *b, unsigned long long v, int bytes)
+{
+	while (bytes--) {
+		unsigned char c = v;
+		put(b, &c, 1);
+		v >>= 8;
+	}
+}
+
+typedef struct {
+	short value;
+	int count;
+} run;
+
+static run *expected;
+static int expected_len, expected_size;
+
+static void expect(int value, int count)
+{
+	if (expected_len == expected_size) {
+		expected_size = expected_size * 2 + 64;
+		expected = realloc(expected, expected_size * sizeof(run));
+	}
+	expected[expected_len].value = value;
+	expected[expected_len++].count = count;
+}
+
+// drops n samples from the start of the runs from first on
+static void skip(int first, int n)
+{
+	int i;
+
+	for (i = first; i < expected_len && n > 0; i++) {
+		int k = expected[i].count < n ? expected[i].count : n;
+		expected[i].count -= k;
+		n -= k;
+	}
+}
+
+// a packet of a logical stream, and the pages it starts and ends on
+typedef struct {
+	unsigned char *data;
+	int len;
+	int first, last;
+} packet;
+
+typedef struct {
+	unsigned serial;
+	unsigned seq;
+	packet *packets;
+	int n;
+} logical;
+
+static void add_packet(logical *l, const void *data, int len)
+{
+	l->packets = realloc(l->packets, (l->n + 1) * sizeof(packet));
+	l->packets[l->n].data = malloc(len + 1);
+	memcpy(l->packets[l->n].data, data, len);
+	l->packets[l->n].len = len;
+	l->n++;
+}
+
+// one page of the stream's packets from packet *i, segment *seg on, of
+// about size bytes, or left out if lose is set; a first page (bos) has
+// the first packet only
+static void put_page(buffer *out, logical *l, int *i, int *seg, int size, int bos, int lose)
+{
+	unsigned char lacing[255];
+	buffer body = { 0 };
+	int segs = 0, flags = (*seg ? 0x01 : 0) | (bos ? 0x02 : 0);
+
+	while (*i < l->n && segs < 255 && (body.len < size || bos)) {
+		packet *p = &l->packets[*i];
+		int from = *seg * 255, k = p->len - from < 255 ? p->len - from : 255;
+
+		if (*seg == 0) p->first = l->seq;
+		p->last = l->seq;
+		lacing[segs++] = k;
+		put(&body, p->data + from, k);
+		if (k < 255) {
+			(*i)++;
+			*seg = 0;
+			if (bos) break;
+		} else
+			(*seg)++;
+	}
+	if (!lose) {
+		put(out, "OggS", 4);
+		put_le(out, 0, 1);
+		put_le(out, flags, 1);
+		put_le(out, 0, 8);	// granule position, not used
+		put_le(out, l->serial, 4);
+		put_le(out, l->seq, 4);
+		put_le(out, 0, 4);	// CRC, not checked
+		put_le(out, segs, 1);
+		put(out, lacing, segs);
+		put(out, body.data, body.len);
+	}
+	l->seq++;
+	free(body.data);
+}
+
+static void free_logical(logical *l)
+{
+	int i;
+
+	for (i = 0; i < l->n; i++)
+		free(l->packets[i].data);
+	free(l->packets);
+	memset(l, 0, sizeof(logical));
+}
+
+// an Opus stream of packets numbered from id, with pages of it lost, into
+// out, and what it decodes to into expected; returns the next number
+static int put_stream(buffer *out, unsigned serial, int id, int lost_pages, int mux)
+{
+	unsigned char head[19] = "OpusHead", buf[3000];
+	logical l = { serial }, other = { serial + 1000 };
+	int i, seg, k, n, preskip = rnd(2000), first = expected_len, last_n = 480, oi, oseg;
+	int lose[4], dropped[4], ndropped = 0, concealed = 0;
+
+	head[8] = 1;
+	head[9] = CHANNELS;
+	head[10] = preskip;
+	head[11] = preskip >> 8;
+	head[12] = 48000 & 0xFF;
+	head[13] = 48000 >> 8 & 0xFF;
+	add_packet(&l, head, sizeof(head));
+	memset(buf, 'T', sizeof(buf));
+	memcpy(buf, "OpusTags", 8);
+	buf[8] = 4;	// vendor string length, and no comments
+	memset(buf + 16, 0, 4);
+	add_packet(&l, buf, 20 + rnd(800));
+
+	for (n = 0; n < 150; n++) {
+		int kind = rnd(20), len;
+
+		buf[0] = 'P';
+		buf[1] = id;
+		buf[2] = id >> 8;
+		buf[3] = 1 + rnd(4);
+		switch (kind) {
+		case 0: len = 0; break;
+		case 1: len = 255; break;
+		case 2: len = 510; break;
+		case 3: len = 700 + rnd(2200); break;	// over a few pages
+		case 4: buf[0] = 'X'; len = 4 + rnd(100); break;
+		case 5: buf[0] = 'D'; len = 4 + rnd(100); break;
+		default: len = 4 + rnd(300); break;
+		}
+		// the stream's format comes from the first packets, before any loss
+		if (n < 3 && (len == 0 || buf[0] != 'P' || len > 300)) {
+			buf[0] = 'P';
+			len = 4;
+		}
+		if (len) id++;
+		add_packet(&l, buf, len);
+	}
+
+	// the pages, the headers on pages of their own
+	memset(buf, 0, 8);
+	memcpy(buf, "\x80theora", 7);
+	add_packet(&other, buf, 42);
+	for (k = 0; k < 40; k++)
+		add_packet(&other, buf, 100 + rnd(400));
+	i = seg = oi = oseg = 0;
+	put_page(out, &l, &i, &seg, 0, 1, 0);
+	if (mux) put_page(out, &other, &oi, &oseg, 0, 1, 0);
+	while (seg || i < 2)
+		put_page(out, &l, &i, &seg, 100 + rnd(500), 0, 0);
+	for (k = 0; k < 4; k++)
+		lose[k] = k < lost_pages ? l.seq + 2 + k * 6 + rnd(5) : -1;
+	while (i < l.n) {
+		int lost = 0;
+
+		for (k = 0; k < 4; k++)
+			lost |= lose[k] == (int)l.seq;
+		// the last pages are never lost, there would be no gap to see
+		if (lost && i < l.n - 20)
+			dropped[ndropped++] = l.seq;
+		put_page(out, &l, &i, &seg, 100 + rnd(3000), 0, lost && i < l.n - 20);
+		if (mux && oi < other.n && rnd(3) == 0)
+			put_page(out, &other, &oi, &oseg, 100 + rnd(1000), 0, 0);
+	}
+
+	// what it decodes to: the concealment for a lost page comes before
+	// the first packet after it, the packets with a part on it are gone
+	for (n = 2; n < l.n; n++) {
+		packet *p = &l.packets[n];
+		int gone = 0;
+
+		for (k = 0; k < ndropped; k++)
+			if (p->first <= dropped[k] && p->last >= dropped[k]) gone = 1;
+		if (gone) continue;
+		for (; concealed < ndropped && dropped[concealed] < p->first; concealed++)
+			expect(LOST, last_n);
+		if (p->len == 0) {
+			expect(LOST, last_n);
+		} else if (p->data[0] == 'P') {
+			expect(p->data[1] | p->data[2] << 8, 480 * p->data[3]);
+			last_n = 480 * p->data[3];
+		}
+	}
+	skip(first, preskip);
+	free_logical(&l);
+	free_logical(&other);
+	return id;
+}
+
+// feeds the stream in random pieces, decodes into buffers of random size
+// and compares the output with what is expected; returns the failures
+static int run_stream(const buffer *s, const char *what)
+{
+	audioDecoder d;
+	static opus_int16 out[20000];
+	int pos = 0, r = 0, e = 0, off = 0, bad = 0, i, total = 0;
+	char msg[160];
+
+	opus_create_decoder(&d);
+	d.init();
+	while (pos < s->len && r >= 0) {
+		int n = 1 + rnd(rnd(4) ? 300 : 5000);
+		char *type;
+		int rate, channels, bitrate;
+
+		if (n > s->len - pos) n = s->len - pos;
+		if (d.feed(s->data + pos, n)) {
+			printf("FAIL: %s: feed\n", what);
+			return 1;
+		}
+		pos += n;
+		if (d.info(&type, &rate, &channels, &bitrate) != 0) {
+			if ((r = d.decode(NULL, 0)) < 0) break;
+			if (d.info(&type, &rate, &channels, &bitrate) != 0) continue;
+			if (channels != CHANNELS || rate != 48000) {
+				printf("FAIL: %s: %d channels at %d Hz\n", what, channels, rate);
+				return 1;
+			}
+		}
+		while ((r = d.decode(out, (1 + rnd(5000)) * CHANNELS * sizeof(opus_int16))) > 0) {
+			for (i = 0; i < r / (int)sizeof(opus_int16); i += CHANNELS, total++) {
+				while (e < expected_len && off == expected[e].count) {
+					e++;
+					off = 0;
+				}
+				if (e == expected_len || out[i] != expected[e].value || out[i + 1] != expected[e].value) {
+					if (!bad++)
+						printf("FAIL: %s: sample %d is %d, expected %d (run %d of %d, %d of %d)\n",
+							what, total, out[i], e < expected_len ? expected[e].value : 0,
+							e, expected_len, off, e < expected_len ? expected[e].count : 0);
+				} else
+					off++;
+			}
+		}
+	}
+	while (e < expected_len && off == expected[e].count) {
+		e++;
+		off = 0;
+	}
+	d.close();
+	if (r < 0) {
+		snprintf(msg, sizeof(msg), "%s: decoding failed: %s", what, d.errstr());
+		return check(msg, 0);
+	}
+	snprintf(msg, sizeof(msg), "%s: stopped %d samples short", what, expected_len > e ? expected[e].count - off : 0);
+	return (bad != 0) + check(msg, e == expected_len || bad);
+}
+
+int main(int argc, char **argv)
+{
+	int n, fails = 0;
+
+	for (n = 0; n < STREAMS && !fails; n++) {
+		buffer s = { 0 };
+		char what[64];
+		int id = 0;
+
+		expected_len = 0;
+		id = put_stream(&s, 1 + n, id, n % 5 == 0 ? 0 : 1 + n % 4, n % 3 == 0);
+		// a chained stream after the first one
+		if (n % 4 == 1)
+			put_stream(&s, 100000 + n, id, n % 2, 0);
+		snprintf(what, sizeof(what), "stream %d", n);
+		fails += run_stream(&s, what);
+		free(s.data);
+	}
+
+	// losing the page sync is an error
+	{
+		buffer s = { 0 };
+
+		expected_len = 0;
+		put_stream(&s, 1, 0, 0, 0);
+		s.data[s.len / 2 + rnd(s.len / 4)] = 0;
+		memcpy(s.data + s.len - 200, "OggX", 4);
+		for (n = s.len - 4000; n < s.len - 200; n++)
+			if (!memcmp(s.data + n, "OggS", 4)) break;
+		s.data[n + 3] = 'X';
+		{
+			audioDecoder d;
+			static opus_int16 out[8000];
+			int r;
+
+			opus_create_decoder(&d);
+			d.init();
+			d.feed(s.data, s.len);
+			d.decode(NULL, 0);
+			while ((r = d.decode(out, sizeof(out))) > 0)
+				;
+			fails += check("lost page sync not an error", r < 0);
+			d.close();
+		}
+		free(s.data);
+	}
+
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,403 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * rfb-decode-mem.c - replays full screen updates of each lossless encoding
+ * through HandleRFBServerMessage() on the host and reports, per decoder,
+ * the heap and RSS it needs on top of the framebuffer and its throughput
+ *
+ * The updates are written to a temporary file as a vncrec recording, then
+ * every decoder runs in a fresh process, so that its peak RSS is its own.
+ * Heap use is counted by replacing malloc() and friends, which works with
+ * glibc only. Each decoded frame is compared with the source image.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o rfb-decode-mem \
+ *      tools/rfb-decode-mem.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: rfb-decode-mem [width height [frames]]   (default 1920 1080 10)
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+// heap accounting; the decoders run on the main thread only
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *p);
+
+static long heap_used, heap_peak;
+
+static void *counted(void *p)
+{
+	if (p) {
+		heap_used += malloc_usable_size(p);
+		if (heap_used > heap_peak) heap_peak = heap_used;
+	}
+	return p;
+}
+
+void *malloc(size_t size) { return counted(__libc_malloc(size)); }
+void *calloc(size_t n, size_t size) { return counted(__libc_calloc(n, size)); }
+void *memalign(size_t align, size_t size) { return counted(__libc_memalign(align, size)); }
+void *aligned_alloc(size_t align, size_t size) { return counted(__libc_memalign(align, size)); }
+void *valloc(size_t size) { return counted(__libc_memalign(4096, size)); }
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+	*p = counted(__libc_memalign(align, size));
+	return *p ? 0 : 12;	// ENOMEM
+}
+
+void free(void *p)
+{
+	if (p) heap_used -= malloc_usable_size(p);
+	__libc_free(p);
+}
+
+void *realloc(void *p, size_t size)
+{
+	long old = p ? malloc_usable_size(p) : 0;
+	void *q = __libc_realloc(p, size);
+	if (q || !size) heap_used -= old;
+	return counted(q);
+}
+
+// the test image: windows of flat colour with text-like noise, moving per frame
+
+static void make_image(uint32_t *img, int w, int h, int frame)
+{
+	int x, y;
+
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++) {
+			int wx = (x + frame * 24) / 240, wy = (y + frame * 8) / 180;
+			unsigned hash = (x * 73856093u) ^ (y * 19349663u) ^ (frame * 83492791u);
+			uint32_t p = 0x303030 + (wx * 0x251317 + wy * 0x0b3f29) % 0x8f8f8f;
+			if ((y + frame * 8) % 180 < 20)
+				p = 0x804020;	// title bar
+			else if ((y % 16) < 10 && (x + frame * 24) % 240 > 12 && (x + frame * 24) % 240 < 200 && (hash >> 12) % 3 == 0)
+				p = 0x101010 * (hash % 8);	// text
+			img[y * w + x] = p;	// red in the low byte, as rfbGetClient(8, 3, 4)
+		}
+}
+
+// encoders
+
+typedef struct {
+	uint8_t *data;
+	size_t len, size;
+} buffer;
+
+static void put(buffer *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put8(buffer *b, int v) { uint8_t c = v; put(b, &c, 1); }
+static void put16(buffer *b, int v) { put8(b, v >> 8); put8(b, v); }
+static void put32(buffer *b, uint32_t v) { put16(b, v >> 16); put16(b, v); }
+static void put_pixel(buffer *b, uint32_t p) { put(b, &p, 4); }
+static void put_cpixel(buffer *b, uint32_t p) { put(b, &p, 3); }
+
+static void put_tpixel(buffer *b, uint32_t p)
+{
+	put8(b, p);
+	put8(b, p >> 8);
+	put8(b, p >> 16);
+}
+
+// deflates in into out, continuing the stream as a VNC server does
+static void put_deflated(buffer *out, z_stream *zs, buffer *in)
+{
+	uint8_t chunk[65536];
+
+	zs->next_in = in->data;
+	zs->avail_in = in->len;
+	do {
+		zs->next_out = chunk;
+		zs->avail_out = sizeof(chunk);
+		deflate(zs, Z_SYNC_FLUSH);
+		put(out, chunk, sizeof(chunk) - zs->avail_out);
+	} while (zs->avail_out == 0);
+	in->len = 0;
+}
+
+static int is_solid(const uint32_t *img, int stride, int x, int y, int w, int h)
+{
+	int i, j;
+
+	for (j = 0; j < h; j++)
+		for (i = 0; i < w; i++)
+			if (img[(y + j) * stride + x + i] != img[y * stride + x]) return 0;
+	return 1;
+}
+
+static void put_rle_tile(buffer *b, const uint32_t *img, int stride, int x, int y, int w, int h)
+{
+	int i, j, run = 0;
+	uint32_t cur = img[y * stride + x];
+
+	if (is_solid(img, stride, x, y, w, h)) {
+		put8(b, 1);	// solid
+		put_cpixel(b, cur);
+		return;
+	}
+	put8(b, 128);	// plain RLE
+	for (j = 0; j < h; j++)
+		for (i = 0; i < w; i++) {
+			uint32_t p = img[(y + j) * stride + x + i];
+			if (p == cur) {
+				run++;
+				continue;
+			}
+			put_cpixel(b, cur);
+			for (run--; run >= 255; run -= 255) put8(b, 255);
+			put8(b, run);
+			cur = p;
+			run = 1;
+		}
+	put_cpixel(b, cur);
+	for (run--; run >= 255; run -= 255) put8(b, 255);
+	put8(b, run);
+}
+
+typedef struct {
+	const char *name;
+	int encoding;
+} encoding;
+
+static const encoding encodings[] = {
+	{ "Raw", rfbEncodingRaw },
+	{ "Zlib", rfbEncodingZlib },
+	{ "Hextile", rfbEncodingHextile },
+	{ "TRLE", rfbEncodingTRLE },
+	{ "ZRLE", rfbEncodingZRLE },
+	{ "Tight", rfbEncodingTight },
+};
+
+// one full screen framebuffer update, preceded by its vncrec timestamp
+static void put_update(buffer *b, z_stream *zs, buffer *tmp, int enc, const uint32_t *img, int w, int h)
+{
+	static const uint8_t timestamp[sizeof(struct timeval)];
+	int x, y, i, j;
+
+	put(b, timestamp, sizeof(timestamp));
+	put8(b, rfbFramebufferUpdate);
+	put8(b, 0);
+	put16(b, 1);
+	put16(b, 0);
+	put16(b, 0);
+	put16(b, w);
+	put16(b, h);
+	put32(b, enc);
+
+	switch (enc) {
+	case rfbEncodingRaw:
+		put(b, img, w * h * 4);
+		break;
+	case rfbEncodingZlib:
+		put(tmp, img, w * h * 4);
+		break;
+	case rfbEncodingHextile:
+		for (y = 0; y < h; y += 16)
+			for (x = 0; x < w; x += 16) {
+				int tw = w - x < 16 ? w - x : 16, th = h - y < 16 ? h - y : 16;
+				if (is_solid(img, w, x, y, tw, th)) {
+					put8(b, rfbHextileBackgroundSpecified);
+					put_pixel(b, img[y * w + x]);
+					continue;
+				}
+				put8(b, rfbHextileRaw);
+				for (j = 0; j < th; j++)
+					put(b, img + (y + j) * w + x, tw * 4);
+			}
+		break;
+	case rfbEncodingTRLE:
+		for (y = 0; y < h; y += 16)
+			for (x = 0; x < w; x += 16)
+				put_rle_tile(b, img, w, x, y, w - x < 16 ? w - x : 16, h - y < 16 ? h - y : 16);
+		break;
+	case rfbEncodingZRLE:
+		for (y = 0; y < h; y += 64)
+			for (x = 0; x < w; x += 64)
+				put_rle_tile(tmp, img, w, x, y, w - x < 64 ? w - x : 64, h - y < 64 ? h - y : 64);
+		break;
+	case rfbEncodingTight:
+		for (i = 0; i < w * h; i++)
+			put_tpixel(tmp, img[i]);
+		break;
+	}
+
+	if (enc == rfbEncodingZlib || enc == rfbEncodingZRLE || enc == rfbEncodingTight) {
+		buffer z = { 0 };
+		if (enc == rfbEncodingTight)
+			put8(b, 0);	// basic compression, stream 0, copy filter
+		put_deflated(&z, zs, tmp);
+		if (enc == rfbEncodingTight) {
+			put8(b, (z.len & 0x7f) | 0x80);
+			put8(b, (z.len >> 7 & 0x7f) | 0x80);
+			put8(b, z.len >> 14);
+		} else
+			put32(b, z.len);
+		put(b, z.data, z.len);
+		free(z.data);
+	}
+}
+
+// the framebuffer update file for one encoding
+static int write_stream(const char *path, int enc, int w, int h, int frames, size_t *bytes)
+{
+	uint32_t *img = malloc(w * h * 4);
+	buffer b = { 0 }, tmp = { 0 };
+	z_stream zs = { 0 };
+	FILE *f = fopen(path, "wb");
+	int i;
+
+	if (!f || !img) return 0;
+	deflateInit(&zs, 6);
+	*bytes = 0;
+	for (i = 0; i < frames; i++) {
+		make_image(img, w, h, i);
+		put_update(&b, &zs, &tmp, enc, img, w, h);
+		fwrite(b.data, 1, b.len, f);
+		*bytes += b.len - sizeof(struct timeval);
+		b.len = 0;
+	}
+	deflateEnd(&zs);
+	fclose(f);
+	free(b.data);
+	free(tmp.data);
+	free(img);
+	return 1;
+}
+
+// the decoding side, in its own process
+
+static void quiet(const char *format, ...)
+{
+}
+
+static long status_kb(const char *field)
+{
+	char line[256];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if (!f) return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, field, strlen(field)))
+			kb = atol(line + strlen(field) + 1);
+	fclose(f);
+	return kb;
+}
+
+static int decode(const char *name, const char *path, int w, int h, int frames, size_t bytes)
+{
+	static char iobuf[65536];
+	rfbClient *client = rfbGetClient(8, 3, 4);
+	FILE *f = fopen(path, "rb");
+	long heap0, rss0, heap, rss, kept;
+	uint32_t *img;
+	u64 t0, t1;
+	int i, ok;
+
+	rfbClientLog = rfbClientErr = quiet;
+	if (!f) return 1;
+	setvbuf(f, iobuf, _IOFBF, sizeof(iobuf));
+	client->width = w;
+	client->height = h;
+	client->frameBuffer = calloc(w * h, 4);
+	memset(client->frameBuffer, 0, w * h * 4);
+	client->serverPort = -1;
+	client->vncRec = calloc(1, sizeof(rfbVNCRec));
+	client->vncRec->file = f;
+	client->vncRec->doNotSleep = TRUE;
+
+	heap0 = heap_peak = heap_used;
+	rss0 = status_kb("VmHWM:");
+	t0 = host_ns();
+	for (i = 0; i < frames; i++)
+		if (!HandleRFBServerMessage(client)) break;
+	t1 = host_ns();
+	heap = heap_peak - heap0;
+	kept = heap_used - heap0;
+	rss = status_kb("VmHWM:") - rss0;
+
+	img = malloc(w * h * 4);
+	make_image(img, w, h, frames - 1);
+	for (ok = i == frames, i = 0; ok && i < w * h; i++)
+		ok = (((uint32_t *)client->frameBuffer)[i] & 0xffffff) == img[i];
+	printf("%-8s %10.1f %10.1f %10.1f %10ld %10.0f %10.1f %s\n", name,
+		bytes / 1024.0 / frames, heap / 1024.0, kept / 1024.0, rss,
+		(double)w * h * frames / ((t1 - t0) / 1e3), bytes / ((t1 - t0) / 1e3),
+		ok ? "" : "FAIL");
+
+	free(img);
+	fclose(f);
+	rfbClientCleanup(client);
+	return !ok;
+}
+
+int main(int argc, char **argv)
+{
+	char path[] = "/tmp/rfb-decode-mem-XXXXXX";
+	int w = 1920, h = 1080, frames = 10, fails = 0, i, fd;
+	size_t bytes;
+
+	if (argc == 8 && !strcmp(argv[1], "-d"))
+		return decode(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), atol(argv[7]));
+	if (argc >= 3) {
+		w = atoi(argv[1]);
+		h = atoi(argv[2]);
+	}
+	if (argc >= 4) frames = atoi(argv[3]);
+
+	fd = mkstemp(path);
+	if (fd < 0) return 1;
+	close(fd);
+
+	printf("%d x %d, 32 bpp, %d frames; heap and RSS on top of the framebuffer\n", w, h, frames);
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n", "", "KB/frame", "peak heap", "kept heap", "peak RSS", "Mpx/s", "MB/s");
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n", "", "", "(KB)", "(KB)", "(KB)", "", "");
+	for (i = 0; i < sizeof(encodings) / sizeof(encodings[0]); i++) {
+		char sw[16], sh[16], sf[16], sb[24];
+		pid_t pid;
+		int status;
+
+		if (!write_stream(path, encodings[i].encoding, w, h, frames, &bytes)) {
+			fails++;
+			continue;
+		}
+		snprintf(sw, sizeof(sw), "%d", w);
+		snprintf(sh, sizeof(sh), "%d", h);
+		snprintf(sf, sizeof(sf), "%d", frames);
+		snprintf(sb, sizeof(sb), "%zu", bytes);
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			execl("/proc/self/exe", argv[0], "-d", encodings[i].name, path, sw, sh, sf, sb, (char *)NULL);
+			_exit(1);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			fails++;
+	}
+	unlink(path);
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * rfb-fill-copy-test.c - checks the default GotFillRect, GotBitmap and
+ * GotCopyRect hooks and rfbClientFillRects() against per-pixel references
+ * at 8, 16 and 32 bpp, CopyRect overlapping in every direction included,
+ * then times them against the per-pixel loops they replaced
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o rfb-fill-copy-test \
+ *      tools/rfb-fill-copy-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: rfb-fill-copy-test [-b]   (-b: run the benchmarks too)
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+// odd sizes, so rows start at every alignment
+#define TEST_W 67
+#define TEST_H 41
+#define BENCH_W 800
+#define BENCH_H 480
+
+static int fails;
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void quiet(const char *format, ...)
+{
+}
+
+static rfbClient *make_client(int bpp, int w, int h)
+{
+	rfbClient *client = rfbGetClient(8, 3, bpp / 8);
+	client->width = w;
+	client->height = h;
+	client->format.bitsPerPixel = bpp;
+	client->frameBuffer = malloc(w * h * bpp / 8);
+	return client;
+}
+
+static void free_client(rfbClient *client)
+{
+	free(client->frameBuffer);
+	client->frameBuffer = NULL;
+	rfbClientCleanup(client);
+}
+
+static void randomize(uint8_t *p, int n)
+{
+	while (n--) *p++ = rnd(256);
+}
+
+static void ref_fill(rfbClient *c, uint8_t *fb, int x, int y, int w, int h, uint32_t colour)
+{
+	int bpp = c->format.bitsPerPixel / 8, i, j, k;
+
+	for (j = y; j < y + h; j++)
+		for (i = x; i < x + w; i++)
+			for (k = 0; k < bpp; k++)	// little endian, as the 3DS
+				fb[(j * c->width + i) * bpp + k] = colour >> (8 * k);
+}
+
+// the source as it was before the copy, whatever the overlap
+static void ref_copy(rfbClient *c, uint8_t *fb, int sx, int sy, int w, int h, int dx, int dy)
+{
+	int bpp = c->format.bitsPerPixel / 8, pitch = c->width * bpp, j;
+	uint8_t *old = malloc(pitch * c->height);
+
+	memcpy(old, fb, pitch * c->height);
+	for (j = 0; j < h; j++)
+		memcpy(fb + (dy + j) * pitch + dx * bpp, old + (sy + j) * pitch + sx * bpp, w * bpp);
+	free(old);
+}
+
+static void check(rfbClient *c, uint8_t *ref, const char *what, int bpp, int x, int y, int w, int h)
+{
+	if (memcmp(c->frameBuffer, ref, c->width * c->height * bpp / 8)) {
+		if (fails++ < 20)
+			printf("FAIL: %s, %d bpp, %dx%d at %d,%d\n", what, bpp, w, h, x, y);
+	}
+}
+
+static void test_bpp(int bpp)
+{
+	rfbClient *c = make_client(bpp, TEST_W, TEST_H);
+	int size = TEST_W * TEST_H * bpp / 8, n, dx, dy;
+	uint8_t *ref = malloc(size), *bitmap = malloc(size);
+
+	randomize(c->frameBuffer, size);
+	memcpy(ref, c->frameBuffer, size);
+
+	// fills, full width ones included
+	for (n = 0; n < 2000; n++) {
+		int w = n % 10 == 0 ? TEST_W : 1 + rnd(TEST_W), h = 1 + rnd(TEST_H);
+		int x = rnd(TEST_W - w + 1), y = rnd(TEST_H - h + 1);
+		uint32_t colour = rnd(0x10000) | rnd(0x10000) << 16;
+		if (bpp < 32) colour &= (1U << bpp) - 1;
+		c->GotFillRect(c, x, y, w, h, colour);
+		ref_fill(c, ref, x, y, w, h, colour);
+		check(c, ref, "GotFillRect", bpp, x, y, w, h);
+	}
+
+	// bitmaps
+	for (n = 0; n < 2000; n++) {
+		int w = n % 10 == 0 ? TEST_W : 1 + rnd(TEST_W), h = 1 + rnd(TEST_H), j;
+		int x = rnd(TEST_W - w + 1), y = rnd(TEST_H - h + 1);
+		randomize(bitmap, w * h * bpp / 8);
+		c->GotBitmap(c, bitmap, x, y, w, h);
+		for (j = 0; j < h; j++)
+			memcpy(ref + ((y + j) * TEST_W + x) * bpp / 8, bitmap + j * w * bpp / 8, w * bpp / 8);
+		check(c, ref, "GotBitmap", bpp, x, y, w, h);
+	}
+
+	// copies overlapping in every direction, by up to 3 pixels, and apart
+	for (dy = -3; dy <= 3; dy++)
+		for (dx = -3; dx <= 3; dx++)
+			for (n = 0; n < 100; n++) {
+				int w = 1 + rnd(TEST_W - 6), h = 1 + rnd(TEST_H - 6);
+				int sx = 3 + rnd(TEST_W - 5 - w), sy = 3 + rnd(TEST_H - 5 - h);
+				randomize(c->frameBuffer, size);
+				memcpy(ref, c->frameBuffer, size);
+				c->GotCopyRect(c, sx, sy, w, h, sx + dx, sy + dy);
+				ref_copy(c, ref, sx, sy, w, h, sx + dx, sy + dy);
+				check(c, ref, "GotCopyRect", bpp, sx + dx, sy + dy, w, h);
+			}
+	for (n = 0; n < 500; n++) {
+		int w = 1 + rnd(TEST_W), h = 1 + rnd(TEST_H);
+		int sx = rnd(TEST_W - w + 1), sy = rnd(TEST_H - h + 1);
+		int tx = rnd(TEST_W - w + 1), ty = rnd(TEST_H - h + 1);
+		c->GotCopyRect(c, sx, sy, w, h, tx, ty);
+		ref_copy(c, ref, sx, sy, w, h, tx, ty);
+		check(c, ref, "GotCopyRect", bpp, tx, ty, w, h);
+	}
+
+	// subrect lists, clipped to their enclosing rectangle
+	for (n = 0; n < 1000; n++) {
+		rfbClientSubrect rects[16];
+		int w = 1 + rnd(TEST_W), h = 1 + rnd(TEST_H), i, k = 1 + rnd(16);
+		int x = rnd(TEST_W - w + 1), y = rnd(TEST_H - h + 1);
+		for (i = 0; i < k; i++) {
+			rects[i].x = rnd(w + 2);
+			rects[i].y = rnd(h + 2);
+			rects[i].w = 1 + rnd(w + 2);
+			rects[i].h = 1 + rnd(h + 2);
+			rects[i].colour = rnd(0x10000) | rnd(0x10000) << 16;
+			if (bpp < 32) rects[i].colour &= (1U << bpp) - 1;
+			if (rects[i].x < w && rects[i].y < h)
+				ref_fill(c, ref, x + rects[i].x, y + rects[i].y,
+					rects[i].w < w - rects[i].x ? rects[i].w : w - rects[i].x,
+					rects[i].h < h - rects[i].y ? rects[i].h : h - rects[i].y,
+					rects[i].colour);
+		}
+		rfbClientFillRects(c, x, y, w, h, rects, k);
+		check(c, ref, "rfbClientFillRects", bpp, x, y, w, h);
+	}
+
+	free(ref);
+	free(bitmap);
+	free_client(c);
+}
+
+// the per-pixel loops of the original hooks, 32 bpp
+static void old_fill32(rfbClient *c, int x, int y, int w, int h, uint32_t colour)
+{
+	int i, j;
+	for (j = y * c->width; j < (y + h) * c->width; j += c->width)
+		for (i = x; i < x + w; i++)
+			((uint32_t *)c->frameBuffer)[j + i] = colour;
+}
+
+static void old_copy32(rfbClient *c, int src_x, int src_y, int w, int h, int dest_x, int dest_y)
+{
+	uint32_t *fb = (uint32_t *)c->frameBuffer;
+	uint32_t *buffer = fb + (src_y - dest_y) * c->width + src_x - dest_x;
+	int i, j;
+
+	if (dest_y < src_y) {
+		for (j = dest_y * c->width; j < (dest_y + h) * c->width; j += c->width) {
+			if (dest_x < src_x)
+				for (i = dest_x; i < dest_x + w; i++) fb[j + i] = buffer[j + i];
+			else
+				for (i = dest_x + w - 1; i >= dest_x; i--) fb[j + i] = buffer[j + i];
+		}
+	} else {
+		for (j = (dest_y + h - 1) * c->width; j >= dest_y * c->width; j -= c->width) {
+			if (dest_x < src_x)
+				for (i = dest_x; i < dest_x + w; i++) fb[j + i] = buffer[j + i];
+			else
+				for (i = dest_x + w - 1; i >= dest_x; i--) fb[j + i] = buffer[j + i];
+		}
+	}
+}
+
+typedef struct {
+	const char *name;
+	int x, y, w, h, tx, ty;	// tx < 0: fill
+} bench_case;
+
+static void bench()
+{
+	static const bench_case cases[] = {
+		{ "fill 16x16 (hextile subrect)",   5, 5, 16, 16, -1, 0 },
+		{ "fill 64x64",                     5, 5, 64, 64, -1, 0 },
+		{ "fill full screen",               0, 0, BENCH_W, BENCH_H, -1, 0 },
+		{ "copy 64x64 apart",               0, 0, 64, 64, 300, 200 },
+		{ "copy scroll up one row",         0, 1, BENCH_W, BENCH_H - 1, 0, 0 },
+		{ "copy scroll down one row",       0, 0, BENCH_W, BENCH_H - 1, 0, 1 },
+		{ "copy 400x300 right one pixel",   10, 10, 400, 300, 11, 10 },
+		{ "copy 400x300 left one pixel",    11, 10, 400, 300, 10, 10 },
+	};
+	rfbClient *c = make_client(32, BENCH_W, BENCH_H);
+	int i, n, reps;
+
+	printf("%-32s %12s %12s %8s\n", "32 bpp, 800x480", "old (Mpx/s)", "new (Mpx/s)", "speedup");
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		const bench_case *b = &cases[i];
+		double mpx = (double)b->w * b->h / 1e6, t_old, t_new;
+		u64 t0;
+
+		reps = (int)(200 / mpx);
+		if (reps > 200000) reps = 200000;
+		t0 = host_ns();
+		for (n = 0; n < reps; n++)
+			if (b->tx < 0) old_fill32(c, b->x, b->y, b->w, b->h, n);
+			else old_copy32(c, b->x, b->y, b->w, b->h, b->tx, b->ty);
+		t_old = (host_ns() - t0) / 1e9;
+		t0 = host_ns();
+		for (n = 0; n < reps; n++)
+			if (b->tx < 0) c->GotFillRect(c, b->x, b->y, b->w, b->h, n);
+			else c->GotCopyRect(c, b->x, b->y, b->w, b->h, b->tx, b->ty);
+		t_new = (host_ns() - t0) / 1e9;
+		printf("%-32s %12.0f %12.0f %7.1fx\n", b->name, reps * mpx / t_old, reps * mpx / t_new, t_old / t_new);
+	}
+	free_client(c);
+}
+
+int main(int argc, char **argv)
+{
+	rfbClientLog = rfbClientErr = quiet;
+
+	test_bpp(8);
+	test_bpp(16);
+	test_bpp(32);
+	printf(fails ? "FAILED: %d mismatches\n" : "OK\n", fails);
+
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		bench();
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,406 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * rfb-h264-test.c - runs Open H.264 rectangles through
+ * HandleRFBServerMessage() and rfbHandleOpenH264() on the host, with a
+ * stand-in video decoder that takes raw I420 pictures: there is no H.264
+ * decoder on the 3DS, and h264avcodec.c needs libavcodec
+ *
+ * Checks that the encoding is only offered with a video decoder, that
+ * pictures are converted into the framebuffer at 16 and 32 bpp (against
+ * BT.601 in floating point) without touching a pixel outside their
+ * rectangle, that a rectangle reaching outside the framebuffer is
+ * refused before anything is drawn, and that a picture smaller than its
+ * rectangle is counted as an error and not drawn.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o rfb-h264-test \
+ *      tools/rfb-h264-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread -lm
+ * Usage: rfb-h264-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+#include "h264.h"
+#include "scratch.h"
+
+// rfbproto.c, not in the header
+extern void DefaultSupportedMessages(rfbClient *client);
+
+#define FB_W 64
+#define FB_H 32
+#define GUARD 256
+#define FILL 0xA5
+
+static int fails;
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void quiet(const char *format, ...)
+{
+}
+
+static int check(const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s\n", what);
+	fails += !ok;
+	return ok;
+}
+
+// the stand-in decoder: every rectangle is a picture of its own, its
+// width and height (big endian, 16 bits each) and the I420 planes
+
+typedef struct {
+	int w, h;
+	uint8_t *pic;
+} raw_ctx;
+
+static int opened;
+
+static void *raw_open(int width, int height)
+{
+	raw_ctx *c = calloc(1, sizeof(raw_ctx));
+
+	opened++;
+	return c;
+}
+
+static int raw_decode(void *p, const uint8_t *data, int size, rfbVideoFrame *frame)
+{
+	raw_ctx *c = p;
+	int w, h, cw, ch;
+
+	if (size < 4) return -1;
+	w = data[0] << 8 | data[1];
+	h = data[2] << 8 | data[3];
+	cw = (w + 1) / 2;
+	ch = (h + 1) / 2;
+	if (size != 4 + w * h + 2 * cw * ch) return -1;
+	free(c->pic);
+	c->pic = malloc(size - 4);
+	memcpy(c->pic, data + 4, size - 4);
+	frame->width = w;
+	frame->height = h;
+	frame->plane[0] = c->pic;
+	frame->plane[1] = c->pic + w * h;
+	frame->plane[2] = c->pic + w * h + cw * ch;
+	frame->stride[0] = w;
+	frame->stride[1] = frame->stride[2] = cw;
+	return 1;
+}
+
+static void raw_close(void *p)
+{
+	raw_ctx *c = p;
+
+	free(c->pic);
+	free(c);
+}
+
+static const char *raw_errstr(void *p)
+{
+	return "not a raw picture";
+}
+
+static const rfbVideoDecoder raw_decoder = { "raw", raw_open, raw_decode, raw_close, raw_errstr };
+
+// the client, its framebuffer between two guards
+
+typedef struct {
+	rfbClient *client;
+	uint8_t *mem;
+	int size;
+	FILE *file;
+} session;
+
+static void open_session(session *s, int bpp)
+{
+	rfbClient *client = bpp == 16 ? rfbGetClient(5, 3, 2) : rfbGetClient(8, 3, 4);
+
+	if (bpp == 16) {
+		// RGB565
+		client->format.redMax = 31;
+		client->format.greenMax = 63;
+		client->format.blueMax = 31;
+		client->format.redShift = 11;
+		client->format.greenShift = 5;
+		client->format.blueShift = 0;
+	}
+	client->width = FB_W;
+	client->height = FB_H;
+	s->size = FB_W * FB_H * bpp / 8;
+	s->mem = malloc(s->size + 2 * GUARD);
+	memset(s->mem, FILL, s->size + 2 * GUARD);
+	client->frameBuffer = s->mem + GUARD;
+	client->serverPort = -1;
+	client->vncRec = calloc(1, sizeof(rfbVNCRec));
+	client->vncRec->file = s->file = tmpfile();
+	client->vncRec->doNotSleep = TRUE;
+	client->videoDecoder = raw_decoder;
+	s->client = client;
+}
+
+static void close_session(session *s)
+{
+	fclose(s->file);
+	s->client->frameBuffer = NULL;
+	rfbClientCleanup(s->client);
+	free(s->mem);
+}
+
+static void put16(FILE *f, int v) { fputc(v >> 8, f); fputc(v, f); }
+static void put32(FILE *f, uint32_t v) { put16(f, v >> 16); put16(f, v); }
+
+// writes a raw picture of pw x ph into the stream, as an Open H.264
+// rectangle at x, y of w x h if message is set, else just its data
+static void put_rect(session *s, int message, int x, int y, int w, int h,
+	const uint8_t *pic, int pw, int ph)
+{
+	static const uint8_t timestamp[sizeof(struct timeval)];
+	int size = 4 + pw * ph + 2 * ((pw + 1) / 2) * ((ph + 1) / 2);
+
+	rewind(s->file);
+	if (message) {
+		fwrite(timestamp, 1, sizeof(timestamp), s->file);
+		fputc(rfbFramebufferUpdate, s->file);
+		fputc(0, s->file);
+		put16(s->file, 1);
+		put16(s->file, x);
+		put16(s->file, y);
+		put16(s->file, w);
+		put16(s->file, h);
+		put32(s->file, rfbEncodingOpenH264);
+	}
+	put32(s->file, size);	// rfbOpenH264Header
+	put32(s->file, 0);
+	put16(s->file, pw);
+	put16(s->file, ph);
+	fwrite(pic, 1, size - 4, s->file);
+	fflush(s->file);
+	rewind(s->file);
+}
+
+static uint8_t *make_picture(int w, int h)
+{
+	int n = w * h + 2 * ((w + 1) / 2) * ((h + 1) / 2), i;
+	uint8_t *pic = malloc(n);
+
+	for (i = 0; i < n; i++)
+		pic[i] = i < w * h ? 16 + rnd(220) : 16 + rnd(225);
+	return pic;
+}
+
+// BT.601, limited range
+static int reference(const uint8_t *pic, int pw, int ph, int i, int j, int channel)
+{
+	int cw = (pw + 1) / 2, ch = (ph + 1) / 2;
+	double y = 1.164 * (pic[j * pw + i] - 16);
+	double u = pic[pw * ph + j / 2 * cw + i / 2] - 128;
+	double v = pic[pw * ph + cw * ch + j / 2 * cw + i / 2] - 128;
+	double c = channel == 0 ? y + 1.596 * v : channel == 1 ? y - 0.392 * u - 0.813 * v : y + 2.017 * u;
+
+	return c < 0 ? 0 : c > 255 ? 255 : (int)(c + 0.5);
+}
+
+static uint32_t pixel(session *s, int i, int j)
+{
+	int bpp = s->client->format.bitsPerPixel / 8;
+	uint8_t *p = s->client->frameBuffer + (j * FB_W + i) * bpp;
+
+	return bpp == 4 ? *(uint32_t *)p : *(uint16_t *)p;
+}
+
+static int untouched(const uint8_t *p, int n)
+{
+	while (n--)
+		if (*p++ != FILL) return 0;
+	return 1;
+}
+
+// the pixels of the rectangle against the reference, and everything
+// around it against the fill
+static void check_drawn(session *s, const char *what, int x, int y, int w, int h,
+	const uint8_t *pic, int pw, int ph)
+{
+	rfbPixelFormat *f = &s->client->format;
+	int max[3] = { f->redMax, f->greenMax, f->blueMax };
+	int shift[3] = { f->redShift, f->greenShift, f->blueShift };
+	int bpp = f->bitsPerPixel / 8, i, j, c, bad = 0, outside = 0;
+	char msg[128];
+
+	for (j = 0; j < FB_H; j++) {
+		for (i = 0; i < FB_W; i++) {
+			uint32_t p = pixel(s, i, j);
+
+			if (i < x || i >= x + w || j < y || j >= y + h) {
+				outside |= !untouched(s->client->frameBuffer + (j * FB_W + i) * bpp, bpp);
+				continue;
+			}
+			for (c = 0; c < 3; c++) {
+				int got = (p >> shift[c]) & max[c];
+				int want = (reference(pic, pw, ph, i - x, j - y, c) * max[c] + 127) / 255;
+
+				// a level of the channel, from rounding
+				if (abs(got - want) > 1) bad++;
+			}
+		}
+	}
+	snprintf(msg, sizeof(msg), "%s: %d channels off the reference", what, bad);
+	check(msg, !bad);
+	snprintf(msg, sizeof(msg), "%s: drawn outside its rectangle", what);
+	check(msg, !outside && untouched(s->mem, GUARD) && untouched(s->mem + GUARD + s->size, GUARD));
+}
+
+static void draw_test(int bpp)
+{
+	session s;
+	uint8_t *pic;
+	char what[64];
+
+	// odd sizes and positions, up to the far corner
+	static const struct { int x, y, w, h; } rects[] = {
+		{ 0, 0, 16, 16 }, { 3, 5, 17, 9 }, { 47, 19, 17, 13 }, { 63, 31, 1, 1 },
+	};
+	for (int r = 0; r < 4; r++) {
+		int x = rects[r].x, y = rects[r].y, w = rects[r].w, h = rects[r].h;
+
+		open_session(&s, bpp);
+		pic = make_picture(w, h);
+		put_rect(&s, 1, x, y, w, h, pic, w, h);
+		snprintf(what, sizeof(what), "%d bpp, %dx%d at (%d, %d)", bpp, w, h, x, y);
+		check(what, HandleRFBServerMessage(s.client) && s.client->videoStats.frames == 1);
+		check_drawn(&s, what, x, y, w, h, pic, w, h);
+		free(pic);
+		close_session(&s);
+	}
+
+	// a larger picture, as decoders pad to whole macroblocks
+	open_session(&s, bpp);
+	pic = make_picture(32, 16);
+	put_rect(&s, 1, 40, 20, 24, 12, pic, 32, 16);
+	snprintf(what, sizeof(what), "%d bpp, padded picture", bpp);
+	check(what, HandleRFBServerMessage(s.client) && s.client->videoStats.frames == 1);
+	{
+		// what is drawn is the top left of the picture
+		uint8_t *crop = make_picture(24, 12);
+		int i, j;
+
+		for (j = 0; j < 12; j++)
+			for (i = 0; i < 24; i++)
+				crop[j * 24 + i] = pic[j * 32 + i];
+		for (j = 0; j < 6; j++)
+			for (i = 0; i < 12; i++) {
+				crop[24 * 12 + j * 12 + i] = pic[32 * 16 + j * 16 + i];
+				crop[24 * 12 + 12 * 6 + j * 12 + i] = pic[32 * 16 + 16 * 8 + j * 16 + i];
+			}
+		check_drawn(&s, what, 40, 20, 24, 12, crop, 24, 12);
+		free(crop);
+	}
+	free(pic);
+	close_session(&s);
+}
+
+static void bounds_test()
+{
+	session s;
+	uint8_t *pic = make_picture(16, 16);
+
+	opened = 0;
+	// beyond the right and the bottom edge, straight to the decoder as
+	// HandleRFBServerMessage would refuse it already
+	open_session(&s, 32);
+	rfbScratchForEncoding(s.client, rfbEncodingOpenH264);
+	put_rect(&s, 0, 56, 0, 16, 16, pic, 16, 16);
+	check("rectangle beyond the right edge accepted", !rfbHandleOpenH264(s.client, 56, 0, 16, 16));
+	check("rectangle beyond the right edge drawn", untouched(s.mem, s.size + 2 * GUARD));
+	// a row past it, into the guard
+	put_rect(&s, 0, 0, 17, 16, 16, pic, 16, 16);
+	check("rectangle beyond the bottom edge accepted", !rfbHandleOpenH264(s.client, 0, 17, 16, 16));
+	check("rectangle beyond the bottom edge drawn", untouched(s.mem, s.size + 2 * GUARD));
+	check("decoder opened for a rectangle outside", opened == 0);
+	close_session(&s);
+
+	// and through the message
+	open_session(&s, 32);
+	put_rect(&s, 1, 56, 0, 16, 16, pic, 16, 16);
+	check("message with a rectangle outside accepted", !HandleRFBServerMessage(s.client));
+	check("message with a rectangle outside drawn", untouched(s.mem, s.size + 2 * GUARD));
+	close_session(&s);
+
+	// a picture smaller than its rectangle is an error, the stream goes on
+	open_session(&s, 32);
+	put_rect(&s, 1, 0, 0, 32, 16, pic, 16, 16);
+	check("small picture ends the stream", HandleRFBServerMessage(s.client));
+	check("small picture not counted", s.client->videoStats.errors == 1 && s.client->videoStats.frames == 0);
+	check("small picture drawn", untouched(s.mem, s.size + 2 * GUARD));
+	close_session(&s);
+
+	// no decoder, no pictures
+	open_session(&s, 32);
+	memset(&s.client->videoDecoder, 0, sizeof(rfbVideoDecoder));
+	put_rect(&s, 1, 0, 0, 16, 16, pic, 16, 16);
+	check("rectangle accepted without a decoder", !HandleRFBServerMessage(s.client));
+	close_session(&s);
+	free(pic);
+}
+
+// the encodings the client asks for, read from the other end of a socket
+static int offers_h264(const rfbVideoDecoder *decoder, const char *encodings)
+{
+	rfbClient *client = rfbGetClient(8, 3, 4);
+	uint8_t buf[4096];
+	int sv[2], n, i, found = 0;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	client->sock = sv[0];
+	client->serverPort = 5900;
+	DefaultSupportedMessages(client);
+	client->appData.encodingsString = encodings;
+	if (decoder) client->videoDecoder = *decoder;
+	SetFormatAndEncodings(client);
+	n = recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT);
+	// rfbSetPixelFormat, then rfbSetEncodings
+	if (n >= sz_rfbSetPixelFormatMsg + sz_rfbSetEncodingsMsg && buf[sz_rfbSetPixelFormatMsg] == rfbSetEncodings) {
+		int count = buf[sz_rfbSetPixelFormatMsg + 2] << 8 | buf[sz_rfbSetPixelFormatMsg + 3];
+		uint8_t *e = buf + sz_rfbSetPixelFormatMsg + sz_rfbSetEncodingsMsg;
+
+		for (i = 0; i < count && e + 4 * i + 4 <= buf + n; i++)
+			if ((e[4 * i] << 24 | e[4 * i + 1] << 16 | e[4 * i + 2] << 8 | e[4 * i + 3]) == rfbEncodingOpenH264)
+				found = 1;
+	} else
+		found = -1;
+	close(sv[1]);
+	client->sock = RFB_INVALID_SOCKET;
+	close(sv[0]);
+	rfbClientCleanup(client);
+	return found;
+}
+
+int main(int argc, char **argv)
+{
+	rfbClientLog = rfbClientErr = quiet;
+
+	check("encoding offered without a decoder", offers_h264(NULL, NULL) == 0);
+	check("encoding offered on request without a decoder", offers_h264(NULL, "h264 raw") == 0);
+	check("encoding not offered with a decoder", offers_h264(&raw_decoder, NULL) == 1);
+	check("encoding not offered on request with a decoder", offers_h264(&raw_decoder, "h264 raw") == 1);
+	draw_test(32);
+	draw_test(16);
+	bounds_test();
+
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
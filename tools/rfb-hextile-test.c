@@ -0,0 +1,420 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * rfb-hextile-test.c - encodes UI-like content as Hextile on the host,
+ * decodes it through HandleRFBServerMessage() and compares the framebuffer
+ * with the source pixels at 8, 16 and 32 bpp
+ *
+ * The encoder picks for every tile what a server would: a solid tile, one
+ * foreground colour or coloured subrects on the most frequent colour, or
+ * raw pixels when the subrects would take more. Background and foreground
+ * are only sent when they change, so that tiles also use the colours of
+ * the tile before them. Rectangles have any size and position, so edge
+ * tiles of every width and height are decoded. Subrects reaching outside
+ * their tile, as a broken server sends them, must be clipped to the tile.
+ * Nothing may be written around the framebuffer.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o rfb-hextile-test \
+ *      tools/rfb-hextile-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: rfb-hextile-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+#define FB_W 400
+#define FB_H 240
+#define GUARD 256
+#define FILL 0xA5
+#define RECTS 400
+
+static const int formats[] = { 8, 16, 32 };
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static uint32_t rnd_pixel(int bpp)
+{
+	uint32_t v = rnd(1 << 16) | rnd(1 << 16) << 16;
+
+	return bpp == 32 ? v : v & ((1u << bpp) - 1);
+}
+
+static int check(const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s\n", what);
+	return !ok;
+}
+
+// the stream
+
+typedef struct {
+	uint8_t *data;
+	size_t len, size;
+} buffer;
+
+static void put(buffer *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put8(buffer *b, int v) { uint8_t c = v; put(b, &c, 1); }
+static void put16(buffer *b, int v) { put8(b, v >> 8); put8(b, v); }
+static void put32(buffer *b, uint32_t v) { put16(b, v >> 16); put16(b, v); }
+
+static void put_update(buffer *b, int rects)
+{
+	static const uint8_t timestamp[sizeof(struct timeval)];
+
+	put(b, timestamp, sizeof(timestamp));
+	put8(b, rfbFramebufferUpdate);
+	put8(b, 0);
+	put16(b, rects);
+}
+
+static void put_rect_header(buffer *b, int x, int y, int w, int h, int encoding)
+{
+	put16(b, x);
+	put16(b, y);
+	put16(b, w);
+	put16(b, h);
+	put32(b, encoding);
+}
+
+// UI-like content: flat windows, one and several colour text, noisy photos
+static void draw_screen(uint32_t *px, int w, int h, int bpp)
+{
+	uint32_t desktop = rnd_pixel(bpp);
+	int i, x, y, n;
+
+	for (i = 0; i < w * h; i++)
+		px[i] = desktop;
+	for (n = 0; n < 16; n++) {
+		int ww = 20 + rnd(200), wh = 10 + rnd(120), wx = rnd(w - ww), wy = rnd(h - wh);
+		uint32_t bg = rnd_pixel(bpp), ink[4];
+		int kind = rnd(3);
+
+		for (i = 0; i < 4; i++)
+			ink[i] = rnd_pixel(bpp);
+		for (y = wy; y < wy + wh; y++)
+			for (x = wx; x < wx + ww; x++) {
+				uint32_t *c = px + y * w + x;
+
+				if (kind == 2)
+					*c = rnd(3) ? rnd_pixel(bpp) : bg;
+				else if ((y - wy) % 10 < 7 && (x - wx) % 30 < 24 && rnd(3) == 0)
+					*c = ink[kind ? rnd(4) : 0];
+				else
+					*c = bg;
+			}
+	}
+}
+
+// the Hextile encoder
+
+typedef struct {
+	uint32_t bg, fg;
+	int bg_valid, fg_valid;
+} tile_state;
+
+static void put_pixel(buffer *b, uint32_t v, int bpp)
+{
+	put(b, &v, bpp / 8);	// in the client's format, which is the host's
+}
+
+static void put_tile(buffer *b, tile_state *st, const uint32_t *px, int stride, int w, int h, int bpp)
+{
+	uint32_t colors[256], tile[16 * 16], bg;
+	int count[256], ncolors = 0, i, j, k, n = 0, size, best = 0, mono;
+	uint8_t rects[16 * 16][2];
+	uint32_t rect_color[16 * 16];
+	uint8_t done[16 * 16];
+
+	for (j = 0; j < h; j++)
+		for (i = 0; i < w; i++) {
+			tile[j * w + i] = px[j * stride + i];
+			for (k = 0; k < ncolors && colors[k] != tile[j * w + i]; k++);
+			if (k == ncolors) {
+				colors[k] = tile[j * w + i];
+				count[ncolors++] = 0;
+			}
+			count[k]++;
+		}
+	for (k = 1; k < ncolors; k++)
+		if (count[k] > count[best]) best = k;
+	bg = colors[best];
+	mono = ncolors == 2;
+
+	if (ncolors == 1) {
+		k = !st->bg_valid || st->bg != bg || rnd(4) == 0 ? rfbHextileBackgroundSpecified : 0;
+		put8(b, k);
+		if (k)
+			put_pixel(b, bg, bpp);
+		st->bg = bg;
+		st->bg_valid = 1;
+		return;
+	}
+
+	// subrects: the widest run of a colour at the first pixel not done,
+	// as far down as the run goes on
+	memset(done, 0, sizeof(done));
+	for (j = 0; j < h; j++)
+		for (i = 0; i < w; i++) {
+			uint32_t c = tile[j * w + i];
+			int sw, sh, x, y;
+
+			if (done[j * w + i] || c == bg) continue;
+			for (sw = 1; i + sw < w && tile[j * w + i + sw] == c && !done[j * w + i + sw]; sw++);
+			for (sh = 1; j + sh < h; sh++) {
+				for (x = 0; x < sw && tile[(j + sh) * w + i + x] == c && !done[(j + sh) * w + i + x]; x++);
+				if (x < sw) break;
+			}
+			for (y = 0; y < sh; y++)
+				memset(done + (j + y) * w + i, 1, sw);
+			rects[n][0] = i << 4 | j;
+			rects[n][1] = (sw - 1) << 4 | (sh - 1);
+			rect_color[n++] = c;
+		}
+
+	size = 1 + bpp / 8 + bpp / 8 + 1 + n * (2 + (mono ? 0 : bpp / 8));
+	if (n > 255 || size > w * h * bpp / 8 || rnd(50) == 0) {
+		put8(b, rfbHextileRaw);
+		for (j = 0; j < w * h; j++)
+			put_pixel(b, tile[j], bpp);
+		// a raw tile leaves both colours undefined
+		st->bg_valid = st->fg_valid = 0;
+		return;
+	}
+
+	k = rfbHextileAnySubrects;
+	if (!st->bg_valid || st->bg != bg || rnd(8) == 0)
+		k |= rfbHextileBackgroundSpecified;
+	if (!mono)
+		k |= rfbHextileSubrectsColoured;
+	else if (!st->fg_valid || st->fg != rect_color[0] || rnd(8) == 0)
+		k |= rfbHextileForegroundSpecified;
+	put8(b, k);
+	if (k & rfbHextileBackgroundSpecified)
+		put_pixel(b, bg, bpp);
+	if (k & rfbHextileForegroundSpecified)
+		put_pixel(b, rect_color[0], bpp);
+	put8(b, n);
+	for (j = 0; j < n; j++) {
+		if (!mono)
+			put_pixel(b, rect_color[j], bpp);
+		put(b, rects[j], 2);
+	}
+	st->bg = bg;
+	st->bg_valid = 1;
+	st->fg = rect_color[0];
+	st->fg_valid = mono;
+}
+
+static void put_hextile(buffer *b, const uint32_t *px, int stride, int w, int h, int bpp)
+{
+	tile_state st = { 0 };
+	int x, y;
+
+	for (y = 0; y < h; y += 16)
+		for (x = 0; x < w; x += 16)
+			put_tile(b, &st, px + y * stride + x, stride,
+				w - x < 16 ? w - x : 16, h - y < 16 ? h - y : 16, bpp);
+}
+
+// the client
+
+static void quiet(const char *format, ...)
+{
+}
+
+typedef struct {
+	rfbClient *client;
+	uint8_t *mem, *ref;
+	int size, bpp;
+	FILE *file;
+	buffer b;
+} session;
+
+static void open_session(session *s, int bpp)
+{
+	rfbClient *client = rfbGetClient(8, 3, 4);
+
+	client->width = FB_W;
+	client->height = FB_H;
+	client->format.bitsPerPixel = bpp;
+	client->format.depth = bpp == 32 ? 24 : bpp;
+	client->format.trueColour = TRUE;
+	client->format.redMax = bpp == 8 ? 7 : bpp == 16 ? 31 : 255;
+	client->format.greenMax = bpp == 8 ? 7 : bpp == 16 ? 63 : 255;
+	client->format.blueMax = bpp == 8 ? 3 : bpp == 16 ? 31 : 255;
+	client->format.redShift = bpp == 8 ? 0 : bpp == 16 ? 11 : 16;
+	client->format.greenShift = bpp == 8 ? 3 : bpp == 16 ? 5 : 8;
+	client->format.blueShift = bpp == 8 ? 6 : 0;
+	s->bpp = bpp;
+	s->size = FB_W * FB_H * bpp / 8;
+	s->mem = malloc(s->size + 2 * GUARD);
+	memset(s->mem, FILL, s->size + 2 * GUARD);
+	s->ref = malloc(s->size);
+	memset(s->ref, FILL, s->size);
+	client->frameBuffer = s->mem + GUARD;
+	client->serverPort = -1;
+	client->vncRec = calloc(1, sizeof(rfbVNCRec));
+	client->vncRec->file = s->file = tmpfile();
+	client->vncRec->doNotSleep = TRUE;
+	SetFormatAndEncodings(client);
+	memset(&s->b, 0, sizeof(buffer));
+	s->client = client;
+}
+
+static void close_session(session *s)
+{
+	fclose(s->file);
+	s->client->frameBuffer = NULL;
+	rfbClientCleanup(s->client);
+	free(s->mem);
+	free(s->ref);
+	free(s->b.data);
+}
+
+// decodes what has been put into the session's buffer
+static rfbBool decode(session *s)
+{
+	rewind(s->file);
+	fwrite(s->b.data, 1, s->b.len, s->file);
+	fflush(s->file);
+	rewind(s->file);
+	s->b.len = 0;
+	return HandleRFBServerMessage(s->client);
+}
+
+// pixels into the reference
+static void draw_ref(session *s, const uint32_t *px, int stride, int x, int y, int w, int h)
+{
+	int i, j;
+
+	for (j = 0; j < h; j++)
+		for (i = 0; i < w; i++)
+			memcpy(s->ref + ((y + j) * FB_W + x + i) * s->bpp / 8, &px[j * stride + i], s->bpp / 8);
+}
+
+// the framebuffer against the reference, and the guards
+static int same(session *s)
+{
+	int i;
+
+	for (i = 0; i < GUARD; i++)
+		if (s->mem[i] != FILL || s->mem[GUARD + s->size + i] != FILL)
+			return 0;
+	return !memcmp(s->client->frameBuffer, s->ref, s->size);
+}
+
+static int test_format(int bpp)
+{
+	static uint32_t screen[FB_W * FB_H];
+	session s;
+	int n, r, fails = 0;
+
+	open_session(&s, bpp);
+	draw_screen(screen, FB_W, FB_H, bpp);
+
+	for (n = 0; n < RECTS && !fails; n++) {
+		// one to three rectangles per update, now and then the whole screen
+		int rects = 1 + rnd(3);
+
+		if (n % 40 == 0)
+			draw_screen(screen, FB_W, FB_H, bpp);
+		put_update(&s.b, rects);
+		for (r = 0; r < rects; r++) {
+			int w = n % 40 == 0 ? FB_W : 1 + rnd(160);
+			int h = n % 40 == 0 ? FB_H : 1 + rnd(100);
+			int x = rnd(FB_W - w + 1), y = rnd(FB_H - h + 1);
+			int sx = rnd(FB_W - w + 1), sy = rnd(FB_H - h + 1);
+			const uint32_t *px = screen + sy * FB_W + sx;
+
+			put_rect_header(&s.b, x, y, w, h, rfbEncodingHextile);
+			put_hextile(&s.b, px, FB_W, w, h, bpp);
+			draw_ref(&s, px, FB_W, x, y, w, h);
+		}
+		if (!decode(&s)) {
+			printf("FAIL: %d bpp, update %d: not decoded\n", bpp, n);
+			fails++;
+		} else if (!same(&s)) {
+			printf("FAIL: %d bpp, update %d: pixels differ\n", bpp, n);
+			fails++;
+		}
+	}
+	close_session(&s);
+	return fails;
+}
+
+// subrects reaching outside their tile are cut at its edge
+static int clip_test(int bpp)
+{
+	// a 10x6 tile: x, y, w, h of each subrect, and where it lands
+	static const int subrects[][8] = {
+		{ 8, 2, 8, 8,   8, 2, 2, 4 },	// past the right and bottom edges
+		{ 0, 5, 16, 16,  0, 5, 10, 1 },	// past both, from the last row
+		{ 12, 0, 2, 2,  0, 0, 0, 0 },	// right of the tile
+		{ 3, 7, 2, 2,   0, 0, 0, 0 },	// below the tile
+	};
+	const int x = 100, y = 50, w = 10, h = 6, n = sizeof(subrects) / sizeof(subrects[0]);
+	uint32_t bg = rnd_pixel(bpp), fg = rnd_pixel(bpp) ^ 1, px[10 * 6];
+	session s;
+	char msg[64];
+	int i, j, k, fails;
+
+	for (i = 0; i < w * h; i++)
+		px[i] = bg;
+	for (k = 0; k < n; k++)
+		for (j = subrects[k][5]; j < subrects[k][5] + subrects[k][7]; j++)
+			for (i = subrects[k][4]; i < subrects[k][4] + subrects[k][6]; i++)
+				px[j * w + i] = fg;
+
+	open_session(&s, bpp);
+	put_update(&s.b, 1);
+	put_rect_header(&s.b, x, y, w, h, rfbEncodingHextile);
+	put8(&s.b, rfbHextileBackgroundSpecified | rfbHextileForegroundSpecified | rfbHextileAnySubrects);
+	put_pixel(&s.b, bg, bpp);
+	put_pixel(&s.b, fg, bpp);
+	put8(&s.b, n);
+	for (k = 0; k < n; k++) {
+		put8(&s.b, subrects[k][0] << 4 | subrects[k][1]);
+		put8(&s.b, (subrects[k][2] - 1) << 4 | (subrects[k][3] - 1));
+	}
+	draw_ref(&s, px, w, x, y, w, h);
+	snprintf(msg, sizeof(msg), "%d bpp: subrects outside the tile decoded", bpp);
+	fails = check(msg, decode(&s));
+	snprintf(msg, sizeof(msg), "%d bpp: subrects not clipped to the tile", bpp);
+	fails += check(msg, same(&s));
+	close_session(&s);
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	int i, fails = 0;
+
+	rfbClientLog = rfbClientErr = quiet;
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		fails += test_format(formats[i]);
+		fails += clip_test(formats[i]);
+	}
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
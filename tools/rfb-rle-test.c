@@ -0,0 +1,464 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * rfb-rle-test.c - encodes UI-like content as TRLE and ZRLE on the host,
+ * decodes it through HandleRFBServerMessage() and compares the framebuffer
+ * with the source pixels, for every compressed pixel layout
+ *
+ * Covers 8 bpp, 16 bpp 565 and 32 bpp with the colours in all four bytes,
+ * in the low three bytes (little and big endian) and in the high three
+ * (little endian: 24Up, big endian: 24Down). The compressed pixels are
+ * taken from the pixel bytes as the format lays them out in memory, less
+ * the byte that holds no colour, as the protocol defines them.
+ *
+ * Every tile gets one of the sub-encodings its colours allow, at random:
+ * raw, solid, packed palette with 1, 2, 4 and (ZRLE only) 8 bit indices,
+ * plain RLE and palette RLE, and for TRLE the reuse of the previous tile's
+ * solid colour or palette. Rectangles have any size and position, so edge
+ * tiles of every width and height are decoded, and runs are long enough
+ * to need several length bytes. Nothing may be written around the
+ * framebuffer.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o rfb-rle-test \
+ *      tools/rfb-rle-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: rfb-rle-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+#define FB_W 400
+#define FB_H 240
+#define GUARD 256
+#define FILL 0xA5
+#define UPDATES 150
+
+typedef struct {
+	const char *name;
+	int bpp, big_endian, max[3], shift[3];
+} format;
+
+static const format formats[] = {
+	{ "8 bpp 332", 8, 0, { 7, 7, 3 }, { 0, 3, 6 } },
+	{ "16 bpp 565", 16, 0, { 31, 63, 31 }, { 11, 5, 0 } },
+	{ "32 bpp", 32, 0, { 255, 255, 255 }, { 0, 8, 24 } },
+	{ "24 bpp, little endian", 32, 0, { 255, 255, 255 }, { 16, 8, 0 } },
+	{ "24 bpp, big endian", 32, 1, { 255, 255, 255 }, { 24, 16, 8 } },
+	{ "24Up, little endian", 32, 0, { 255, 255, 255 }, { 24, 16, 8 } },
+	{ "24Down, big endian", 32, 1, { 255, 255, 255 }, { 16, 8, 0 } },
+};
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static uint32_t color_mask(const format *f)
+{
+	return (uint32_t)f->max[0] << f->shift[0] | (uint32_t)f->max[1] << f->shift[1] |
+		(uint32_t)f->max[2] << f->shift[2];
+}
+
+static uint32_t rnd_pixel(const format *f)
+{
+	return (rnd(1 << 16) | rnd(1 << 16) << 16) & color_mask(f);
+}
+
+// the pixel as the format lays it out in memory
+static void pixel_bytes(const format *f, uint32_t v, uint8_t *p)
+{
+	int i, n = f->bpp / 8;
+
+	for (i = 0; i < n; i++)
+		p[i] = v >> (f->big_endian ? (n - 1 - i) * 8 : i * 8);
+}
+
+// the byte of a 32 bpp pixel in memory that the compressed pixel leaves
+// out, or -1 if it is the whole pixel
+static int unused_byte(const format *f)
+{
+	uint8_t m[4];
+
+	if (f->bpp != 32)
+		return -1;
+	pixel_bytes(f, color_mask(f), m);
+	return !m[3] ? 3 : !m[0] ? 0 : -1;
+}
+
+// the stream
+
+typedef struct {
+	uint8_t *data;
+	size_t len, size;
+} buffer;
+
+static void put(buffer *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put8(buffer *b, int v) { uint8_t c = v; put(b, &c, 1); }
+static void put16(buffer *b, int v) { put8(b, v >> 8); put8(b, v); }
+static void put32(buffer *b, uint32_t v) { put16(b, v >> 16); put16(b, v); }
+
+static void put_update(buffer *b, int rects)
+{
+	static const uint8_t timestamp[sizeof(struct timeval)];
+
+	put(b, timestamp, sizeof(timestamp));
+	put8(b, rfbFramebufferUpdate);
+	put8(b, 0);
+	put16(b, rects);
+}
+
+static void put_rect_header(buffer *b, int x, int y, int w, int h, int encoding)
+{
+	put16(b, x);
+	put16(b, y);
+	put16(b, w);
+	put16(b, h);
+	put32(b, encoding);
+}
+
+// UI-like content: flat windows, text, many colour pictures and noise
+static void draw_screen(const format *f, uint32_t *px, int w, int h)
+{
+	uint32_t desktop = rnd_pixel(f), colors[120];
+	int i, x, y, n;
+
+	for (i = 0; i < w * h; i++)
+		px[i] = desktop;
+	for (n = 0; n < 16; n++) {
+		int ww = 20 + rnd(200), wh = 10 + rnd(120), wx = rnd(w - ww), wy = rnd(h - wh);
+		int kind = rnd(4), ncolors = kind == 1 ? 2 + rnd(15) : 17 + rnd(100);
+
+		for (i = 0; i < ncolors; i++)
+			colors[i] = rnd_pixel(f);
+		for (y = wy; y < wy + wh; y++)
+			for (x = wx; x < wx + ww; x++) {
+				uint32_t *c = px + y * w + x;
+
+				if (kind == 3)
+					*c = rnd_pixel(f);
+				else if (kind == 2)
+					*c = colors[(x / 3 + y / 2) % ncolors];
+				else if ((y - wy) % 10 < 7 && (x - wx) % 30 < 24 && rnd(3) == 0)
+					*c = colors[1 + rnd(ncolors - 1)];
+				else
+					*c = colors[0];
+			}
+	}
+}
+
+// the TRLE and ZRLE encoder
+
+typedef struct {
+	const format *f;
+	int zrle;
+	// TRLE: the solid colour or palette the next tile can reuse
+	int last;	// 1: solid, 2: palette, 0: none
+	uint32_t palette[128];
+	int npalette;
+} encoder;
+
+static void put_cpixel(buffer *b, const encoder *e, uint32_t v)
+{
+	uint8_t p[4];
+	int unused = unused_byte(e->f);
+
+	pixel_bytes(e->f, v, p);
+	if (unused < 0)
+		put(b, p, e->f->bpp / 8);
+	else
+		put(b, unused ? p : p + 1, 3);
+}
+
+static void put_run_length(buffer *b, int length)
+{
+	for (length--; length >= 255; length -= 255)
+		put8(b, 255);
+	put8(b, length);
+}
+
+static void put_tile(buffer *b, encoder *e, const uint32_t *px, int stride, int w, int h)
+{
+	uint32_t palette[128], tile[64 * 64];
+	uint8_t index[64 * 64];
+	int ncolors = 0, i, j, k, n = w * h, bits, types[8], ntypes = 0, type, reuse;
+
+	for (j = 0; j < h; j++)
+		for (i = 0; i < w; i++) {
+			uint32_t c = tile[j * w + i] = px[j * stride + i];
+
+			for (k = 0; k < ncolors && palette[k] != c; k++);
+			if (k == ncolors && ncolors < 128)
+				palette[ncolors++] = c;
+			index[j * w + i] = k;
+		}
+
+	// the sub-encodings these colours allow
+	types[ntypes++] = 0;
+	types[ntypes++] = 128;
+	if (ncolors == 1)
+		types[ntypes++] = 1;
+	if (ncolors >= 2 && ncolors <= (e->zrle ? 127 : 16))
+		types[ntypes++] = ncolors;
+	if (ncolors >= 2 && ncolors <= 127)
+		types[ntypes++] = 128 + ncolors;
+	if (!e->zrle && ncolors == 1 && e->last == 1 && e->palette[0] == palette[0])
+		types[ntypes++] = 127;
+	if (!e->zrle && e->last == 2 && ncolors < 128) {
+		for (i = 0; i < ncolors; i++) {
+			for (k = 0; k < e->npalette && e->palette[k] != palette[i]; k++);
+			if (k == e->npalette) break;
+		}
+		if (i == ncolors) {
+			if (e->npalette <= 16)
+				types[ntypes++] = 127;
+			types[ntypes++] = 129;
+		}
+	}
+	type = types[rnd(ntypes)];
+	reuse = !e->zrle && (type == 127 || type == 129);
+	put8(b, type);
+
+	if (reuse) {
+		// the previous palette, which may hold more colours
+		ncolors = e->npalette;
+		memcpy(palette, e->palette, sizeof(palette));
+	} else if (type == 1 || (type >= 2 && type <= 127) || type >= 130) {
+		for (i = 0; i < ncolors; i++)
+			put_cpixel(b, e, palette[i]);
+		if (type != 1) {
+			e->last = 2;
+			e->npalette = ncolors;
+			memcpy(e->palette, palette, sizeof(palette));
+		} else {
+			e->last = 1;
+			e->palette[0] = palette[0];
+		}
+	}
+	if (reuse)
+		for (i = 0; i < n; i++)
+			for (index[i] = 0; palette[index[i]] != tile[i]; index[i]++);
+
+	if (type == 0) {
+		for (i = 0; i < n; i++)
+			put_cpixel(b, e, tile[i]);
+	} else if (type == 128) {
+		for (i = 0; i < n; i += k) {
+			for (k = 1; i + k < n && tile[i + k] == tile[i]; k++);
+			put_cpixel(b, e, tile[i]);
+			put_run_length(b, k);
+		}
+	} else if (type >= 129) {
+		for (i = 0; i < n; i += k) {
+			for (k = 1; i + k < n && tile[i + k] == tile[i]; k++);
+			if (k == 1) {
+				put8(b, index[i]);
+			} else {
+				put8(b, index[i] | 0x80);
+				put_run_length(b, k);
+			}
+		}
+	} else if (type >= 2 && !(reuse && e->last == 1)) {
+		bits = ncolors > 16 ? 8 : ncolors > 4 ? 4 : ncolors > 2 ? 2 : 1;
+		for (j = 0; j < h; j++) {
+			uint8_t byte = 0;
+
+			for (i = 0; i < w; i++) {
+				byte |= index[j * w + i] << (8 - bits * (i % (8 / bits) + 1));
+				if (i % (8 / bits) == 8 / bits - 1 || i == w - 1) {
+					put8(b, byte);
+					byte = 0;
+				}
+			}
+		}
+	}
+}
+
+static void put_tiles(buffer *b, encoder *e, const uint32_t *px, int stride, int w, int h)
+{
+	int size = e->zrle ? 64 : 16, x, y;
+
+	e->last = 0;	// nothing to reuse from another rectangle
+	for (y = 0; y < h; y += size)
+		for (x = 0; x < w; x += size)
+			put_tile(b, e, px + y * stride + x, stride,
+				w - x < size ? w - x : size, h - y < size ? h - y : size);
+}
+
+// deflates a ZRLE rectangle, continuing the stream as a VNC server does
+static void put_zrle(buffer *b, z_stream *zs, buffer *tiles)
+{
+	uLong size = deflateBound(zs, tiles->len) + 16;
+	uint8_t *out = malloc(size);
+
+	zs->next_in = tiles->data;
+	zs->avail_in = tiles->len;
+	zs->next_out = out;
+	zs->avail_out = size;
+	deflate(zs, Z_SYNC_FLUSH);
+	put32(b, size - zs->avail_out);
+	put(b, out, size - zs->avail_out);
+	free(out);
+	tiles->len = 0;
+}
+
+// the client
+
+static void quiet(const char *format, ...)
+{
+}
+
+typedef struct {
+	rfbClient *client;
+	uint8_t *mem, *ref;
+	int size;
+	FILE *file;
+	buffer b;
+} session;
+
+static void open_session(session *s, const format *f)
+{
+	rfbClient *client = rfbGetClient(8, 3, 4);
+
+	client->width = FB_W;
+	client->height = FB_H;
+	client->format.bitsPerPixel = f->bpp;
+	client->format.depth = f->bpp == 32 ? 24 : f->bpp;
+	client->format.bigEndian = f->big_endian;
+	client->format.trueColour = TRUE;
+	client->format.redMax = f->max[0];
+	client->format.greenMax = f->max[1];
+	client->format.blueMax = f->max[2];
+	client->format.redShift = f->shift[0];
+	client->format.greenShift = f->shift[1];
+	client->format.blueShift = f->shift[2];
+	client->si.format = client->format;	// 16 bpp decoding looks at the server's
+	s->size = FB_W * FB_H * f->bpp / 8;
+	s->mem = malloc(s->size + 2 * GUARD);
+	memset(s->mem, FILL, s->size + 2 * GUARD);
+	s->ref = malloc(s->size);
+	memset(s->ref, FILL, s->size);
+	client->frameBuffer = s->mem + GUARD;
+	client->serverPort = -1;
+	client->vncRec = calloc(1, sizeof(rfbVNCRec));
+	client->vncRec->file = s->file = tmpfile();
+	client->vncRec->doNotSleep = TRUE;
+	SetFormatAndEncodings(client);
+	memset(&s->b, 0, sizeof(buffer));
+	s->client = client;
+}
+
+static void close_session(session *s)
+{
+	fclose(s->file);
+	s->client->frameBuffer = NULL;
+	rfbClientCleanup(s->client);
+	free(s->mem);
+	free(s->ref);
+	free(s->b.data);
+}
+
+// decodes what has been put into the session's buffer
+static rfbBool decode(session *s)
+{
+	rewind(s->file);
+	fwrite(s->b.data, 1, s->b.len, s->file);
+	fflush(s->file);
+	rewind(s->file);
+	s->b.len = 0;
+	return HandleRFBServerMessage(s->client);
+}
+
+// the framebuffer against the reference, and the guards
+static int same(session *s)
+{
+	int i;
+
+	for (i = 0; i < GUARD; i++)
+		if (s->mem[i] != FILL || s->mem[GUARD + s->size + i] != FILL)
+			return 0;
+	return !memcmp(s->client->frameBuffer, s->ref, s->size);
+}
+
+static int test_format(const format *f, int zrle)
+{
+	static uint32_t screen[FB_W * FB_H];
+	const char *name = zrle ? "ZRLE" : "TRLE";
+	encoder e = { f, zrle };
+	buffer tiles = { 0 };
+	z_stream zs;
+	session s;
+	int n, r, i, j, fails = 0;
+
+	memset(&zs, 0, sizeof(zs));
+	deflateInit(&zs, 6);
+	open_session(&s, f);
+
+	for (n = 0; n < UPDATES && !fails; n++) {
+		// one to three rectangles per update, now and then the whole screen
+		int rects = 1 + rnd(3);
+
+		if (n % 30 == 0)
+			draw_screen(f, screen, FB_W, FB_H);
+		put_update(&s.b, rects);
+		for (r = 0; r < rects; r++) {
+			int w = n % 30 == 0 ? FB_W : 1 + rnd(200);
+			int h = n % 30 == 0 ? FB_H : 1 + rnd(150);
+			int x = rnd(FB_W - w + 1), y = rnd(FB_H - h + 1);
+			int sx = rnd(FB_W - w + 1), sy = rnd(FB_H - h + 1);
+			const uint32_t *px = screen + sy * FB_W + sx;
+
+			put_rect_header(&s.b, x, y, w, h, zrle ? rfbEncodingZRLE : rfbEncodingTRLE);
+			if (zrle) {
+				put_tiles(&tiles, &e, px, FB_W, w, h);
+				put_zrle(&s.b, &zs, &tiles);
+			} else
+				put_tiles(&s.b, &e, px, FB_W, w, h);
+			for (j = 0; j < h; j++)
+				for (i = 0; i < w; i++)
+					pixel_bytes(f, px[j * FB_W + i], s.ref + ((y + j) * FB_W + x + i) * f->bpp / 8);
+		}
+		if (!decode(&s)) {
+			printf("FAIL: %s, %s, update %d: not decoded\n", f->name, name, n);
+			fails++;
+		} else if (!same(&s)) {
+			printf("FAIL: %s, %s, update %d: pixels differ\n", f->name, name, n);
+			fails++;
+		}
+	}
+	close_session(&s);
+	deflateEnd(&zs);
+	free(tiles.data);
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	int i, fails = 0;
+
+	rfbClientLog = rfbClientErr = quiet;
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		fails += test_format(&formats[i], 0);
+		fails += test_format(&formats[i], 1);
+	}
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * rfb-scratch-share-test.c - runs two clients sharing their decoder scratch
+ * memory (rfbClientShareScratch(), as the top and bottom screen sessions
+ * do) through HandleRFBServerMessage() on the host, with a memory budget
+ * so that every update ends with a trim
+ *
+ * The updates are Hextile, which decodes in the shared buffer, and Raw,
+ * which does not. Checks that the buffer is allocated once while either
+ * client still needs it, that a client's trim does not take it from the
+ * other one, that it is freed once neither needs it, and that no client
+ * is left pointing at it then. Mallocs are counted by replacing malloc(),
+ * which works with glibc only.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o rfb-scratch-share-test \
+ *      tools/rfb-scratch-share-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: rfb-scratch-share-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+#define FB_W 64
+#define FB_H 16
+
+// the shared buffer is the only allocation of its size
+
+extern void *__libc_malloc(size_t size);
+
+static int buffer_allocs;
+
+void *malloc(size_t size)
+{
+	if (size == RFB_BUFFER_SIZE) buffer_allocs++;
+	return __libc_malloc(size);
+}
+
+static void quiet(const char *format, ...)
+{
+}
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+// the stream
+
+typedef struct {
+	rfbClient *client;
+	FILE *file;
+	uint8_t ref[FB_W * FB_H * 4];
+} session;
+
+static void put16(FILE *f, int v) { fputc(v >> 8, f); fputc(v, f); }
+static void put32(FILE *f, uint32_t v) { put16(f, v >> 16); put16(f, v); }
+
+static void open_session(session *s)
+{
+	rfbClient *client = rfbGetClient(8, 3, 4);
+
+	client->width = FB_W;
+	client->height = FB_H;
+	client->frameBuffer = calloc(FB_W * FB_H, 4);
+	client->serverPort = -1;
+	client->vncRec = calloc(1, sizeof(rfbVNCRec));
+	client->vncRec->file = s->file = tmpfile();
+	client->vncRec->doNotSleep = TRUE;
+	client->memoryBudget = 1;	// trim after every update
+	memset(s->ref, 0, sizeof(s->ref));
+	s->client = client;
+}
+
+static void close_session(session *s)
+{
+	fclose(s->file);
+	free(s->client->frameBuffer);
+	s->client->frameBuffer = NULL;
+	rfbClientCleanup(s->client);
+}
+
+// one 16x16 rectangle of random pixels at a random tile, Hextile with a
+// raw tile or Raw; returns 0 if it was decoded right
+static int update(session *s, int hextile)
+{
+	static const uint8_t timestamp[sizeof(struct timeval)];
+	int x = rnd(FB_W / 16) * 16, y = 0, i, j;
+
+	rewind(s->file);
+	fwrite(timestamp, 1, sizeof(timestamp), s->file);
+	fputc(rfbFramebufferUpdate, s->file);
+	fputc(0, s->file);
+	put16(s->file, 1);
+	put16(s->file, x);
+	put16(s->file, y);
+	put16(s->file, 16);
+	put16(s->file, 16);
+	put32(s->file, hextile ? rfbEncodingHextile : rfbEncodingRaw);
+	if (hextile) fputc(rfbHextileRaw, s->file);
+	for (j = 0; j < 16; j++) {
+		for (i = 0; i < 16 * 4; i++) {
+			uint8_t c = rnd(256);
+			fputc(c, s->file);
+			s->ref[(y + j) * FB_W * 4 + x * 4 + i] = c;
+		}
+	}
+	fflush(s->file);
+	rewind(s->file);
+	return !HandleRFBServerMessage(s->client) || memcmp(s->client->frameBuffer, s->ref, sizeof(s->ref));
+}
+
+static int check(const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s\n", what);
+	return !ok;
+}
+
+int main(int argc, char **argv)
+{
+	session a, b;
+	int n, fails = 0, bad = 0;
+
+	rfbClientLog = rfbClientErr = quiet;
+	open_session(&a);
+	open_session(&b);
+	fails += check("could not share", rfbClientShareScratch(b.client, a.client));
+
+	// both decode in the buffer: it stays
+	for (n = 0; n < 50; n++)
+		bad += update(&a, 1) + update(&b, 1);
+	fails += check("Hextile not decoded while both use the buffer", !bad);
+	fails += check("buffer reallocated while both use it", buffer_allocs == 1);
+	fails += check("clients not decoding in the same buffer",
+		a.client->buffer && a.client->buffer == b.client->buffer);
+
+	// a no longer needs it, b goes on using it: a's trims leave it to b
+	for (n = 0; n < 50; n++)
+		bad += update(&a, 0) + update(&b, 1);
+	fails += check("not decoded while one uses the buffer", !bad);
+	fails += check("buffer reallocated while one still uses it", buffer_allocs == 1);
+	fails += check("buffer taken from the client using it", b.client->buffer != NULL);
+
+	// neither needs it: it goes, and neither points at it any more
+	bad += update(&a, 0) + update(&b, 0);
+	fails += check("Raw not decoded", !bad);
+	fails += check("buffer kept by a client", a.client->buffer == NULL);
+	fails += check("buffer kept by the other client", b.client->buffer == NULL);
+
+	// and comes back for whoever needs it next
+	bad += update(&a, 1) + update(&b, 1);
+	fails += check("Hextile not decoded after the trim", !bad);
+	fails += check("buffer not allocated once again", buffer_allocs == 2);
+
+	close_session(&a);
+	bad = update(&b, 1);
+	fails += check("Hextile not decoded after the other client is gone", !bad);
+	close_session(&b);
+
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
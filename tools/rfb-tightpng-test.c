@@ -0,0 +1,535 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * rfb-tightpng-test.c - decodes TightPng rectangles through
+ * HandleRFBServerMessage() on the host and compares the framebuffer with
+ * the PNG's pixels, then measures TightPng against Tight
+ *
+ * Covers 32 bpp with the red, green and blue bytes in each of the orders
+ * libpng writes straight into the framebuffer and in another one, and
+ * 16 bpp 565; truecolour and colour-mapped PNGs; and rectangles too large
+ * for client->buffer. PNGs of another size than their rectangle,
+ * rectangles reaching outside the framebuffer and broken PNGs must be
+ * refused without a pixel written, inside or around the framebuffer.
+ *
+ * The benchmark (-b) encodes 20 frames of 800x480 UI-like content in
+ * 128x96 rectangles at 32 bpp, once as Tight (fill, palette and copy
+ * filters on their own zlib streams, level 6) and once as TightPng (fill,
+ * colour-mapped PNGs up to 256 colours, truecolour ones above), and
+ * prints the bytes and the decoding time per frame.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o rfb-tightpng-test \
+ *      tools/rfb-tightpng-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: rfb-tightpng-test [-b]   (-b: run the benchmark too)
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <png.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+#define FB_W 800
+#define FB_H 480
+#define GUARD 256
+#define FILL 0xA5
+#define RECTS 300
+
+typedef struct {
+	const char *name;
+	int bpp, depth, max[3], shift[3];
+} format;
+
+static const format formats[] = {
+	{ "32 bpp RGBX", 32, 24, { 255, 255, 255 }, { 0, 8, 16 } },
+	{ "32 bpp BGRX", 32, 24, { 255, 255, 255 }, { 16, 8, 0 } },
+	{ "32 bpp XBGR", 32, 24, { 255, 255, 255 }, { 24, 16, 8 } },
+	{ "32 bpp XRGB", 32, 24, { 255, 255, 255 }, { 8, 16, 24 } },
+	{ "16 bpp 565", 16, 16, { 31, 63, 31 }, { 11, 5, 0 } },
+};
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void quiet(const char *format, ...)
+{
+}
+
+// the stream
+
+typedef struct {
+	uint8_t *data;
+	size_t len, size;
+} buffer;
+
+static void put(buffer *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put8(buffer *b, int v) { uint8_t c = v; put(b, &c, 1); }
+static void put16(buffer *b, int v) { put8(b, v >> 8); put8(b, v); }
+static void put32(buffer *b, uint32_t v) { put16(b, v >> 16); put16(b, v); }
+
+static void put_compact_len(buffer *b, int len)
+{
+	if (len > 0x7f) {
+		put8(b, (len & 0x7f) | 0x80);
+		if (len > 0x3fff) {
+			put8(b, (len >> 7 & 0x7f) | 0x80);
+			put8(b, len >> 14);
+		} else
+			put8(b, len >> 7);
+	} else
+		put8(b, len);
+}
+
+static void put_update(buffer *b, int rects)
+{
+	static const uint8_t timestamp[sizeof(struct timeval)];
+
+	put(b, timestamp, sizeof(timestamp));
+	put8(b, rfbFramebufferUpdate);
+	put8(b, 0);
+	put16(b, rects);
+}
+
+static void put_rect_header(buffer *b, int x, int y, int w, int h, int encoding)
+{
+	put16(b, x);
+	put16(b, y);
+	put16(b, w);
+	put16(b, h);
+	put32(b, encoding);
+}
+
+// the pixels, RGB, with a colour map if there are at most 256 colours
+
+typedef struct {
+	int w, h, colors;
+	uint8_t *rgb;
+	uint8_t map[256 * 3];
+	uint8_t *index;
+} picture;
+
+// the colours of the picture into its map, if they fit
+static void make_map(picture *p)
+{
+	int i, j, n = p->w * p->h;
+
+	p->colors = 0;
+	for (i = 0; i < n; i++) {
+		const uint8_t *c = p->rgb + i * 3;
+
+		for (j = 0; j < p->colors && memcmp(p->map + j * 3, c, 3); j++);
+		if (j == p->colors) {
+			if (p->colors == 256) {
+				p->colors = 257;
+				return;
+			}
+			memcpy(p->map + p->colors++ * 3, c, 3);
+		}
+		p->index[i] = j;
+	}
+}
+
+static void put_png(buffer *b, const picture *p, int w, int h)
+{
+	png_image image;
+	png_alloc_size_t size = 0;
+	uint8_t *png;
+
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+	image.width = w;
+	image.height = h;
+	if (p->colors <= 256) {
+		image.format = PNG_FORMAT_RGB_COLORMAP;
+		image.colormap_entries = p->colors;
+		png_image_write_get_memory_size(image, size, 0, p->index, p->w, p->map);
+		png = malloc(size);
+		png_image_write_to_memory(&image, png, &size, 0, p->index, p->w, p->map);
+	} else {
+		image.format = PNG_FORMAT_RGB;
+		png_image_write_get_memory_size(image, size, 0, p->rgb, p->w * 3, NULL);
+		png = malloc(size);
+		png_image_write_to_memory(&image, png, &size, 0, p->rgb, p->w * 3, NULL);
+	}
+	put8(b, rfbTightPng << 4);
+	put_compact_len(b, size);
+	put(b, png, size);
+	free(png);
+}
+
+// UI-like content: flat backgrounds, frames, lines of text, a few photos
+static void draw_screen(uint8_t *rgb, int w, int h)
+{
+	int i, x, y, n;
+
+	for (i = 0; i < w * h; i++) {
+		rgb[i * 3] = 0xE8;
+		rgb[i * 3 + 1] = 0xEC;
+		rgb[i * 3 + 2] = 0xF0;
+	}
+	for (n = 0; n < 12; n++) {
+		int ww = 80 + rnd(300), wh = 40 + rnd(200), wx = rnd(w - ww), wy = rnd(h - wh);
+		uint8_t bg = 0xF8 - rnd(3) * 0x10, title[3] = { 0x30 + rnd(64), 0x50 + rnd(64), 0x90 + rnd(64) };
+		int photo = rnd(4) == 0;
+
+		for (y = wy; y < wy + wh; y++)
+			for (x = wx; x < wx + ww; x++) {
+				uint8_t *c = rgb + (y * w + x) * 3;
+
+				if (y == wy || y == wy + wh - 1 || x == wx || x == wx + ww - 1) {
+					c[0] = c[1] = c[2] = 0x80;
+				} else if (y < wy + 14) {
+					c[0] = title[0]; c[1] = title[1]; c[2] = title[2];
+				} else if (photo && x > wx + 8 && x < wx + ww - 8 && y > wy + 20 && y < wy + wh - 8) {
+					c[0] = x * 3 + y + rnd(24);
+					c[1] = y * 2 + rnd(24);
+					c[2] = (x ^ y) + rnd(24);
+				} else if (!photo && (y - wy - 18) % 12 < 8 && (x - wx) % 40 < 30 + (y % 7) && rnd(3)) {
+					// glyphs, antialiased
+					c[0] = c[1] = c[2] = rnd(4) ? 0x20 : 0x20 + rnd(6) * 0x28;
+				} else {
+					c[0] = c[1] = c[2] = bg;
+				}
+			}
+	}
+}
+
+// the reference pixel for r, g, b, as RGB24_TO_PIXEL
+static uint32_t to_pixel(const format *f, const uint8_t *c)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		v |= (uint32_t)((c[i] * f->max[i] + 127) / 255) << f->shift[i];
+	return v;
+}
+
+typedef struct {
+	rfbClient *client;
+	uint8_t *mem, *ref;
+	int size;
+	FILE *file;
+	buffer b;
+} session;
+
+static void open_session(session *s, const format *f)
+{
+	rfbClient *client = rfbGetClient(8, 3, 4);
+
+	client->width = FB_W;
+	client->height = FB_H;
+	client->format.bitsPerPixel = f->bpp;
+	client->format.depth = f->depth;
+	client->format.redMax = f->max[0];
+	client->format.greenMax = f->max[1];
+	client->format.blueMax = f->max[2];
+	client->format.redShift = f->shift[0];
+	client->format.greenShift = f->shift[1];
+	client->format.blueShift = f->shift[2];
+	s->size = FB_W * FB_H * f->bpp / 8;
+	s->mem = malloc(s->size + 2 * GUARD);
+	memset(s->mem, FILL, s->size + 2 * GUARD);
+	s->ref = malloc(s->size);
+	memset(s->ref, FILL, s->size);
+	client->frameBuffer = s->mem + GUARD;
+	client->serverPort = -1;
+	client->vncRec = calloc(1, sizeof(rfbVNCRec));
+	client->vncRec->file = s->file = tmpfile();
+	client->vncRec->doNotSleep = TRUE;
+	SetFormatAndEncodings(client);	// classifies the pixel format
+	memset(&s->b, 0, sizeof(buffer));
+	s->client = client;
+}
+
+static void close_session(session *s)
+{
+	fclose(s->file);
+	s->client->frameBuffer = NULL;
+	rfbClientCleanup(s->client);
+	free(s->mem);
+	free(s->ref);
+	free(s->b.data);
+}
+
+// decodes what has been put into the session's buffer
+static rfbBool decode(session *s)
+{
+	rewind(s->file);
+	fwrite(s->b.data, 1, s->b.len, s->file);
+	fflush(s->file);
+	rewind(s->file);
+	s->b.len = 0;
+	return HandleRFBServerMessage(s->client);
+}
+
+// the framebuffer against the reference, in the colour bits, and the guards
+static int same(session *s, const format *f)
+{
+	uint32_t mask = 0;
+	int i, n = FB_W * FB_H;
+
+	for (i = 0; i < 3; i++)
+		mask |= (uint32_t)f->max[i] << f->shift[i];
+	for (i = 0; i < GUARD; i++)
+		if (s->mem[i] != FILL || s->mem[GUARD + s->size + i] != FILL)
+			return 0;
+	for (i = 0; i < n; i++) {
+		uint32_t a = 0, b = 0;
+
+		memcpy(&a, s->client->frameBuffer + i * f->bpp / 8, f->bpp / 8);
+		memcpy(&b, s->ref + i * f->bpp / 8, f->bpp / 8);
+		if ((a ^ b) & mask)
+			return 0;
+	}
+	return 1;
+}
+
+static int test_format(const format *f)
+{
+	static uint8_t screen[FB_W * FB_H * 3], index[FB_W * FB_H];
+	session s;
+	picture p;
+	int n, i, j, fails = 0;
+
+	open_session(&s, f);
+	draw_screen(screen, FB_W, FB_H);
+
+	for (n = 0; n < RECTS && !fails; n++) {
+		// small ones, then a few larger than client->buffer takes as RGB
+		int w = n % 50 == 0 ? 400 + rnd(FB_W - 400) : 1 + rnd(200);
+		int h = n % 50 == 0 ? 300 + rnd(FB_H - 300) : 1 + rnd(150);
+		int x = rnd(FB_W - w + 1), y = rnd(FB_H - h + 1);
+		int sx = rnd(FB_W - w + 1), sy = rnd(FB_H - h + 1);
+
+		p.w = w;
+		p.h = h;
+		p.rgb = malloc(w * h * 3);
+		p.index = index;
+		for (j = 0; j < h; j++)
+			memcpy(p.rgb + j * w * 3, screen + ((sy + j) * FB_W + sx) * 3, w * 3);
+		make_map(&p);
+		if (n % 2)
+			p.colors = 257;	// truecolour all the same
+
+		put_update(&s.b, 1);
+		put_rect_header(&s.b, x, y, w, h, rfbEncodingTightPng);
+		put_png(&s.b, &p, w, h);
+		for (j = 0; j < h; j++)
+			for (i = 0; i < w; i++) {
+				uint32_t v = to_pixel(f, p.rgb + (j * w + i) * 3);
+				memcpy(s.ref + ((y + j) * FB_W + x + i) * f->bpp / 8, &v, f->bpp / 8);
+			}
+		if (!decode(&s)) {
+			printf("FAIL: %s: %s %dx%d at %d,%d: not decoded\n", f->name,
+				p.colors <= 256 ? "colour-mapped" : "truecolour", w, h, x, y);
+			fails++;
+		} else if (!same(&s, f)) {
+			printf("FAIL: %s: %s %dx%d at %d,%d: pixels differ\n", f->name,
+				p.colors <= 256 ? "colour-mapped" : "truecolour", w, h, x, y);
+			fails++;
+		}
+		free(p.rgb);
+	}
+	close_session(&s);
+	return fails;
+}
+
+// rectangles that must be refused, with nothing drawn
+static int refuse_test(const format *f)
+{
+	static const struct {
+		const char *what;
+		int x, y, w, h, pw, ph, broken;
+	} cases[] = {
+		{ "PNG wider than its rectangle", 10, 10, 64, 32, 65, 32 },
+		{ "PNG taller than its rectangle", 10, 10, 64, 32, 64, 33 },
+		{ "PNG smaller than its rectangle", 10, 10, 64, 32, 63, 31 },
+		{ "rectangle beyond the right edge", FB_W - 63, 0, 64, 32, 64, 32 },
+		{ "rectangle beyond the bottom edge", 0, FB_H - 31, 64, 32, 64, 32 },
+		{ "broken PNG", 10, 10, 64, 32, 64, 32, 1 },
+	};
+	static uint8_t screen[FB_W * FB_H * 3], index[128 * 64];
+	int c, j, fails = 0;
+
+	draw_screen(screen, FB_W, FB_H);
+
+	for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		session s;
+		picture p;
+		char msg[128];
+
+		open_session(&s, f);
+		p.w = cases[c].pw;
+		p.h = cases[c].ph;
+		p.rgb = malloc(p.w * p.h * 3);
+		p.index = index;
+		for (j = 0; j < p.h; j++)
+			memcpy(p.rgb + j * p.w * 3, screen + ((100 + j) * FB_W + 100) * 3, p.w * 3);
+		p.colors = c % 2 ? 257 : 0;
+		if (!p.colors)
+			make_map(&p);
+		put_update(&s.b, 1);
+		put_rect_header(&s.b, cases[c].x, cases[c].y, cases[c].w, cases[c].h, rfbEncodingTightPng);
+		put_png(&s.b, &p, p.w, p.h);
+		if (cases[c].broken) {
+			// the image data, past the signature and the header
+			for (int i = 40; i < s.b.len; i++)
+				s.b.data[i] ^= 0x5A;
+		}
+		snprintf(msg, sizeof(msg), "%s: %s decoded", f->name, cases[c].what);
+		if (decode(&s)) {
+			printf("FAIL: %s\n", msg);
+			fails++;
+		}
+		snprintf(msg, sizeof(msg), "%s: %s drawn", f->name, cases[c].what);
+		if (!same(&s, f)) {
+			printf("FAIL: %s\n", msg);
+			fails++;
+		}
+		free(p.rgb);
+		close_session(&s);
+	}
+	return fails;
+}
+
+// the Tight encoder for the benchmark
+
+static void put_zlib(buffer *b, z_stream *zs, const uint8_t *data, int len)
+{
+	static uint8_t out[128 * 96 * 4 + 1024];
+
+	if (len < 12) {
+		put(b, data, len);
+		return;
+	}
+	zs->next_in = (uint8_t *)data;
+	zs->avail_in = len;
+	zs->next_out = out;
+	zs->avail_out = sizeof(out);
+	deflate(zs, Z_SYNC_FLUSH);
+	put_compact_len(b, sizeof(out) - zs->avail_out);
+	put(b, out, sizeof(out) - zs->avail_out);
+}
+
+static void put_tight(buffer *b, z_stream zs[3], const picture *p)
+{
+	static uint8_t packed[128 * 96];
+	int i, j;
+
+	if (p->colors == 2) {
+		int bw = (p->w + 7) / 8;
+
+		memset(packed, 0, bw * p->h);
+		for (j = 0; j < p->h; j++)
+			for (i = 0; i < p->w; i++)
+				packed[j * bw + i / 8] |= p->index[j * p->w + i] << (7 - i % 8);
+		put8(b, (1 | rfbTightExplicitFilter) << 4);
+		put8(b, rfbTightFilterPalette);
+		put8(b, 1);
+		put(b, p->map, 6);
+		put_zlib(b, &zs[1], packed, bw * p->h);
+	} else if (p->colors <= 256) {
+		put8(b, (2 | rfbTightExplicitFilter) << 4);
+		put8(b, rfbTightFilterPalette);
+		put8(b, p->colors - 1);
+		put(b, p->map, p->colors * 3);
+		put_zlib(b, &zs[2], p->index, p->w * p->h);
+	} else {
+		put8(b, 0);
+		put_zlib(b, &zs[0], p->rgb, p->w * p->h * 3);
+	}
+}
+
+static void benchmark()
+{
+	static const format *f = &formats[1];
+	static uint8_t screen[FB_W * FB_H * 3], rgb[128 * 96 * 3], index[128 * 96];
+	const int frames = 20;
+	double t[2] = { 0, 0 };
+	size_t bytes[2] = { 0, 0 };
+	int frame, png, x, y, j;
+
+	for (png = 0; png < 2; png++) {
+		session s;
+		z_stream zs[3];
+
+		seed = 1;
+		open_session(&s, f);
+		for (j = 0; j < 3; j++) {
+			memset(&zs[j], 0, sizeof(z_stream));
+			deflateInit(&zs[j], 6);
+		}
+		for (frame = 0; frame < frames; frame++) {
+			uint64_t t0;
+
+			draw_screen(screen, FB_W, FB_H);
+			put_update(&s.b, ((FB_W + 127) / 128) * ((FB_H + 95) / 96));
+			for (y = 0; y < FB_H; y += 96)
+				for (x = 0; x < FB_W; x += 128) {
+					picture p = { FB_W - x < 128 ? FB_W - x : 128, FB_H - y < 96 ? FB_H - y : 96 };
+
+					p.rgb = rgb;
+					p.index = index;
+					for (j = 0; j < p.h; j++)
+						memcpy(rgb + j * p.w * 3, screen + ((y + j) * FB_W + x) * 3, p.w * 3);
+					make_map(&p);
+					put_rect_header(&s.b, x, y, p.w, p.h, png ? rfbEncodingTightPng : rfbEncodingTight);
+					if (p.colors == 1) {
+						put8(&s.b, rfbTightFill << 4);
+						put(&s.b, rgb, 3);
+					} else if (png)
+						put_png(&s.b, &p, p.w, p.h);
+					else
+						put_tight(&s.b, zs, &p);
+				}
+			bytes[png] += s.b.len - sizeof(struct timeval);
+			t0 = host_ns();
+			if (!decode(&s)) {
+				printf("FAIL: %s frame %d not decoded\n", png ? "TightPng" : "Tight", frame);
+				break;
+			}
+			t[png] += (host_ns() - t0) / 1e6;
+		}
+		for (j = 0; j < 3; j++)
+			deflateEnd(&zs[j]);
+		close_session(&s);
+	}
+	printf("%d frames of %dx%d in 128x96 rectangles, %s:\n", frames, FB_W, FB_H, f->name);
+	printf("  Tight:    %5.1f KB/frame, %5.2f ms/frame\n", bytes[0] / 1024.0 / frames, t[0] / frames);
+	printf("  TightPng: %5.1f KB/frame, %5.2f ms/frame\n", bytes[1] / 1024.0 / frames, t[1] / frames);
+}
+
+int main(int argc, char **argv)
+{
+	int i, fails = 0;
+
+	rfbClientLog = rfbClientErr = quiet;
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		fails += test_format(&formats[i]);
+		fails += refuse_test(&formats[i]);
+	}
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		benchmark();
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
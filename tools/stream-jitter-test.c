@@ -0,0 +1,502 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * stream-jitter-test.c - runs the audio stream client on the host against
+ * audio arriving with injected jitter, stalls and clock drift, and checks
+ * what the jitter buffer makes of it through stream_get_stats()
+ *
+ * The HTTP scenarios serve the stream from a local stand-in server through
+ * stream_start(), in real time or all at once as a file would be, the fed
+ * ones hand it over with stream_feed() as the VNC session does. Fed audio
+ * may be dropped when it is late; HTTP audio never. The audio is 48 kHz stereo PCM in 20 ms packets; the
+ * stand-in for the MP3 decoder passes it on to the PCM decoder. The DSP
+ * stand-in plays the queued wave buffers in real time, at a clock that may
+ * run apart from the server's, and counts the times it ran out of audio.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -DVERSION='"host"' -Itools/host -Isrc -o stream-jitter-test \
+ *      tools/stream-jitter-test.c src/streamclient.c src/pcmdecoder.c \
+ *      src/linearpool.c -lcurl -lpthread -lm
+ * Usage: stream-jitter-test [-v]   (-v: print the statistics as they go)
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+#include "streamclient.h"
+#include "mp3decoder.h"
+#include "opusdecoder.h"
+#include "pcmdecoder.h"
+
+#define RATE 48000
+#define CHANNELS 2
+#define PACKET_MS 20
+#define PACKET_BYTES (RATE * PACKET_MS / 1000 * CHANNELS * 2)
+#define MAGIC "TPCM"
+
+// what streamclient.c aims for, see JITTER_*_MS there
+#define TARGET_MIN_MS 80
+#define TARGET_MAX_MS 150
+#define LATE_MS 300
+#define AHEAD_MS 1000		// see STREAM_AHEAD_MS
+
+static int verbose = 0;
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void host_log(const char *format, ...)
+{
+	va_list args;
+
+	if (!verbose) return;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf("\n");
+}
+
+rfbClientLogProc rfbClientLog = host_log;
+rfbClientLogProc rfbClientErr = host_log;
+
+Result osGetSystemVersionDataString(OS_VersionBin *nver, OS_VersionBin *cver, char *sysverstr, u32 size)
+{
+	snprintf(sysverstr, size, "host");
+	return 0;
+}
+
+// linear memory, from the heap
+
+size_t host_linear_limit = 0;
+size_t host_linear_used = 0;
+
+void *linearAlloc(size_t size) { return aligned_alloc(0x80, (size + 0x7f) & ~0x7f); }
+void *linearMemAlign(size_t size, size_t align) { return aligned_alloc(align, (size + align - 1) & ~(align - 1)); }
+void linearFree(void *mem) { free(mem); }
+u32 linearSpaceFree(void) { return 64 * 1024 * 1024; }
+
+// the decoders: the stand-in MP3 decoder takes PCM behind a magic
+
+static audioDecoder pcm;
+static int magic_skipped;
+
+static int fake_init()
+{
+	magic_skipped = 0;
+	return pcm.init();
+}
+
+static int fake_feed(void *data, int size)
+{
+	if (!magic_skipped) {
+		data = (char *)data + strlen(MAGIC);
+		size -= strlen(MAGIC);
+		magic_skipped = 1;
+	}
+	return size > 0 ? pcm.feed(data, size) : 0;
+}
+
+int mp3_checkmagic(char *magic)
+{
+	return memcmp(magic, MAGIC, strlen(MAGIC)) ? -1 : 0;
+}
+
+void mp3_create_decoder(audioDecoder *d)
+{
+	pcm_create_decoder(&pcm, RATE, CHANNELS);
+	*d = pcm;
+	d->init = fake_init;
+	d->feed = fake_feed;
+}
+
+int opus_checkmagic(char *magic)
+{
+	return -1;
+}
+
+void opus_create_decoder(audioDecoder *d)
+{
+}
+
+// the DSP: plays the queued buffers in real time on a thread of its own
+
+#define DSP_QUEUE 128
+#define DSP_TICK_MS 2
+
+static LightLock dsp_lock;
+static Thread dsp_tid;
+static volatile int dsp_quit;
+static ndspWaveBuf *dsp_queue[DSP_QUEUE];
+static int dsp_head, dsp_count;
+static int dsp_paused, dsp_empty;
+static float dsp_rate;
+static double dsp_clock = 1.0;	// speed of the DSP's clock against the server's
+static double dsp_pos;		// samples played of the buffer at dsp_head
+static u64 dsp_time;
+static u32 dsp_starved;		// times playback ran out of audio
+
+static void dsp_advance()
+{
+	u64 now = host_ns();
+	double n = (now - dsp_time) / 1e9 * dsp_rate * dsp_clock;
+
+	dsp_time = now;
+	if (dsp_paused) return;
+	while (n > 0 && dsp_count) {
+		ndspWaveBuf *w = dsp_queue[dsp_head];
+		if (n < w->nsamples - dsp_pos) {
+			w->status = NDSP_WBUF_PLAYING;
+			dsp_pos += n;
+			return;
+		}
+		n -= w->nsamples - dsp_pos;
+		w->status = NDSP_WBUF_DONE;
+		dsp_pos = 0;
+		dsp_head = (dsp_head + 1) % DSP_QUEUE;
+		dsp_count--;
+	}
+	if (!dsp_count && !dsp_empty) {
+		dsp_empty = 1;
+		dsp_starved++;
+	}
+}
+
+static void dsp_thread(void *arg)
+{
+	while (!dsp_quit) {
+		LightLock_Lock(&dsp_lock);
+		dsp_advance();
+		LightLock_Unlock(&dsp_lock);
+		svcSleepThread(DSP_TICK_MS * 1000000LL);
+	}
+}
+
+Result ndspInit(void)
+{
+	LightLock_Init(&dsp_lock);
+	dsp_head = dsp_count = dsp_starved = 0;
+	dsp_paused = dsp_empty = 1;
+	dsp_time = host_ns();
+	dsp_quit = 0;
+	dsp_tid = threadCreate(dsp_thread, NULL, 0, 0, 0, false);
+	return 0;
+}
+
+void ndspExit(void)
+{
+	dsp_quit = 1;
+	threadJoin(dsp_tid, U64_MAX);
+	threadFree(dsp_tid);
+}
+
+void ndspChnWaveBufClear(int id)
+{
+	LightLock_Lock(&dsp_lock);
+	dsp_head = dsp_count = 0;
+	dsp_pos = 0;
+	dsp_empty = 1;
+	LightLock_Unlock(&dsp_lock);
+}
+
+void ndspChnReset(int id)
+{
+	ndspChnWaveBufClear(id);
+}
+
+void ndspSetOutputMode(int mode) {}
+void ndspChnSetInterp(int id, int type) {}
+void ndspChnSetFormat(int id, u16 format) {}
+
+void ndspChnSetRate(int id, float rate)
+{
+	LightLock_Lock(&dsp_lock);
+	dsp_advance();
+	dsp_rate = rate;
+	LightLock_Unlock(&dsp_lock);
+}
+
+void ndspChnSetPaused(int id, bool paused)
+{
+	LightLock_Lock(&dsp_lock);
+	dsp_advance();
+	dsp_paused = paused;
+	LightLock_Unlock(&dsp_lock);
+}
+
+void ndspChnWaveBufAdd(int id, ndspWaveBuf *buf)
+{
+	LightLock_Lock(&dsp_lock);
+	dsp_advance();
+	buf->status = NDSP_WBUF_QUEUED;
+	dsp_queue[(dsp_head + dsp_count++) % DSP_QUEUE] = buf;
+	dsp_empty = 0;
+	LightLock_Unlock(&dsp_lock);
+}
+
+u32 ndspChnGetSamplePos(int id)
+{
+	u32 pos;
+
+	LightLock_Lock(&dsp_lock);
+	dsp_advance();
+	pos = dsp_count ? (u32)dsp_pos : 0;
+	LightLock_Unlock(&dsp_lock);
+	return pos;
+}
+
+// the server's side: packet n is due PACKET_MS * n after the start, late
+// by up to jitter_ms, and held back to the end of a stall it falls into
+
+typedef struct {
+	const char *name;
+	int http;			// 0: fed with stream_feed()
+	int burst;			// HTTP: everything at once, not in real time
+	int seconds;
+	int jitter_ms;
+	int stall_every_ms, stall_ms;
+	double dsp_clock;
+} scenario;
+
+static u64 packet_due(const scenario *s, int n, u64 start, u64 last)
+{
+	u64 ms = (u64)n * PACKET_MS + rnd(s->jitter_ms + 1);
+	u64 due;
+
+	if (s->burst) return start;
+	if (s->stall_ms && ms % s->stall_every_ms >= s->stall_every_ms - s->stall_ms)
+		ms += s->stall_every_ms - ms % s->stall_every_ms;
+	due = start + ms * 1000000;
+	return due > last ? due : last;	// in order, as TCP delivers them
+}
+
+static void make_packet(int16_t *p, int n)
+{
+	int i;
+
+	for (i = 0; i < PACKET_BYTES / 2; i++)
+		p[i] = (int16_t)(((n * PACKET_BYTES / 2 + i) * 37) % 4000 - 2000);
+}
+
+static void wait_until(u64 t)
+{
+	u64 now = host_ns();
+	if (t > now) svcSleepThread(t - now);
+}
+
+static int server_fd, server_packets;
+static const scenario *server_scenario;
+static Thread server_tid;
+
+static void server_thread(void *arg)
+{
+	const scenario *s = server_scenario;
+	static int16_t packet[PACKET_BYTES / 2];
+	char request[1024];
+	static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\n\r\n" MAGIC;
+	int fd = accept(server_fd, NULL, NULL), n;
+	u64 start, due = 0;
+
+	if (fd < 0) return;
+	recv(fd, request, sizeof(request), 0);
+	send(fd, header, strlen(header), MSG_NOSIGNAL);
+	start = host_ns();
+	for (n = 0; n < server_packets; n++) {
+		due = packet_due(s, n, start, due);
+		wait_until(due);
+		make_packet(packet, n);
+		if (send(fd, packet, PACKET_BYTES, MSG_NOSIGNAL) != PACKET_BYTES) break;
+	}
+	close(fd);
+}
+
+static int server_start(const scenario *s)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(server_fd, 1) ||
+		getsockname(server_fd, (struct sockaddr *)&addr, &len))
+		return -1;
+	server_scenario = s;
+	server_packets = s->seconds * 1000 / PACKET_MS;
+	// a file is longer than the run, with what is read ahead
+	if (s->burst) server_packets += 2 * AHEAD_MS / PACKET_MS;
+	server_tid = threadCreate(server_thread, NULL, 0, 0, 0, false);
+	return server_tid ? ntohs(addr.sin_port) : -1;
+}
+
+// what a scenario saw from the start of playback on
+
+typedef struct {
+	int samples;
+	int depth_min, depth_max, depth_sum;
+	int target_min, target_max;
+	int underruns, skipped_ms;
+	float skew;				// mean over the second half
+	int depth_end;			// mean over the last second
+	int end_samples, end_sum, half_samples;
+} observed;
+
+static void observe(observed *o, const stream_stats *st, int ms, int total_ms)
+{
+	if (!st->target_ms) return;
+	if (!o->samples++) {
+		o->depth_min = o->target_min = 1 << 30;
+		o->depth_max = o->target_max = 0;
+	}
+	// the first second is filling up
+	if (ms > 1000) {
+		if (st->depth_ms < o->depth_min) o->depth_min = st->depth_ms;
+		if (st->depth_ms > o->depth_max) o->depth_max = st->depth_ms;
+	}
+	if (st->target_ms < o->target_min) o->target_min = st->target_ms;
+	if (st->target_ms > o->target_max) o->target_max = st->target_ms;
+	if (ms > total_ms - 1000) {
+		o->end_samples++;
+		o->end_sum += st->depth_ms;
+	}
+	if (ms > total_ms / 2) {
+		o->half_samples++;
+		o->skew += st->rate_skew;
+	}
+	o->underruns = st->underruns;
+	o->skipped_ms = st->skipped_ms;
+	if (verbose && o->samples % 50 == 0)
+		printf("  %5d ms: depth %3d ms, target %3d ms, jitter %3d ms, %d underruns, %d ms dropped, skew %+.4f\n",
+			ms, st->depth_ms, st->target_ms, st->jitter_ms, st->underruns, st->skipped_ms, st->rate_skew);
+}
+
+static void run(const scenario *s, observed *o)
+{
+	static int16_t packet[PACKET_BYTES / 2];
+	int total_ms = s->seconds * 1000, packets = total_ms / PACKET_MS, n = 0;
+	u64 start, due = 0, next_poll;
+	stream_stats st;
+	char url[64];
+
+	memset(o, 0, sizeof(*o));
+	seed = 1;	// the same jitter, whichever scenarios ran before
+	dsp_clock = s->dsp_clock;
+	if (s->http) {
+		int port = server_start(s);
+		if (port < 0) {
+			printf("FAIL: %s: cannot start the HTTP stand-in\n", s->name);
+			return;
+		}
+		snprintf(url, sizeof(url), "http://127.0.0.1:%d/stream", port);
+		stream_start(url, NULL, NULL);
+	} else
+		stream_start_fed(RATE, CHANNELS);
+
+	start = next_poll = host_ns();
+	while (host_ns() - start < (u64)total_ms * 1000000) {
+		// the session feeds the packets that are due, the HTTP stand-in
+		// sends its own
+		if (!s->http && n < packets) {
+			if (!due) due = packet_due(s, n, start, 0);
+			if (host_ns() >= due) {
+				make_packet(packet, n++);
+				stream_feed(packet, PACKET_BYTES);
+				due = 0;
+				continue;
+			}
+		}
+		if (host_ns() >= next_poll) {
+			stream_get_stats(&st);
+			observe(o, &st, (int)((host_ns() - start) / 1000000), total_ms);
+			if (stream_health()) break;
+			next_poll += 10000000;
+		}
+		svcSleepThread(1000000);
+	}
+	stream_stop();
+	if (s->http) {
+		threadJoin(server_tid, U64_MAX);
+		threadFree(server_tid);
+		close(server_fd);
+	}
+	o->depth_end = o->end_samples ? o->end_sum / o->end_samples : 0;
+	if (o->half_samples) o->skew /= o->half_samples;
+}
+
+static int check(const scenario *s, const char *what, int ok)
+{
+	if (!ok) printf("FAIL: %s: %s\n", s->name, what);
+	return !ok;
+}
+
+int main(int argc, char **argv)
+{
+	static const scenario scenarios[] = {
+		// name                          http burst secs jitter stalls    dsp clock
+		{ "HTTP, 0-30 ms jitter",          1,  0,    6,  30,   0,    0,   1.0 },
+		{ "HTTP, 250 ms stalls",           1,  0,    6,  10,   2000, 250, 1.0 },
+		{ "HTTP, all at once",             1,  1,    6,  0,    0,    0,   1.0 },
+		{ "fed, 0-60 ms jitter",           0,  0,    6,  60,   0,    0,   1.0 },
+		{ "fed, DSP clock 0.3% slow",      0,  0,    10, 20,   0,    0,   0.997 },
+		{ "fed, DSP clock 0.3% fast",      0,  0,    10, 20,   0,    0,   1.003 },
+	};
+	int i, fails = 0;
+
+	if (argc > 1 && !strcmp(argv[1], "-v")) verbose = 1;
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		const scenario *s = &scenarios[i];
+		observed o;
+		int f = 0;
+
+		if (verbose) printf("%s:\n", s->name);
+		run(s, &o);
+		printf("%-28s depth %3d-%3d ms, at the end %3d ms, target %3d-%3d ms, %d underruns, %u stalls, %d ms dropped, skew %+.4f\n",
+			s->name, o.depth_min, o.depth_max, o.depth_end, o.target_min, o.target_max,
+			o.underruns, dsp_starved, o.skipped_ms, o.skew);
+
+		f += check(s, "never played", o.samples > 0);
+		f += check(s, "target outside its range", o.target_min >= TARGET_MIN_MS && o.target_max <= TARGET_MAX_MS);
+		if (s->http) {
+			f += check(s, "audio dropped", o.skipped_ms == 0);
+			f += check(s, "decoded too far ahead", o.depth_max <= AHEAD_MS + 2 * PACKET_MS);
+		}
+		if (s->stall_ms) {
+			// a stall longer than the buffer is bridged, then buffered
+			// again, and the burst after it is played, not dropped
+			f += check(s, "stalls not counted as underruns", o.underruns > 0);
+			f += check(s, "no recovery after the stalls", o.depth_end > 0);
+		} else if (s->burst) {
+			// the stream waits in curl, and plays at its own rate
+			f += check(s, "underruns", o.underruns == 0 && dsp_starved <= 1);
+			f += check(s, "not held ahead", o.depth_end >= AHEAD_MS / 2);
+			f += check(s, "not played at its rate", o.skew == 0);
+		} else {
+			f += check(s, "underruns", o.underruns == 0 && dsp_starved <= 1);
+			f += check(s, "ran dry", o.depth_min > 0);
+			f += check(s, "grew beyond the late limit", o.depth_max <= LATE_MS);
+			f += check(s, "audio dropped", o.skipped_ms == 0);
+			f += check(s, "depth off the target at the end",
+				o.depth_end >= TARGET_MIN_MS / 2 && o.depth_end <= TARGET_MAX_MS * 3 / 2);
+		}
+		if (s->dsp_clock < 1)
+			f += check(s, "not playing faster for the slow DSP", o.skew > 0);
+		if (s->dsp_clock > 1)
+			f += check(s, "not playing slower for the fast DSP", o.skew < 0);
+		fails += f;
+	}
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
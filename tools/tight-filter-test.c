@@ -0,0 +1,349 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * tight-filter-test.c - decodes random Tight rectangles with the copy,
+ * palette and gradient filters through HandleRFBServerMessage() on the host
+ * and compares the framebuffer with the filters as they were before they
+ * were specialised on the pixel format: per pixel, with the shifts read
+ * from client->format and 2048 pixel row buffers
+ *
+ * Covers 32 bpp with the red, green and blue bytes in each of the
+ * specialised orders and in another one, 32 bpp with 10 bit channels,
+ * 16 bpp 565 and 8 bpp 332, and rectangles wider than 2048 pixels.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o tight-filter-test \
+ *      tools/tight-filter-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: tight-filter-test
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+#define FB_W 2600
+#define FB_H 40
+#define RECTS 600
+
+typedef struct {
+	const char *name;
+	int bpp, depth, max[3], shift[3];
+} format;
+
+static const format formats[] = {
+	{ "32 bpp RGBX", 32, 24, { 255, 255, 255 }, { 0, 8, 16 } },
+	{ "32 bpp BGRX", 32, 24, { 255, 255, 255 }, { 16, 8, 0 } },
+	{ "32 bpp XBGR", 32, 24, { 255, 255, 255 }, { 24, 16, 8 } },
+	{ "32 bpp XRGB", 32, 24, { 255, 255, 255 }, { 8, 16, 24 } },
+	{ "32 bpp 10 bit", 32, 30, { 1023, 1023, 1023 }, { 20, 10, 0 } },
+	{ "16 bpp 565", 16, 16, { 31, 63, 31 }, { 11, 5, 0 } },
+	{ "8 bpp 332", 8, 8, { 7, 7, 3 }, { 0, 3, 6 } },
+};
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void quiet(const char *format, ...)
+{
+}
+
+// the reference: the filters before they were specialised
+
+static const format *fmt;
+static int cut_zeros;
+
+static uint32_t rgb_to_pixel(int r, int g, int b)
+{
+	return ((uint32_t)r & fmt->max[0]) << fmt->shift[0] |
+		((uint32_t)g & fmt->max[1]) << fmt->shift[1] |
+		((uint32_t)b & fmt->max[2]) << fmt->shift[2];
+}
+
+static uint32_t get_pixel(const uint8_t *p)
+{
+	uint32_t v = 0;
+	memcpy(&v, p, fmt->bpp / 8);	// little endian
+	return v;
+}
+
+static void put_pixel(uint8_t *fb, int x, int y, uint32_t v)
+{
+	memcpy(fb + (y * FB_W + x) * (fmt->bpp / 8), &v, fmt->bpp / 8);
+}
+
+static void ref_copy(uint8_t *fb, int rx, int ry, int rw, int rh, const uint8_t *data)
+{
+	int x, y;
+
+	for (y = 0; y < rh; y++)
+		for (x = 0; x < rw; x++)
+			if (cut_zeros) {
+				const uint8_t *p = data + (y * rw + x) * 3;
+				put_pixel(fb, rx + x, ry + y, (uint32_t)p[0] << fmt->shift[0] |
+					(uint32_t)p[1] << fmt->shift[1] | (uint32_t)p[2] << fmt->shift[2]);
+			} else
+				put_pixel(fb, rx + x, ry + y, get_pixel(data + (y * rw + x) * (fmt->bpp / 8)));
+}
+
+static void ref_gradient24(uint8_t *fb, int rx, int ry, int rw, int rh, const uint8_t *data)
+{
+	static uint8_t prevRow[FB_W * 3], thisRow[FB_W * 3];
+	uint8_t pix[3];
+	int x, y, c, est;
+
+	memset(prevRow, 0, rw * 3);
+	for (y = 0; y < rh; y++) {
+		for (c = 0; c < 3; c++) {
+			pix[c] = prevRow[c] + data[y * rw * 3 + c];
+			thisRow[c] = pix[c];
+		}
+		put_pixel(fb, rx, ry + y, rgb_to_pixel(pix[0], pix[1], pix[2]));
+		for (x = 1; x < rw; x++) {
+			for (c = 0; c < 3; c++) {
+				est = (int)prevRow[x * 3 + c] + (int)pix[c] - (int)prevRow[(x - 1) * 3 + c];
+				if (est > 0xFF) est = 0xFF;
+				else if (est < 0) est = 0;
+				pix[c] = (uint8_t)est + data[(y * rw + x) * 3 + c];
+				thisRow[x * 3 + c] = pix[c];
+			}
+			put_pixel(fb, rx + x, ry + y, rgb_to_pixel(pix[0], pix[1], pix[2]));
+		}
+		memcpy(prevRow, thisRow, rw * 3);
+	}
+}
+
+static void ref_gradient(uint8_t *fb, int rx, int ry, int rw, int rh, const uint8_t *data)
+{
+	static uint16_t thatRow[FB_W * 3], thisRow[FB_W * 3];
+	uint16_t pix[3];
+	int x, y, c, est;
+
+	if (cut_zeros) {
+		ref_gradient24(fb, rx, ry, rw, rh, data);
+		return;
+	}
+	memset(thatRow, 0, sizeof(thatRow));
+	for (y = 0; y < rh; y++) {
+		uint32_t src = get_pixel(data + y * rw * (fmt->bpp / 8));
+		for (c = 0; c < 3; c++) {
+			pix[c] = ((src >> fmt->shift[c]) + thatRow[c]) & fmt->max[c];
+			thisRow[c] = pix[c];
+		}
+		put_pixel(fb, rx, ry + y, rgb_to_pixel(pix[0], pix[1], pix[2]));
+		for (x = 1; x < rw; x++) {
+			src = get_pixel(data + (y * rw + x) * (fmt->bpp / 8));
+			for (c = 0; c < 3; c++) {
+				est = (int)thatRow[x * 3 + c] + (int)pix[c] - (int)thatRow[(x - 1) * 3 + c];
+				if (est > fmt->max[c]) est = fmt->max[c];
+				else if (est < 0) est = 0;
+				pix[c] = ((src >> fmt->shift[c]) + est) & fmt->max[c];
+				thisRow[x * 3 + c] = pix[c];
+			}
+			put_pixel(fb, rx + x, ry + y, rgb_to_pixel(pix[0], pix[1], pix[2]));
+		}
+		memcpy(thatRow, thisRow, rw * 3 * sizeof(uint16_t));
+	}
+}
+
+static void ref_palette(uint8_t *fb, int rx, int ry, int rw, int rh, const uint8_t *data,
+	const uint32_t *palette, int colors)
+{
+	int x, y, w = (rw + 7) / 8;
+
+	for (y = 0; y < rh; y++)
+		for (x = 0; x < rw; x++)
+			if (colors == 2)
+				put_pixel(fb, rx + x, ry + y, palette[data[y * w + x / 8] >> (7 - x % 8) & 1]);
+			else
+				put_pixel(fb, rx + x, ry + y, palette[data[y * rw + x]]);
+}
+
+// the stream
+
+typedef struct {
+	uint8_t *data;
+	size_t len, size;
+} buffer;
+
+static void put(buffer *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void put8(buffer *b, int v) { uint8_t c = v; put(b, &c, 1); }
+static void put16(buffer *b, int v) { put8(b, v >> 8); put8(b, v); }
+static void put32(buffer *b, uint32_t v) { put16(b, v >> 16); put16(b, v); }
+
+static void put_compact_len(buffer *b, int len)
+{
+	if (len > 0x7f) {
+		put8(b, (len & 0x7f) | 0x80);
+		if (len > 0x3fff) {
+			put8(b, (len >> 7 & 0x7f) | 0x80);
+			put8(b, len >> 14);
+		} else
+			put8(b, len >> 7);
+	} else
+		put8(b, len);
+}
+
+// the filter data, compressed on zlib stream 0 unless it is tiny
+static void put_data(buffer *b, z_stream *zs, const uint8_t *data, int len)
+{
+	static uint8_t out[FB_W * FB_H * 4 + 1024];
+
+	if (len < 12) {
+		put(b, data, len);
+		return;
+	}
+	zs->next_in = (uint8_t *)data;
+	zs->avail_in = len;
+	zs->next_out = out;
+	zs->avail_out = sizeof(out);
+	deflate(zs, Z_SYNC_FLUSH);
+	put_compact_len(b, sizeof(out) - zs->avail_out);
+	put(b, out, sizeof(out) - zs->avail_out);
+}
+
+enum { NO_FILTER, COPY, PALETTE2, PALETTE, GRADIENT, FILTERS };
+static const char *filter_names[] = { "no filter", "copy", "2 colour palette", "palette", "gradient" };
+
+static int test_format(const format *f)
+{
+	static uint8_t data[FB_W * FB_H * 4];
+	rfbClient *client = rfbGetClient(8, 3, 4);
+	int size = FB_W * FB_H * f->bpp / 8, pixel = f->bpp / 8, n, i, fails = 0;
+	uint8_t *ref = calloc(size, 1);
+	z_stream zs = { 0 };
+	FILE *file = tmpfile();
+	buffer b = { 0 };
+
+	fmt = f;
+	cut_zeros = f->bpp == 32 && f->depth == 24;
+	client->width = FB_W;
+	client->height = FB_H;
+	client->frameBuffer = calloc(size, 1);
+	client->format.bitsPerPixel = f->bpp;
+	client->format.depth = f->depth;
+	client->format.redMax = f->max[0];
+	client->format.greenMax = f->max[1];
+	client->format.blueMax = f->max[2];
+	client->format.redShift = f->shift[0];
+	client->format.greenShift = f->shift[1];
+	client->format.blueShift = f->shift[2];
+	client->serverPort = -1;
+	client->vncRec = calloc(1, sizeof(rfbVNCRec));
+	client->vncRec->file = file;
+	client->vncRec->doNotSleep = TRUE;
+	SetFormatAndEncodings(client);	// classifies the pixel format for the filters
+	deflateInit(&zs, 1);
+
+	// one update per rectangle, as a vncrec recording, decoded as it is written
+	for (n = 0; n < RECTS && !fails; n++) {
+		static const uint8_t timestamp[sizeof(struct timeval)];
+		int filter = rnd(FILTERS), w, h, x, y, colors = 2, len;
+		uint32_t palette[256];
+
+		w = n % 25 == 0 ? 2049 + rnd(FB_W - 2049) : 1 + rnd(n % 5 ? 40 : 300);
+		h = 1 + rnd(FB_H);
+		x = rnd(FB_W - w + 1);
+		y = rnd(FB_H - h + 1);
+
+		put(&b, timestamp, sizeof(timestamp));
+		put8(&b, rfbFramebufferUpdate);
+		put8(&b, 0);
+		put16(&b, 1);
+		put16(&b, x);
+		put16(&b, y);
+		put16(&b, w);
+		put16(&b, h);
+		put32(&b, rfbEncodingTight);
+		put8(&b, filter == NO_FILTER ? 0 : (rfbTightExplicitFilter << 4));
+
+		switch (filter) {
+		case NO_FILTER:
+		case COPY:
+		case GRADIENT:
+			if (filter != NO_FILTER)
+				put8(&b, filter == GRADIENT ? rfbTightFilterGradient : rfbTightFilterCopy);
+			len = w * h * (cut_zeros ? 3 : pixel);
+			for (i = 0; i < len; i++) data[i] = rnd(256);
+			if (filter == GRADIENT)
+				ref_gradient(ref, x, y, w, h, data);
+			else
+				ref_copy(ref, x, y, w, h, data);
+			break;
+		case PALETTE:
+			colors = 3 + rnd(254);
+			/* fall through */
+		case PALETTE2:
+			put8(&b, rfbTightFilterPalette);
+			put8(&b, colors - 1);
+			for (i = 0; i < colors; i++) {
+				uint8_t c[4] = { rnd(256), rnd(256), rnd(256), rnd(256) };
+				if (cut_zeros) {
+					put(&b, c, 3);
+					palette[i] = (uint32_t)c[0] << f->shift[0] | (uint32_t)c[1] << f->shift[1] | (uint32_t)c[2] << f->shift[2];
+				} else {
+					put(&b, c, pixel);
+					palette[i] = get_pixel(c);
+				}
+			}
+			len = colors == 2 ? (w + 7) / 8 * h : w * h;
+			for (i = 0; i < len; i++) data[i] = colors == 2 ? rnd(256) : rnd(colors);
+			ref_palette(ref, x, y, w, h, data, palette, colors);
+			break;
+		}
+		put_data(&b, &zs, data, len);
+		rewind(file);
+		fwrite(b.data, 1, b.len, file);
+		rewind(file);
+		b.len = 0;
+
+		if (!HandleRFBServerMessage(client)) {
+			printf("FAIL: %s: %s, %dx%d at %d,%d: not decoded\n", f->name,
+				filter_names[filter], w, h, x, y);
+			fails++;
+		} else if (memcmp(client->frameBuffer, ref, size)) {
+			for (i = 0; client->frameBuffer[i] == ref[i]; i++);
+			printf("FAIL: %s: %s, %dx%d at %d,%d: pixel %d,%d differs\n", f->name,
+				filter_names[filter], w, h, x, y, i / pixel % FB_W, i / pixel / FB_W);
+			fails++;
+		}
+	}
+
+	deflateEnd(&zs);
+	fclose(file);
+	free(b.data);
+	free(ref);
+	free(client->frameBuffer);
+	client->frameBuffer = NULL;
+	rfbClientCleanup(client);
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	int i, fails = 0;
+
+	rfbClientLog = rfbClientErr = quiet;
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+		fails += test_format(&formats[i]);
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}
@@ -0,0 +1,392 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * vjoy-batch-receiver.c - receives the batch datagrams of the vJoy UDP
+ * client on the host, rebuilds the samples and reports the rates
+ *
+ * With -t it checks the coding instead: it runs the client on the host
+ * with random input, once sending every sample as a plain vJoy packet
+ * and once in batch datagrams, and compares the samples rebuilt from the
+ * batches with the plain packets, with and without motion.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -o vjoy-batch-receiver \
+ *      tools/vjoy-batch-receiver.c src/vjoy-udp-feeder-client.c -lm
+ * Usage: vjoy-batch-receiver [-v] [port]   (default port 1608)
+ *        vjoy-batch-receiver -t
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <3ds.h>
+#include "vjoy-udp-feeder-client.h"
+
+#define HEADER_SIZE 16
+#define MAX_FIELDS 17
+#define MAX_SAMPLES 255
+#define TEST_SAMPLES 5000
+
+typedef struct {
+	uint64_t time;
+	uint32_t f[MAX_FIELDS];
+} sample;
+
+static const char *field_names[MAX_FIELDS] = {
+	"X", "Y", "Z", "XRot", "YRot", "ZRot", "Slider", "Dial", "Buttons", "ContPov", "DiscPovs",
+	"AccX", "AccY", "AccZ", "GyX", "GyY", "GyZ"
+};
+
+// reads a varint, returns NULL if it runs past end
+static const uint8_t *get_varint(const uint8_t *b, const uint8_t *end, uint32_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (b < end && shift < 35) {
+		*v |= (uint32_t)(*b & 0x7F) << shift;
+		if (!(*b++ & 0x80)) return b;
+		shift += 7;
+	}
+	return NULL;
+}
+
+// rebuilds the samples of a batch datagram into samples; returns their
+// number, -1 if it is not a batch datagram. *ok is cleared unless the
+// samples use up exactly the bytes of the datagram.
+static int decode_batch(const uint8_t *buf, int n, uint16_t *seq, int *fields, sample *samples, int *ok)
+{
+	const uint8_t *b = buf + HEADER_SIZE, *end = buf + n;
+	uint32_t f[MAX_FIELDS] = {0}, dt, mask, v;
+	uint64_t t;
+	int count, i, s;
+
+	if (n < HEADER_SIZE || memcmp(buf, "VJB\x01", 4))
+		return -1;
+	*seq = buf[4] << 8 | buf[5];
+	count = buf[6];
+	*fields = buf[7];
+	for (i = 0, t = 0; i < 8; i++)
+		t = t << 8 | buf[8 + i];
+	if (*fields > MAX_FIELDS)
+		return -1;
+
+	for (s = 0; s < count; s++) {
+		if (!(b = get_varint(b, end, &dt)) || !(b = get_varint(b, end, &mask))) break;
+		for (i = 0; i < *fields && b; i++) {
+			if (!(mask & (1u << i))) continue;
+			if ((b = get_varint(b, end, &v)))
+				f[i] += (v >> 1) ^ -(v & 1);
+		}
+		if (!b) break;
+		t += dt;
+		samples[s].time = t;
+		memcpy(samples[s].f, f, sizeof(f));
+	}
+	// every byte must be used up by exactly the samples announced
+	*ok = s == count && b == end;
+	return s;
+}
+
+// the client, built for the host
+
+char *itoa(int value, char *str, int base)
+{
+	sprintf(str, "%d", value);	// only ever called for port numbers
+	return str;
+}
+
+u64 getmicrotime()
+{
+	return host_ns() / 1000;
+}
+
+typedef struct {
+	uint64_t time;
+	u32 held;
+	circlePosition cpad, cstick;
+	touchPosition touch;
+	accelVector accel;
+	angularRate gyro;
+	float slider;
+} test_input;
+
+static unsigned seed = 1;
+
+static int rnd(int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+// random input, every part of it changing now and then, some of them
+// swinging across their whole range
+static void make_input(test_input *in, int n)
+{
+	static const u32 keys[] = {
+		KEY_A, KEY_B, KEY_X, KEY_Y, KEY_L, KEY_R, KEY_ZL, KEY_ZR, KEY_SELECT, KEY_START,
+		KEY_DUP, KEY_DDOWN, KEY_DLEFT, KEY_DRIGHT, KEY_TOUCH
+	};
+	uint64_t t = 1000000;
+	int i, k;
+
+	memset(&in[0], 0, sizeof(in[0]));
+	in[0].held = KEY_TOUCH;		// sets the touch position, whatever came before
+	for (i = 0; i < n; i++) {
+		if (i) in[i] = in[i - 1];
+		t += 1000 + rnd(7000);
+		in[i].time = t;
+		if (i && rnd(3) == 0)
+			for (k = 0; k < sizeof(keys) / sizeof(keys[0]); k++)
+				if (rnd(4) == 0) in[i].held ^= keys[k];
+		if (rnd(2)) {
+			in[i].cpad.dx = rnd(341) - 170;
+			in[i].cpad.dy = rnd(341) - 170;
+		}
+		if (rnd(4) == 0) {
+			in[i].cstick.dx = rnd(221) - 110;
+			in[i].cstick.dy = rnd(221) - 110;
+		}
+		if (rnd(2)) {
+			in[i].touch.px = rnd(320);
+			in[i].touch.py = rnd(240);
+		}
+		if (rnd(8) == 0) in[i].slider = rnd(101) / 100.0f;
+		in[i].accel.x = rnd(2401) - 1200;
+		in[i].accel.y = rnd(2401) - 1200;
+		in[i].accel.z = rnd(2401) - 1200;
+		if (rnd(2)) {
+			in[i].gyro.x = rnd(8001) - 4000;
+			in[i].gyro.y = rnd(8001) - 4000;
+			in[i].gyro.z = rnd(8001) - 4000;
+		}
+	}
+}
+
+static void feed(struct vjoy_udp_client *client, test_input *in, uint64_t offset)
+{
+	vjoy_udp_client_update(client, in->time + offset, in->held, &in->cpad, &in->cstick,
+		&in->touch, &in->accel, &in->gyro, in->slider);
+}
+
+static int udp_socket(int *port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	int size = 4 * 1024 * 1024;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		getsockname(sock, (struct sockaddr *)&addr, &len) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	*port = ntohs(addr.sin_port);
+	return sock;
+}
+
+// the plain vJoy packet waiting on sock, if any, into f
+static int recv_plain(int sock, uint32_t *f)
+{
+	uint32_t p[11];
+	int i;
+
+	if (recv(sock, p, sizeof(p), MSG_DONTWAIT) != sizeof(p)) return 0;
+	for (i = 0; i < 11; i++) f[i] = ntohl(p[i]);
+	return 1;
+}
+
+static int test(int motion)
+{
+	static test_input in[TEST_SAMPLES];
+	static sample expected[TEST_SAMPLES], got[TEST_SAMPLES + MAX_SAMPLES];
+	static uint32_t sent[MAX_FIELDS];	// what the plain packets said last
+	struct vjoy_udp_client client;
+	uint8_t buf[2048];
+	uint64_t offset = (uint64_t)TEST_SAMPLES * 10000;
+	int pad_port, motion_port, pad = udp_socket(&pad_port), mot = udp_socket(&motion_port);
+	int n = 0, fields = 0, fails = 0, datagrams = 0, i, k, ok, nf;
+	uint16_t seq, nextseq = 0;
+	uint32_t m[11];
+
+	make_input(in, TEST_SAMPLES);
+
+	// the original: every sample on its own, as plain packets that are
+	// only sent when they change
+	if (vjoy_udp_client_init(&client, "127.0.0.1", pad_port, motion ? motion_port : 0)) {
+		printf("FAIL: %s\n", client.lasterrmsg);
+		return 1;
+	}
+	client.interval = 0;
+	for (i = 0; i < TEST_SAMPLES; i++) {
+		feed(&client, &in[i], 0);
+		recv_plain(pad, sent);
+		if (motion && recv_plain(mot, m))
+			memcpy(sent + 11, m, 6 * sizeof(u32));
+		expected[i].time = in[i].time;
+		memcpy(expected[i].f, sent, sizeof(sent));
+	}
+	vjoy_udp_client_shutdown(&client);
+
+	// the same samples in batch datagrams, later, as the client keeps the
+	// time of the last update
+	vjoy_udp_client_init(&client, "127.0.0.1", pad_port, motion ? motion_port : 0);
+	client.batch = 1;
+	for (i = 0; i < TEST_SAMPLES; i++)
+		feed(&client, &in[i], offset);
+	vjoy_udp_client_shutdown(&client);
+
+	while ((k = recv(pad, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+		int c = decode_batch(buf, k, &seq, &nf, got + n, &ok);
+		if (c < 0 || !ok || (datagrams && seq != nextseq) || n + c > TEST_SAMPLES) {
+			printf("FAIL: datagram %d: %s\n", datagrams, c < 0 ? "not a batch" : !ok ? "malformed" :
+				n + c > TEST_SAMPLES ? "too many samples" : "out of sequence");
+			fails++;
+			break;
+		}
+		if (datagrams++ && nf != fields) {
+			printf("FAIL: datagram %d: %d fields after %d\n", datagrams, nf, fields);
+			fails++;
+		}
+		fields = nf;
+		nextseq = seq + 1;
+		n += c;
+	}
+	if (fields != (motion ? MAX_FIELDS : 11)) {
+		printf("FAIL: %d fields, with%s motion\n", fields, motion ? "" : "out");
+		fails++;
+	}
+	if (n != TEST_SAMPLES) {
+		printf("FAIL: %d samples rebuilt of %d\n", n, TEST_SAMPLES);
+		fails++;
+	}
+	for (i = 0; i < n && i < TEST_SAMPLES && fails < 10; i++) {
+		if (got[i].time - offset != expected[i].time) {
+			printf("FAIL: sample %d: time %llu, sent at %llu\n", i,
+				(unsigned long long)(got[i].time - offset), (unsigned long long)expected[i].time);
+			fails++;
+		}
+		for (k = 0; k < fields; k++)
+			if (got[i].f[k] != expected[i].f[k]) {
+				printf("FAIL: sample %d: %s=%x, sent as %x\n", i, field_names[k], got[i].f[k], expected[i].f[k]);
+				fails++;
+			}
+	}
+	printf("%s motion: %d samples in %d datagrams, %d fields\n", motion ? "with" : "without", n, datagrams, fields);
+	close(pad);
+	close(mot);
+	return fails;
+}
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int port = 1608, verbose = 0, i, n;
+	uint8_t buf[2048];
+	struct sockaddr_in addr;
+	int sock;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-t")) {
+			int fails = test(1) + test(0);
+			printf(fails ? "FAILED\n" : "OK\n");
+			return fails ? 1 : 0;
+		}
+		if (!strcmp(argv[i], "-v")) verbose = 1;
+		else port = atoi(argv[i]);
+	}
+
+	if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return 1;
+	}
+	printf("listening on UDP port %d\n", port);
+
+	// totals for the current report period
+	unsigned long packets = 0, samples = 0, bytes = 0, lost = 0, errors = 0, late = 0;
+	uint64_t span = 0;			// microseconds covered by the samples
+	uint32_t maxgap = 0;		// longest time between two samples
+	double report = now_sec() + 1;
+	int haveseq = 0;
+	uint16_t nextseq = 0;
+	uint64_t lasttime = 0;
+
+	while (1) {
+		n = recv(sock, buf, sizeof(buf), 0);
+		if (n < 0) {
+			perror("recv");
+			return 1;
+		}
+
+		sample rebuilt[MAX_SAMPLES];
+		uint16_t seq;
+		uint64_t t;
+		int fields, s, k, ok;
+
+		if ((s = decode_batch(buf, n, &seq, &fields, rebuilt, &ok)) < 0) {
+			// a plain vJoy packet or garbage
+			errors++;
+			continue;
+		}
+
+		if (haveseq && seq != nextseq) lost += (uint16_t)(seq - nextseq);
+		haveseq = 1;
+		nextseq = seq + 1;
+		if (s && lasttime && rebuilt[0].time < lasttime) late++;
+
+		for (k = 0; k < s; k++) {
+			t = rebuilt[k].time;
+			if (lasttime && t > lasttime && t - lasttime > maxgap) maxgap = t - lasttime;
+			if (lasttime && t > lasttime) span += t - lasttime;
+			lasttime = t;
+			if (verbose) {
+				printf("%llu.%06llu", (unsigned long long)(t / 1000000), (unsigned long long)(t % 1000000));
+				for (i = 0; i < fields; i++)
+					printf(" %s=%x", field_names[i], rebuilt[k].f[i]);
+				printf("\n");
+			}
+		}
+		if (!ok) errors++;
+
+		packets++;
+		samples += s;
+		bytes += n;
+
+		if (now_sec() >= report) {
+			printf("%lu packets/s, %lu samples/s (%.0f Hz sensor rate), %lu bytes/s, "
+				"%.1f samples/packet, max gap %u us, lost %lu, errors %lu, out of order %lu\n",
+				packets, samples, span ? samples * 1e6 / span : 0.0, bytes,
+				packets ? (double)samples / packets : 0.0, maxgap, lost, errors, late);
+			packets = samples = bytes = lost = errors = late = 0;
+			span = 0;
+			maxgap = 0;
+			report += 1;
+		}
+	}
+	return 0;
+}
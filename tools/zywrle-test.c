@@ -0,0 +1,237 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * zywrle-test.c - checks that the ZYWRLE decoder of the rfb library gives
+ * bit-exact results with the scalar reference (zywrletemplate-c.h built
+ * with ZYWRLE_SCALAR_DECODE) at 16 and 32 bpp and all levels, on encoded
+ * video-like tiles and on random coefficients, then times both
+ *
+ * The packed transform step, which the decoder uses with ARMv6 SIMD32
+ * only, is checked against Harr() on the host for every pair of bytes.
+ *
+ * Build (from the top directory):
+ *   cc -O2 -Itools/host -Isrc -Isrc/rfb -o zywrle-test \
+ *      tools/zywrle-test.c src/rfb/[a-z]*.c -lz -ljpeg -lpng -lpthread
+ * Usage: zywrle-test [-b]   (-b: run the benchmark too)
+ *
+ * Copyright 2022 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+// the library's decoders, as instantiated by zrle-c.h
+uint32_t *zywrleSynthesize32LE(uint32_t *dst, uint32_t *src, int w, int h, int scanline, int level, int *pBuf);
+uint16_t *zywrleSynthesize16LE(uint16_t *dst, uint16_t *src, int w, int h, int scanline, int level, int *pBuf);
+
+// the scalar reference decoders and the encoders, from the same template
+#define ENDIAN_LITTLE 0
+#define ENDIAN_BIG 1
+#define ZYWRLE_ENDIAN ENDIAN_LITTLE
+#define END_FIX Ref
+#define CONCAT2(a,b) a##b
+#define CONCAT2E(a,b) CONCAT2(a,b)
+#define CONCAT3(a,b,c) a##b##c
+#define CONCAT3E(a,b,c) CONCAT3(a,b,c)
+#define __RFB_CONCAT3E(a,b,c) CONCAT3E(a,b,c)
+#define __RFB_CONCAT2E(a,b) CONCAT2E(a,b)
+#define ZYWRLE_ENCODE
+#define ZYWRLE_DECODE
+#define ZYWRLE_SCALAR_DECODE
+#define BPP 32
+#define PIXEL_T uint32_t
+#include "zywrletemplate-c.h"
+#undef BPP
+#undef PIXEL_T
+#define BPP 16
+#define PIXEL_T uint16_t
+#include "zywrletemplate-c.h"
+
+#define SCANLINE 80	// wider than a tile, as in a framebuffer
+#define BENCH_W 800
+#define BENCH_H 480
+#define TILE 64	// rfbZRLETileWidth
+
+static unsigned seed = 1;
+static int pbuf[TILE * TILE];
+
+static unsigned rnd(unsigned n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+// smooth shading, a moving disc and some sensor noise
+static void make_video(uint8_t *rgb, int w, int h, int frame)
+{
+	int x, y, cx = 200 + frame * 7, cy = 150 + frame * 3;
+
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++) {
+			uint8_t *p = rgb + (y * w + x) * 3;
+			int d = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+			int n = rnd(9) - 4;
+			p[0] = (x * 200 / w + 30 + n) & 0xff;
+			p[1] = (y * 180 / h + 40 + n) & 0xff;
+			p[2] = ((x + y) * 100 / (w + h) + 90 + n) & 0xff;
+			if (d < 90 * 90) {
+				p[0] = 230 - d / 100;
+				p[1] = 120 + n;
+				p[2] = 40;
+			}
+		}
+}
+
+static void to_pixels(void *fb, int bpp, const uint8_t *rgb, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, rgb += 3)
+		if (bpp == 32)
+			((uint32_t *)fb)[i] = rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+		else
+			((uint16_t *)fb)[i] = (rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[2] >> 3;
+}
+
+static void analyze(void *dst, void *src, int bpp, int w, int h, int scanline, int level)
+{
+	if (bpp == 32)
+		zywrleAnalyze32Ref(dst, src, w, h, scanline, level, pbuf);
+	else
+		zywrleAnalyze16Ref(dst, src, w, h, scanline, level, pbuf);
+}
+
+static void synthesize(int ref, void *fb, int bpp, int w, int h, int scanline, int level)
+{
+	if (bpp == 32) {
+		if (ref) zywrleSynthesize32Ref(fb, fb, w, h, scanline, level, pbuf);
+		else zywrleSynthesize32LE(fb, fb, w, h, scanline, level, pbuf);
+	} else {
+		if (ref) zywrleSynthesize16Ref(fb, fb, w, h, scanline, level, pbuf);
+		else zywrleSynthesize16LE(fb, fb, w, h, scanline, level, pbuf);
+	}
+}
+
+static int test_packed()
+{
+	int x0, x1, fails = 0;
+
+	for (x0 = 0; x0 < 256; x0++)
+		for (x1 = 0; x1 < 256; x1++) {
+			unsigned int p0 = rnd(256) << 24 | (x0 ^ 0x55) << 16 | x1 << 8 | x0;
+			unsigned int p1 = rnd(256) << 24 | ((x1 + 7) & 0xff) << 16 | x0 << 8 | x1;
+			unsigned int r0 = p0, r1 = p1;
+			int i;
+
+			for (i = 0; i < 3; i++)
+				Harr((signed char *)&r0 + i, (signed char *)&r1 + i);	// little endian
+			HarrPacked(&p0, &p1);
+			if ((p0 != r0 || p1 != r1) && fails++ < 10)
+				printf("FAIL: HarrPacked(%08x, %08x)\n", p0, p1);
+		}
+	return fails;
+}
+
+static int test(int bpp)
+{
+	int size = SCANLINE * TILE * bpp / 8, n, fails = 0;
+	uint8_t *rgb = malloc(SCANLINE * TILE * 3);
+	uint8_t *img = malloc(size), *a = malloc(size), *b = malloc(size);
+
+	for (n = 0; n < 20000; n++) {
+		int w = 1 + rnd(TILE), h = 1 + rnd(TILE), level = 1 + rnd(3), i;
+
+		if (n & 1) {
+			// encoded video: the coefficients a server would send
+			make_video(rgb, SCANLINE, TILE, n);
+			to_pixels(img, bpp, rgb, SCANLINE * TILE);
+			memcpy(a, img, size);
+			analyze(a, img, bpp, w, h, SCANLINE, level);
+		} else {
+			// any coefficients, to reach every branch of Harr()
+			for (i = 0; i < size; i++) a[i] = rnd(256);
+		}
+		memcpy(b, a, size);
+		synthesize(1, a, bpp, w, h, SCANLINE, level);
+		synthesize(0, b, bpp, w, h, SCANLINE, level);
+		if (memcmp(a, b, size) && fails++ < 10)
+			printf("FAIL: %d bpp, level %d, %dx%d, %s\n", bpp, level, w, h, n & 1 ? "video" : "random");
+	}
+	free(rgb);
+	free(img);
+	free(a);
+	free(b);
+	return fails;
+}
+
+// a frame's worth of tiles, decoded in place as zrle-c.h does
+static double decode_frame(int ref, uint8_t *fb, const uint8_t *coeff, int bpp, int level, int reps)
+{
+	int size = BENCH_W * BENCH_H * bpp / 8, x, y, n;
+	u64 t0, t_copy, t;
+
+	t0 = host_ns();
+	for (n = 0; n < reps; n++) memcpy(fb, coeff, size);
+	t_copy = host_ns() - t0;
+	t0 = host_ns();
+	for (n = 0; n < reps; n++) {
+		memcpy(fb, coeff, size);
+		for (y = 0; y < BENCH_H; y += TILE)
+			for (x = 0; x < BENCH_W; x += TILE)
+				synthesize(ref, fb + (y * BENCH_W + x) * bpp / 8, bpp,
+					BENCH_W - x < TILE ? BENCH_W - x : TILE, BENCH_H - y < TILE ? BENCH_H - y : TILE,
+					BENCH_W, level);
+	}
+	t = host_ns() - t0 - t_copy;
+	return (double)BENCH_W * BENCH_H * reps / (t / 1e3);
+}
+
+static int bench()
+{
+	uint8_t *rgb = malloc(BENCH_W * BENCH_H * 3);
+	uint8_t *img = malloc(BENCH_W * BENCH_H * 4), *coeff = malloc(BENCH_W * BENCH_H * 4);
+	uint8_t *fb = malloc(BENCH_W * BENCH_H * 4), *check = malloc(BENCH_W * BENCH_H * 4);
+	int bpp, level, x, y, fails = 0;
+
+	make_video(rgb, BENCH_W, BENCH_H, 0);
+	printf("%dx%d video frame in %dx%d tiles   scalar (Mpx/s)   library (Mpx/s)\n", BENCH_W, BENCH_H, TILE, TILE);
+	for (bpp = 16; bpp <= 32; bpp += 16)
+		for (level = 1; level <= 3; level++) {
+			int size = BENCH_W * BENCH_H * bpp / 8;
+			double ref, lib;
+
+			to_pixels(img, bpp, rgb, BENCH_W * BENCH_H);
+			memcpy(coeff, img, size);
+			for (y = 0; y < BENCH_H; y += TILE)
+				for (x = 0; x < BENCH_W; x += TILE)
+					analyze(coeff + (y * BENCH_W + x) * bpp / 8, img + (y * BENCH_W + x) * bpp / 8, bpp,
+						BENCH_W - x < TILE ? BENCH_W - x : TILE, BENCH_H - y < TILE ? BENCH_H - y : TILE,
+						BENCH_W, level);
+			ref = decode_frame(1, check, coeff, bpp, level, 20);
+			lib = decode_frame(0, fb, coeff, bpp, level, 20);
+			if (memcmp(fb, check, size)) {
+				printf("FAIL: %d bpp, level %d: frames differ\n", bpp, level);
+				fails++;
+			}
+			printf("  %d bpp, level %d %27.1f %17.1f  (%.2fx)\n", bpp, level, ref, lib, lib / ref);
+		}
+	free(rgb);
+	free(img);
+	free(coeff);
+	free(fb);
+	free(check);
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	int fails = test_packed() + test(16) + test(32);
+
+	if (argc > 1 && !strcmp(argv[1], "-b"))
+		fails += bench();
+	printf(fails ? "FAILED\n" : "OK\n");
+	return fails ? 1 : 0;
+}